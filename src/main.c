@@ -1,8 +1,57 @@
 #include "miniweb.h"
 #include "miniweb_logging.h"
+#include "mw_alog.h"
+#include "mw_clock.h"
+#include "mw_codec.h"
+#include "mw_fcache.h"
+#include "mw_fdcache.h"
+#include "mw_fmt.h"
+#include "mw_shard.h"
+#include "mw_slab.h"
+#include "mw_zcache.h"
+#include "mw_zctl.h"
+#include <signal.h>
 
 int main(void)
 {
-    return 0;
+    mw_clock_init(server.clock_tsc);
+    mw_fmt_init();
+    log_queue = dispatch_queue_create("log", NULL);
+    log_name = server.log_name;
+    log_file = log_name ? fopen(log_name, "a") : stdout;
+    if (!log_file) {
+        perror(log_name);
+        return 1;
+    }
+    mw_alog_init(log_file, server.log_flush_ms, mw_alog_format_for(log_name));
+    if (log_name) reopen_log_file_when_needed();
+
+    // a client closing early must not kill us (where SO_NOSIGPIPE is missing)
+    signal(SIGPIPE, SIG_IGN);
+    mw_codec_init(&server.codec_levels);
+    mw_codec_set_max_open(server.codec_max_open);
+    mw_zctl_init(server.n_shards, server.zctl_low, server.zctl_high);
+    mw_slab_init(server.slab_max_idle);
+    // held output is sent by the keep-alive timer, which can't be quicker
+    if (server.chunk_wait_ms < server.timer_tick_ms) {
+        server.chunk_wait_ms = server.timer_tick_ms;
+    }
+    mw_zcache_init(server.zcache_budget);
+    // compress the files we know are hot before the first client asks
+    for (const char **t = server.zcache_warm; t && *t; t++) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s%s", server.doc_base, *t);
+        if (!mw_zcache_warm(path)) {
+            qfprintf(stderr, "zcache: not warming %s\n", path);
+        }
+    }
+    mw_fdcache_init(server.fdcache_max, server.fdcache_ttl);
+    mw_fcache_init(server.fcache_budget, server.fcache_max_file);
+    if (mw_shards_start(server.server_port,
+                        server.n_shards,
+                        server.evloop) < 0) {
+        return 1;
+    }
+    dispatch_main();
 }
 /* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -1,3 +1,38 @@
 #include "miniweb.h"
+#include "mw_alog.h"
+#include "mw_chunk.h"
+#include "mw_evloop.h"
+#include "mw_fcache.h"
+#include "mw_fdcache.h"
+#include "mw_pdeflate.h"
+#include "mw_reqpool.h"
+#include "mw_slab.h"
+#include "mw_twheel.h"
+#include "mw_zcache.h"
+#include "mw_zctl.h"
+
+mw_server server = {
+    .doc_base = ".",
+    .server_port = "8080",
+    .stats_path = "/stats",
+    .zcache_budget = MW_ZCACHE_DEFAULT_BUDGET,
+    .req_pool_max = MW_REQPOOL_DEFAULT_MAX,
+    .fdcache_max = MW_FDCACHE_DEFAULT_MAX,
+    .fdcache_ttl = MW_FDCACHE_DEFAULT_TTL,
+    .fcache_budget = MW_FCACHE_DEFAULT_BUDGET,
+    .fcache_max_file = MW_FCACHE_DEFAULT_MAX_FILE,
+    .log_flush_ms = MW_ALOG_DEFAULT_FLUSH_MS,
+    .timer_tick_ms = MW_TWHEEL_DEFAULT_TICK_MS,
+    .clock_tsc = true,
+    .evloop = MW_EVLOOP_DEFAULT,
+    .pdeflate_min = MW_PDEFLATE_DEFAULT_MIN,
+    .codec_levels = MW_CODEC_DEFAULT_LEVELS,
+    .codec_max_open = MW_CODEC_DEFAULT_MAX_OPEN,
+    .zctl_low = MW_ZCTL_DEFAULT_LOW,
+    .zctl_high = MW_ZCTL_DEFAULT_HIGH,
+    .slab_max_idle = MW_SLAB_DEFAULT_MAX_IDLE,
+    .chunk_target = MW_CHUNK_DEFAULT_TARGET,
+    .chunk_wait_ms = MW_CHUNK_DEFAULT_WAIT_MS,
+};
 
 /* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -1,6 +1,9 @@
 #ifndef MINIWEB_H
 #define MINIWEB_H
 
+#include "mw_codec.h"
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
 /**
@@ -11,8 +14,32 @@ typedef struct _mw_server {
     char *log_name;    ///< The name of our log file
     FILE *log_file;    ///< The log file handle
     char *server_port; ///< The port we will serve on
+    char *stats_path;  ///< Where loopback clients get our stats, or NULL
+
+    size_t zcache_budget;         ///< Compressed bytes to cache in memory
+    const char **zcache_warm;     ///< Files to compress at startup, NULL ended
+    size_t req_pool_max;          ///< Idle requests kept for reuse, per shard
+    int n_shards;                 ///< Listening sockets, 0 for one per CPU
+    size_t fdcache_max;           ///< Open files to keep for reuse
+    int fdcache_ttl;              ///< Seconds a cached file's stat is trusted
+    size_t fcache_budget;         ///< Bytes of small files to keep in memory
+    size_t fcache_max_file;       ///< Largest file to keep in memory
+    int log_flush_ms;             ///< Longest a log line waits to be written
+    unsigned timer_tick_ms;       ///< Resolution of the keep-alive timeouts
+    bool clock_tsc;               ///< Time requests with an invariant TSC
+    int evloop;                   ///< MW_EVLOOP_* backend to run the shards on
+    size_t pdeflate_min;          ///< Smallest file deflated in parallel, or 0
+    mw_codec_levels codec_levels; ///< Level of each compression engine
+    size_t codec_max_open;        ///< Compression engine states open at most
+    unsigned zctl_low;            ///< CPU permille above which levels come down
+    unsigned zctl_high;           ///< CPU permille that stops most compression
+    size_t slab_max_idle;         ///< Idle output slabs kept for reuse
+    size_t chunk_target;          ///< Chunk size compressed output is held for
+    unsigned chunk_wait_ms;       ///< Longest output is held, >= a timer tick
 } mw_server;
 
+extern mw_server server; ///< The server's configuration
+
 #endif /* ifndef MINIWEB_H */
 
 /* vim: set ts=8 sw=4 tw=0 ft=cpp et :*/
@@ -1,4 +1,5 @@
 #include "miniweb_logging.h"
+#include "mw_alog.h"
 #include <stdarg.h>
 #include <stdlib.h>
 
@@ -34,7 +35,6 @@ void qfflush(FILE *f)
 void reopen_log_file_when_needed(void)
 {
     int lf_dup = dup(fileno(log_file));
-    FILE **lf = &log_file;
 
     dispatch_source_t vn =
         dispatch_source_create(DISPATCH_SOURCE_TYPE_VNODE,
@@ -47,11 +47,10 @@ void reopen_log_file_when_needed(void)
         printf("lf_dup is %d (logfile's fileno = %d)\n",
                lf_dup,
                fileno(log_file));
-        fprintf(log_file, "# flush 'n roll!\n");
         dispatch_source_cancel(vn);
         dispatch_release(vn);
-        fflush(log_file);
-        *lf = freopen(log_name, "a", log_file);
+        // the access log writer owns log_file, it reopens it in place
+        mw_alog_reopen(log_name);
 
         reopen_log_file_when_needed();
     });
@@ -17,6 +17,18 @@ void reopen_log_file_when_needed(void);
 
 #define qprintf(fmt, ...) qfprintf(stdout, fmt, ##__VA_ARGS__)
 
+/* Every connection's accept, responses and close.  Each line costs a heap
+ * allocation and a trip to log_queue, so it is compiled out unless MW_TRACE
+ * is set; the arguments are still checked.
+ */
+#ifndef MW_TRACE
+#define MW_TRACE 0
+#endif
+#define qtrace(fmt, ...)                                                       \
+    do {                                                                       \
+        if (MW_TRACE) qprintf(fmt, ##__VA_ARGS__);                             \
+    } while (0)
+
 #endif /* ifndef MINIWEB_LOGGING_H */
 
 /* vim: set ts=8 sw=4 tw=0 ft=cpp et :*/
@@ -1,65 +1,171 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for preadv
+#endif
 #include "miniweb_request.h"
+#include "miniweb.h"
 #include "miniweb_logging.h"
+#include "mw_alog.h"
+#include "mw_clock.h"
+#include "mw_fcache.h"
+#include "mw_fdcache.h"
+#include "mw_fmt.h"
+#include "mw_reqpool.h"
+#include "mw_sendfile.h"
+#include "mw_shard.h"
+#include "mw_stats.h"
+#include "mw_zcache.h"
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <strings.h>
 #include <sys/uio.h>
 #include <time.h>
 
-int n_reqs;
-mw_request **debug_reqs;
+static bool mw_req_process(mw_request *req);
+static void mw_req_keep_alive(mw_request *req);
 
-static uint64_t getnanotime(void)
+/* Let go of the file we were sending, if any */
+static void mw_req_close_file(mw_request *req)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
+    if (req->fc) mw_fdcache_release(req->fc);
+    req->fc = NULL;
+    req->fd = -1;
+}
 
-    return tv.tv_sec * NSEC_PER_SEC + tv.tv_usec * NSEC_PER_SEC;
+static bool mw_req_source_live(const mw_request_source *src)
+{
+    return src->ds || src->ev.fn;
+}
+
+/* Let go of the parallel deflate, if any; blocks still being compressed
+ * free it when the last of them is done
+ */
+static void mw_req_pdeflate_end(mw_request *req)
+{
+    mw_pdeflate *pd = req->pd;
+    if (!pd) return;
+    req->pd = NULL;
+    if (pd->inflight) {
+        pd->ctx = NULL;
+        return;
+    }
+    mw_pdeflate_free(pd);
 }
 
 static void mw_req_free_impl(mw_request *req)
 {
     req->reuse_guard = true;
     *(req->cb) = '\0';
-    qprintf("$$$ mw_req_free %s; fd#%d; buf: %s\n",
-            dispatch_queue_get_label(req->q),
-            req->fd,
-            req->cmd_buf);
-    assert(req->sd_rd.ds == NULL && req->sd_wr.ds == NULL);
+    qtrace("$$$ mw_req_free %s; fd#%d; buf: %s\n",
+           req->q_name,
+           req->fd,
+           req->cmd_buf);
+    assert(!mw_req_source_live(&req->sd_rd) &&
+           !mw_req_source_live(&req->sd_wr));
     close(req->sd);
-    assert(req->fd_rd.ds == NULL);
-    if (req->fd >= 0) close(req->fd);
-    free(req->file_b.buf);
-    free(req->deflate_b.buf);
-    free(req->q_name);
-    free(req->deflate);
-    free(req);
-
-    int i;
-    bool found = false;
-    for (i = 0; i < n_reqs; i++) {
-        if (found) {
-            debug_reqs[i - 1] = debug_reqs[i];
-        }
-        else {
-            found = (debug_reqs[i] == req);
-        }
-    }
-    debug_reqs = reallocf(debug_reqs, sizeof(mw_request *) * --n_reqs);
-    assert(n_reqs >= 0);
+    mw_stats_count(MW_STAT_CLOSES, 1);
+    assert(!mw_req_source_live(&req->fd_rd) && !req->idle);
+    mw_req_pdeflate_end(req);
+    mw_req_close_file(req);
+    if (req->zc) mw_zcache_release(req->zc);
+    if (req->fce) mw_fcache_release(req->fce);
+    mw_shard_remove(req->shard, req);
+    mw_reqpool_put(&req->shard->pool, req);
 }
 
 void mw_req_free(mw_request *req)
 {
     assert(!req->reuse_guard);
-    dispatch_async(dispatch_get_main_queue(), ^{ mw_req_free_impl(req); });
+    // the request belongs to its shard's registry and pool
+    if (req->shard->loop) {
+        // the handler that let go of us may still be running
+        mw_evloop_defer(req->shard->loop,
+                        &req->free_task,
+                        (mw_task_fn)mw_req_free_impl,
+                        req);
+        return;
+    }
+    dispatch_async(req->shard->q, ^{ mw_req_free_impl(req); });
+}
+
+/* Hand an event to the handler for the source it came from */
+static void mw_req_fired(mw_request *req, mw_request_source *src, size_t avail)
+{
+    if (src == &req->sd_rd) {
+        mw_read_req(req, avail);
+    }
+    else if (src == &req->sd_wr) {
+        mw_write_filedata(req, avail);
+    }
+    else {
+        mw_read_filedata(req, avail);
+    }
+    /* A response that ended with another request behind it in cmd_buf leaves
+     * it to us, so a run of them that are answered straight away is a loop
+     * here rather than a recursion through mw_req_file_done
+     */
+    while (req->pipelined) {
+        req->pipelined = false;
+        if (!mw_req_process(req)) mw_req_keep_alive(req);
+    }
+}
+
+static void mw_req_on_event(mw_ev *ev, size_t avail)
+{
+    mw_request_source *src =
+        (mw_request_source *)((char *)ev - offsetof(mw_request_source, ev));
+    mw_req_fired(ev->ctx, src, avail);
+}
+
+/* Make a suspended source for reads from, or writes to, efd->fd.  On a loop
+ * the request lives until its last source is deleted; under libdispatch its
+ * queue does, and the sources hold it.  Returns 0, or an errno if the loop
+ * can't watch efd->fd, which only its first source registers.
+ */
+static int mw_req_make_source(mw_request *req,
+                              mw_request_source *src,
+                              mw_evfd *efd,
+                              bool write)
+{
+    src->suspended = true;
+    if (req->shard->loop) {
+        int rc = mw_ev_init(&src->ev,
+                            req->shard->loop,
+                            efd,
+                            write,
+                            mw_req_on_event,
+                            req);
+        if (rc == 0) req->n_sources++;
+        return rc;
+    }
+    src->ds = dispatch_source_create(write ? DISPATCH_SOURCE_TYPE_WRITE
+                                           : DISPATCH_SOURCE_TYPE_READ,
+                                     efd->fd,
+                                     0,
+                                     req->q);
+    dispatch_source_set_event_handler(src->ds, ^{
+        mw_req_fired(req, src, dispatch_source_get_data(src->ds));
+    });
+    return 0;
+}
+
+/* The source's handler got EAGAIN: on a loop, wait for the next edge */
+static void mw_req_source_blocked(mw_request_source *src)
+{
+    if (src->ev.fn) mw_ev_blocked(&src->ev);
 }
 
 void mw_req_disable_source(mw_request *req, mw_request_source *src)
 {
+    if (req->shard->loop) {
+        // we are on the loop's thread, so this can't race a handler
+        src->suspended = true;
+        if (src->ev.fn) mw_ev_disable(&src->ev);
+        return;
+    }
     dispatch_async(req->q, ^{
         if (!src->suspended) {
             src->suspended = true;
@@ -70,6 +176,11 @@ void mw_req_disable_source(mw_request *req, mw_request_source *src)
 
 void mw_req_enable_source(mw_request *req, mw_request_source *src)
 {
+    if (req->shard->loop) {
+        src->suspended = false;
+        if (src->ev.fn) mw_ev_enable(&src->ev);
+        return;
+    }
     dispatch_async(req->q, ^{
         if (src->suspended) {
             src->suspended = false;
@@ -80,6 +191,13 @@ void mw_req_enable_source(mw_request *req, mw_request_source *src)
 
 void mw_req_delete_source(mw_request *req, mw_request_source *src)
 {
+    if (req->shard->loop) {
+        src->suspended = false;
+        if (!src->ev.fn) return;
+        mw_ev_delete(&src->ev);
+        if (--req->n_sources == 0) mw_req_free(req);
+        return;
+    }
     dispatch_async(req->q, ^{
         if (src->ds) {
             /* sources need to be resumed before they can be deleted
@@ -96,38 +214,62 @@ void mw_req_delete_source(mw_request *req, mw_request_source *src)
     });
 }
 
-void mw_dump_reqs(void)
+void mw_dump_reqs(mw_shard *shard)
 {
-    int i = 0;
-    static int last_reported = -1;
-
-    // We want to see that transition into n_reqs == 0, but we don't need to
-    // keep seeing it
-    if (n_reqs == 0 && n_reqs == last_reported) {
+    /* We want to see that transition into n_reqs == 0, but we don't need to
+     * keep seeing it.  This is only ever called on the shard's queue, which
+     * owns the shard's registry, so this is safe.
+     */
+    if (shard->n_reqs == 0 && shard->dump_reported == 0) {
         return;
     }
-    else {
-        last_reported = n_reqs;
-    }
+    shard->dump_reported = shard->n_reqs;
 
-    qprintf("%d active requests to dump\n", n_reqs);
-    uint64_t now = getnanotime();
-    /* because we iterate over the debug_reqs array in this queue (the "main"
-     * queue), it has to "own" that array.  All manipulation of the array as a
-     * whole must occur on this queue!
+    /* the requests' own pools belong to their queues, so our scratch strings
+     * come from here
      */
-    for (i = 0; i < n_reqs; i++) {
-        mw_request *req = debug_reqs[i];
-        qprintf("%s sources: fd_rd %p%s, sd_rd %p%s, sd_rw %p%s, timeo %p%s\n",
+    char scratch[128];
+    mw_mempool dbg;
+    mw_mpool_init(&dbg, scratch, sizeof(scratch));
+
+    qprintf("shard#%d: %d active requests to dump; request pool: %zu idle, "
+            "%zu hits, %zu misses, %zu dropped\n",
+            shard->id,
+            shard->n_reqs,
+            shard->pool.n_free,
+            shard->pool.hits,
+            shard->pool.misses,
+            shard->pool.drops);
+    qprintf("  accepted %zu in %zu wakeups (%zu empty); batches of 1, 2-3, "
+            "4-7, ...: ",
+            shard->accepted,
+            shard->accept_wakeups,
+            shard->accept_empty);
+    for (int b = 0; b < MW_ACCEPT_BUCKETS; b++) {
+        qprintf("%zu%s",
+                shard->accept_batches[b],
+                b + 1 < MW_ACCEPT_BUCKETS ? ", " : "\n");
+    }
+    uint64_t now = mw_clock_ns();
+    if (shard->loop) {
+        qprintf("  loop: %zu passes, %zu kernel events, %zu handler calls, "
+                "%zu jobs (%zu stolen)\n",
+                shard->loop->passes,
+                shard->loop->wakeups,
+                shard->loop->calls,
+                shard->loop->ran,
+                shard->loop->stolen);
+    }
+    for (mw_request *req = shard->reqs; req; req = req->shard_next) {
+        qprintf("%s sources: fd_rd %s%s, sd_rd %s%s, sd_rw %s%s%s\n",
                 req->q_name,
-                (void *)req->fd_rd.ds,
+                mw_req_source_live(&req->fd_rd) ? "live" : "none",
                 req->fd_rd.suspended ? " (SUSPENDED)" : "",
-                (void *)req->sd_rd.ds,
+                mw_req_source_live(&req->sd_rd) ? "live" : "none",
                 req->sd_rd.suspended ? " (SUSPENDED)" : "",
-                (void *)req->sd_wr.ds,
+                mw_req_source_live(&req->sd_wr) ? "live" : "none",
                 req->sd_wr.suspended ? " (SUSPENDED)" : "",
-                (void *)req->timeo.ds,
-                req->timeo.suspended ? " (SUSPENDED)" : "");
+                req->idle ? ", idle" : "");
         if (req->timeout_at) {
             double when = req->timeout_at - now;
             when /= NSEC_PER_SEC;
@@ -141,202 +283,523 @@ void mw_dump_reqs(void)
         else {
             qprintf("  timeout not yet set\n");
         }
-        char *file_bd = buf_debug_str(&req->file_b),
-             *deflate_bd = buf_debug_str(&req->deflate_b);
-        qprintf("  file_b %s; deflate_b %s\n  cmd_buf used %ld, fd#%d; "
-                "files_served %d\n",
+        mw_mpool_clear(&dbg);
+        char *file_bd = buf_debug_str(&req->file_b, &dbg);
+        qprintf("  file_b %s; deflate_q %zu in %u slabs\n  cmd_buf used %ld, "
+                "fd#%d; files_served %d\n",
                 file_bd,
-                deflate_bd,
+                req->deflate_q.bytes,
+                req->deflate_q.n,
                 (long)(req->cb - req->cmd_buf),
                 req->fd,
                 req->files_served);
         if (req->deflate) {
-            qprintf("  deflate total in: %ld", req->deflate->total_in);
+            qprintf("  %s total in: %llu",
+                    req->deflate->codec->name,
+                    (unsigned long long)req->deflate->total_in);
         }
         qprintf("%s total written %lu, file size %lld\n",
                 req->deflate ? "" : " ",
                 req->total_written,
                 req->sb.st_size);
-        free(file_bd);
-        free(deflate_bd);
     }
 }
 
 void mw_close_connection(mw_request *req)
 {
-    qprintf("$$$ close_connection %s, served %d files -- cancelling all "
-            "sources\n",
-            dispatch_queue_get_label(req->q),
-            req->files_served);
+    qtrace("$$$ close_connection %s, served %d files -- cancelling all "
+           "sources\n",
+           req->q_name,
+           req->files_served);
     mw_req_delete_source(req, &req->fd_rd);
     mw_req_delete_source(req, &req->sd_rd);
     mw_req_delete_source(req, &req->sd_wr);
-    mw_req_delete_source(req, &req->timeo);
+    req->pipelined = false;
+    // the wheel must let go of us before the queue goes away
+    if (req->idle || req->flush_armed) {
+        mw_twheel_disarm(&req->shard->wheel, &req->timer);
+        req->idle = false;
+        req->flush_armed = false;
+    }
+}
+
+/* Close an idle connection whose timer fired, unless it has woken up since,
+ * which re-arms or disarms the timer.  Mid-response the timer sends a chunk
+ * that has been held back long enough.
+ */
+static void mw_req_expire(mw_request *req, unsigned gen)
+{
+    if (req->timer.gen != gen) return;
+    if (req->flush_armed) {
+        req->flush_armed = false;
+        req->chunk.due = true;
+        mw_req_enable_source(req, &req->sd_wr);
+        return;
+    }
+    if (!req->idle) return;
+    qfprintf(stderr,
+             "$$$ -- timeo fire (delta = %f) -- close connection: q = %s\n",
+             (mw_clock_ns() - (double)req->timeout_at) / NSEC_PER_SEC,
+             req->q_name);
+    req->idle = false;
+    mw_stats_count(MW_STAT_TIMEOUTS, 1);
+    mw_close_connection(req);
+}
+
+void mw_req_timed_out(mw_timer *t, unsigned gen, __unused void *ctx)
+{
+    mw_request *req = (mw_request *)((char *)t - offsetof(mw_request, timer));
+    // a shard's loop turns its wheel, so we are already on the right thread
+    if (req->shard->loop) {
+        mw_req_expire(req, gen);
+        return;
+    }
+    dispatch_async(req->q, ^{ mw_req_expire(req, gen); });
+}
+
+/* Write whatever is left of a small file cache hit: the cached header, our
+ * end of the header, and the file, in one writev
+ */
+static ssize_t mw_write_cached(mw_request *req)
+{
+    mw_fcache_entry *e = req->fce;
+    size_t tail_len = req->head_tail_len;
+    size_t done = req->total_written + e->hdr_len + tail_len;
+    struct iovec iov[3] = {
+        {e->hdr, e->hdr_len},
+        {req->head_tail, tail_len},
+        {e->data, req->body_len},
+    };
+    int i = 0;
+    while (i < 3 && done >= iov[i].iov_len) done -= iov[i++].iov_len;
+    if (i == 3) return 0;
+    iov[i].iov_base = (char *)iov[i].iov_base + done;
+    iov[i].iov_len -= done;
+    return writev(req->sd, iov + i, 3 - i);
+}
+
+/* Write the response header out of file_b, then send the body straight from
+ * the cached compressed data, or have the kernel send it from fd.  Returns
+ * the number of bytes written like writev.
+ */
+static ssize_t mw_write_zero_copy(mw_request *req)
+{
+    if (req->fce) return mw_write_cached(req);
+
+    ssize_t sz = 0;
+    struct iovec iov[2];
+    int n = buf_outof_iov(&req->file_b, iov);
+    if (n) {
+        sz = writev(req->sd, iov, n);
+        if (sz <= 0) return sz;
+        buf_used_outof(&req->file_b, sz);
+        if (buf_outof_sz(&req->file_b)) return sz;
+    }
+
+    ssize_t sent;
+    if (req->zc) {
+        sent = write(req->sd,
+                     req->zc->data + req->file_off,
+                     req->body_len - req->file_off);
+        if (sent > 0) req->file_off += sent;
+    }
+    else {
+        sent = mw_sendfile(req->sd,
+                           req->fd,
+                           &req->file_off,
+                           req->body_len - req->file_off);
+        // the file shrank since it was stat'ed: the socket stays writable,
+        // and the Content-Length can't be met
+        if (sent == 0 && req->file_off < req->body_len) {
+            qprintf("sendfile %s: file ended at %lld of %lld\n",
+                    req->q_name,
+                    (long long)req->file_off,
+                    (long long)req->body_len);
+            errno = ENODATA;
+            return -1;
+        }
+    }
+    if (sent < 0) {
+        // we did write the tail of the header, errno can wait for next time
+        return sz ? sz : sent;
+    }
+    return sz + sent;
+}
+
+/* Arm the keep-alive timeout, and wait for the next request */
+static void mw_req_keep_alive(mw_request *req)
+{
+    int64_t t_offset = 5 * NSEC_PER_SEC + req->files_served * NSEC_PER_SEC / 10;
+    req->timeout_at = mw_clock_now() + t_offset;
+    mw_twheel_arm(&req->shard->wheel, &req->timer, t_offset / NSEC_PER_MSEC);
+    req->idle = true;
+    mw_req_enable_source(req, &req->sd_rd);
+}
+
+/* The whole response has been written: log it, then leave the next pipelined
+ * request to mw_req_fired, or go back to waiting for one
+ */
+static void mw_req_file_done(mw_request *req)
+{
+    /* We have transferred the file, time to write the log entry.  The log
+     * writer thread formats it later.
+     *
+     * TODO: Escape '"' in the request string
+     */
+    uint64_t took = mw_clock_now() - req->resp_start;
+    uint64_t latency = took / NSEC_PER_USEC;
+    mw_zrate_done(&req->zrate, req->total_written, took);
+    mw_alog_rec *rec = mw_alog_begin();
+    if (rec) {
+        mw_span rl = req->parser.req_line;
+        rec->when = mw_fmt_now();
+        rec->addr = req->r_addr.sin_addr;
+        rec->status = req->status_number;
+        rec->total_written = req->total_written;
+        rec->latency_us = latency;
+        rec->rl_len = rl.len < MW_ALOG_RL_MAX ? rl.len : MW_ALOG_RL_MAX;
+        memcpy(rec->rl, req->cmd_buf + rl.off, rec->rl_len);
+        mw_alog_commit(rec);
+    }
+    mw_stats_count(MW_STAT_REQUESTS, 1);
+    mw_stats_record(MW_HIST_LATENCY_US, latency);
+    mw_stats_record(MW_HIST_RESP_BYTES, req->total_written);
+    if (req->pd) {
+        mw_stats_count(MW_STAT_DEFLATE_IN, req->pd->in_done);
+        mw_stats_count(MW_STAT_DEFLATE_OUT, req->pd->out_done);
+    }
+    else if (req->deflate) {
+        mw_stats_count(MW_STAT_DEFLATE_IN, req->deflate->total_in);
+        mw_stats_count(MW_STAT_DEFLATE_OUT, req->deflate->total_out);
+    }
+
+    req->files_served++;
+    qtrace("$$$ wrote whole file (%s); about to close %d, total written %zd, "
+           "this is the %d%s file served\n",
+           req->q_name,
+           req->fd,
+           req->total_written,
+           req->files_served,
+           (1 == req->files_served) ? "st" : (2 == req->files_served) ? "nd"
+                                                                      : "th");
+    mw_req_disable_source(req, &req->sd_wr);
+    if (mw_req_source_live(&req->fd_rd)) {
+        // fd_rd's cancel handler drops its own reference to the file
+        mw_req_delete_source(req, &req->fd_rd);
+    }
+    mw_req_pdeflate_end(req);
+    mw_req_close_file(req);
+    if (req->zc) mw_zcache_release(req->zc);
+    req->zc = NULL;
+    if (req->fce) mw_fcache_release(req->fce);
+    req->fce = NULL;
+    // an idle connection holds no engine state: the next file, on whichever
+    // connection, resets one from the pool
+    mw_codec_stream_release(&req->zs);
+    req->deflate = NULL;
+    req->responding = false;
+    mw_mpool_rewind(&req->pool, req->conn_mark);
+
+    if (req->close_after) {
+        mw_close_connection(req);
+        return;
+    }
+
+    // move whatever the client pipelined behind this request to the front
+    size_t end = req->parser.end;
+    size_t left = (req->cb - req->cmd_buf) - end;
+    memmove(req->cmd_buf, req->cmd_buf + end, left);
+    req->cb = req->cmd_buf + left;
+    mw_http_init(&req->parser, 0);
+    // we may be deep in the handler of the request before, e.g. through
+    // mw_req_send_file's first write; answering it here would recurse
+    if (left) {
+        req->pipelined = true;
+        return;
+    }
+    mw_req_keep_alive(req);
+}
+
+static void mw_req_pdeflate_more(mw_request *req);
+
+/* A block of the file has been compressed, and the ones before it have been
+ * taken: put it in deflate_q, on the request's loop
+ */
+static void mw_req_pdeflate_done(void *ctx)
+{
+    mw_pdeflate_block *b = ctx;
+    mw_pdeflate *pd = b->pd;
+    mw_request *req = pd->ctx;
+    if (!req) {
+        // the connection went while we were compressing
+        mw_pdeflate_release(pd, b);
+        if (!pd->inflight) mw_pdeflate_free(pd);
+        return;
+    }
+    if (b->err) {
+        qprintf("pdeflate %s block at %lld: %s\n",
+                req->q_name,
+                (long long)b->off,
+                strerror(b->err));
+        mw_pdeflate_release(pd, b);
+        // the blocks after it are dropped as they come in
+        mw_req_pdeflate_end(req);
+        mw_close_connection(req);
+        return;
+    }
+    unsigned char trailer[MW_PDEFLATE_TRAILER_MAX];
+    size_t t = mw_pdeflate_take(pd, b, trailer);
+    // its slabs are ours now
+    mw_slabq_append(&req->deflate_q, b->out);
+    b->out = NULL;
+    if (!mw_slabq_write(&req->deflate_q, trailer, t)) {
+        qprintf("pdeflate %s trailer: out of memory\n", req->q_name);
+        mw_pdeflate_release(pd, b);
+        mw_req_pdeflate_end(req);
+        mw_close_connection(req);
+        return;
+    }
+    mw_pdeflate_release(pd, b);
+    mw_req_enable_source(req, &req->sd_wr);
+    mw_req_pdeflate_more(req);
+}
+
+/* Hand out blocks of the file to the loops while few are in flight, and
+ * the network has caught up with what they made
+ */
+static void mw_req_pdeflate_more(mw_request *req)
+{
+    mw_pdeflate *pd = req->pd;
+    while (pd->inflight < MW_PDEFLATE_INFLIGHT &&
+           req->deflate_q.bytes < MW_PDEFLATE_BLOCK) {
+        mw_pdeflate_block *b = mw_pdeflate_next(pd);
+        if (!b) return;
+        mw_evloop_spawn(req->shard->loop,
+                        &pd->strand,
+                        &b->job,
+                        mw_pdeflate_compress,
+                        mw_req_pdeflate_done,
+                        b);
+    }
+}
+
+/* Input whose compressed output has all gone into deflate_q */
+static off_t mw_req_deflated_in(mw_request *req)
+{
+    if (req->pd) return req->pd->in_done;
+    // the engine holds back output for the input it has taken, until the end
+    return req->deflate_end ? req->body_len : 0;
+}
+
+/* Compress what file_b holds into deflate_q, until it is all in or
+ * MW_SLABQ_MAX slabs are full.  Either the network or the file sets the pace:
+ * full slabs wait for mw_write_filedata to empty them, and leave file_b full
+ * so mw_read_filedata waits too.  Returns false if the connection has been
+ * closed.
+ */
+static bool mw_req_deflate_more(mw_request *req)
+{
+    mw_codec_stream *s = req->deflate;
+    size_t consumed = 0, produced = 0;
+    while (!req->deflate_end) {
+        struct iovec in[2];
+        int n_in = buf_outof_iov(&req->file_b, in);
+        const unsigned char *p = n_in ? in[0].iov_base : NULL;
+        size_t left = n_in ? in[0].iov_len : 0;
+        assert((off_t)(left + s->total_in) <= req->sb.st_size);
+        // at EOF we finish the stream, otherwise the engine holds on to
+        // what it needs for the best compression
+        bool finish = (off_t)(left + s->total_in) >= req->sb.st_size;
+        if (!left && !finish) break;
+        unsigned char *out;
+        size_t room = mw_slabq_room(&req->deflate_q, MW_SLABQ_MAX, &out);
+        // with nothing queued for the network to empty, nothing would wake
+        // us to try again
+        if (!room && !req->deflate_q.n) {
+            qprintf("deflate %s: out of memory\n", req->q_name);
+            mw_close_connection(req);
+            return false;
+        }
+        // the network is behind
+        if (!room) break;
+        size_t used = left;
+        mw_codec_status rc =
+            mw_codec_stream_run(s, p, &used, out, &room, finish);
+        if (rc == MW_CODEC_ERROR) {
+            qprintf("deflate %s %s failed\n", req->q_name, s->codec->name);
+            mw_close_connection(req);
+            return false;
+        }
+        buf_used_outof(&req->file_b, used);
+        mw_slabq_used_into(&req->deflate_q, room);
+        consumed += used;
+        produced += room;
+        req->deflate_end = rc == MW_CODEC_END;
+        // no progress with room to spare: it needs more input first
+        if (!used && !room) break;
+    }
+    // mw_read_filedata stops reading when file_b fills up
+    if (consumed && mw_req_source_live(&req->fd_rd)) {
+        mw_req_enable_source(req, &req->fd_rd);
+    }
+    if (produced) mw_req_enable_source(req, &req->sd_wr);
+    return true;
 }
 
 void mw_write_filedata(mw_request *req, __unused size_t avail)
 {
+    mw_clock_update();
     /* we always attempt to write as much data as we have.  This is save
      * because we use non-blocking I/O.  It is a good idea because the amount
      * of buffer space that dispatch tells us may be stale (more space could
      * have opened up, or memory pressure may have caused it to go down).
      */
-    mw_buffer *w_buf = req->deflate ? &req->deflate_b : &req->file_b;
-    ssize_t sz = buf_outof_sz(w_buf);
-    if (req->deflate) {
-        struct iovec iov[2];
-        if (!req->chunk_bytes_remaining) {
-            req->chunk_bytes_remaining = sz;
-            req->needs_zero_chunk = sz != 0;
-            req->cnp = req->chunk_num;
-            int n = snprintf(req->chunk_num,
-                             sizeof(req->chunk_num),
-                             "\r\n%lx\r\n%s",
-                             sz,
-                             sz ? "" : "\r\n");
-            assert((size_t)n <= sizeof(req->chunk_num));
-        }
-        iov[0].iov_base = req->cnp;
-        iov[0].iov_len = req->cnp ? strlen(req->cnp) : 0;
-        iov[1].iov_base = w_buf->outof;
-        iov[1].iov_len = (req->chunk_bytes_remaining < (size_t)sz)
-                             ? req->chunk_bytes_remaining
-                             : sz;
-        sz = writev(req->sd, iov, 2);
-        if (sz > 0) {
-            if (req->cnp) {
-                if (sz >= (ssize_t)strlen(req->cnp)) {
-                    req->cnp = NULL;
-                }
-                else {
-                    req->cnp += sz;
-                }
+    mw_buffer *w_buf = &req->file_b;
+    mw_slabq *w_q = req->deflate ? &req->deflate_q : NULL;
+    ssize_t sz;
+    struct iovec iov[MW_SLABQ_IOV + MW_CHUNK_IOV];
+    if (req->zero_copy) {
+        sz = mw_write_zero_copy(req);
+    }
+    else if (w_q) {
+        // small pieces of output wait to go out together, as one chunk
+        mw_chunk_state st = mw_chunk_begin(&req->chunk,
+                                           w_q->bytes,
+                                           mw_req_deflated_in(req) <
+                                               req->body_len,
+                                           mw_clock_now());
+        if (st != MW_CHUNK_SEND) {
+            // the timer sends what is held back if no more comes in time
+            if (st == MW_CHUNK_HOLD && !req->flush_armed) {
+                mw_twheel_arm_within(&req->shard->wheel,
+                                     &req->timer,
+                                     server.chunk_wait_ms);
+                req->flush_armed = true;
             }
-            sz -= iov[0].iov_len;
-            sz = (sz < 0) ? 0 : sz;
-            req->chunk_bytes_remaining -= sz;
+            mw_req_disable_source(req, &req->sd_wr);
+            return;
         }
+        if (req->flush_armed) {
+            mw_twheel_disarm(&req->shard->wheel, &req->timer);
+            req->flush_armed = false;
+        }
+        // the chunk-size line, the data, its CRLF, and at the end the
+        // last-chunk and trailers, in one writev
+        struct iovec data[MW_SLABQ_IOV];
+        int n = mw_slabq_outof_iov(w_q, data, MW_SLABQ_IOV);
+        sz = writev(req->sd, iov, mw_chunk_iov(&req->chunk, data, n, iov));
+        // only the data counts, it is what deflate_q gives up
+        if (sz > 0) sz = mw_chunk_sent(&req->chunk, sz);
     }
     else {
-        sz = write(req->sd, w_buf->outof, sz);
+        sz = writev(req->sd, iov, buf_outof_iov(w_buf, iov));
     }
     if (sz > 0) {
-        buf_used_outof(w_buf, sz);
+        mw_zrate_write(&req->zrate, false);
+        if (!req->ttfb_noted) {
+            mw_stats_record(MW_HIST_TTFB_US,
+                            (mw_clock_now() - req->resp_start) / NSEC_PER_USEC);
+            req->ttfb_noted = true;
+        }
+        // mw_write_zero_copy has already taken the header out of file_b
+        if (w_q) {
+            mw_slabq_used_outof(w_q, sz);
+        }
+        else if (!req->zero_copy) {
+            buf_used_outof(w_buf, sz);
+        }
+        // mw_read_filedata stops reading when file_b fills up
+        if (!w_q && mw_req_source_live(&req->fd_rd)) {
+            mw_req_enable_source(req, &req->fd_rd);
+        }
+        // and deflate when the network is behind
+        if (req->pd) {
+            mw_req_pdeflate_more(req);
+        }
+        else if (w_q && !mw_req_deflate_more(req)) {
+            return;
+        }
     }
     else if (sz < 0) {
         int e = errno;
-        qprintf("write filedata %s write error %d %s\n",
-                dispatch_queue_get_label(req->q),
-                e,
-                strerror(e));
-        mw_close_connection(req);
-        return;
+        if (e != EAGAIN && e != EWOULDBLOCK) {
+            // a short file has been logged already
+            if (e != ENODATA) {
+                qprintf("write filedata %s write error %d %s\n",
+                        req->q_name,
+                        e,
+                        strerror(e));
+            }
+            mw_close_connection(req);
+            return;
+        }
+        mw_req_source_blocked(&req->sd_wr);
+        mw_zrate_write(&req->zrate, true);
+        sz = 0;
     }
 
     req->total_written += sz;
-    off_t bytes = req->total_written;
-    if (req->deflate) {
-        if (req->deflate->total_in - buf_outof_sz(w_buf)) {
-            bytes = 0;
-        }
+    if (w_q) {
+        // we are done once the last chunk has gone, trailers and all
+        if (req->chunk.done) mw_req_file_done(req);
+        return;
     }
-    if (bytes == req->sb.st_size) {
-        if (req->needs_zero_chunk && req->deflate && (sz || req->cnp)) {
-            return;
-        }
-
-        /* We have transferred the file, time to write the log entry
-         *
-         * TODO: Escape '"' in the request string
-         */
-        size_t rlen = strcspn(req->cmd_buf, "\r\n");
-        char tstr[45], astr[45];
-        struct tm tm;
-        time_t clock;
-        time(&clock);
-        strftime(tstr,
-                 sizeof(tstr),
-                 "%d/%b/%Y:%H:%M:%S +0",
-                 gmtime_r(&clock, &tm));
-        addr2ascii(AF_INET,
-                   &req->r_addr.sin_addr,
-                   sizeof(struct in_addr),
-                   astr);
-        qfprintf(log_file,
-                 "%s -- [%s] \"%.*s\" %hd %zd\n",
-                 astr,
-                 tstr,
-                 (int)rlen,
-                 req->cmd_buf,
-                 req->status_number,
-                 req->total_written);
-
-        int64_t t_offset =
-            5 * NSEC_PER_SEC + req->files_served * NSEC_PER_SEC / 10;
-        int64_t timeout_at = req->timeout_at = getnanotime() + t_offset;
-
-        req->timeo.ds =
-            dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, req->q);
-        dispatch_source_set_timer(req->timeo.ds,
-                                  dispatch_time(DISPATCH_TIME_NOW, t_offset),
-                                  NSEC_PER_SEC,
-                                  NSEC_PER_SEC);
-        dispatch_source_set_event_handler(req->timeo.ds, ^{
-            if (req->timeout_at == (uint64_t)timeout_at) {
-                qfprintf(stderr,
-                         "$$$ -- timeo fire (delta = %f) -- close connection: "
-                         "q = "
-                         "%s\n",
-                         (getnanotime() - (double)timeout_at) / NSEC_PER_SEC,
-                         dispatch_queue_get_label(req->q));
-                mw_close_connection(req);
-            }
-        });
-        dispatch_resume(req->timeo.ds);
-
-        req->files_served++;
-        qprintf(
-            "$$$ wrote whole file (%s); timeo %p, about to enable %p and close "
-            "%d, total written %zd, this is the %d%s file served\n",
-            dispatch_queue_get_label(req->q),
-            (void *)req->timeo.ds,
-            (void *)req->sd_rd.ds,
-            req->fd,
-            req->total_written,
-            req->files_served,
-            (1 == req->files_served) ? "st" : (2 == req->files_served) ? "nd"
-                                                                       : "th");
-        mw_req_enable_source(req, &req->sd_rd);
-        if (req->fd_rd.ds) {
-            mw_req_delete_source(req, &req->fd_rd);
-        }
-        req->cb = req->cmd_buf;
+    off_t bytes = req->total_written;
+    size_t pending = buf_outof_sz(w_buf);
+    if (bytes == req->body_len) {
+        mw_req_file_done(req);
+        return;
     }
     else {
-        assert(bytes <= req->sb.st_size);
+        assert(bytes <= req->body_len);
+        // sendfile still has work to do even though file_b is empty
+        if (req->zero_copy) return;
     }
 
-    if (0 == buf_outof_sz(w_buf)) {
+    if (0 == pending) {
         mw_req_disable_source(req, &req->sd_wr);
     }
 }
 
 void mw_read_filedata(mw_request *req, size_t avail)
 {
-    if (avail == 0) {
+    // body_len, not sb: a sibling .gz has its own size
+    if (avail == 0 || req->file_off >= req->body_len) {
         mw_req_delete_source(req, &req->fd_rd);
         return;
     }
 
-    /* We make sure we can read at least as many bytes as dispatch says are
-     * available, but if our buffer is bigger we will read as much as we have
-     * space for.  We have the file opened in non-blocking mode so this is safe
+    /* We read as much as file_b has free space for, which may be more or
+     * less than dispatch says is available.  We have the file opened in
+     * non-blocking mode so this is safe.  file_b never grows here: if it is
+     * full the network is behind, so we stop reading until mw_write_filedata
+     * makes room.  The descriptor is shared through mw_fdcache, so we read
+     * at our own offset.
      */
-    buf_need_into(&req->file_b, avail);
-    size_t rsz = buf_into_sz(&req->file_b);
-    ssize_t sz = read(req->fd, req->file_b.into, rsz);
-    if (sz >= 0) {
-        assert(req->sd_wr.ds);
+    struct iovec iov[2];
+    int n = buf_into_iov(&req->file_b, iov);
+    if (n == 0) {
+        mw_req_disable_source(req, &req->fd_rd);
+        return;
+    }
+#if HAVE_PREADV
+    ssize_t sz = preadv(req->fd, iov, n, req->file_off);
+#else
+    ssize_t sz = pread(req->fd, iov[0].iov_base, iov[0].iov_len, req->file_off);
+#endif
+    if (sz == 0) {
+        // the cached descriptor's file was cut short within the stat's TTL:
+        // the source stays ready, and the Content-Length can't be met
+        qprintf("read_filedata %s: file ended at %lld of %lld\n",
+                req->q_name,
+                (long long)req->file_off,
+                (long long)req->body_len);
+        mw_close_connection(req);
+        return;
+    }
+    else if (sz > 0) {
+        req->file_off += sz;
+        assert(mw_req_source_live(&req->sd_wr));
         size_t sz0 = buf_outof_sz(&req->file_b);
         buf_used_into(&req->file_b, sz);
         assert((size_t)sz == buf_outof_sz(&req->file_b) - sz0);
@@ -344,120 +807,641 @@ void mw_read_filedata(mw_request *req, size_t avail)
     else {
         int e = errno;
         qprintf("read_filedata %s read error: %d %s\n",
-                dispatch_queue_get_label(req->q),
+                req->q_name,
                 e,
                 strerror(e));
         mw_close_connection(req);
         return;
     }
     if (req->deflate) {
-        // NOTE: deflateBound is "worst case", we could try with any non-zero
-        // buffer, and allof more if we get Z_BUF_ERROR
-        buf_need_into(&req->deflate_b,
-                      deflateBound(req->deflate, buf_outof_sz(&req->file_b)));
-        req->deflate->next_in = (req->file_b.outof);
-        size_t o_sz = buf_outof_sz(&req->file_b);
-        req->deflate->avail_in = o_sz;
-        req->deflate->next_out = req->deflate_b.into;
-
-        size_t i_sz = buf_into_sz(&req->deflate_b);
-        req->deflate->avail_out = i_sz;
-        assert((off_t)req->deflate->avail_in + (off_t)req->deflate->total_in <=
-               req->sb.st_size);
-        // at EOF we want to use Z_FINISH, otherwise we pass Z_NO_FLUSH so we
-        // get max compression
-        int rc = deflate(req->deflate,
-                         ((off_t)req->deflate->avail_in +
-                              (off_t)req->deflate->total_in >=
-                          req->sb.st_size)
-                             ? Z_FINISH
-                             : Z_NO_FLUSH);
-        assert(rc == Z_OK || rc == Z_STREAM_END);
-        buf_used_outof(&req->file_b, o_sz - req->deflate->avail_in);
-        buf_used_into(&req->deflate_b, i_sz - req->deflate->avail_out);
-        if (i_sz != req->deflate->avail_out) {
-            mw_req_enable_source(req, &req->sd_wr);
-        }
+        mw_req_deflate_more(req);
     }
     else {
         mw_req_enable_source(req, &req->sd_wr);
     }
 }
 
+/* Look for a cached compressed representation the client accepts.  On a hit
+ * req->fd/req->zc and req->body_len describe the body, and the Content-Coding
+ * is returned.
+ */
+static const char *mw_req_cached_coding(mw_request *req,
+                                        const char *path,
+                                        unsigned accept_enc)
+{
+    const char *coding = NULL;
+    mw_zcache_entry *zc = mw_zcache_get(path, &req->sb);
+    if (!zc) return NULL;
+
+    if ((accept_enc & MW_ENC_GZIP) && zc->gz_path) {
+        mw_fdcache_entry *gz = mw_fdcache_open(zc->gz_path);
+        if (gz) {
+            mw_req_close_file(req);
+            req->fc = gz;
+            req->fd = gz->fd;
+            req->body_len = gz->sb.st_size;
+            coding = "gzip";
+        }
+    }
+    if (!coding && (accept_enc & MW_ENC_DEFLATE) && zc->data) {
+        req->zc = zc;
+        req->body_len = zc->len;
+        return "deflate";
+    }
+    mw_zcache_release(zc);
+    return coding;
+}
+
+/* Write our "Date: " header line at p, from the cached time, returning the
+ * end of it
+ */
+static char *mw_put_date(char *p)
+{
+    memcpy(p, "Date: ", 6);
+    mw_fmt_http_now(p + 6);
+    p += 6 + MW_FMT_HTTP_LEN;
+    memcpy(p, "\r\n", 2);
+    return p + 2;
+}
+
+/* Stop reading requests, and start writing the response that has been put
+ * in file_b or deflate_q
+ */
+static void mw_req_start_response(mw_request *req)
+{
+    req->responding = true;
+    req->resp_start = mw_clock_now();
+    req->ttfb_noted = false;
+    // pipelined requests wait until this one has been answered
+    mw_req_disable_source(req, &req->sd_rd);
+
+    if (!mw_req_source_live(&req->sd_wr)) {
+        mw_req_make_source(req, &req->sd_wr, &req->sd_io, true);
+    }
+    mw_req_enable_source(req, &req->sd_wr);
+}
+
+/* Put the header of a response compressed as it goes out at p, in at most room
+ * bytes, returning its length
+ */
+static int mw_req_stream_header(mw_request *req,
+                                char *p,
+                                size_t room,
+                                const char *ctype,
+                                mw_coding stream)
+{
+    char date[48], *date_end = mw_put_date(date);
+    int n = snprintf(p,
+                     room,
+                     "HTTP/1.1 200 OK\r\n"
+                     "%.*s"
+                     "Content-Type: %s\r\n"
+                     "Transfer-Encoding: chunked\r\n"
+                     "Content-Encoding: %s\r\n"
+                     "Vary: Accept-Encoding\r\n"
+                     "%s\r\n",
+                     (int)(date_end - date),
+                     date,
+                     ctype,
+                     mw_coding_name(stream),
+                     req->close_after ? "Connection: close\r\n" : "");
+    assert(n > 0 && (size_t)n < room);
+    return n;
+}
+
+void mw_req_send_file(mw_request *req,
+                      const char *path,
+                      const char *ctype,
+                      unsigned accept_enc)
+{
+    req->status_number = 200;
+    req->total_written = 0;
+    req->file_off = 0;
+    req->body_len = req->sb.st_size;
+    req->zero_copy = false;
+
+    const char *coding =
+        accept_enc ? mw_req_cached_coding(req, path, accept_enc) : NULL;
+    mw_coding stream = coding ? MW_CODINGS : mw_codec_pick(accept_enc);
+    unsigned char *hdr;
+    // HEAD names the coding without starting an engine for it
+    if (stream != MW_CODINGS && !req->head_only) {
+        int level = mw_zctl_choose(mw_codec_streamer(stream), &req->zrate);
+        // too busy to compress, with as many engines open as we allow, or
+        // without memory for one or the slab its header goes in, the file
+        // goes out as it is
+        if (level == MW_ZCTL_SKIP ||
+            mw_codec_stream_open(&req->zs, stream, level)) {
+            stream = MW_CODINGS;
+        }
+        else if (!mw_slabq_room(&req->deflate_q, MW_SLABQ_MAX, &hdr)) {
+            mw_codec_stream_release(&req->zs);
+            stream = MW_CODINGS;
+        }
+    }
+    if (!coding && stream == MW_CODINGS &&
+        (req->fce = mw_fcache_get(path, req->fd, &req->sb, ctype))) {
+        req->body_len = req->head_only ? 0 : req->fce->len;
+        char *p = req->head_tail;
+        p = mw_put_date(p);
+        if (req->close_after) {
+            memcpy(p, "Connection: close\r\n", 19);
+            p += 19;
+        }
+        memcpy(p, "\r\n", 2);
+        p += 2;
+        req->head_tail_len = p - req->head_tail;
+        req->total_written = -(req->fce->hdr_len + req->head_tail_len);
+        req->zero_copy = true;
+        mw_req_start_response(req);
+        // the socket is almost always writable, don't wait for the event
+        mw_write_filedata(req, 0);
+        return;
+    }
+    if (stream != MW_CODINGS && req->head_only) {
+        struct iovec iov[2];
+        buf_into_iov(&req->file_b, iov);
+        int n = mw_req_stream_header(req,
+                                     iov[0].iov_base,
+                                     iov[0].iov_len,
+                                     ctype,
+                                     stream);
+        buf_used_into(&req->file_b, n);
+        req->total_written = -n;
+    }
+    else if (stream != MW_CODINGS) {
+        req->deflate = &req->zs;
+        req->deflate_end = false;
+        // big files are compressed a block per job, on all the loops
+        if (server.pdeflate_min && req->shard->loop &&
+            req->sb.st_size >= (off_t)server.pdeflate_min &&
+            (stream == MW_CODING_DEFLATE || stream == MW_CODING_GZIP)) {
+            req->pd = mw_pdeflate_new(req->fd,
+                                      req->sb.st_size,
+                                      req->zs.level,
+                                      stream == MW_CODING_GZIP);
+            if (req->pd) req->pd->ctx = req;
+        }
+        // the header always fits in the first slab, taken above
+        size_t room = mw_slabq_room(&req->deflate_q, MW_SLABQ_MAX, &hdr);
+        int n = mw_req_stream_header(req, (char *)hdr, room, ctype, stream);
+        mw_slabq_used_into(&req->deflate_q, n);
+        // the header goes out unframed, in the first chunk's writev; a held
+        // back chunk must fit in the slabs deflate may fill
+        size_t target = server.chunk_target;
+        if (target > (MW_SLABQ_MAX - 1) * MW_SLAB_SZ) {
+            target = (MW_SLABQ_MAX - 1) * MW_SLAB_SZ;
+        }
+        mw_chunk_init(&req->chunk,
+                      n,
+                      target,
+                      server.chunk_wait_ms * NSEC_PER_MSEC);
+    }
+    else {
+        char date[48], *date_end = mw_put_date(date);
+        int n = buf_sprintf(&req->file_b,
+                            "HTTP/1.1 200 OK\r\n"
+                            "%.*s"
+                            "Content-Type: %s\r\n"
+                            "%s%s%s%s"
+                            "Content-Length: %lld\r\n\r\n",
+                            (int)(date_end - date),
+                            date,
+                            ctype,
+                            coding ? "Content-Encoding: " : "",
+                            coding ? coding : "",
+                            coding ? "\r\nVary: Accept-Encoding\r\n" : "",
+                            req->close_after ? "Connection: close\r\n" : "",
+                            (long long)req->body_len);
+        // only the body counts towards body_len
+        req->total_written = -n;
+        req->zero_copy = !req->head_only && (req->zc || MW_HAVE_SENDFILE);
+    }
+    if (req->head_only) req->body_len = 0;
+
+    mw_req_start_response(req);
+    if (req->zero_copy || req->head_only) return;
+    if (req->pd) {
+        mw_req_pdeflate_more(req);
+        return;
+    }
+
+    // the source keeps the file open until it is cancelled
+    mw_fdcache_entry *fc = req->fc;
+    mw_fdcache_retain(fc);
+    mw_evfd_init(&req->fd_io, fc->fd, MW_EVFD_FILE);
+    mw_req_make_source(req, &req->fd_rd, &req->fd_io, false);
+    if (req->shard->loop) {
+        mw_ev_set_cancel(&req->fd_rd.ev, (mw_task_fn)mw_fdcache_release, fc);
+    }
+    else {
+        dispatch_source_set_cancel_handler(req->fd_rd.ds, ^{
+            mw_fdcache_release(fc);
+        });
+    }
+    mw_req_enable_source(req, &req->fd_rd);
+}
+
+static const char *mw_status_text(short status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Error";
+    }
+}
+
+void mw_req_send_error(mw_request *req, short status)
+{
+    req->status_number = status;
+    req->file_off = 0;
+    req->body_len = 0;
+    req->zero_copy = false;
+    mw_req_close_file(req);
+
+    char date[48], *date_end = mw_put_date(date);
+    int n = buf_sprintf(&req->file_b,
+                        "HTTP/1.1 %hd %s\r\n"
+                        "%.*s"
+                        "%s"
+                        "Content-Length: 0\r\n\r\n",
+                        status,
+                        mw_status_text(status),
+                        (int)(date_end - date),
+                        date,
+                        req->close_after ? "Connection: close\r\n" : "");
+    req->total_written = -n;
+    mw_req_start_response(req);
+}
+
+/* Answer a request for server.stats_path with a snapshot of the stats, in
+ * the Prometheus text format if the query asks for it, else as JSON
+ */
+static void mw_req_send_stats(mw_request *req, bool prometheus)
+{
+    mw_buffer body = {0};
+    if (prometheus) {
+        mw_stats_prometheus(&body);
+    }
+    else {
+        mw_stats_json(&body);
+    }
+    size_t len = buf_outof_sz(&body);
+
+    req->status_number = 200;
+    req->file_off = 0;
+    req->body_len = len;
+    req->zero_copy = false;
+
+    char date[48], *date_end = mw_put_date(date);
+    int n = buf_sprintf(&req->file_b,
+                        "HTTP/1.1 200 OK\r\n"
+                        "%.*s"
+                        "Content-Type: %s\r\n"
+                        "Cache-Control: no-store\r\n"
+                        "%s"
+                        "Content-Length: %zu\r\n\r\n",
+                        (int)(date_end - date),
+                        date,
+                        prometheus ? "text/plain; version=0.0.4"
+                                   : "application/json",
+                        req->close_after ? "Connection: close\r\n" : "",
+                        len);
+    if (req->head_only) {
+        req->body_len = 0;
+    }
+    else {
+        buf_sprintf(&req->file_b, "%.*s", (int)len, (char *)body.outof);
+    }
+    free(body.buf);
+    req->total_written = -n;
+    mw_req_start_response(req);
+}
+
+/* Is this a request for the stats, from this machine? */
+static bool mw_req_is_stats(mw_request *req, bool *prometheus)
+{
+    const char *buf = req->cmd_buf;
+    mw_span t = req->parser.target;
+    size_t l = server.stats_path ? strlen(server.stats_path) : 0;
+    if (!l || t.len < l || memcmp(buf + t.off, server.stats_path, l) ||
+        (t.len > l && buf[t.off + l] != '?')) {
+        return false;
+    }
+    if ((ntohl(req->r_addr.sin_addr.s_addr) >> 24) != 127) return false;
+
+    static const char prom[] = "format=prometheus";
+    *prometheus = false;
+    for (size_t i = t.off + l; i + sizeof(prom) - 1 <= t.off + t.len; i++) {
+        if (!memcmp(buf + i, prom, sizeof(prom) - 1)) *prometheus = true;
+    }
+    return true;
+}
+
+/* Content types we know, and the MW_ENC_* codings worth using on them: none
+ * for the ones that are compressed already
+ */
+static const struct {
+    const char *ext;
+    const char *ctype;
+    unsigned codings;
+} mw_ctypes[] = {
+    {"html", "text/html", MW_ENC_ALL},
+    {"htm", "text/html", MW_ENC_ALL},
+    {"txt", "text/plain", MW_ENC_ALL},
+    {"css", "text/css", MW_ENC_ALL},
+    {"js", "application/javascript", MW_ENC_ALL},
+    {"json", "application/json", MW_ENC_ALL},
+    {"xml", "text/xml", MW_ENC_ALL},
+    {"svg", "image/svg+xml", MW_ENC_ALL},
+    {"wasm", "application/wasm", MW_ENC_ALL},
+    {"png", "image/png", 0},
+    {"jpg", "image/jpeg", 0},
+    {"jpeg", "image/jpeg", 0},
+    {"gif", "image/gif", 0},
+    // small, so not worth setting up the bigger engines' windows for
+    {"ico", "image/x-icon", MW_ENC_DEFLATE | MW_ENC_GZIP},
+    {"woff2", "font/woff2", 0},
+    {"webp", "image/webp", 0},
+    {"avif", "image/avif", 0},
+    {"mp3", "audio/mpeg", 0},
+    {"mp4", "video/mp4", 0},
+    {"webm", "video/webm", 0},
+    {"woff", "font/woff", 0},
+    {"pdf", "application/pdf", 0},
+    {"gz", "application/gzip", 0},
+    {"tgz", "application/gzip", 0},
+    {"zip", "application/zip", 0},
+    {"bz2", "application/x-bzip2", 0},
+    {"xz", "application/x-xz", 0},
+    {"zst", "application/zstd", 0},
+    {"br", "application/x-brotli", 0},
+};
+
+static const char *mw_req_ctype(const char *path, unsigned *codings)
+{
+    const char *slash = strrchr(path, '/');
+    const char *dot = strrchr(path, '.');
+    if (dot && (!slash || dot > slash)) {
+        for (size_t i = 0; i < sizeof(mw_ctypes) / sizeof(mw_ctypes[0]); i++) {
+            if (!strcasecmp(dot + 1, mw_ctypes[i].ext)) {
+                *codings = mw_ctypes[i].codings;
+                return mw_ctypes[i].ctype;
+            }
+        }
+    }
+    *codings = 0;
+    return "application/octet-stream";
+}
+
+static int hexval(char ch)
+{
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+/* Map the request-target to a path under doc_base, in the request's pool.
+ * Returns NULL for targets that aren't a plain path, or that try to leave
+ * doc_base.
+ */
+static char *mw_req_resolve(mw_request *req)
+{
+    const char *t = req->cmd_buf + req->parser.target.off;
+    size_t len = strcspn(t, "?# ");
+    if (len > req->parser.target.len) len = req->parser.target.len;
+    if (len == 0 || t[0] != '/') return NULL;
+
+    const char *base = server.doc_base ? server.doc_base : ".";
+    size_t b_len = strlen(base);
+    // room for the base, the decoded path, "index.html" and the NUL
+    char *path = mw_mpool_malloc(&req->pool, b_len + len + 11);
+    if (!path) return NULL;
+    memcpy(path, base, b_len);
+
+    char *p = path + b_len;
+    for (size_t i = 0; i < len; i++) {
+        char ch = t[i];
+        if (ch == '%') {
+            int hi = i + 2 < len ? hexval(t[i + 1]) : -1;
+            int lo = hi >= 0 ? hexval(t[i + 2]) : -1;
+            if (lo < 0) return NULL;
+            ch = hi << 4 | lo;
+            if (ch == '\0') return NULL;
+            i += 2;
+        }
+        *p++ = ch;
+    }
+    *p = '\0';
+
+    // refuse any ".." segment
+    for (char *s = path + b_len; (s = strstr(s, "/..")); s += 3) {
+        if (s[3] == '/' || s[3] == '\0') return NULL;
+    }
+    if (p[-1] == '/') strcpy(p, "index.html");
+    return path;
+}
+
+/* Work out the response to a completely parsed request, and start it */
+static void mw_req_serve(mw_request *req)
+{
+    const char *buf = req->cmd_buf;
+    mw_http_parser *p = &req->parser;
+
+    const mw_http_header *conn = mw_http_find(p, buf, "Connection");
+    if (p->minor == 0) {
+        req->close_after =
+            !(conn && mw_span_has_token(buf, conn->value, "keep-alive"));
+    }
+    else {
+        req->close_after = conn && mw_span_has_token(buf, conn->value, "close");
+    }
+
+    // HEAD gets the header GET would, without the body (RFC 7231 4.3.2)
+    req->head_only = mw_span_eq(buf, p->method, "HEAD");
+    if (!req->head_only && !mw_span_eq(buf, p->method, "GET")) {
+        bool known = mw_span_eq(buf, p->method, "POST") ||
+                     mw_span_eq(buf, p->method, "PUT") ||
+                     mw_span_eq(buf, p->method, "DELETE") ||
+                     mw_span_eq(buf, p->method, "OPTIONS");
+        mw_req_send_error(req, known ? 405 : 501);
+        return;
+    }
+
+    bool prometheus;
+    if (mw_req_is_stats(req, &prometheus)) {
+        mw_req_send_stats(req, prometheus);
+        return;
+    }
+
+    char *path = mw_req_resolve(req);
+    if (!path) {
+        mw_req_send_error(req, 400);
+        return;
+    }
+    req->fc = mw_fdcache_open(path);
+    if (!req->fc) {
+        mw_req_send_error(req, errno == EACCES ? 403 : 404);
+        return;
+    }
+    req->fd = req->fc->fd;
+    req->sb = req->fc->sb;
+
+    unsigned codings;
+    const char *ctype = mw_req_ctype(path, &codings);
+    unsigned accept_enc = 0;
+    const mw_http_header *ae = mw_http_find(p, buf, "Accept-Encoding");
+    // streamed compression needs chunked encoding, which HTTP/1.0 doesn't have
+    if (ae && !codings && p->minor > 0) {
+        // compressed already, or otherwise not worth it
+        mw_stats_count(MW_STAT_Z_SKIP_TYPE, 1);
+    }
+    else if (ae && p->minor > 0) {
+        int q[MW_CODINGS];
+        for (int c = 0; c < MW_CODINGS; c++) {
+            q[c] = mw_span_token_q(buf, ae->value, mw_coding_name(c));
+        }
+        accept_enc = mw_codec_negotiate(q, codings & mw_codec_available());
+    }
+    mw_req_send_file(req, path, ctype, accept_enc);
+}
+
+/* Parse what we have of the request at the front of cmd_buf, and respond if
+ * it is complete.  Returns false if we need more bytes.
+ */
+static bool mw_req_process(mw_request *req)
+{
+    if (req->responding) return true;
+
+    switch (mw_http_parse(&req->parser, req->cmd_buf, req->cb - req->cmd_buf)) {
+    case MW_HTTP_AGAIN:
+        return false;
+    case MW_HTTP_ERROR:
+        req->parser.end = req->cb - req->cmd_buf;
+        req->close_after = true;
+        mw_req_send_error(req, 400);
+        return true;
+    case MW_HTTP_DONE:
+        assert(buf_outof_sz(&req->file_b) == 0);
+        assert(req->deflate_q.bytes == 0);
+        mw_req_serve(req);
+        return true;
+    }
+    return false;
+}
+
+/* Read from the client: on an io_uring loop, out of what the ring has already
+ * received
+ */
+static ssize_t mw_req_recv(mw_request *req, void *buf, size_t len)
+{
+    if (req->sd_rd.ev.fn) return mw_ev_read(&req->sd_rd.ev, buf, len);
+    return read(req->sd, buf, len);
+}
+
 void mw_read_req(mw_request *req, __unused size_t avail)
 {
-    if (req->timeo.ds) {
-        mw_req_delete_source(req, &req->timeo);
+    mw_clock_update();
+    if (req->idle) {
+        mw_twheel_disarm(&req->shard->wheel, &req->timer);
+        req->idle = false;
     }
 
     // -1 to account for the trailing NULL byte
     int s = (sizeof(req->cmd_buf) - (req->cb - req->cmd_buf)) - 1;
     if (s == 0) {
         qprintf("reqd req fd#%d command overflow\n", req->sd);
-        mw_close_connection(req);
+        if (req->responding) {
+            // the client is pipelining faster than we answer, wait for it
+            mw_req_disable_source(req, &req->sd_rd);
+            return;
+        }
+        req->parser.end = req->cb - req->cmd_buf;
+        req->close_after = true;
+        mw_req_send_error(req, 431);
         return;
     }
 
-    int rd = read(req->sd, req->cb, s);
+    int rd = mw_req_recv(req, req->cb, s);
     if (rd > 0) {
+        /* A read can still be delivered after sd_rd was disabled for a
+         * response; the bytes wait in cmd_buf until the response is done.
+         */
         req->cb += rd;
-
-        if (req->cb > req->cmd_buf + 4) {
-            int i;
-            for (i = -4; i != 0; i++) {
-                char ch = *(req->cb + i);
-                if (ch != '\n' && ch != '\r') {
-                    break;
-                }
-            }
-            if (i == 0) {
-                *(req->cb) = '\0';
-                assert(buf_outof_sz(&req->file_b) == 0);
-                assert(buf_outof_sz(&req->deflate_b) == 0);
-            }
+        mw_req_process(req);
+    }
+    else if (rd == 0) {
+        // the client has closed its end, finish any response we owe it first
+        if (req->responding) {
+            req->close_after = true;
+            mw_req_disable_source(req, &req->sd_rd);
+            return;
         }
+        mw_close_connection(req);
+    }
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        mw_req_source_blocked(&req->sd_rd);
+    }
+    else {
+        qprintf("read req %s read error: %d %s\n",
+                req->q_name,
+                errno,
+                strerror(errno));
+        mw_close_connection(req);
     }
 }
 
-void mw_accept_cb(int fd)
+void mw_accept_one(mw_shard *shard, int s, struct sockaddr_in *addr)
 {
-    static int req_num = 0;
-    mw_request *new_req = calloc(1, sizeof(mw_request));
-    assert(new_req);
-    new_req->cb = new_req->cmd_buf;
-    socklen_t r_len = sizeof(new_req->r_addr);
-    int s = accept(fd, (struct sockaddr *)&(new_req->r_addr), &r_len);
-    if (s < 0) {
-        qfprintf(stderr,
-                 "accept failure (rc = %d, errno=%d %s)\n",
-                 s,
-                 errno,
-                 strerror(errno));
+    mw_request *new_req = mw_reqpool_get(&shard->pool);
+    new_req->r_addr = *addr;
+    new_req->sd = s;
+    new_req->req_num = shard->req_num++;
+    new_req->q_name = mw_mpool_asprintf(&new_req->pool,
+                                        "req#%d.%d s#%d",
+                                        shard->id,
+                                        new_req->req_num,
+                                        s);
+    new_req->conn_mark = mw_mpool_mark_get(&new_req->pool);
+    mw_http_init(&new_req->parser, 0);
+    qtrace("accept_cb shard#%d; made: %s\n", shard->id, new_req->q_name);
+
+    mw_shard_add(shard, new_req);
+    mw_evfd_init(&new_req->sd_io, s, MW_EVFD_STREAM);
+
+    if (shard->loop) {
+        // the connection stays on the shard's loop, teardown and all
+        int rc = mw_req_make_source(new_req,
+                                    &new_req->sd_rd,
+                                    &new_req->sd_io,
+                                    false);
+        if (rc) {
+            qfprintf(stderr,
+                     "%s: can't watch the socket: %s\n",
+                     new_req->q_name,
+                     strerror(rc));
+            mw_req_free(new_req);
+            return;
+        }
+        mw_req_enable_source(new_req, &new_req->sd_rd);
         return;
     }
 
-    assert(s >= 0);
-    new_req->sd = s;
-    new_req->req_num = req_num;
-    asprintf(&(new_req->q_name), "req#%d s#%d", req_num++, s);
-    qprintf("accept_cb fd#%d; made: %s\n", fd, new_req->q_name);
-
     // All further work for this request will happen on new_req->q, except the
-    // final teardown
+    // final teardown, which is back on the shard's queue
     new_req->q = dispatch_queue_create(new_req->q_name, NULL);
     dispatch_set_context(new_req->q, new_req);
     dispatch_set_finalizer_f(new_req->q, (dispatch_function_t)mw_req_free);
 
-    debug_reqs = reallocf(debug_reqs, sizeof(mw_request) * ++n_reqs);
-    debug_reqs[n_reqs - 1] = new_req;
-
-    new_req->sd_rd.ds = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ,
-                                               new_req->sd,
-                                               0,
-                                               new_req->q);
-    dispatch_source_set_event_handler(new_req->sd_rd.ds, ^{
-        mw_read_req(new_req, dispatch_source_get_data(new_req->sd_rd.ds));
-    });
+    mw_req_make_source(new_req, &new_req->sd_rd, &new_req->sd_io, false);
+    new_req->sd_rd.suspended = false;
 
     dispatch_release(new_req->q);
     dispatch_resume(new_req->sd_rd.ds);
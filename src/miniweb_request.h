@@ -2,20 +2,44 @@
 #define MINIWEB_REQUEST_H
 
 #include "mw_buffer.h"
+#include "mw_chunk.h"
+#include "mw_codec.h"
+#include "mw_evloop.h"
+#include "mw_fcache.h"
+#include "mw_fdcache.h"
+#include "mw_http.h"
+#include "mw_mempool.h"
+#include "mw_pdeflate.h"
+#include "mw_slab.h"
+#include "mw_twheel.h"
+#include "mw_zcache.h"
+#include "mw_zctl.h"
 #include <dispatch/dispatch.h>
 #include <netinet/in.h>
 #include <stdbool.h>
 #include <sys/stat.h>
-#include <zlib.h>
+
+/**
+ * @brief Capacity of a request's circular file_b
+ */
+#define MW_FILE_BUF_SZ (64 * 1024)
+
+/**
+ * @brief Size of the scratch region built into each request's pool
+ */
+#define MW_REQ_SCRATCH_SZ 1024
 
 /**
  * \brief A struct to track request sources.
  *
- * libdispatch gives suspension a counting behavior, but we want a simple
- * on/off behavior, so we use this struct to track suspensions.
+ * Under libdispatch a source is a dispatch source on the request's queue;
+ * under an event loop it is a mw_ev on the shard's loop.  libdispatch gives
+ * suspension a counting behavior, but we want a simple on/off behavior, so we
+ * use this struct to track suspensions.
  */
 typedef struct _mw_request_source {
     dispatch_source_t ds; ///< The request source's dispatch source
+    mw_ev ev;             ///< The request source's event loop source
     bool suspended;       ///< Use this to track suspensions.
 } mw_request_source;
 
@@ -24,51 +48,94 @@ typedef struct _mw_request_source {
  */
 typedef struct _mw_request {
     struct sockaddr_in r_addr; ///< The request address
-    z_stream *deflate;         ///< Z-Stream for compressed requests
+    mw_codec_stream *deflate;  ///< compresses the response body, or NULL
+    mw_codec_stream zs;        ///< deflate points here while compressing
+    bool deflate_end;          ///< has deflate given all its output?
+    mw_chunker chunk;          ///< frames deflate_q in chunked coding
+    mw_zrate zrate;            ///< how fast the client takes our responses
+    mw_pdeflate *pd;           ///< the file being deflated in parallel, or NULL
+    struct _mw_request *pool_next; ///< next idle request in a mw_reqpool
+    struct _mw_shard *shard;       ///< the shard that accepted us
+    struct _mw_request *shard_prev, *shard_next; ///< in shard->reqs
 
     char cmd_buf[8196]; ///< Holds the HTTP Request
     char *cb;           ///< pointer to the current position of cmd_buf
+    mw_http_parser parser; ///< parses the request at the start of cmd_buf
+    bool responding;       ///< is a response to the parsed request under way?
+    bool close_after;      ///< close the connection after this response?
+    bool head_only;        ///< is it a HEAD, answered without the body?
+    bool pipelined;        ///< is a request left in cmd_buf for mw_req_fired?
 
-    char chunk_num[13]; ///< chunk, big enough for 8 digits plus \r\n\r\n\0
-    char *cnp;          ///< pointer to current position of chunk_num
-
-    bool needs_zero_chunk; ///< do we need zero chunk?
-    bool reuse_guard;      ///< should we resuse the guard?
+    bool reuse_guard; ///< should we resuse the guard?
 
-    short status_number;          ///< http status code
-    size_t chunk_bytes_remaining; ///< the number of bytes left in chunk
-    char *q_name;                 ///< Name of our queue
-    int req_num;                  ///< for debugging
-    int files_served;             ///< files served for this socket
-    dispatch_queue_t q;           ///< this request's queue
+    short status_number; ///< http status code
+    char *q_name;        ///< Name of our queue, in pool
+    int req_num;         ///< for debugging
+    int files_served;    ///< files served for this socket
+    dispatch_queue_t q;  ///< this request's queue, NULL on a loop
 
     int sd; ///< the socket descriptor, where network I/O takes place
-    int fd; ///< the source file, or -1 if none=
+    int fd; ///< the source file (fc->fd), or -1 if none
+    mw_fdcache_entry *fc; ///< our reference to the source file, or NULL
 
     mw_request_source fd_rd; ///< for read events from the source file
     mw_request_source sd_rd; ///< for read events from the network socket
     mw_request_source sd_wr; ///< for write events to the network socket
-    mw_request_source timeo; ///< timeout event waiting for a new header
+    mw_evfd sd_io;           ///< sd's registration with the shard's loop
+    mw_evfd fd_io;           ///< fd's registration with the shard's loop
+    int n_sources;           ///< live sources on the loop, freed at 0
+    mw_evtask free_task;     ///< frees us once the loop's pass is done
+    mw_timer timer;          ///< keep-alive timeout, in the shard's wheel
+    bool idle;               ///< is timer armed, waiting for a new header?
+    bool flush_armed;        ///< is timer armed, to send a held back chunk?
 
-    uint64_t timeout_at; ///< when we will timeout
+    uint64_t timeout_at; ///< when we will timeout, on mw_clock_ns
+    uint64_t resp_start; ///< when we started the response, on mw_clock_ns
+    bool ttfb_noted;     ///< has the response's first byte been timed?
     struct stat sb;
+    off_t file_off;        ///< next offset to read from fd, or send from fd/zc
+    off_t body_len;        ///< body length, or input length if compressing
+    bool zero_copy;        ///< does the body bypass file_b (sendfile or zc)?
+    mw_zcache_entry *zc;   ///< cached compressed body we are sending, or NULL
+    mw_fcache_entry *fce;  ///< cached small file we are sending, or NULL
+    char head_tail[64];    ///< what follows fce->hdr: our fields, blank line
+    size_t head_tail_len;  ///< bytes in head_tail
 
     /**
      * For compressed GET requests:
-     *   - data is compressed from file_b into deflate_b
-     *   - data is written to the network socket from deflate_b
+     *   - data is compressed from file_b into deflate_q
+     *   - data is written to the network socket from deflate_q, framed by
+     *     chunk: small pieces wait up to server.chunk_wait_ms to go out as
+     *     one chunk of server.chunk_target bytes
      *
      * For uncompressed GET requests:
      *   - data is written to the network socket from file_b
-     *   - deflate_b is unused
+     *   - deflate_q is unused
+     *
+     * file_b is a fixed size circular buffer; reading from fd pauses while it
+     * is full.  deflate_q holds at most MW_SLABQ_MAX slabs of output (more
+     * while deflating in parallel, a block at a time); compressing pauses
+     * while they are full, so file_b fills and reading pauses in turn.
+     *
+     * For zero-copy GET requests only the response header goes through
+     * file_b, the body is sent from fd to sd by the kernel, or written
+     * straight out of a mw_zcache entry.  Small files come from mw_fcache,
+     * header and all, and don't touch file_b.
      */
     mw_buffer file_b; ///< Where we read data from fd into
-    mw_buffer deflate_b;
+    mw_slabq deflate_q; ///< Where compressed data goes, empty when idle
     ssize_t total_written; ///< The total number of bytes written
+
+    /**
+     * Scratch memory.  Allocations for the connection come first, up to
+     * conn_mark, then each request's allocations, which are given back when
+     * its response is done.
+     */
+    mw_mempool pool;
+    mw_mpool_mark conn_mark; ///< pool position after the connection's data
+    char scratch[MW_REQ_SCRATCH_SZ]; ///< the first region of pool
 } mw_request;
 
-extern int n_reqs;              ///< The number of requests we have received
-extern mw_request **debug_reqs; ///< For debugging purposes
 
 /**
  * @brief Free a request
@@ -102,9 +169,13 @@ void mw_req_enable_source(mw_request *req, mw_request_source *src);
 void mw_req_delete_source(mw_request *req, mw_request_source *src);
 
 /**
- * @brief Dump all requests. For debugging purposes.
+ * @brief Dump a shard's requests. For debugging purposes.
+ *
+ * Must be called on the shard's queue.
+ *
+ * @param shard The shard whose requests to dump
  */
-void mw_dump_reqs(void);
+void mw_dump_reqs(struct _mw_shard *shard);
 
 /**
  * @brief Close a connection
@@ -134,6 +205,40 @@ void mw_write_filedata(mw_request *req, size_t avail);
  */
 void mw_read_filedata(mw_request *req, size_t avail);
 
+/**
+ * @brief Start sending a file as the response to the current request
+ *
+ * req->fc must hold the file (from mw_fdcache), with req->fd and req->sb
+ * copied from it.  This
+ * writes the response header, and sets up the sources that move the file to
+ * the network socket, ending in the "wrote whole file" completion.
+ * Uncompressed responses come from mw_fcache if the file is small, and are
+ * sent with sendfile when the platform has it otherwise.
+ * Compressed responses come from mw_zcache (a sibling .gz file, or data
+ * compressed earlier) with a Content-Length when they can, and are compressed
+ * on the fly, chunked, when they can't: with the coding mw_codec_pick
+ * prefers of those in accept_enc.  For req->head_only just the header is sent,
+ * the one GET would get.
+ *
+ * @param req The request to respond to
+ * @param path The path of the file, the key for mw_zcache
+ * @param ctype The Content-Type of the file
+ * @param accept_enc The MW_ENC_* codings to choose from, see
+ *                   mw_codec_negotiate; 0 to send the file as it is
+ */
+void mw_req_send_file(mw_request *req,
+                      const char *path,
+                      const char *ctype,
+                      unsigned accept_enc);
+
+/**
+ * @brief Send a response with no body, e.g. 404
+ *
+ * @param req The request to respond to
+ * @param status The HTTP status code
+ */
+void mw_req_send_error(mw_request *req, short status);
+
 /**
  * @brief Read a request
  *
@@ -147,12 +252,24 @@ void mw_read_filedata(mw_request *req, size_t avail);
 void mw_read_req(mw_request *req, size_t avail);
 
 /**
- * @brief We have a new connection, allocate a req and set up the read event
- *        handler
+ * @brief Allocate a req for a newly accepted connection, and set up its read
+ *        event handler
+ *
+ * Runs on the shard's queue, or loop.
+ *
+ * @param shard The shard that accepted the connection
+ * @param s The connection's socket
+ * @param addr The peer's address
+ */
+void mw_accept_one(struct _mw_shard *shard, int s, struct sockaddr_in *addr);
+
+/**
+ * @brief A request's keep-alive timer expired, close it on its own queue, or
+ *        straight away on its shard's loop
  *
- * @param fd The file descriptor for this request's network socket
+ * The mw_timer_fn for the shards' wheels.
  */
-void mw_accept_cb(int fd);
+void mw_req_timed_out(mw_timer *t, unsigned gen, void *ctx);
 
 #endif /* ifndef MINIWEB_REQUEST_H */
 
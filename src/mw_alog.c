@@ -0,0 +1,387 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for fileno
+#endif
+#include "mw_alog.h"
+#include "mw_clock.h"
+#include "mw_fmt.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* How often the writer looks at the rings */
+#define ALOG_POLL_MS 10
+
+/* Binary records a batch can hold: batches are written once they pass the
+ * flush size
+ */
+#define ALOG_BIN_RECS (MW_ALOG_FLUSH_BYTES / sizeof(mw_alog_bin_rec) + 1)
+
+/* Slots for finding request lines already in a binary batch */
+#define ALOG_INTERN_SZ 1024
+
+/* The writer formats into a buffer this big, a little over the flush size so
+ * a whole ring always fits after a flush
+ */
+#define ALOG_BUF_SZ                                                            \
+    (MW_ALOG_FLUSH_BYTES + MW_ALOG_RING_SZ * (MW_ALOG_RL_MAX + 128))
+
+/* A single producer, single consumer ring of records.  head is only written
+ * by the thread that owns the ring, tail only by the writer thread.
+ */
+typedef struct _alog_ring {
+    struct _alog_ring *next; ///< in alog.rings
+    _Atomic size_t head;     ///< next record to fill in
+    _Atomic size_t tail;     ///< next record to write out
+    _Atomic size_t drops;    ///< records dropped because the ring was full
+    _Atomic bool orphaned;   ///< the owning thread has exited
+    mw_alog_rec recs[MW_ALOG_RING_SZ];
+} alog_ring;
+
+static struct {
+    pthread_mutex_t lock; ///< protects rings, and the reopen handshake
+    pthread_cond_t cond;  ///< wakes the writer, and reopen waiters
+    alog_ring *rings;     ///< every thread's ring, never freed
+    pthread_key_t key;    ///< marks a thread's ring orphaned when it exits
+    bool started;
+
+    FILE *f;                          ///< the log file, only the writer's
+    int flush_ms;                     ///< longest a formatted line waits
+    mw_alog_format fmt;               ///< text lines or binary batches
+    const char *reopen_name;          ///< file to reopen, for mw_alog_reopen
+    unsigned reopen_req, reopen_done; ///< reopen handshake
+
+    char buf[ALOG_BUF_SZ]; ///< formatted, or binary request lines
+    size_t len;            ///< bytes in buf
+    uint64_t oldest;       ///< when the oldest line in buf was formatted
+
+    mw_alog_bin_rec recs[ALOG_BIN_RECS]; ///< the binary batch being built
+    size_t n_recs;                       ///< records in recs
+    size_t drops;                        ///< drops to note in the batch
+    struct {
+        uint32_t off, len;
+    } intern[ALOG_INTERN_SZ]; ///< request lines in buf, by hash
+} alog = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static _Thread_local alog_ring *my_ring;
+
+static uint64_t now_ms(void)
+{
+    return mw_clock_coarse_ns() / 1000000;
+}
+
+static void alog_orphan(void *ring)
+{
+    atomic_store(&((alog_ring *)ring)->orphaned, true);
+}
+
+/* Find this thread a ring: one left by a thread that has exited, or a new
+ * one
+ */
+static alog_ring *alog_ring_get(void)
+{
+    pthread_mutex_lock(&alog.lock);
+    alog_ring *r;
+    for (r = alog.rings; r; r = r->next) {
+        if (atomic_load(&r->orphaned)) break;
+    }
+    if (r) {
+        atomic_store(&r->orphaned, false);
+    }
+    else {
+        r = calloc(1, sizeof(*r));
+        assert(r);
+        r->next = alog.rings;
+        alog.rings = r;
+    }
+    pthread_mutex_unlock(&alog.lock);
+    pthread_setspecific(alog.key, r);
+    return r;
+}
+
+mw_alog_rec *mw_alog_begin(void)
+{
+    if (!alog.started) return NULL;
+    if (!my_ring) my_ring = alog_ring_get();
+
+    alog_ring *r = my_ring;
+    size_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t t = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (h - t == MW_ALOG_RING_SZ) {
+        atomic_fetch_add_explicit(&r->drops, 1, memory_order_relaxed);
+        return NULL;
+    }
+    return &r->recs[h % MW_ALOG_RING_SZ];
+}
+
+void mw_alog_commit(mw_alog_rec *rec)
+{
+    if (!rec) return;
+    alog_ring *r = my_ring;
+    assert(rec == &r->recs[atomic_load(&r->head) % MW_ALOG_RING_SZ]);
+    size_t h = atomic_fetch_add_explicit(&r->head, 1, memory_order_release);
+    // don't wait for the writer's next poll if we are filling up fast
+    size_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (h + 1 - t == MW_ALOG_RING_SZ * 3 / 4) pthread_cond_signal(&alog.cond);
+}
+
+/* Write v in decimal at p, returning the end of it */
+static char *put_num(char *p, long long v)
+{
+    char tmp[24], *end = tmp + sizeof(tmp), *t = end;
+    unsigned long long u = v;
+    if (v < 0) {
+        *p++ = '-';
+        u = -u;
+    }
+    do {
+        *--t = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    memcpy(p, t, end - t);
+    return p + (end - t);
+}
+
+size_t mw_alog_format_line(const mw_alog_rec *rec, char *out)
+{
+    char *p = out;
+    p += mw_fmt_addr(AF_INET, &rec->addr, p);
+    memcpy(p, " -- [", 5);
+    p += 5;
+    mw_fmt_clf(rec->when, p);
+    p += MW_FMT_CLF_LEN;
+    memcpy(p, "] \"", 3);
+    p += 3;
+    memcpy(p, rec->rl, rec->rl_len);
+    p += rec->rl_len;
+    memcpy(p, "\" ", 2);
+    p = put_num(p + 2, rec->status);
+    *p++ = ' ';
+    p = put_num(p, rec->total_written);
+    *p++ = '\n';
+    return p - out;
+}
+
+/* Bytes waiting to be written */
+static size_t alog_pending(void)
+{
+    return alog.len + alog.n_recs * sizeof(mw_alog_bin_rec);
+}
+
+/* Is there nothing at all to write, not even a count of drops? */
+static bool alog_empty(void)
+{
+    return alog_pending() == 0 && alog.drops == 0;
+}
+
+/* Find rec's request line in the batch's strings, or add it */
+static uint32_t alog_intern(const mw_alog_rec *rec)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned i = 0; i < rec->rl_len; i++) {
+        h = (h ^ (unsigned char)rec->rl[i]) * 16777619u;
+    }
+    h %= ALOG_INTERN_SZ;
+    if (alog.intern[h].len == rec->rl_len &&
+        !memcmp(alog.buf + alog.intern[h].off, rec->rl, rec->rl_len)) {
+        return alog.intern[h].off;
+    }
+    uint32_t off = alog.len;
+    memcpy(alog.buf + alog.len, rec->rl, rec->rl_len);
+    alog.len += rec->rl_len;
+    alog.intern[h].off = off;
+    alog.intern[h].len = rec->rl_len;
+    return off;
+}
+
+/* Add one record to the buffer: a formatted line, or a binary record whose
+ * request line goes in buf, without going through stdio either way
+ */
+static void alog_format(const mw_alog_rec *rec)
+{
+    if (alog_empty()) alog.oldest = now_ms();
+    // ALOG_BUF_SZ leaves room for a whole ring after a flush
+    if (alog.fmt == MW_ALOG_TEXT) {
+        alog.len += mw_alog_format_line(rec, alog.buf + alog.len);
+        return;
+    }
+
+    mw_alog_bin_rec *b = &alog.recs[alog.n_recs++];
+    b->when = rec->when;
+    b->total_written = rec->total_written;
+    b->latency_us = rec->latency_us;
+    b->rl_off = alog_intern(rec);
+    b->rl_len = rec->rl_len;
+    b->status = rec->status;
+    memcpy(b->addr, &rec->addr, sizeof(b->addr));
+}
+
+/* Write a binary batch: the header, the records and the request lines */
+static void alog_write_batch(int fd)
+{
+    mw_alog_bin_batch hdr = {
+        .magic = MW_ALOG_BIN_MAGIC,
+        .n_recs = alog.n_recs,
+        .str_len = alog.len,
+        .drops = alog.drops,
+    };
+    struct iovec iov[3] = {
+        {&hdr, sizeof(hdr)},
+        {alog.recs, alog.n_recs * sizeof(mw_alog_bin_rec)},
+        {alog.buf, alog.len},
+    };
+    int i = 0;
+    while (i < 3) {
+        ssize_t n = writev(fd, iov + i, 3 - i);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break; // nothing sensible to do, the batch is lost
+        while (i < 3 && (size_t)n >= iov[i].iov_len) n -= iov[i++].iov_len;
+        if (i < 3) {
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
+    alog.n_recs = 0;
+    alog.drops = 0;
+    memset(alog.intern, 0, sizeof(alog.intern));
+}
+
+static void alog_write_out(void)
+{
+    size_t off = 0;
+    int fd = fileno(alog.f);
+    if (alog.fmt == MW_ALOG_BINARY) {
+        if (!alog_empty()) alog_write_batch(fd);
+        alog.len = 0;
+        return;
+    }
+    while (off < alog.len) {
+        ssize_t n = write(fd, alog.buf + off, alog.len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break; // nothing sensible to do, the lines are lost
+        off += n;
+    }
+    alog.len = 0;
+}
+
+/* Move every ring's records into buf, writing buf out whenever it passes the
+ * flush size
+ */
+static void alog_drain(void)
+{
+    pthread_mutex_lock(&alog.lock);
+    alog_ring *rings = alog.rings;
+    pthread_mutex_unlock(&alog.lock);
+
+    // rings are only ever added at the head, so walking without the lock is
+    // safe
+    for (alog_ring *r = rings; r; r = r->next) {
+        size_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t h = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; t != h; t++) {
+            alog_format(&r->recs[t % MW_ALOG_RING_SZ]);
+            atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+            if (alog_pending() >= MW_ALOG_FLUSH_BYTES) alog_write_out();
+        }
+        size_t drops = atomic_exchange(&r->drops, 0);
+        if (drops && alog.fmt == MW_ALOG_BINARY) {
+            if (alog_empty()) alog.oldest = now_ms();
+            alog.drops += drops;
+        }
+        else if (drops) {
+            alog.len += snprintf(alog.buf + alog.len,
+                                 sizeof(alog.buf) - alog.len,
+                                 "# dropped %zu log records\n",
+                                 drops);
+        }
+    }
+}
+
+static void alog_reopen_now(void)
+{
+    alog_write_out();
+    if (alog.fmt == MW_ALOG_TEXT) fputs("# flush 'n roll!\n", alog.f);
+    fflush(alog.f);
+    alog.f = freopen(alog.reopen_name, "a", alog.f);
+    assert(alog.f);
+}
+
+static void *alog_writer(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&alog.lock);
+    for (;;) {
+        struct timeval tv;
+        struct timespec until;
+        gettimeofday(&tv, NULL);
+        until.tv_sec = tv.tv_sec;
+        until.tv_nsec = tv.tv_usec * 1000 + ALOG_POLL_MS * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&alog.cond, &alog.lock, &until);
+        unsigned reopen = alog.reopen_req;
+        pthread_mutex_unlock(&alog.lock);
+
+        alog_drain();
+        if (reopen != alog.reopen_done) {
+            alog_reopen_now();
+        }
+        else if (!alog_empty() &&
+                 now_ms() - alog.oldest >= (uint64_t)alog.flush_ms) {
+            alog_write_out();
+        }
+
+        pthread_mutex_lock(&alog.lock);
+        if (reopen != alog.reopen_done) {
+            alog.reopen_done = reopen;
+            pthread_cond_broadcast(&alog.cond);
+        }
+    }
+    return NULL;
+}
+
+mw_alog_format mw_alog_format_for(const char *name)
+{
+    size_t l = name ? strlen(name) : 0, sl = strlen(MW_ALOG_BIN_SUFFIX);
+    if (l > sl && !strcmp(name + l - sl, MW_ALOG_BIN_SUFFIX)) {
+        return MW_ALOG_BINARY;
+    }
+    return MW_ALOG_TEXT;
+}
+
+void mw_alog_init(FILE *f, int flush_ms, mw_alog_format fmt)
+{
+    alog.f = f;
+    alog.flush_ms = flush_ms;
+    alog.fmt = fmt;
+    pthread_key_create(&alog.key, alog_orphan);
+
+    pthread_t t;
+    int rc = pthread_create(&t, NULL, alog_writer, NULL);
+    assert(rc == 0);
+    pthread_detach(t);
+    alog.started = true;
+}
+
+void mw_alog_reopen(const char *name)
+{
+    pthread_mutex_lock(&alog.lock);
+    alog.reopen_name = name;
+    unsigned want = ++alog.reopen_req;
+    pthread_cond_broadcast(&alog.cond);
+    while (alog.reopen_done != want) {
+        pthread_cond_wait(&alog.cond, &alog.lock);
+    }
+    pthread_mutex_unlock(&alog.lock);
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
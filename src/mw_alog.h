@@ -0,0 +1,156 @@
+#ifndef MW_ALOG_H
+#define MW_ALOG_H
+
+#include "config.h"
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief Records each thread's ring can hold before records are dropped
+ */
+#define MW_ALOG_RING_SZ 1024
+
+/**
+ * @brief The longest request line a record keeps, longer ones are cut
+ */
+#define MW_ALOG_RL_MAX 200
+
+/**
+ * @brief Write the log once this many bytes of it are formatted
+ */
+#define MW_ALOG_FLUSH_BYTES (64 * 1024)
+
+/**
+ * @brief The default for how long a formatted line may wait to be written
+ */
+#define MW_ALOG_DEFAULT_FLUSH_MS 500
+
+/**
+ * @brief Room for one text log line, as mw_alog_format_line writes it
+ */
+#define MW_ALOG_LINE_MAX (MW_ALOG_RL_MAX + 128)
+
+/**
+ * @brief A log file whose name ends in this gets the binary format
+ */
+#define MW_ALOG_BIN_SUFFIX ".mwlog"
+
+/**
+ * @brief The magic number starting each binary batch, "MWL1" on disk
+ *
+ * Binary logs are in the writing host's byte order, so a reader on a host of
+ * the other order sees this swapped.
+ */
+#define MW_ALOG_BIN_MAGIC 0x314c574d
+
+typedef enum {
+    MW_ALOG_TEXT,   ///< one formatted line per request
+    MW_ALOG_BINARY, ///< batches of fixed size records, see mw_alog_bin_batch
+} mw_alog_format;
+
+/**
+ * @brief One access log entry, as it sits in a ring
+ */
+typedef struct _mw_alog_rec {
+    time_t when;             ///< when the response was finished
+    struct in_addr addr;     ///< the client
+    short status;            ///< the response status code
+    ssize_t total_written;   ///< body bytes sent
+    uint32_t latency_us;     ///< from the request being parsed to the end
+    unsigned short rl_len;   ///< length of rl
+    char rl[MW_ALOG_RL_MAX]; ///< the request line
+} mw_alog_rec;
+
+/**
+ * @brief The header of one batch of a binary log
+ *
+ * Each batch is written with a single write: this header, n_recs
+ * mw_alog_bin_rec, then str_len bytes of request lines the records point
+ * into.  A request line repeated within a batch is only stored once.
+ */
+typedef struct _mw_alog_bin_batch {
+    uint32_t magic;   ///< MW_ALOG_BIN_MAGIC
+    uint32_t n_recs;  ///< records in the batch
+    uint32_t str_len; ///< bytes of request lines after the records
+    uint32_t drops;   ///< records dropped since the last batch
+} mw_alog_bin_batch;
+
+/**
+ * @brief One record of a binary log
+ */
+typedef struct _mw_alog_bin_rec {
+    int64_t when;          ///< when the response was finished, Unix time
+    int64_t total_written; ///< body bytes sent
+    uint32_t latency_us;   ///< from the request being parsed to the end
+    uint32_t rl_off;       ///< where the request line starts in the strings
+    uint16_t rl_len;       ///< length of the request line
+    int16_t status;        ///< the response status code
+    uint8_t addr[4];       ///< the client, in network order
+} mw_alog_bin_rec;
+
+/**
+ * @brief Which format a log file of this name is written in
+ *
+ * @param name The log file's name, or NULL for stdout
+ *
+ * @return MW_ALOG_BINARY if name ends in MW_ALOG_BIN_SUFFIX, else MW_ALOG_TEXT
+ */
+mw_alog_format mw_alog_format_for(const char *name);
+
+/**
+ * @brief Start the log writer thread
+ *
+ * Until this is called log records are dropped.
+ *
+ * @param f The log file; from now on only the writer thread uses it
+ * @param flush_ms How long a formatted line may wait to be written
+ * @param fmt How to write the records
+ */
+void mw_alog_init(FILE *f, int flush_ms, mw_alog_format fmt);
+
+/**
+ * @brief Write a record as a text log line
+ *
+ * @param rec The record
+ * @param out Room for MW_ALOG_LINE_MAX bytes, not NUL terminated
+ *
+ * @return The length of the line, including its newline
+ */
+size_t mw_alog_format_line(const mw_alog_rec *rec, char *out);
+
+/**
+ * @brief Get a record to fill in
+ *
+ * Each thread has its own ring, so this takes no locks.  If the ring is full
+ * the record will be dropped, and counted.  Every call must be followed by
+ * mw_alog_commit on the same thread.
+ *
+ * @return The record to fill in, or NULL if it will be dropped
+ */
+mw_alog_rec *mw_alog_begin(void);
+
+/**
+ * @brief Hand a record filled in after mw_alog_begin to the writer
+ *
+ * @param rec The record
+ */
+void mw_alog_commit(mw_alog_rec *rec);
+
+/**
+ * @brief Write out what is buffered, mark the file and reopen it by name
+ *
+ * For log rotation: returns once the writer is using the new file.
+ *
+ * @param name The log file's name
+ */
+void mw_alog_reopen(const char *name);
+
+___END_DECLS
+#endif /* ifndef MW_ALOG_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -1,12 +1,54 @@
 #include "mw_buffer.h"
+#include "mw_stats.h"
 #include <assert.h>
 #include <malloc/malloc.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* Move the contents of a circular buffer into a new allocation of sz bytes,
+ * unwrapping them so the data OUT OF starts at buf and the space IN TO is one
+ * contiguous region.
+ */
+static void buf_ring_resize(mw_buffer *b, size_t sz)
+{
+    assert(sz >= b->used);
+    unsigned char *nbuf = malloc(sz);
+    assert(nbuf);
+    mw_stats_count(MW_STAT_BUF_GROWTHS, 1);
+
+    struct iovec iov[2];
+    int n = buf_outof_iov(b, iov);
+    size_t off = 0;
+    for (int i = 0; i < n; i++) {
+        memcpy(nbuf + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    assert(off == b->used);
+
+    free(b->buf);
+    b->buf = nbuf;
+    b->sz = sz;
+    b->outof = b->buf;
+    b->into = b->buf + b->used;
+    if (b->into == b->buf + b->sz) b->into = b->buf;
+}
+
+void buf_init_ring(mw_buffer *b, size_t sz)
+{
+    assert(b->buf == NULL);
+    b->ring = true;
+    b->used = 0;
+    b->buf = malloc(sz);
+    assert(b->buf);
+    b->sz = sz;
+    b->into = b->outof = b->buf;
+}
 
 size_t buf_into_sz(mw_buffer *b)
 {
+    if (b->ring) return b->sz - b->used;
     return (b->buf + b->sz) - b->into;
 }
 
@@ -15,7 +57,22 @@ void buf_need_into(mw_buffer *b, size_t count)
     // resize the buf so it has at least count bytes ready to use
     size_t sz = buf_into_sz(b);
     if (count <= sz) return;
-    malloc_good_size(count - sz + b->sz);
+    if (b->ring) {
+        size_t nsz = b->sz * 2;
+        if (nsz < b->used + count) nsz = b->used + count;
+        buf_ring_resize(b, malloc_good_size(nsz));
+        return;
+    }
+    // reclaim the wasted space in front of outof before growing
+    size_t wasted = b->outof - b->buf;
+    if (wasted && count <= sz + wasted) {
+        size_t o_sz = buf_outof_sz(b);
+        memmove(b->buf, b->outof, o_sz);
+        b->outof = b->buf;
+        b->into = b->buf + o_sz;
+        return;
+    }
+    sz = malloc_good_size(count - sz + b->sz);
     unsigned char *old = b->buf;
     /* We _could_ account for a special case where:
      *      b->buf == b->into && b->into == b->outof
@@ -25,6 +82,7 @@ void buf_need_into(mw_buffer *b, size_t count)
      */
     b->buf = reallocf(b->buf, sz);
     assert(b->buf);
+    mw_stats_count(MW_STAT_BUF_GROWTHS, 1);
     b->sz = sz;
     b->into = b->buf + (b->into - old);
     b->outof = b->buf + (b->outof - old);
@@ -32,21 +90,62 @@ void buf_need_into(mw_buffer *b, size_t count)
 
 void buf_used_into(mw_buffer *b, size_t used)
 {
+    if (b->ring) {
+        assert(b->used + used <= b->sz);
+        b->used += used;
+        b->into += used;
+        if (b->into >= b->buf + b->sz) b->into -= b->sz;
+        return;
+    }
     b->into += used;
     assert(b->into <= b->buf + b->sz);
 }
 
 size_t buf_outof_sz(mw_buffer *b)
 {
+    if (b->ring) return b->used;
     return b->into - b->outof;
 }
 
+int buf_into_iov(mw_buffer *b, struct iovec iov[2])
+{
+    size_t avail = buf_into_sz(b);
+    if (avail == 0) return 0;
+
+    size_t first = (b->buf + b->sz) - b->into;
+    if (first > avail) first = avail;
+    iov[0].iov_base = b->into;
+    iov[0].iov_len = first;
+    if (first == avail) return 1;
+
+    iov[1].iov_base = b->buf;
+    iov[1].iov_len = avail - first;
+    return 2;
+}
+
+int buf_outof_iov(mw_buffer *b, struct iovec iov[2])
+{
+    size_t avail = buf_outof_sz(b);
+    if (avail == 0) return 0;
+
+    size_t first = (b->buf + b->sz) - b->outof;
+    if (first > avail) first = avail;
+    iov[0].iov_base = b->outof;
+    iov[0].iov_len = first;
+    if (first == avail) return 1;
+
+    iov[1].iov_base = b->buf;
+    iov[1].iov_len = avail - first;
+    return 2;
+}
+
 int buf_sprintf(mw_buffer *b, char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
-    size_t s = buf_into_sz(b);
-    int l = vsnprintf((char *)(b->into), s, fmt, ap);
+    struct iovec iov[2];
+    size_t s = buf_into_iov(b, iov) ? iov[0].iov_len : 0;
+    int l = vsnprintf(s ? iov[0].iov_base : NULL, s, fmt, ap);
     if ((size_t)l < s) {
         buf_used_into(b, l);
     }
@@ -54,10 +153,18 @@ int buf_sprintf(mw_buffer *b, char *fmt, ...)
         // reset ap -- vsnprintf has already used it
         va_end(ap);
         va_start(ap, fmt);
-        buf_need_into(b, l);
-        s = buf_into_sz(b);
+        if (b->ring) {
+            // unwrap so the formatted string (and its NUL) is contiguous
+            buf_ring_resize(b, b->used + l + 1 > b->sz ? b->used + l + 1
+                                                       : b->sz);
+        }
+        else {
+            buf_need_into(b, l + 1);
+        }
+        buf_into_iov(b, iov);
+        s = iov[0].iov_len;
         l = vsnprintf((char *)(b->into), s, fmt, ap);
-        assert((size_t)l <= s);
+        assert((size_t)l < s);
         buf_used_into(b, l);
     }
     va_end(ap);
@@ -67,14 +174,26 @@ int buf_sprintf(mw_buffer *b, char *fmt, ...)
 
 void buf_used_outof(mw_buffer *b, size_t used)
 {
+    if (b->ring) {
+        assert(used <= b->used);
+        b->used -= used;
+        b->outof += used;
+        if (b->outof >= b->buf + b->sz) b->outof -= b->sz;
+        // keep the free space contiguous when we can
+        if (b->used == 0) b->into = b->outof = b->buf;
+        return;
+    }
     b->outof += used;
     assert(b->outof <= b->into);
     if (b->into == b->outof) b->into = b->outof = b->buf;
 }
 
-char *buf_debug_str(mw_buffer *b)
+char *buf_debug_str(mw_buffer *b, mw_mempool *pool)
 {
-    char *ret = NULL;
-    asprintf(&ret, "S%zu i#%zu o#%zu", b->sz, buf_into_sz(b), buf_outof_sz(b));
-    return ret;
+    return mw_mpool_asprintf(pool,
+                             "%sS%zu i#%zu o#%zu",
+                             b->ring ? "R" : "",
+                             b->sz,
+                             buf_into_sz(b),
+                             buf_outof_sz(b));
 }
@@ -2,8 +2,11 @@
 #define MW_BUFFER_H
 
 #include "config.h"
+#include "mw_mempool.h"
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 /**
  * \brief Manage a buffer, currently at sz bytes, but realloc if needed.
@@ -11,21 +14,38 @@
  * The buffer has a part that we read data INTO, and a part that we read data
  * OUTOF.
  *
- * Best use of space would be a circular buffer (and we would use readv/writev
- * and pass around iovec structs), but for now, we use a simpler layout:
+ * A buffer starts out in the simple linear layout:
  *     buf    ---> outof    - wasted
  *     outof  ---> into     - "ready to write data OUT OF"
  *     into   ---> buf+sz   - "ready to write data IN TO"
+ *
+ * A buffer set up with buf_init_ring is circular instead.  Data is written at
+ * into and read at outof, both wrapping at buf+sz, and used tells the "empty"
+ * and "full" cases apart when into == outof.  Either region may wrap, so use
+ * buf_into_iov/buf_outof_iov and readv/writev rather than the raw pointers.
  */
 typedef struct _mw_buffer {
-    /* TODO: Use a Circular Buffer */
     size_t sz; ///< The current size of the buffer, realloc if needed.
 
     unsigned char *buf;
     unsigned char *into;
     unsigned char *outof;
+
+    bool ring;   ///< Is this a circular buffer?
+    size_t used; ///< Bytes ready to read OUT OF (circular buffers only)
 } mw_buffer;
 
+/**
+ * @brief Turn an empty buffer into a circular buffer of sz bytes
+ *
+ * A circular buffer never moves its data to make room, and only grows if
+ * buf_need_into is asked for more than its free space.
+ *
+ * @param b The buffer
+ * @param sz The capacity of the buffer
+ */
+void buf_init_ring(mw_buffer *b, size_t sz);
+
 size_t buf_into_sz(mw_buffer *b);
 
 void buf_need_into(mw_buffer *b, size_t count);
@@ -34,10 +54,38 @@ void buf_used_into(mw_buffer *b, size_t used);
 
 size_t buf_outof_sz(mw_buffer *b);
 
+/**
+ * @brief Describe the region we can read data INTO
+ *
+ * @param b The buffer
+ * @param iov Filled in with up to two regions, suitable for readv
+ *
+ * @return The number of iovecs used, 0 if the buffer is full
+ */
+int buf_into_iov(mw_buffer *b, struct iovec iov[2]);
+
+/**
+ * @brief Describe the region we can write data OUT OF
+ *
+ * @param b The buffer
+ * @param iov Filled in with up to two regions, suitable for writev
+ *
+ * @return The number of iovecs used, 0 if the buffer is empty
+ */
+int buf_outof_iov(mw_buffer *b, struct iovec iov[2]);
+
 int buf_sprintf(mw_buffer *b, char *fmt, ...) PRINTF_STYLE(2, 3);
 
 void buf_used_outof(mw_buffer *b, size_t used);
 
-char *buf_debug_str(mw_buffer *b);
+/**
+ * @brief Describe a buffer's state, for debugging
+ *
+ * @param b The buffer
+ * @param pool Where to allocate the description
+ *
+ * @return The description
+ */
+char *buf_debug_str(mw_buffer *b, mw_mempool *pool);
 
 #endif /* ifndef MW_BUFFER_H */
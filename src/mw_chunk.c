@@ -0,0 +1,132 @@
+#include "mw_chunk.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+void mw_chunk_init(mw_chunker *c, size_t raw, size_t target, uint64_t wait_ns)
+{
+    memset(c, 0, sizeof(*c));
+    c->raw = raw;
+    c->target = target;
+    c->wait_ns = wait_ns;
+}
+
+void mw_chunk_trailers(mw_chunker *c, const char *fields, size_t len)
+{
+    c->trailers = fields;
+    c->trailers_len = len;
+}
+
+mw_chunk_state mw_chunk_begin(mw_chunker *c,
+                              size_t avail,
+                              bool more,
+                              uint64_t now)
+{
+    if (c->done) return MW_CHUNK_DONE;
+    if (c->busy) return MW_CHUNK_SEND;
+    assert(avail >= c->raw);
+    size_t body = avail - c->raw;
+    if (more && body < c->target && !c->due) {
+        if (!avail) return MW_CHUNK_EMPTY;
+        if (!c->held) c->held = now;
+        if (now - c->held < c->wait_ns) return MW_CHUNK_HOLD;
+    }
+    c->held = 0;
+    c->due = false;
+    c->busy = true;
+    c->f_raw = c->raw;
+    c->raw = 0;
+    c->len = body;
+    c->last = !more;
+    c->off = 0;
+    c->line_len = 0;
+    if (body) {
+        int n = snprintf(c->line, sizeof(c->line), "%zx\r\n", body);
+        assert(n > 0 && (size_t)n < sizeof(c->line));
+        c->line_len = n;
+    }
+    return MW_CHUNK_SEND;
+}
+
+/* The frame's pieces, in order: data pieces come from the caller's data */
+typedef struct {
+    const char *p; ///< the bytes, NULL for data
+    size_t len;    ///< the bytes in the piece
+} piece;
+
+static int frame_pieces(const mw_chunker *c, piece f[7])
+{
+    int n = 0;
+    f[n++] = (piece){NULL, c->f_raw};
+    f[n++] = (piece){c->line, c->line_len};
+    f[n++] = (piece){NULL, c->len};
+    f[n++] = (piece){"\r\n", c->len ? 2 : 0};
+    if (c->last) {
+        f[n++] = (piece){"0\r\n", 3};
+        f[n++] = (piece){c->trailers ? c->trailers : "", c->trailers_len};
+        f[n++] = (piece){"\r\n", 2};
+    }
+    return n;
+}
+
+int mw_chunk_iov(const mw_chunker *c,
+                 const struct iovec *data,
+                 int n_data,
+                 struct iovec *iov)
+{
+    piece f[7];
+    int n_f = frame_pieces(c, f);
+    size_t skip = c->off;
+    int n = 0, d = 0;
+    size_t d_off = 0;
+    for (int i = 0; i < n_f; i++) {
+        size_t w = skip < f[i].len ? skip : f[i].len;
+        size_t len = f[i].len - w;
+        skip -= w;
+        if (!len) continue;
+        if (f[i].p) {
+            iov[n].iov_base = (char *)f[i].p + w;
+            iov[n++].iov_len = len;
+            continue;
+        }
+        // the data written already is gone from data
+        while (len && d < n_data) {
+            size_t l = data[d].iov_len - d_off;
+            if (l > len) l = len;
+            iov[n].iov_base = (char *)data[d].iov_base + d_off;
+            iov[n++].iov_len = l;
+            len -= l;
+            d_off += l;
+            if (d_off == data[d].iov_len) {
+                d++;
+                d_off = 0;
+            }
+        }
+        // not all of it described: the rest of the frame waits for next time
+        if (len) break;
+    }
+    return n;
+}
+
+size_t mw_chunk_sent(mw_chunker *c, size_t n)
+{
+    piece f[7];
+    int n_f = frame_pieces(c, f);
+    size_t start = 0, end = c->off + n, data = 0;
+    for (int i = 0; i < n_f; i++) {
+        // the part of the piece in [off, end)
+        size_t a = start > c->off ? start : c->off;
+        size_t b = start + f[i].len < end ? start + f[i].len : end;
+        if (!f[i].p && b > a) data += b - a;
+        start += f[i].len;
+    }
+    assert(end <= start);
+    c->off = end;
+    if (c->off == start) {
+        c->busy = false;
+        c->done = c->last;
+    }
+    return data;
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,136 @@
+#ifndef MW_CHUNK_H
+#define MW_CHUNK_H
+
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief The default size of chunk worth holding data back for
+ */
+#define MW_CHUNK_DEFAULT_TARGET (16 * 1024)
+
+/**
+ * @brief The default longest data is held back, in milliseconds
+ *
+ * The server's timer sends what is held back, so it holds data for at least
+ * a tick of the timer, server.timer_tick_ms.
+ */
+#define MW_CHUNK_DEFAULT_WAIT_MS 20
+
+/**
+ * @brief The most iovecs mw_chunk_iov gives, besides the data's own
+ */
+#define MW_CHUNK_IOV 6
+
+/**
+ * @brief What the writer should do next
+ */
+typedef enum {
+    MW_CHUNK_SEND,  ///< a frame is under way, write it
+    MW_CHUNK_HOLD,  ///< data is held back for more to join it, wait
+    MW_CHUNK_EMPTY, ///< nothing to send until more data comes
+    MW_CHUNK_DONE,  ///< the last chunk and the trailers have gone
+} mw_chunk_state;
+
+/**
+ * @brief Frames a body in chunked transfer coding, as large chunks
+ *
+ * The data is written elsewhere, in order (a mw_slabq, say); the framer
+ * decides how much of it makes the next chunk, and describes the chunk-size
+ * line, the data and the CRLF after it as one list of iovecs for writev.
+ * Small pieces of data are held back until there are target bytes of them,
+ * the body ends, or the first of them has waited wait_ns.  The frame with the
+ * last data also carries the last-chunk and the trailer section.
+ *
+ * The first raw bytes of the data go out unframed before the first chunk, so
+ * the response header can share its writev.
+ */
+typedef struct _mw_chunker {
+    size_t target;    ///< chunk size worth holding data back for
+    uint64_t wait_ns; ///< longest data is held back
+    uint64_t held;    ///< when the data held back was first held, or 0
+    bool due;         ///< send what there is without holding it back
+    size_t raw;       ///< unframed bytes before the first chunk
+
+    const char *trailers; ///< trailer fields, each ending in CRLF, or NULL
+    size_t trailers_len;  ///< bytes in trailers
+
+    bool busy;          ///< is a frame under way?
+    size_t f_raw;       ///< raw bytes in the frame
+    char line[20];      ///< the frame's chunk-size line
+    unsigned line_len;  ///< bytes in line, 0 if the frame has no data
+    size_t len;         ///< data bytes in the frame's chunk
+    bool last;          ///< does the frame end the body?
+    size_t off;         ///< bytes of the frame written
+    bool done;          ///< has the last frame been written?
+} mw_chunker;
+
+/**
+ * @brief Start framing a body
+ *
+ * @param c The framer
+ * @param raw Bytes at the front of the data to send unframed
+ * @param target The chunk size worth holding data back for
+ * @param wait_ns The longest data is held back
+ */
+void mw_chunk_init(mw_chunker *c, size_t raw, size_t target, uint64_t wait_ns);
+
+/**
+ * @brief Set the trailer fields to send after the last chunk
+ *
+ * @param c The framer
+ * @param fields Each field ending in CRLF; they must stay put until done
+ * @param len The bytes in fields
+ */
+void mw_chunk_trailers(mw_chunker *c, const char *fields, size_t len);
+
+/**
+ * @brief Decide what to write next
+ *
+ * If no frame is under way, start one with all the data there is, unless it
+ * is worth holding back.
+ *
+ * @param c The framer
+ * @param avail The bytes of data ready, not yet written
+ * @param more Will more data follow?
+ * @param now The time, in nanoseconds
+ *
+ * @return What to do; after MW_CHUNK_HOLD call again within wait_ns, or once
+ *         more data comes
+ */
+mw_chunk_state mw_chunk_begin(mw_chunker *c,
+                              size_t avail,
+                              bool more,
+                              uint64_t now);
+
+/**
+ * @brief Describe what is left of the frame under way
+ *
+ * @param c The framer
+ * @param data The data not yet written, in order
+ * @param n_data The iovecs in data
+ * @param iov Filled in, with room for n_data + MW_CHUNK_IOV
+ *
+ * @return The iovecs used
+ */
+int mw_chunk_iov(const mw_chunker *c,
+                 const struct iovec *data,
+                 int n_data,
+                 struct iovec *iov);
+
+/**
+ * @brief Account for bytes of the frame written
+ *
+ * @return The bytes of data among them, to take out of where the data is
+ */
+size_t mw_chunk_sent(mw_chunker *c, size_t n);
+
+___END_DECLS
+#endif /* ifndef MW_CHUNK_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
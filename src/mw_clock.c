@@ -0,0 +1,99 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for CLOCK_MONOTONIC_COARSE
+#endif
+#include "mw_clock.h"
+#include <time.h>
+#if HAVE_RDTSC
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+__extension__ typedef unsigned __int128 u128;
+
+/* Converting TSC readings: ns = base_ns + (tsc - base_tsc) * mult >> 32.  Set
+ * once by mw_clock_init, before any other thread reads the clock.
+ */
+static struct {
+    bool tsc;          ///< are we reading the TSC?
+    uint64_t base_tsc; ///< a TSC reading
+    uint64_t base_ns;  ///< CLOCK_MONOTONIC at base_tsc
+    uint64_t mult;     ///< nanoseconds per tick, times 2^32
+} clk;
+
+static _Thread_local uint64_t cached_now;
+
+static uint64_t ts_ns(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#if HAVE_RDTSC
+static bool tsc_invariant(void)
+{
+    unsigned a, b, c, d;
+    if (!__get_cpuid(0x80000007, &a, &b, &c, &d)) return false;
+    return d & (1u << 8);
+}
+
+static bool tsc_calibrate(void)
+{
+    uint64_t t0 = ts_ns(CLOCK_MONOTONIC), c0 = __rdtsc();
+    struct timespec nap = {0, MW_CLOCK_CALIBRATE_MS * 1000000L};
+    while (nanosleep(&nap, &nap)) continue;
+    uint64_t t1 = ts_ns(CLOCK_MONOTONIC), c1 = __rdtsc();
+    if (c1 <= c0 || t1 <= t0) return false;
+
+    clk.mult = (uint64_t)(((u128)(t1 - t0) << 32) / (c1 - c0));
+    clk.base_tsc = c1;
+    clk.base_ns = t1;
+    return clk.mult != 0;
+}
+#endif
+
+bool mw_clock_init(bool use_tsc)
+{
+    clk.tsc = false;
+#if HAVE_RDTSC
+    if (use_tsc && tsc_invariant()) clk.tsc = tsc_calibrate();
+#else
+    (void)use_tsc;
+#endif
+    mw_clock_update();
+    return clk.tsc;
+}
+
+uint64_t mw_clock_ns(void)
+{
+#if HAVE_RDTSC
+    if (clk.tsc) {
+        // another core's counter may be a little behind the one we read
+        uint64_t c = __rdtsc();
+        uint64_t d = c > clk.base_tsc ? c - clk.base_tsc : 0;
+        return clk.base_ns + (uint64_t)(((u128)d * clk.mult) >> 32);
+    }
+#endif
+    return ts_ns(CLOCK_MONOTONIC);
+}
+
+uint64_t mw_clock_coarse_ns(void)
+{
+#if HAVE_CLOCK_MONOTONIC_COARSE
+    return ts_ns(CLOCK_MONOTONIC_COARSE);
+#else
+    return ts_ns(CLOCK_MONOTONIC);
+#endif
+}
+
+uint64_t mw_clock_update(void)
+{
+    return cached_now = mw_clock_ns();
+}
+
+uint64_t mw_clock_now(void)
+{
+    return cached_now ? cached_now : mw_clock_update();
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
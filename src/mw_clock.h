@@ -0,0 +1,63 @@
+#ifndef MW_CLOCK_H
+#define MW_CLOCK_H
+
+#include "config.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief How long mw_clock_init watches the TSC to find its rate
+ */
+#define MW_CLOCK_CALIBRATE_MS 20
+
+/**
+ * @brief Pick and calibrate the clock source
+ *
+ * Until this is called, and if use_tsc is false or the CPU has no invariant
+ * TSC, mw_clock_ns reads CLOCK_MONOTONIC.
+ *
+ * @param use_tsc Read the CPU's time stamp counter instead, if it is
+ *        invariant (it ticks at a constant rate, in sync on every core)
+ *
+ * @return Whether the TSC is in use
+ */
+bool mw_clock_init(bool use_tsc);
+
+/**
+ * @brief Nanoseconds on a monotonic clock, as precisely as we can
+ *
+ * The clock does not jump when the wall clock is set.  Its zero is
+ * arbitrary, so only differences mean anything.
+ */
+uint64_t mw_clock_ns(void);
+
+/**
+ * @brief Nanoseconds on CLOCK_MONOTONIC, to within a few milliseconds
+ *
+ * CLOCK_MONOTONIC_COARSE where there is one, which is cheaper than a precise
+ * reading.  The TSC drifts from this a little, so don't subtract readings of
+ * one clock from the other.
+ */
+uint64_t mw_clock_coarse_ns(void);
+
+/**
+ * @brief Read the clock into the calling thread's cached now
+ *
+ * Each event handler calls this once on entry, and everything it does then
+ * shares the one reading.
+ *
+ * @return The new now
+ */
+uint64_t mw_clock_update(void);
+
+/**
+ * @brief The calling thread's cached now, from its last mw_clock_update
+ */
+uint64_t mw_clock_now(void);
+
+___END_DECLS
+#endif /* ifndef MW_CLOCK_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,607 @@
+#include "mw_codec.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#if HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#if HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+static const char *mw_coding_names[MW_CODINGS] = {
+    [MW_CODING_DEFLATE] = "deflate",
+    [MW_CODING_GZIP] = "gzip",
+    [MW_CODING_BR] = "br",
+    [MW_CODING_ZSTD] = "zstd",
+};
+
+// zlib, always there
+
+static void *zlib_open(mw_coding coding, int level)
+{
+    z_stream *zs = calloc(1, sizeof(*zs));
+    if (!zs) return NULL;
+    // 15 bits of window, plus 16 for the gzip wrapper
+    int bits = coding == MW_CODING_GZIP ? 15 + 16 : 15;
+    if (deflateInit2(zs, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) !=
+        Z_OK) {
+        free(zs);
+        return NULL;
+    }
+    return zs;
+}
+
+static bool zlib_reset(void *st, int level)
+{
+    // with no input yet the new level takes effect without a flush
+    return deflateReset(st) == Z_OK &&
+           deflateParams(st, level, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+static mw_codec_status zlib_run(void *st,
+                                const void *in,
+                                size_t *in_len,
+                                void *out,
+                                size_t *out_len,
+                                bool finish)
+{
+    z_stream *zs = st;
+    uInt in_sz = *in_len > UINT_MAX ? UINT_MAX : *in_len;
+    uInt out_sz = *out_len > UINT_MAX ? UINT_MAX : *out_len;
+    // a clamped input isn't the end of it
+    finish = finish && in_sz == *in_len;
+    zs->next_in = (Bytef *)in;
+    zs->avail_in = in_sz;
+    zs->next_out = out;
+    zs->avail_out = out_sz;
+    int rc = deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH);
+    *in_len = in_sz - zs->avail_in;
+    *out_len = out_sz - zs->avail_out;
+    if (rc == Z_STREAM_END) return MW_CODEC_END;
+    // Z_BUF_ERROR only means there was no room to make progress in
+    return rc == Z_OK || rc == Z_BUF_ERROR ? MW_CODEC_OK : MW_CODEC_ERROR;
+}
+
+static size_t zlib_bound(void *st, size_t len)
+{
+    // and the flush of what an earlier call left pending
+    return deflateBound(st, len) + 64;
+}
+
+static void zlib_close(void *st)
+{
+    deflateEnd(st);
+    free(st);
+}
+
+static size_t zlib_compress(mw_coding coding,
+                            int level,
+                            const void *in,
+                            size_t len,
+                            void *out,
+                            size_t cap)
+{
+    void *zs = zlib_open(coding, level);
+    if (!zs) return 0;
+    size_t in_len = len, out_len = cap;
+    mw_codec_status rc = zlib_run(zs, in, &in_len, out, &out_len, true);
+    zlib_close(zs);
+    return rc == MW_CODEC_END ? out_len : 0;
+}
+
+static mw_codec mw_codec_zlib = {
+    .name = "zlib",
+    .codings = MW_ENC_DEFLATE | MW_ENC_GZIP,
+    // level 0 only stores
+    .min_level = 1,
+    .max_level = 9,
+    .level = 6,
+    .open = zlib_open,
+    .reset = zlib_reset,
+    .run = zlib_run,
+    .bound = zlib_bound,
+    .close = zlib_close,
+    .compress = zlib_compress,
+};
+
+#if HAVE_LIBDEFLATE
+// libdeflate has no streams, but compresses a whole buffer much faster
+
+static size_t libdeflate_compress(mw_coding coding,
+                                  int level,
+                                  const void *in,
+                                  size_t len,
+                                  void *out,
+                                  size_t cap)
+{
+    struct libdeflate_compressor *c = libdeflate_alloc_compressor(level);
+    if (!c) return 0;
+    size_t n = coding == MW_CODING_GZIP
+                   ? libdeflate_gzip_compress(c, in, len, out, cap)
+                   : libdeflate_zlib_compress(c, in, len, out, cap);
+    libdeflate_free_compressor(c);
+    return n;
+}
+
+static mw_codec mw_codec_libdeflate = {
+    .name = "libdeflate",
+    .codings = MW_ENC_DEFLATE | MW_ENC_GZIP,
+    .min_level = 1,
+    .max_level = 12,
+    .level = 6,
+    .compress = libdeflate_compress,
+};
+#endif /* HAVE_LIBDEFLATE */
+
+#if HAVE_BROTLI
+static void *brotli_open(mw_coding coding, int level)
+{
+    (void)coding;
+    BrotliEncoderState *s = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (s) BrotliEncoderSetParameter(s, BROTLI_PARAM_QUALITY, level);
+    return s;
+}
+
+static mw_codec_status brotli_run(void *st,
+                                  const void *in,
+                                  size_t *in_len,
+                                  void *out,
+                                  size_t *out_len,
+                                  bool finish)
+{
+    size_t avail_in = *in_len, avail_out = *out_len;
+    const uint8_t *next_in = in;
+    uint8_t *next_out = out;
+    if (!BrotliEncoderCompressStream(st,
+                                     finish ? BROTLI_OPERATION_FINISH
+                                            : BROTLI_OPERATION_PROCESS,
+                                     &avail_in,
+                                     &next_in,
+                                     &avail_out,
+                                     &next_out,
+                                     NULL)) {
+        return MW_CODEC_ERROR;
+    }
+    *in_len -= avail_in;
+    *out_len -= avail_out;
+    return finish && BrotliEncoderIsFinished(st) ? MW_CODEC_END : MW_CODEC_OK;
+}
+
+static size_t brotli_bound(void *st, size_t len)
+{
+    (void)st;
+    // and some of what the encoder held back from earlier input
+    return BrotliEncoderMaxCompressedSize(len) + 1024;
+}
+
+static void brotli_close(void *st)
+{
+    BrotliEncoderDestroyInstance(st);
+}
+
+static size_t brotli_compress(mw_coding coding,
+                              int level,
+                              const void *in,
+                              size_t len,
+                              void *out,
+                              size_t cap)
+{
+    (void)coding;
+    size_t n = cap;
+    if (!BrotliEncoderCompress(level,
+                               BROTLI_DEFAULT_WINDOW,
+                               BROTLI_MODE_GENERIC,
+                               len,
+                               in,
+                               &n,
+                               out)) {
+        return 0;
+    }
+    return n;
+}
+
+static mw_codec mw_codec_brotli = {
+    .name = "brotli",
+    .codings = MW_ENC_BR,
+    .min_level = BROTLI_MIN_QUALITY,
+    .max_level = BROTLI_MAX_QUALITY,
+    .level = 5,
+    .open = brotli_open,
+    // a stream is a new instance, brotli can't be reset
+    .run = brotli_run,
+    .bound = brotli_bound,
+    .close = brotli_close,
+    .compress = brotli_compress,
+};
+#endif /* HAVE_BROTLI */
+
+#if HAVE_ZSTD
+static void *zstd_open(mw_coding coding, int level)
+{
+    (void)coding;
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (cctx) ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    return cctx;
+}
+
+static bool zstd_reset(void *st, int level)
+{
+    // the parameters can change between sessions
+    return !ZSTD_isError(ZSTD_CCtx_reset(st, ZSTD_reset_session_only)) &&
+           !ZSTD_isError(
+               ZSTD_CCtx_setParameter(st, ZSTD_c_compressionLevel, level));
+}
+
+static mw_codec_status zstd_run(void *st,
+                                const void *in,
+                                size_t *in_len,
+                                void *out,
+                                size_t *out_len,
+                                bool finish)
+{
+    ZSTD_inBuffer ib = {in, *in_len, 0};
+    ZSTD_outBuffer ob = {out, *out_len, 0};
+    size_t left = ZSTD_compressStream2(st,
+                                       &ob,
+                                       &ib,
+                                       finish ? ZSTD_e_end : ZSTD_e_continue);
+    if (ZSTD_isError(left)) return MW_CODEC_ERROR;
+    *in_len = ib.pos;
+    *out_len = ob.pos;
+    return finish && left == 0 ? MW_CODEC_END : MW_CODEC_OK;
+}
+
+static size_t zstd_bound(void *st, size_t len)
+{
+    (void)st;
+    // and the block the context may be holding
+    return ZSTD_compressBound(len) + ZSTD_CStreamOutSize();
+}
+
+static void zstd_close(void *st)
+{
+    ZSTD_freeCCtx(st);
+}
+
+static size_t zstd_compress(mw_coding coding,
+                            int level,
+                            const void *in,
+                            size_t len,
+                            void *out,
+                            size_t cap)
+{
+    (void)coding;
+    size_t n = ZSTD_compress(out, cap, in, len, level);
+    return ZSTD_isError(n) ? 0 : n;
+}
+
+static mw_codec mw_codec_zstd = {
+    .name = "zstd",
+    .codings = MW_ENC_ZSTD,
+    .min_level = 1,
+    // the levels above need far more memory to decode
+    .max_level = 19,
+    .level = 3,
+    .open = zstd_open,
+    .reset = zstd_reset,
+    .run = zstd_run,
+    .bound = zstd_bound,
+    .close = zstd_close,
+    .compress = zstd_compress,
+};
+#endif /* HAVE_ZSTD */
+
+/* In order of preference, for each coding: one-shot engines come first */
+static mw_codec *mw_codecs[] = {
+#if HAVE_LIBDEFLATE
+    &mw_codec_libdeflate,
+#endif
+    &mw_codec_zlib,
+#if HAVE_BROTLI
+    &mw_codec_brotli,
+#endif
+#if HAVE_ZSTD
+    &mw_codec_zstd,
+#endif
+};
+
+#define N_CODECS (sizeof(mw_codecs) / sizeof(mw_codecs[0]))
+
+/* The order mw_codec_pick prefers codings in */
+static const mw_coding mw_coding_pref[MW_CODINGS] = {
+    MW_CODING_ZSTD,
+    MW_CODING_BR,
+    MW_CODING_GZIP,
+    MW_CODING_DEFLATE,
+};
+
+static int clamp_level(const mw_codec *c, int level)
+{
+    if (level < c->min_level) return c->min_level;
+    if (level > c->max_level) return c->max_level;
+    return level;
+}
+
+static void set_level(mw_codec *c, int level)
+{
+    c->level = clamp_level(c, level);
+}
+
+void mw_codec_init(const mw_codec_levels *levels)
+{
+    set_level(&mw_codec_zlib, levels->zlib);
+#if HAVE_LIBDEFLATE
+    set_level(&mw_codec_libdeflate, levels->libdeflate);
+#endif
+#if HAVE_BROTLI
+    set_level(&mw_codec_brotli, levels->brotli);
+#endif
+#if HAVE_ZSTD
+    set_level(&mw_codec_zstd, levels->zstd);
+#endif
+}
+
+unsigned mw_codec_available(void)
+{
+    unsigned codings = 0;
+    for (size_t i = 0; i < N_CODECS; i++) {
+        if (mw_codecs[i]->open) codings |= mw_codecs[i]->codings;
+    }
+    return codings;
+}
+
+const mw_codec *mw_codec_streamer(mw_coding coding)
+{
+    for (size_t i = 0; i < N_CODECS; i++) {
+        if (mw_codecs[i]->open && (mw_codecs[i]->codings & (1u << coding))) {
+            return mw_codecs[i];
+        }
+    }
+    return NULL;
+}
+
+const mw_codec *mw_codec_oneshot(mw_coding coding)
+{
+    for (size_t i = 0; i < N_CODECS; i++) {
+        if (mw_codecs[i]->codings & (1u << coding)) return mw_codecs[i];
+    }
+    return NULL;
+}
+
+const char *mw_coding_name(mw_coding coding)
+{
+    return mw_coding_names[coding];
+}
+
+unsigned mw_codec_negotiate(const int q[MW_CODINGS], unsigned allowed)
+{
+    unsigned best = 0;
+    int best_q = 0;
+    for (int c = 0; c < MW_CODINGS; c++) {
+        // q=0 means "not acceptable"
+        if (!(allowed & (1u << c)) || q[c] <= 0 || q[c] < best_q) continue;
+        if (q[c] > best_q) best = 0;
+        best |= 1u << c;
+        best_q = q[c];
+    }
+    return best;
+}
+
+mw_coding mw_codec_pick(unsigned codings)
+{
+    for (int i = 0; i < MW_CODINGS; i++) {
+        if (codings & (1u << mw_coding_pref[i])) return mw_coding_pref[i];
+    }
+    return MW_CODINGS;
+}
+
+size_t mw_codec_compress(const mw_codec *c,
+                         mw_coding coding,
+                         int level,
+                         const void *in,
+                         size_t len,
+                         void *out,
+                         size_t cap)
+{
+    return c->compress(coding, level, in, len, out, cap);
+}
+
+/* An engine's state is its window and match tables, 256K and up: too much to
+ * leave with every keep-alive connection between responses, and too much to
+ * allocate for each.  The ones given back are kept per coding, shared by
+ * every thread, for the next stream to reset.
+ */
+static struct {
+    pthread_mutex_t lock;
+    void *idle[MW_CODINGS][MW_CODEC_MAX_IDLE];
+    unsigned n_idle[MW_CODINGS];
+    mw_codec_usage usage;
+    size_t max_open;
+} states = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .max_open = MW_CODEC_DEFAULT_MAX_OPEN,
+};
+
+/* An idle state of coding, or NULL if there is none */
+static void *state_take(mw_coding coding)
+{
+    void *st = NULL;
+    pthread_mutex_lock(&states.lock);
+    if (states.n_idle[coding]) {
+        st = states.idle[coding][--states.n_idle[coding]];
+        states.usage.idle--;
+    }
+    pthread_mutex_unlock(&states.lock);
+    return st;
+}
+
+/* A new state, or NULL with errno set: EBUSY if max_open are open and none
+ * of them is idle, to be closed to make way
+ */
+static void *state_open(const mw_codec *c, mw_coding coding, int level)
+{
+    void *spare = NULL;
+    int spare_coding = 0;
+    pthread_mutex_lock(&states.lock);
+    if (states.usage.open < states.max_open) {
+        states.usage.open++;
+    }
+    else {
+        for (; spare_coding < MW_CODINGS; spare_coding++) {
+            if (!states.n_idle[spare_coding]) continue;
+            unsigned n = --states.n_idle[spare_coding];
+            spare = states.idle[spare_coding][n];
+            states.usage.idle--;
+            break;
+        }
+        if (!spare) {
+            pthread_mutex_unlock(&states.lock);
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+    pthread_mutex_unlock(&states.lock);
+    // the new state takes its place in the count
+    if (spare) mw_codec_streamer(spare_coding)->close(spare);
+
+    void *st = c->open(coding, level);
+    pthread_mutex_lock(&states.lock);
+    if (st) {
+        states.usage.allocs++;
+    }
+    else {
+        states.usage.open--;
+    }
+    pthread_mutex_unlock(&states.lock);
+    if (!st) errno = ENOMEM;
+    return st;
+}
+
+static void state_close(const mw_codec *c, void *st)
+{
+    c->close(st);
+    pthread_mutex_lock(&states.lock);
+    states.usage.open--;
+    pthread_mutex_unlock(&states.lock);
+}
+
+mw_codec_usage mw_codec_usage_get(void)
+{
+    pthread_mutex_lock(&states.lock);
+    mw_codec_usage u = states.usage;
+    pthread_mutex_unlock(&states.lock);
+    return u;
+}
+
+void mw_codec_drain(void)
+{
+    for (int coding = 0; coding < MW_CODINGS; coding++) {
+        const mw_codec *c = mw_codec_streamer(coding);
+        void *st;
+        while ((st = state_take(coding))) state_close(c, st);
+    }
+}
+
+void mw_codec_set_max_open(size_t max_open)
+{
+    pthread_mutex_lock(&states.lock);
+    states.max_open = max_open;
+    pthread_mutex_unlock(&states.lock);
+}
+
+int mw_codec_stream_open(mw_codec_stream *s, mw_coding coding, int level)
+{
+    const mw_codec *c = mw_codec_streamer(coding);
+    if (!c) return ENOTSUP;
+    level = clamp_level(c, level);
+    if (!s->state || s->codec != c || s->coding != coding) {
+        mw_codec_stream_release(s);
+        s->state = state_take(coding);
+    }
+    // a reset state is as good as new
+    if (s->state && (!c->reset || !c->reset(s->state, level))) {
+        state_close(c, s->state);
+        s->state = NULL;
+    }
+    if (!s->state) {
+        s->state = state_open(c, coding, level);
+        if (!s->state) return errno;
+    }
+    s->codec = c;
+    s->coding = coding;
+    s->level = level;
+    s->total_in = 0;
+    s->total_out = 0;
+    // only worth it for an engine faster than the streaming one
+    s->oneshot = mw_codec_oneshot(coding);
+    if (s->oneshot == c) s->oneshot = NULL;
+    return 0;
+}
+
+mw_codec_status mw_codec_stream_run(mw_codec_stream *s,
+                                    const void *in,
+                                    size_t *in_len,
+                                    void *out,
+                                    size_t *out_len,
+                                    bool finish)
+{
+    // with room for the worst case, so the work is never thrown away
+    if (finish && !s->total_in && s->oneshot &&
+        *out_len >= s->codec->bound(s->state, *in_len)) {
+        // as far from its own level as the stream is from the streamer's
+        const mw_codec *o = s->oneshot;
+        int level = clamp_level(o, o->level + s->level - s->codec->level);
+        size_t n = o->compress(s->coding, level, in, *in_len, out, *out_len);
+        // the engine failed: the stream may yet do it
+        if (n) {
+            s->total_in = *in_len;
+            s->total_out = n;
+            *out_len = n;
+            return MW_CODEC_END;
+        }
+    }
+    mw_codec_status rc =
+        s->codec->run(s->state, in, in_len, out, out_len, finish);
+    s->total_in += *in_len;
+    s->total_out += *out_len;
+    return rc;
+}
+
+size_t mw_codec_stream_bound(mw_codec_stream *s, size_t len)
+{
+    return s->codec->bound(s->state, len);
+}
+
+void mw_codec_stream_release(mw_codec_stream *s)
+{
+    void *st = s->state;
+    if (!st) return;
+    pthread_mutex_lock(&states.lock);
+    // one that can't be reset would only be closed by the next stream
+    if (s->codec->reset && states.n_idle[s->coding] < MW_CODEC_MAX_IDLE) {
+        states.idle[s->coding][states.n_idle[s->coding]++] = st;
+        states.usage.idle++;
+        st = NULL;
+    }
+    pthread_mutex_unlock(&states.lock);
+    // free outside the lock
+    if (st) state_close(s->codec, st);
+    s->state = NULL;
+    s->codec = NULL;
+}
+
+void mw_codec_stream_close(mw_codec_stream *s)
+{
+    if (s->state) state_close(s->codec, s->state);
+    s->state = NULL;
+    s->codec = NULL;
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
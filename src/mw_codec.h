@@ -0,0 +1,271 @@
+#ifndef MW_CODEC_H
+#define MW_CODEC_H
+
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief The content codings we can send, in no particular order
+ */
+typedef enum {
+    MW_CODING_DEFLATE, ///< zlib format, "Content-Encoding: deflate"
+    MW_CODING_GZIP,    ///< "Content-Encoding: gzip"
+    MW_CODING_BR,      ///< brotli, "Content-Encoding: br"
+    MW_CODING_ZSTD,    ///< "Content-Encoding: zstd"
+    MW_CODINGS,
+} mw_coding;
+
+/**
+ * @brief Sets of content codings, see mw_req_send_file
+ */
+enum {
+    MW_ENC_DEFLATE = 1 << MW_CODING_DEFLATE,
+    MW_ENC_GZIP = 1 << MW_CODING_GZIP,
+    MW_ENC_BR = 1 << MW_CODING_BR,
+    MW_ENC_ZSTD = 1 << MW_CODING_ZSTD,
+    MW_ENC_ALL = (1 << MW_CODINGS) - 1,
+};
+
+typedef enum {
+    MW_CODEC_OK,    ///< progress made, call again with more input or room
+    MW_CODEC_END,   ///< all input given with finish is compressed and out
+    MW_CODEC_ERROR, ///< the engine failed, the stream is unusable
+} mw_codec_status;
+
+/**
+ * @brief A compression engine: a library, and the codings it can produce
+ *
+ * Engines that stream have open, reset, run, bound and close; engines that
+ * only compress a whole body at once have compress.  Each has its own range
+ * of levels, and the level set for it by mw_codec_init.
+ */
+typedef struct _mw_codec {
+    const char *name;  ///< the library, for logs: "zlib", "brotli", ...
+    unsigned codings;  ///< the MW_ENC_* it produces
+    int min_level;     ///< its fastest level
+    int max_level;     ///< its smallest output
+    int level;         ///< the level it compresses at
+
+    /// a stream of coding at level, or NULL
+    void *(*open)(mw_coding coding, int level);
+    /// start the next stream with the same coding, at level; NULL if the
+    /// engine can't, and its states aren't kept for reuse
+    bool (*reset)(void *st, int level);
+    /// see mw_codec_stream_run
+    mw_codec_status (*run)(void *st,
+                           const void *in,
+                           size_t *in_len,
+                           void *out,
+                           size_t *out_len,
+                           bool finish);
+    /// enough room for len more bytes of input, in one call of run
+    size_t (*bound)(void *st, size_t len);
+    void (*close)(void *st);
+
+    /// see mw_codec_compress
+    size_t (*compress)(mw_coding coding,
+                       int level,
+                       const void *in,
+                       size_t len,
+                       void *out,
+                       size_t cap);
+} mw_codec;
+
+/**
+ * @brief The level each engine compresses at, clamped to its range
+ */
+typedef struct _mw_codec_levels {
+    int zlib;       ///< 1 to 9
+    int libdeflate; ///< 1 to 12
+    int brotli;     ///< 0 to 11
+    int zstd;       ///< 1 to 19
+} mw_codec_levels;
+
+/**
+ * @brief The engines' levels unless configured otherwise
+ *
+ * On the fly the cost is paid per response, so brotli and zstd run well below
+ * their maximums; they still beat zlib's default on both ratio and speed.
+ */
+#define MW_CODEC_DEFAULT_LEVELS                                                \
+    { .zlib = 6, .libdeflate = 6, .brotli = 5, .zstd = 3 }
+
+/**
+ * @brief A stream of compressed output, with whichever engine produces its
+ *        coding
+ *
+ * A stream is opened for each body and released when the body is done, its
+ * engine state going to a shared pool for the next stream of the coding to
+ * reset rather than allocate, if the engine can reset one; opened again
+ * without being released it resets its own.
+ * A body given whole, with finish and room for mw_codec_stream_bound of it,
+ * goes to the one-shot engine for the coding if there is one.
+ */
+typedef struct _mw_codec_stream {
+    const mw_codec *codec;   ///< streams the coding, NULL until opened
+    const mw_codec *oneshot; ///< compresses a whole body, or NULL
+    mw_coding coding;        ///< what it produces
+    int level;               ///< the level it compresses at
+    void *state;             ///< the codec's, NULL until opened
+    uint64_t total_in;       ///< input consumed since opened
+    uint64_t total_out;      ///< output produced since opened
+} mw_codec_stream;
+
+/**
+ * @brief The idle engine states kept for reuse, per coding
+ */
+#define MW_CODEC_MAX_IDLE 16
+
+/**
+ * @brief The engine states open at once unless set otherwise: 256MB and up
+ */
+#define MW_CODEC_DEFAULT_MAX_OPEN 1024
+
+/**
+ * @brief The engine states' use of memory, for stats and tests
+ */
+typedef struct _mw_codec_usage {
+    size_t open;   ///< states allocated, in streams or idle
+    size_t idle;   ///< states kept for reuse
+    size_t allocs; ///< states that had to be allocated
+} mw_codec_usage;
+
+/**
+ * @brief Set the engines' levels
+ */
+void mw_codec_init(const mw_codec_levels *levels);
+
+/**
+ * @brief The codings we have an engine to stream, MW_ENC_*
+ */
+unsigned mw_codec_available(void);
+
+/**
+ * @brief The engine that streams a coding, or NULL if we have none
+ */
+const mw_codec *mw_codec_streamer(mw_coding coding);
+
+/**
+ * @brief The engine that best compresses a whole body into a coding
+ */
+const mw_codec *mw_codec_oneshot(mw_coding coding);
+
+/**
+ * @brief The token a coding goes by in Accept-Encoding and Content-Encoding
+ */
+const char *mw_coding_name(mw_coding coding);
+
+/**
+ * @brief Pick the codings to send from the client's q-values
+ *
+ * @param q Per coding, the q-value in thousandths as from mw_span_token_q, or
+ *          -1 if the client didn't list it
+ * @param allowed The MW_ENC_* the content type is worth and we can produce
+ *
+ * @return The allowed codings the client ranks highest, as MW_ENC_*; 0 to
+ *         send the body as it is
+ */
+unsigned mw_codec_negotiate(const int q[MW_CODINGS], unsigned allowed);
+
+/**
+ * @brief Of a set of acceptable codings, the one to compress on the fly
+ *
+ * zstd and brotli are preferred, for their ratio and speed; then gzip, which
+ * more clients decode correctly than deflate.
+ *
+ * @return The coding, or MW_CODINGS if codings is 0
+ */
+mw_coding mw_codec_pick(unsigned codings);
+
+/**
+ * @brief Compress a whole body at once
+ *
+ * @return The bytes of out used, or 0 if the output didn't fit in cap (or
+ *         the engine failed)
+ */
+size_t mw_codec_compress(const mw_codec *c,
+                         mw_coding coding,
+                         int level,
+                         const void *in,
+                         size_t len,
+                         void *out,
+                         size_t cap);
+
+/**
+ * @brief Start a stream of coding
+ *
+ * @param s The stream
+ * @param coding What it is to produce
+ * @param level The level, clamped to the engine's range; the engine's own
+ *              is mw_codec_streamer(coding)->level
+ *
+ * @return 0, or an errno value: ENOTSUP if no engine streams the coding,
+ *         EBUSY if as many states are open as mw_codec_set_max_open allows
+ *         and none is idle, ENOMEM if there is no memory for its state
+ */
+int mw_codec_stream_open(mw_codec_stream *s, mw_coding coding, int level);
+
+/**
+ * @brief Compress some input
+ *
+ * @param s The stream
+ * @param in The input
+ * @param in_len The bytes of input, set to the bytes consumed
+ * @param out Where the output goes
+ * @param out_len The room at out, set to the bytes produced
+ * @param finish Is this the end of the input?  Once passed, the rest of the
+ *               input must be passed with it until MW_CODEC_END.
+ *
+ * @return MW_CODEC_END once finished and all output is out, MW_CODEC_OK if
+ *         there is more to do, MW_CODEC_ERROR if the engine failed
+ */
+mw_codec_status mw_codec_stream_run(mw_codec_stream *s,
+                                    const void *in,
+                                    size_t *in_len,
+                                    void *out,
+                                    size_t *out_len,
+                                    bool finish);
+
+/**
+ * @brief Output room that guarantees progress for len bytes of input
+ */
+size_t mw_codec_stream_bound(mw_codec_stream *s, size_t len);
+
+/**
+ * @brief Give the stream's engine state to the pool, or free it if the pool
+ *        has MW_CODEC_MAX_IDLE of the coding already.  Thread safe.
+ */
+void mw_codec_stream_release(mw_codec_stream *s);
+
+/**
+ * @brief Free the stream's engine state
+ */
+void mw_codec_stream_close(mw_codec_stream *s);
+
+/**
+ * @brief How many engine states there are
+ */
+mw_codec_usage mw_codec_usage_get(void);
+
+/**
+ * @brief Free the idle engine states
+ */
+void mw_codec_drain(void);
+
+/**
+ * @brief Set how many engine states may be open at once, idle ones included
+ *
+ * Each is 256K and up, so 10k connections can't all compress at once.  Past
+ * this, an idle state of another coding is closed to make way, or the stream
+ * isn't opened.  Thread safe.
+ */
+void mw_codec_set_max_open(size_t max_open);
+
+___END_DECLS
+#endif /* ifndef MW_CODEC_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
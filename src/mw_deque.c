@@ -0,0 +1,80 @@
+#include "mw_deque.h"
+
+/* After "Correct and Efficient Work-Stealing for Weak Memory Models", Lê,
+ * Pop, Cohen and Zappa Nardelli, 2013; without the resizing.
+ */
+
+void mw_deque_init(mw_deque *d)
+{
+    d->top = 0;
+    d->bottom = 0;
+}
+
+bool mw_deque_push(mw_deque *d, void *item)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - t >= MW_DEQUE_SIZE) return false;
+    __atomic_store_n(&d->items[b & (MW_DEQUE_SIZE - 1)],
+                     item,
+                     __ATOMIC_RELAXED);
+    // thieves must see the item before the new bottom
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void *mw_deque_pop(mw_deque *d)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    // claim the slot before looking at top, which thieves move
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    void *item =
+        __atomic_load_n(&d->items[b & (MW_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (t == b) {
+        // the last item: race the thieves for it
+        if (!__atomic_compare_exchange_n(&d->top,
+                                         &t,
+                                         t + 1,
+                                         false,
+                                         __ATOMIC_SEQ_CST,
+                                         __ATOMIC_RELAXED)) {
+            item = NULL;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return item;
+}
+
+void *mw_deque_steal(mw_deque *d)
+{
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return NULL;
+    void *item =
+        __atomic_load_n(&d->items[t & (MW_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top,
+                                     &t,
+                                     t + 1,
+                                     false,
+                                     __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return item;
+}
+
+bool mw_deque_empty(mw_deque *d)
+{
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    return t >= b;
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,75 @@
+#ifndef MW_DEQUE_H
+#define MW_DEQUE_H
+
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief Slots in a work-stealing deque, as a power of two
+ */
+#define MW_DEQUE_BITS 10
+
+/**
+ * @brief Slots in a work-stealing deque
+ */
+#define MW_DEQUE_SIZE (1 << MW_DEQUE_BITS)
+
+/**
+ * @brief A Chase-Lev work-stealing deque of pointers
+ *
+ * One thread, the owner, pushes and pops at the bottom, without locks or
+ * atomic read-modify-writes unless it is down to the last item.  Any other
+ * thread may steal from the top, with one compare-and-swap.  The owner takes
+ * the newest work, whose data is still in its cache; thieves take the
+ * oldest, which is likely to be the biggest.
+ *
+ * The deque doesn't grow; a push to a full deque fails, and the owner runs
+ * the work itself.
+ */
+typedef struct _mw_deque {
+    int64_t top;    ///< next to steal, only ever increases
+    char pad[64 - sizeof(int64_t)]; ///< keeps thieves off the owner's line
+    int64_t bottom; ///< next free slot, the owner's end
+    void *items[MW_DEQUE_SIZE];
+} mw_deque;
+
+/**
+ * @brief Set up an empty deque
+ */
+void mw_deque_init(mw_deque *d);
+
+/**
+ * @brief Push an item at the bottom; owner only
+ *
+ * @return false if the deque is full
+ */
+bool mw_deque_push(mw_deque *d, void *item);
+
+/**
+ * @brief Pop the newest item; owner only
+ *
+ * @return The item, or NULL if the deque is empty (or a thief got it first)
+ */
+void *mw_deque_pop(mw_deque *d);
+
+/**
+ * @brief Steal the oldest item; any thread
+ *
+ * @return The item, or NULL if the deque is empty or another thread won the
+ *         race for it
+ */
+void *mw_deque_steal(mw_deque *d);
+
+/**
+ * @brief Does the deque look empty?  Only a hint, unless on the owner
+ */
+bool mw_deque_empty(mw_deque *d);
+
+___END_DECLS
+#endif /* ifndef MW_DEQUE_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,1066 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for pthread_setaffinity_np
+#endif
+#include "mw_evloop.h"
+#include "mw_clock.h"
+#include "mw_uring.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#if HAVE_EPOLL
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#if HAVE_IO_URING
+#include <poll.h>
+#include <sys/socket.h>
+#endif
+
+static uint64_t now_ms(void)
+{
+    return mw_clock_coarse_ns() / 1000000;
+}
+
+static void ev_unlink(mw_ev *ev)
+{
+    ev->prev->next = ev->next;
+    ev->next->prev = ev->prev;
+    ev->prev = ev->next = NULL;
+}
+
+static bool ev_ready(const mw_ev *ev)
+{
+    return ev->fn && ev->enabled &&
+           (ev->write ? ev->efd->writable : ev->efd->readable);
+}
+
+/* Put ev on the list of sources to call next pass, if it should be called
+ */
+static void ev_queue(mw_ev *ev)
+{
+    if (ev->next || !ev_ready(ev)) return;
+    mw_ev *head = &ev->loop->ready;
+    ev->prev = head->prev;
+    ev->next = head;
+    head->prev->next = ev;
+    head->prev = ev;
+}
+
+/* Mark a direction of efd ready, and queue its source */
+static void efd_ready(mw_evfd *efd, bool write)
+{
+    if (write) {
+        efd->writable = true;
+        if (efd->wr) ev_queue(efd->wr);
+    }
+    else {
+        efd->readable = true;
+        if (efd->rd) ev_queue(efd->rd);
+    }
+}
+
+#if HAVE_IO_URING
+/* What a request is, in the low bits of its user_data; the rest is its
+ * mw_evreg.  Cancellations have a user_data of 0.
+ */
+enum {
+    OP_POLL_OUT = 1 << 0, ///< multishot poll for writes
+    OP_POLL_IN = 1 << 1,  ///< multishot poll for reads, without OP_RECV
+    OP_RECV = 1 << 2,     ///< receive into a buffer from the buffer ring
+    OP_ACCEPT = 1 << 3,   ///< multishot accept
+};
+#define OP_MASK 15
+
+/* A descriptor's requests in the kernel.  It outlives its mw_evfd until the
+ * kernel has finished with every request, so late completions have somewhere
+ * to go.
+ */
+typedef struct __attribute__((aligned(16))) _mw_evreg {
+    mw_evfd *efd;   ///< NULL once the descriptor is deregistered
+    int inflight;   ///< requests the kernel holds
+    unsigned armed; ///< OP_* bits of the requests in the kernel
+    unsigned want;  ///< OP_* bits of requests to submit
+    bool dirty;     ///< on the ring's dirty list?
+    bool starved;   ///< did OP_RECV stop for want of buffers?
+    bool plain;     ///< not a socket: poll, and read ourselves
+    struct _mw_evreg *next; ///< in the dirty list, or free list
+
+    int head, tail; ///< received buffers, in order, -1 for none
+    unsigned off;   ///< bytes of head already read
+    size_t queued;  ///< bytes received and not yet read
+    bool eof;       ///< has the peer closed its end?
+    int err;        ///< a receive or accept error, not yet reported
+
+    int *fds;          ///< accepted sockets, from fds[first] to fds[n - 1]
+    unsigned first, n; ///< the accepted sockets waiting
+    unsigned cap;      ///< room in fds
+} mw_evreg;
+
+/* A loop's io_uring, and the buffers it receives into */
+typedef struct _mw_evring {
+    mw_uring r;
+    mw_uring_bufs bufs;
+    unsigned buf_len[MW_EVLOOP_RECV_BUFS]; ///< bytes in each buffer
+    int buf_next[MW_EVLOOP_RECV_BUFS];     ///< next in its mw_evreg's list
+    bool returned;     ///< have buffers been given back this pass?
+    mw_evreg *dirty;   ///< registrations with requests to submit or cancel
+    mw_evreg *free;    ///< registrations to reuse
+    unsigned regs;     ///< registrations not on the free list
+} mw_evring;
+
+static int ring_init(mw_evloop *loop)
+{
+    static const uint8_t ops[] = {
+        IORING_OP_POLL_ADD,
+        IORING_OP_RECV,
+        IORING_OP_ACCEPT,
+        IORING_OP_ASYNC_CANCEL,
+    };
+    mw_evring *ring = calloc(1, sizeof(*ring));
+    if (!ring) return -ENOMEM;
+    int rc = mw_uring_init(&ring->r, MW_EVLOOP_RING_ENTRIES);
+    if (rc == 0 && !mw_uring_supports(&ring->r, ops, sizeof(ops))) {
+        rc = -ENOSYS;
+    }
+    // buffer rings came with multishot accept, in 5.19
+    if (rc == 0) {
+        rc = mw_uring_bufs_init(&ring->r,
+                                &ring->bufs,
+                                MW_EVLOOP_RECV_BUFS,
+                                MW_EVLOOP_RECV_BUF_SZ,
+                                0);
+    }
+    if (rc) {
+        if (ring->r.fd >= 0) mw_uring_exit(&ring->r);
+        free(ring);
+        return rc;
+    }
+    loop->ring = ring;
+    return 0;
+}
+
+static void reg_dirty(mw_evring *ring, mw_evreg *reg)
+{
+    if (reg->dirty) return;
+    reg->dirty = true;
+    reg->next = ring->dirty;
+    ring->dirty = reg;
+}
+
+static void reg_free(mw_evring *ring, mw_evreg *reg)
+{
+    free(reg->fds);
+    reg->next = ring->free;
+    ring->free = reg;
+    ring->regs--;
+}
+
+/* Returns 0, or -ENOMEM if there is no registration to be had */
+static int ring_register(mw_evloop *loop, mw_evfd *efd)
+{
+    mw_evring *ring = loop->ring;
+    mw_evreg *reg = ring->free;
+    if (reg) {
+        ring->free = reg->next;
+    }
+    else {
+        reg = aligned_alloc(16, sizeof(*reg));
+        if (!reg) return -ENOMEM;
+    }
+    memset(reg, 0, sizeof(*reg));
+    ring->regs++;
+    reg->efd = efd;
+    reg->head = reg->tail = -1;
+    if (efd->kind == MW_EVFD_LISTEN) {
+        reg->want = OP_ACCEPT;
+    }
+    else if (efd->kind == MW_EVFD_EVENT) {
+        reg->plain = true;
+        reg->want = OP_POLL_IN;
+    }
+    else {
+        reg->want = OP_POLL_OUT | OP_RECV;
+    }
+    efd->reg = reg;
+    efd->polled = true;
+    reg_dirty(ring, reg);
+    return 0;
+}
+
+static void buf_put(mw_evring *ring, int bid)
+{
+    mw_uring_buf_put(&ring->bufs, bid);
+    ring->returned = true;
+}
+
+static void ring_deregister(mw_evloop *loop, mw_evfd *efd)
+{
+    mw_evring *ring = loop->ring;
+    mw_evreg *reg = efd->reg;
+    efd->reg = NULL;
+    if (!reg) return;
+    reg->efd = NULL;
+    reg->want = 0;
+    while (reg->head >= 0) {
+        int bid = reg->head;
+        reg->head = ring->buf_next[bid];
+        buf_put(ring, bid);
+    }
+    while (reg->first < reg->n) close(reg->fds[reg->first++]);
+    // the requests still in the kernel are cancelled next pass
+    if (reg->inflight || reg->dirty) {
+        reg_dirty(ring, reg);
+    }
+    else {
+        reg_free(ring, reg);
+    }
+}
+
+/* Submit what a registration wants: its requests, or the cancellation of
+ * them.  Returns whether there is nothing left to submit.
+ */
+static bool reg_flush(mw_evring *ring, mw_evreg *reg, bool bufs_back)
+{
+    if (!reg->efd) {
+        // armed bits stay set until the final completions come in
+        unsigned cancel = reg->armed & ~reg->want;
+        for (unsigned op = 1; op <= OP_ACCEPT; op <<= 1) {
+            if (!(cancel & op)) continue;
+            struct io_uring_sqe *sqe = mw_uring_sqe(&ring->r);
+            if (!sqe) return false;
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t)reg | op;
+            if (ring->r.features & IORING_FEAT_CQE_SKIP) {
+                sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+            }
+            // the want bit marks it cancelled
+            reg->want |= op;
+        }
+        return true;
+    }
+
+    if (reg->starved && bufs_back) reg->starved = false;
+    for (unsigned op = 1; op <= OP_ACCEPT; op <<= 1) {
+        if (!(reg->want & op)) continue;
+        if (op == OP_RECV && reg->starved) continue;
+        struct io_uring_sqe *sqe = mw_uring_sqe(&ring->r);
+        if (!sqe) return false;
+        sqe->fd = reg->efd->fd;
+        sqe->user_data = (uint64_t)(uintptr_t)reg | op;
+        switch (op) {
+        case OP_POLL_OUT:
+        case OP_POLL_IN:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            sqe->poll32_events = op == OP_POLL_OUT ? POLLOUT
+                                                   : POLLIN | POLLRDHUP;
+            break;
+        case OP_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = ring->bufs.bgid;
+            break;
+        case OP_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            break;
+        }
+        reg->want &= ~op;
+        reg->armed |= op;
+        reg->inflight++;
+    }
+    return reg->want == 0;
+}
+
+static void ring_flush(mw_evring *ring)
+{
+    bool bufs_back = ring->returned;
+    ring->returned = false;
+    mw_evreg **pp = &ring->dirty;
+    while (*pp) {
+        mw_evreg *reg = *pp;
+        if (!reg_flush(ring, reg, bufs_back)) {
+            // starved, or the SQ is full: try again next pass
+            pp = &reg->next;
+            continue;
+        }
+        *pp = reg->next;
+        reg->dirty = false;
+        if (!reg->efd && !reg->inflight) reg_free(ring, reg);
+    }
+}
+
+static void reg_push_fd(mw_evreg *reg, int fd)
+{
+    if (reg->first == reg->n) reg->first = reg->n = 0;
+    if (reg->n == reg->cap) {
+        unsigned cap = reg->cap ? reg->cap * 2 : 64;
+        int *fds = realloc(reg->fds, cap * sizeof(int));
+        if (!fds) {
+            close(fd);
+            return;
+        }
+        reg->fds = fds;
+        reg->cap = cap;
+    }
+    reg->fds[reg->n++] = fd;
+}
+
+/* Receive into another buffer, unless the reader has fallen behind.  A
+ * multishot receive would take all the socket has, however little is read.
+ */
+static void reg_recv(mw_evring *ring, mw_evreg *reg)
+{
+    if ((reg->armed | reg->want) & OP_RECV) return;
+    if (reg->eof || reg->err) return;
+    if (reg->queued >= MW_EVLOOP_RECV_QUEUE_MAX) return;
+    reg->want |= OP_RECV;
+    reg_dirty(ring, reg);
+}
+
+/* Deal with a completion for one of a registration's requests */
+static void ring_complete(mw_evloop *loop, struct io_uring_cqe *cqe)
+{
+    mw_evring *ring = loop->ring;
+    uint64_t data = cqe->user_data;
+    mw_evreg *reg = (mw_evreg *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+    unsigned op = data & OP_MASK;
+    int res = cqe->res;
+    if (!reg) return;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    int bid = -1;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+    if (!more) {
+        reg->inflight--;
+        reg->armed &= ~op;
+    }
+
+    mw_evfd *efd = reg->efd;
+    if (!efd) {
+        // deregistered: give back whatever comes
+        if (bid >= 0) buf_put(ring, bid);
+        if (op == OP_ACCEPT && res >= 0) close(res);
+        if (!reg->inflight && !reg->dirty) reg_free(ring, reg);
+        return;
+    }
+
+    switch (op) {
+    case OP_POLL_OUT:
+    case OP_POLL_IN:
+        // its events, or an error or hangup, for the handler to find
+        efd_ready(efd, op == OP_POLL_OUT);
+        break;
+    case OP_RECV:
+        if (res > 0 && bid >= 0) {
+            ring->buf_len[bid] = res;
+            ring->buf_next[bid] = -1;
+            if (reg->tail >= 0) {
+                ring->buf_next[reg->tail] = bid;
+            }
+            else {
+                reg->head = bid;
+            }
+            reg->tail = bid;
+            reg->queued += res;
+        }
+        else if (bid >= 0) {
+            buf_put(ring, bid);
+        }
+        if (res == 0) {
+            reg->eof = true;
+        }
+        else if (res == -ENOBUFS) {
+            // the connections that hold buffers have to read them first
+            reg->starved = true;
+        }
+        else if (res < 0) {
+            reg->err = -res;
+        }
+        if (!reg->starved) efd_ready(efd, false);
+        reg_recv(ring, reg);
+        return;
+    case OP_ACCEPT:
+        if (res >= 0) {
+            reg_push_fd(reg, res);
+        }
+        else {
+            reg->err = -res;
+        }
+        efd_ready(efd, false);
+        break;
+    }
+    if (!more) {
+        reg->want |= op;
+        reg_dirty(ring, reg);
+    }
+}
+
+static void ring_poll(mw_evloop *loop, int timeout_ms)
+{
+    mw_evring *ring = loop->ring;
+    ring_flush(ring);
+    int rc = mw_uring_enter(&ring->r, timeout_ms);
+    (void)rc; // -ETIME and -EINTR just mean there is nothing to do
+    struct io_uring_cqe *cqe;
+    while ((cqe = mw_uring_peek(&ring->r))) {
+        ring_complete(loop, cqe);
+        mw_uring_seen(&ring->r);
+        loop->wakeups++;
+    }
+}
+#endif /* HAVE_IO_URING */
+
+mw_evloop *mw_evloop_create(int backend, int id)
+{
+    if (backend != MW_EVLOOP_EPOLL && backend != MW_EVLOOP_URING) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    mw_evloop *loop = calloc(1, sizeof(*loop));
+    if (!loop) return NULL;
+    loop->jobs = malloc(sizeof(mw_deque));
+    if (!loop->jobs) {
+        free(loop);
+        return NULL;
+    }
+    mw_deque_init(loop->jobs);
+    loop->id = id;
+    loop->epfd = -1;
+    loop->wake_fd = -1;
+    loop->ready.prev = loop->ready.next = &loop->ready;
+#if HAVE_IO_URING
+    // without a recent enough io_uring, we fall back to epoll
+    if (backend == MW_EVLOOP_URING && ring_init(loop) == 0) {
+        loop->backend = MW_EVLOOP_URING;
+        return loop;
+    }
+#endif
+#if HAVE_EPOLL
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd >= 0) {
+        loop->backend = MW_EVLOOP_EPOLL;
+        return loop;
+    }
+#else
+    errno = ENOTSUP;
+#endif
+    int e = errno;
+    free(loop->jobs);
+    free(loop);
+    errno = e;
+    return NULL;
+}
+
+void mw_evloop_destroy(mw_evloop *loop)
+{
+    mw_ev_delete(&loop->wake_ev);
+    if (loop->wake_fd >= 0) close(loop->wake_fd);
+#if HAVE_IO_URING
+    if (loop->ring) {
+        mw_evring *ring = loop->ring;
+        // let the kernel finish with the deleted descriptors' requests
+        for (int i = 0; ring->regs && i < 100; i++) ring_poll(loop, 10);
+        mw_uring_exit(&ring->r);
+        while (ring->free) {
+            mw_evreg *reg = ring->free;
+            ring->free = reg->next;
+            free(reg);
+        }
+        mw_uring_bufs_exit(&ring->bufs);
+        free(ring);
+    }
+#endif
+    if (loop->epfd >= 0) close(loop->epfd);
+    free(loop->jobs);
+    free(loop);
+}
+
+const char *mw_evloop_name(int backend)
+{
+    switch (backend) {
+    case MW_EVLOOP_DISPATCH: return "dispatch";
+    case MW_EVLOOP_EPOLL: return "epoll";
+    case MW_EVLOOP_URING: return "io_uring";
+    }
+    return "?";
+}
+
+void mw_evloop_set_tick(mw_evloop *loop, unsigned ms, mw_task_fn fn, void *ctx)
+{
+    loop->tick_ms = ms;
+    loop->tick = fn;
+    loop->tick_ctx = ctx;
+    loop->next_tick = now_ms() + ms;
+}
+
+static void *evloop_thread(void *arg)
+{
+    mw_evloop *loop = arg;
+    for (;;) mw_evloop_poll(loop, -1);
+    return NULL;
+}
+
+int mw_evloop_start(mw_evloop *loop, int cpu)
+{
+    int rc = pthread_create(&loop->thread, NULL, evloop_thread, loop);
+    if (rc) return rc;
+#if HAVE_EPOLL
+    char name[16];
+    snprintf(name, sizeof(name), "evloop#%d", loop->id);
+    pthread_setname_np(loop->thread, name);
+    if (cpu >= 0) {
+        // a connection's cache lines stay on the core that accepted it
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(loop->thread, sizeof(set), &set);
+    }
+#else
+    (void)cpu;
+#endif
+    return 0;
+}
+
+/* Bytes a read source could read now, for its handler */
+static size_t ev_avail(mw_ev *ev)
+{
+#if HAVE_IO_URING
+    mw_evreg *reg = ev->efd->reg;
+    if (reg && !reg->plain) return reg->queued;
+#endif
+    int avail = 0;
+    if (ioctl(ev->efd->fd, FIONREAD, &avail) < 0) avail = 0;
+    return avail;
+}
+
+/* Call the handlers of the sources that were ready at the start of the pass.
+ * Sources that are still ready afterwards go round again next pass, after the
+ * kernel has had its say, so one busy connection can't starve the rest.
+ */
+static size_t evloop_run_ready(mw_evloop *loop)
+{
+    mw_ev *head = &loop->ready;
+    if (head->next == head) return 0;
+    // take the whole list, as tw_cascade does
+    mw_ev pass;
+    pass.next = head->next;
+    pass.prev = head->prev;
+    pass.next->prev = &pass;
+    pass.prev->next = &pass;
+    head->next = head->prev = head;
+
+    size_t calls = 0;
+    while (pass.next != &pass) {
+        mw_ev *ev = pass.next;
+        ev_unlink(ev);
+        if (!ev_ready(ev)) continue;
+        ev->fn(ev, ev->write ? 0 : ev_avail(ev));
+        calls++;
+        // the handler may have disabled, blocked or deleted it
+        ev_queue(ev);
+    }
+    return calls;
+}
+
+static void evloop_run_deferred(mw_evloop *loop)
+{
+    // tasks deferred by these tasks run too
+    while (loop->deferred) {
+        mw_evtask *t = loop->deferred;
+        loop->deferred = t->next;
+        t->next = NULL;
+        t->fn(t->ctx);
+    }
+}
+
+/* Call the done of a job that has run, and of the jobs in its strand that
+ * were waiting for it
+ */
+static void job_deliver(mw_job *job)
+{
+    mw_strand *s = job->strand;
+    job->finished = true;
+    if (!s) {
+        if (job->done) job->done(job->ctx);
+        return;
+    }
+    while (s->head && s->head->finished) {
+        mw_job *j = s->head;
+        s->head = j->next;
+        if (!s->head) s->tail = NULL;
+        bool more = s->head != NULL;
+        // done may free the job, and the last job's done the strand
+        if (j->done) j->done(j->ctx);
+        if (!more) return;
+    }
+}
+
+static void evloop_wake(mw_evloop *loop)
+{
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+        // the counter is already set, which is all we want
+    }
+}
+
+/* Hand a job that ran on another loop back to the one that spawned it */
+static void job_return(mw_job *job)
+{
+    mw_evloop *owner = job->loop;
+    mw_job *head = __atomic_load_n(&owner->finished, __ATOMIC_RELAXED);
+    do {
+        job->done_next = head;
+    } while (!__atomic_compare_exchange_n(&owner->finished,
+                                          &head,
+                                          job,
+                                          true,
+                                          __ATOMIC_SEQ_CST,
+                                          __ATOMIC_RELAXED));
+    if (__atomic_exchange_n(&owner->asleep, false, __ATOMIC_SEQ_CST)) {
+        evloop_wake(owner);
+    }
+}
+
+static void job_run(mw_evloop *loop, mw_job *job)
+{
+    job->fn(job->ctx);
+    loop->ran++;
+    if (job->loop == loop) {
+        job_deliver(job);
+    }
+    else {
+        job_return(job);
+    }
+}
+
+/* Call the dones of the jobs other loops have run for us, oldest first */
+static size_t evloop_run_finished(mw_evloop *loop)
+{
+    mw_job *job = __atomic_exchange_n(&loop->finished, NULL, __ATOMIC_ACQUIRE);
+    mw_job *fifo = NULL;
+    while (job) {
+        mw_job *next = job->done_next;
+        job->done_next = fifo;
+        fifo = job;
+        job = next;
+    }
+    size_t calls = 0;
+    while (fifo) {
+        job = fifo;
+        fifo = job->done_next;
+        job_deliver(job);
+        calls++;
+    }
+    return calls;
+}
+
+static mw_job *evloop_steal(mw_evloop *loop)
+{
+    mw_evgroup *g = loop->group;
+    if (!g) return NULL;
+    int n = __atomic_load_n(&g->n, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        int k = (loop->steal_from + i) % n;
+        mw_evloop *victim = g->loops[k];
+        if (victim == loop) continue;
+        mw_job *job = mw_deque_steal(victim->jobs);
+        if (job) {
+            // it may well have more
+            loop->steal_from = k;
+            loop->stolen++;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+/* Run a job of our own, or if the pass had nothing else to do, one of
+ * another loop's.  One a pass keeps the handlers responsive.
+ */
+static size_t evloop_run_jobs(mw_evloop *loop, size_t calls)
+{
+    mw_job *job = mw_deque_pop(loop->jobs);
+    if (!job && !calls) job = evloop_steal(loop);
+    if (!job) return 0;
+    job_run(loop, job);
+    return 1;
+}
+
+static bool evloop_has_jobs(mw_evloop *loop)
+{
+    return !mw_deque_empty(loop->jobs) ||
+           __atomic_load_n(&loop->finished, __ATOMIC_ACQUIRE);
+}
+
+/* About to wait in the kernel: let spawners know to wake us, then look for
+ * work once more, so a job spawned in between isn't left for later
+ */
+static bool evloop_may_sleep(mw_evloop *loop)
+{
+    mw_evgroup *g = loop->group;
+    if (!g) return true;
+    __atomic_store_n(&loop->asleep, true, __ATOMIC_SEQ_CST);
+    bool work = evloop_has_jobs(loop);
+    int n = __atomic_load_n(&g->n, __ATOMIC_ACQUIRE);
+    for (int i = 0; !work && i < n; i++) {
+        work = !mw_deque_empty(g->loops[i]->jobs);
+    }
+    if (work) __atomic_store_n(&loop->asleep, false, __ATOMIC_RELAXED);
+    return !work;
+}
+
+#if HAVE_EPOLL
+static void epoll_poll(mw_evloop *loop, int timeout_ms)
+{
+    struct epoll_event evs[MW_EVLOOP_BATCH];
+    int n = epoll_wait(loop->epfd, evs, MW_EVLOOP_BATCH, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        mw_evfd *efd = evs[i].data.ptr;
+        uint32_t e = evs[i].events;
+        // errors and hangups are reported to whichever side is waiting
+        if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            efd_ready(efd, false);
+        }
+        if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) efd_ready(efd, true);
+    }
+    if (n > 0) loop->wakeups += n;
+}
+#endif
+
+size_t mw_evloop_poll(mw_evloop *loop, int timeout_ms)
+{
+    loop->passes++;
+    uint64_t now = now_ms();
+    if (loop->ready.next != &loop->ready || evloop_has_jobs(loop)) {
+        timeout_ms = 0;
+    }
+    else if (loop->tick) {
+        int until = loop->next_tick > now ? loop->next_tick - now : 0;
+        if (timeout_ms < 0 || until < timeout_ms) timeout_ms = until;
+    }
+    if (timeout_ms != 0 && !evloop_may_sleep(loop)) timeout_ms = 0;
+
+#if HAVE_IO_URING
+    if (loop->ring) ring_poll(loop, timeout_ms);
+#endif
+#if HAVE_EPOLL
+    if (loop->epfd >= 0) epoll_poll(loop, timeout_ms);
+#endif
+
+    __atomic_store_n(&loop->asleep, false, __ATOMIC_RELAXED);
+
+    size_t calls = evloop_run_ready(loop);
+    loop->calls += calls;
+    calls += evloop_run_finished(loop);
+    calls += evloop_run_jobs(loop, calls);
+    if (loop->tick) {
+        now = now_ms();
+        if (now >= loop->next_tick) {
+            // a late tick isn't made up for, the next is a full period on
+            loop->next_tick = now + loop->tick_ms;
+            loop->tick(loop->tick_ctx);
+        }
+    }
+    evloop_run_deferred(loop);
+    return calls;
+}
+
+void mw_evloop_defer(mw_evloop *loop, mw_evtask *t, mw_task_fn fn, void *ctx)
+{
+    t->fn = fn;
+    t->ctx = ctx;
+    t->next = loop->deferred;
+    loop->deferred = t;
+}
+
+static void evloop_on_wake(mw_ev *ev, __attribute__((unused)) size_t avail)
+{
+    uint64_t n;
+    while (mw_ev_read(ev, &n, sizeof(n)) > 0) continue;
+    mw_ev_blocked(ev);
+}
+
+int mw_evgroup_add(mw_evgroup *g, mw_evloop *loop)
+{
+    if (g->n == MW_EVGROUP_MAX) return ENOSPC;
+#if HAVE_EPOLL
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+    // loops need epoll, so this isn't reached
+    errno = ENOTSUP;
+#endif
+    if (loop->wake_fd < 0) return errno;
+    mw_evfd_init(&loop->wake_io, loop->wake_fd, MW_EVFD_EVENT);
+    int rc = mw_ev_init(&loop->wake_ev,
+                        loop,
+                        &loop->wake_io,
+                        false,
+                        evloop_on_wake,
+                        loop);
+    if (rc) {
+        close(loop->wake_fd);
+        loop->wake_fd = -1;
+        return rc;
+    }
+    mw_ev_enable(&loop->wake_ev);
+    loop->group = g;
+    loop->steal_from = g->n;
+    g->loops[g->n] = loop;
+    // loops already running may be looking for something to steal
+    __atomic_store_n(&g->n, g->n + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void mw_strand_init(mw_strand *s)
+{
+    s->head = s->tail = NULL;
+}
+
+bool mw_strand_idle(const mw_strand *s)
+{
+    return !s->head;
+}
+
+void mw_evloop_spawn(mw_evloop *loop,
+                     mw_strand *strand,
+                     mw_job *job,
+                     mw_task_fn fn,
+                     mw_task_fn done,
+                     void *ctx)
+{
+    job->next = job->done_next = NULL;
+    job->fn = fn;
+    job->done = done;
+    job->ctx = ctx;
+    job->loop = loop;
+    job->strand = strand;
+    job->finished = false;
+    if (strand) {
+        if (strand->tail) {
+            strand->tail->next = job;
+        }
+        else {
+            strand->head = job;
+        }
+        strand->tail = job;
+    }
+
+    if (!mw_deque_push(loop->jobs, job)) {
+        // no room: do it ourselves, done comes at the end of the pass
+        fn(ctx);
+        loop->ran++;
+        job_return(job);
+        return;
+    }
+
+    mw_evgroup *g = loop->group;
+    if (!g) return;
+    // pairs with evloop_may_sleep: either it sees the job, or we see it asleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int n = __atomic_load_n(&g->n, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        mw_evloop *other = g->loops[i];
+        if (other == loop) continue;
+        if (__atomic_load_n(&other->asleep, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&other->asleep, false, __ATOMIC_SEQ_CST)) {
+            evloop_wake(other);
+            return;
+        }
+    }
+}
+
+void mw_evfd_init(mw_evfd *efd, int fd, int kind)
+{
+    efd->fd = fd;
+    efd->kind = kind;
+    efd->polled = efd->readable = efd->writable = false;
+    efd->rd = efd->wr = NULL;
+    efd->reg = NULL;
+}
+
+/* Start watching efd, for the first source on it.  Returns 0, or an errno if
+ * it can't be watched: a socket thought always ready would spin.
+ */
+static int evfd_register(mw_evloop *loop, mw_evfd *efd)
+{
+    if (efd->kind == MW_EVFD_FILE) {
+        // files never block, so are always ready
+        efd->readable = efd->writable = true;
+        return 0;
+    }
+#if HAVE_IO_URING
+    if (loop->ring) return -ring_register(loop, efd);
+#endif
+#if HAVE_EPOLL
+    struct epoll_event e = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = efd,
+    };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, efd->fd, &e) < 0) return errno;
+    efd->polled = true;
+    return 0;
+#else
+    return ENOTSUP;
+#endif
+}
+
+/* Stop watching efd, its last source has gone */
+static void evfd_deregister(mw_evloop *loop, mw_evfd *efd)
+{
+    if (!efd->polled) return;
+#if HAVE_IO_URING
+    if (loop->ring) ring_deregister(loop, efd);
+#endif
+#if HAVE_EPOLL
+    if (loop->epfd >= 0) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, efd->fd, NULL);
+#endif
+    efd->polled = false;
+}
+
+int mw_ev_init(mw_ev *ev,
+               mw_evloop *loop,
+               mw_evfd *efd,
+               bool write,
+               mw_ev_fn fn,
+               void *ctx)
+{
+    ev->prev = ev->next = NULL;
+    ev->loop = loop;
+    ev->efd = efd;
+    ev->write = write;
+    ev->enabled = false;
+    ev->fn = fn;
+    ev->ctx = ctx;
+    ev->cancel = NULL;
+    ev->cancel_ctx = NULL;
+
+    if (!efd->rd && !efd->wr) {
+        int rc = evfd_register(loop, efd);
+        if (rc) {
+            ev->fn = NULL;
+            return rc;
+        }
+    }
+    if (write) {
+        efd->wr = ev;
+    }
+    else {
+        efd->rd = ev;
+    }
+    return 0;
+}
+
+void mw_ev_set_cancel(mw_ev *ev, mw_task_fn fn, void *ctx)
+{
+    ev->cancel = fn;
+    ev->cancel_ctx = ctx;
+}
+
+void mw_ev_enable(mw_ev *ev)
+{
+    ev->enabled = true;
+    ev_queue(ev);
+}
+
+void mw_ev_disable(mw_ev *ev)
+{
+    ev->enabled = false;
+    if (ev->next) ev_unlink(ev);
+}
+
+void mw_ev_delete(mw_ev *ev)
+{
+    if (!ev->fn) return;
+    mw_ev_disable(ev);
+    mw_evfd *efd = ev->efd;
+    if (ev->write) {
+        efd->wr = NULL;
+    }
+    else {
+        efd->rd = NULL;
+    }
+    if (!efd->rd && !efd->wr) evfd_deregister(ev->loop, efd);
+    ev->fn = NULL;
+    if (ev->cancel) ev->cancel(ev->cancel_ctx);
+    ev->cancel = NULL;
+}
+
+void mw_ev_blocked(mw_ev *ev)
+{
+    if (!ev->efd->polled) return;
+    if (ev->write) {
+        ev->efd->writable = false;
+    }
+    else {
+        ev->efd->readable = false;
+    }
+    if (ev->next) ev_unlink(ev);
+}
+
+ssize_t mw_ev_read(mw_ev *ev, void *buf, size_t len)
+{
+#if HAVE_IO_URING
+    mw_evreg *reg = ev->efd->reg;
+    if (reg && !reg->plain) {
+        mw_evring *ring = ev->loop->ring;
+        size_t got = 0;
+        while (got < len && reg->head >= 0) {
+            int bid = reg->head;
+            size_t n = ring->buf_len[bid] - reg->off;
+            if (n > len - got) n = len - got;
+            memcpy((char *)buf + got,
+                   mw_uring_buf(&ring->bufs, bid) + reg->off,
+                   n);
+            got += n;
+            reg->off += n;
+            reg->queued -= n;
+            if (reg->off == ring->buf_len[bid]) {
+                reg->head = ring->buf_next[bid];
+                if (reg->head < 0) reg->tail = -1;
+                reg->off = 0;
+                buf_put(ring, bid);
+            }
+        }
+        if (got) {
+            reg_recv(ring, reg);
+            return got;
+        }
+        if (reg->err) {
+            errno = reg->err;
+            reg->err = 0;
+            return -1;
+        }
+        if (reg->eof) return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+#endif
+    return read(ev->efd->fd, buf, len);
+}
+
+int mw_ev_accepted(mw_ev *ev)
+{
+#if HAVE_IO_URING
+    mw_evreg *reg = ev->efd->reg;
+    if (reg) {
+        if (reg->first < reg->n) return reg->fds[reg->first++];
+        errno = reg->err ? reg->err : EAGAIN;
+        reg->err = 0;
+        return -1;
+    }
+#else
+    (void)ev;
+#endif
+    errno = ENOTSUP;
+    return -1;
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,424 @@
+#ifndef MW_EVLOOP_H
+#define MW_EVLOOP_H
+
+#include "config.h"
+#include "mw_deque.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief What runs the shards and their connections
+ */
+typedef enum {
+    MW_EVLOOP_DISPATCH, ///< libdispatch, with a queue per connection
+    MW_EVLOOP_EPOLL,    ///< a thread per shard, around an epoll set
+    MW_EVLOOP_URING,    ///< a thread per shard, around an io_uring
+} mw_evloop_backend;
+
+/**
+ * @brief The backend used unless the server is configured otherwise
+ */
+#if HAVE_IO_URING
+#define MW_EVLOOP_DEFAULT MW_EVLOOP_URING
+#elif HAVE_EPOLL
+#define MW_EVLOOP_DEFAULT MW_EVLOOP_EPOLL
+#else
+#define MW_EVLOOP_DEFAULT MW_EVLOOP_DISPATCH
+#endif
+
+/**
+ * @brief The most kernel events taken per pass of a loop
+ */
+#define MW_EVLOOP_BATCH 128
+
+/**
+ * @brief Submission queue entries of a loop's io_uring
+ */
+#define MW_EVLOOP_RING_ENTRIES 1024
+
+/**
+ * @brief Buffers in a loop's io_uring receive buffer ring, a power of two
+ *
+ * Shared by all the loop's connections; a connection holds its buffers until
+ * its requests have been read out of them.
+ */
+#define MW_EVLOOP_RECV_BUFS 512
+
+/**
+ * @brief Size of each receive buffer
+ */
+#define MW_EVLOOP_RECV_BUF_SZ 4096
+
+/**
+ * @brief Most bytes one connection may have waiting in receive buffers
+ *
+ * About a request's cmd_buf.  Past it nothing more is received for the
+ * connection until it has read some, so one that doesn't read leaves the
+ * rest in its socket, and the buffers to the others.
+ */
+#define MW_EVLOOP_RECV_QUEUE_MAX (2 * MW_EVLOOP_RECV_BUF_SZ)
+
+/**
+ * @brief The most loops that can share jobs
+ */
+#define MW_EVGROUP_MAX 256
+
+/**
+ * @brief What a descriptor is, which decides how a loop watches it
+ */
+typedef enum {
+    MW_EVFD_STREAM, ///< a connected socket
+    MW_EVFD_LISTEN, ///< a listening socket
+    MW_EVFD_FILE,   ///< a regular file: never watched, always ready
+    MW_EVFD_EVENT,  ///< an eventfd or pipe: watched, but read with read()
+} mw_evfd_kind;
+
+struct _mw_ev;
+
+/**
+ * @brief Called on the loop's thread while an event source is enabled and
+ *        its descriptor is ready
+ *
+ * @param ev The source
+ * @param avail Bytes waiting to be read (FIONREAD), 0 for write sources
+ */
+typedef void (*mw_ev_fn)(struct _mw_ev *ev, size_t avail);
+
+/**
+ * @brief Work run on a loop's thread
+ */
+typedef void (*mw_task_fn)(void *ctx);
+
+/**
+ * @brief A descriptor's registration with a loop, shared by its read and
+ *        write sources
+ *
+ * Sockets are registered once, for both directions, and we keep their
+ * readiness here: a direction is ready from the event that reports it until
+ * a handler finds it would block.  Under epoll the events are edges of an
+ * edge-triggered registration.  Under io_uring they are completions: of a
+ * multishot poll for writes, and for reads of the receives themselves, or of
+ * a multishot accept on a listening socket.  Regular files are always ready.
+ */
+typedef struct _mw_evfd {
+    int fd;
+    mw_evfd_kind kind;      ///< what fd is
+    bool polled;            ///< is fd registered with the loop?
+    bool readable;          ///< can a read make progress?
+    bool writable;          ///< can a write make progress?
+    struct _mw_ev *rd, *wr; ///< the sources on fd, or NULL
+    struct _mw_evreg *reg;  ///< io_uring: its requests in the kernel
+} mw_evfd;
+
+/**
+ * @brief An event source: like a dispatch source, it calls its handler for
+ *        as long as it is enabled and its descriptor is ready
+ *
+ * A zeroed source is deleted.
+ */
+typedef struct _mw_ev {
+    struct _mw_ev *prev;     ///< in the loop's ready list, NULL when not
+    struct _mw_ev *next;     ///< in the loop's ready list, NULL when not
+    struct _mw_evloop *loop; ///< the loop it belongs to
+    mw_evfd *efd;            ///< its descriptor
+    bool write;              ///< for writes, or reads?
+    bool enabled;            ///< is the handler called when ready?
+    mw_ev_fn fn;             ///< the handler, NULL once deleted
+    void *ctx;               ///< for fn
+    mw_task_fn cancel;       ///< called when it is deleted, or NULL
+    void *cancel_ctx;        ///< for cancel
+} mw_ev;
+
+/**
+ * @brief A task to run at the end of a loop's pass, kept in whatever it works
+ *        on
+ */
+typedef struct _mw_evtask {
+    struct _mw_evtask *next; ///< in the loop's deferred list
+    mw_task_fn fn;
+    void *ctx;
+} mw_evtask;
+
+/**
+ * @brief CPU-heavy work a loop hands out, kept in whatever it works on
+ *
+ * fn runs on whichever loop of the group gets to it first, so it may only
+ * touch what the job owns; done then runs on the loop that spawned it, where
+ * the connection lives.
+ */
+typedef struct _mw_job {
+    struct _mw_job *next;      ///< in its strand, in spawn order
+    struct _mw_job *done_next; ///< in its loop's list of finished jobs
+    mw_task_fn fn;             ///< the work
+    mw_task_fn done;           ///< called once fn has run, or NULL
+    void *ctx;                 ///< for fn and done
+    struct _mw_evloop *loop;   ///< the loop that spawned it
+    struct _mw_strand *strand; ///< the strand it is in, or NULL
+    bool finished;             ///< has fn run? (on loop's thread)
+} mw_job;
+
+/**
+ * @brief Jobs whose done must be called in the order they were spawned,
+ *        such as the chunks of one response
+ *
+ * The jobs run in parallel; a finished job's done waits for those spawned
+ * before it.  A strand belongs to one loop, and must be idle before it is
+ * freed, which the done of its last job may do.
+ */
+typedef struct _mw_strand {
+    mw_job *head; ///< the oldest job whose done hasn't been called
+    mw_job *tail; ///< the newest
+} mw_strand;
+
+/**
+ * @brief Loops that steal each other's jobs
+ *
+ * A loop runs one of its own jobs a pass, between its handlers; one with
+ * nothing to do steals from the others before it sleeps, and spawning a job
+ * wakes a sleeping loop to come and steal it.
+ */
+typedef struct _mw_evgroup {
+    struct _mw_evloop *loops[MW_EVGROUP_MAX];
+    int n; ///< loops in the group
+} mw_evgroup;
+
+/**
+ * @brief One thread, its epoll set or io_uring, and the sources registered
+ *        with it
+ *
+ * Everything about a loop belongs to its thread, so nothing in it is
+ * locked, and sources are enabled and disabled without a system call.  A
+ * pass waits for the kernel's events, calls the handlers of the ready
+ * sources, turns the tick, and runs the deferred tasks.  With io_uring the
+ * pass's one system call also submits every registration, receive and
+ * cancellation the last pass asked for.
+ */
+typedef struct _mw_evloop {
+    int id;                  ///< for thread names
+    int backend;             ///< MW_EVLOOP_EPOLL or MW_EVLOOP_URING
+    int epfd;                ///< the epoll set, or -1
+    struct _mw_evring *ring; ///< the io_uring, or NULL
+    pthread_t thread;        ///< runs mw_evloop_poll, once started
+    mw_ev ready;             ///< head of the list of sources to call next pass
+    mw_evtask *deferred;     ///< to run at the end of this pass
+
+    unsigned tick_ms;   ///< period of tick, 0 for none
+    uint64_t next_tick; ///< when tick is next due, in ms on mw_clock
+    mw_task_fn tick;    ///< called every tick_ms
+    void *tick_ctx;     ///< for tick
+
+    mw_deque *jobs;     ///< jobs spawned here and not yet taken
+    mw_job *finished;   ///< jobs other loops ran, for done to be called
+    mw_evgroup *group;  ///< the loops it shares jobs with, or NULL
+    int steal_from;     ///< the loop in group to try stealing from first
+    bool asleep;        ///< waiting in the kernel, to be woken for jobs?
+    int wake_fd;        ///< eventfd other loops wake it with, or -1
+    mw_evfd wake_io;    ///< wake_fd's registration
+    mw_ev wake_ev;      ///< reads wake_fd
+
+    size_t passes;  ///< passes so far
+    size_t wakeups; ///< kernel events taken
+    size_t calls;   ///< handlers called
+    size_t ran;     ///< jobs run, stolen ones included
+    size_t stolen;  ///< jobs stolen from other loops
+} mw_evloop;
+
+/**
+ * @brief Make a loop for a backend, not yet started
+ *
+ * If the kernel has no io_uring, or one too old for multishot requests and
+ * buffer rings, an io_uring loop falls back to epoll; loop->backend says
+ * which it got.
+ *
+ * @param backend The MW_EVLOOP_* backend
+ * @param id Names the loop's thread
+ *
+ * @return The loop, or NULL with errno set (ENOTSUP if the backend isn't
+ *         built in, or is libdispatch, which has no loops of its own)
+ */
+mw_evloop *mw_evloop_create(int backend, int id);
+
+/**
+ * @brief Free a loop that was never started, closing its epoll set or ring
+ *
+ * Its sources must all have been deleted.
+ */
+void mw_evloop_destroy(mw_evloop *loop);
+
+/**
+ * @brief The name of a MW_EVLOOP_* backend, for logs
+ */
+const char *mw_evloop_name(int backend);
+
+/**
+ * @brief Call fn on the loop every ms milliseconds
+ */
+void mw_evloop_set_tick(mw_evloop *loop, unsigned ms, mw_task_fn fn, void *ctx);
+
+/**
+ * @brief Run the loop on a thread of its own, pinned to a CPU
+ *
+ * @param loop The loop
+ * @param cpu The CPU to keep the thread on, or -1 to let it roam
+ *
+ * @return 0, or an errno value
+ */
+int mw_evloop_start(mw_evloop *loop, int cpu);
+
+/**
+ * @brief Run one pass of the loop
+ *
+ * mw_evloop_start's thread calls this forever; tests call it directly.
+ *
+ * @param loop The loop
+ * @param timeout_ms Longest to wait for an event, -1 for the next tick
+ *
+ * @return The number of handlers, jobs and jobs' dones called
+ */
+size_t mw_evloop_poll(mw_evloop *loop, int timeout_ms);
+
+/**
+ * @brief Run fn(ctx) on the loop's thread at the end of the current pass
+ *
+ * Freeing something a handler may still be using must wait for this.  The
+ * task must stay put until it has run.
+ */
+void mw_evloop_defer(mw_evloop *loop, mw_evtask *t, mw_task_fn fn, void *ctx);
+
+/**
+ * @brief Add a loop to a group, before it is started
+ *
+ * @return 0, or an errno value (ENOSPC if the group is full)
+ */
+int mw_evgroup_add(mw_evgroup *g, mw_evloop *loop);
+
+/**
+ * @brief Set up a strand with no jobs
+ */
+void mw_strand_init(mw_strand *s);
+
+/**
+ * @brief Has every job in the strand had its done called?
+ */
+bool mw_strand_idle(const mw_strand *s);
+
+/**
+ * @brief Hand out fn(ctx) to run on any loop in the group, then done(ctx)
+ *        here
+ *
+ * Must be called on the loop's thread.  If the loop's deque is full, fn runs
+ * here and now, and done at the end of the pass.
+ *
+ * @param loop The loop spawning it
+ * @param strand Orders done with the strand's other jobs, or NULL
+ * @param job The job, which must stay put until done has been called
+ * @param fn The work
+ * @param done Called on loop once fn has run, or NULL
+ * @param ctx For fn and done
+ */
+void mw_evloop_spawn(mw_evloop *loop,
+                     mw_strand *strand,
+                     mw_job *job,
+                     mw_task_fn fn,
+                     mw_task_fn done,
+                     void *ctx);
+
+/**
+ * @brief Set up a descriptor's registration, with no sources on it yet
+ *
+ * @param efd The registration
+ * @param fd The descriptor
+ * @param kind What it is, a mw_evfd_kind
+ */
+void mw_evfd_init(mw_evfd *efd, int fd, int kind);
+
+/**
+ * @brief Make a disabled source on efd
+ *
+ * The first source on a descriptor registers it with the loop.  A
+ * descriptor has at most one read and one write source.
+ *
+ * @param ev The source
+ * @param loop The loop to run fn on
+ * @param efd The descriptor
+ * @param write Watch for writes, or reads?
+ * @param fn The handler
+ * @param ctx For fn
+ *
+ * @return 0, or an errno if the loop can't watch the descriptor (ENOMEM when
+ *         there is no io_uring registration to be had), and there is no
+ *         source
+ */
+int mw_ev_init(mw_ev *ev,
+               mw_evloop *loop,
+               mw_evfd *efd,
+               bool write,
+               mw_ev_fn fn,
+               void *ctx);
+
+/**
+ * @brief Call fn(ctx) when the source is deleted, like a dispatch source's
+ *        cancel handler
+ */
+void mw_ev_set_cancel(mw_ev *ev, mw_task_fn fn, void *ctx);
+
+/**
+ * @brief Start calling the handler while the descriptor is ready
+ */
+void mw_ev_enable(mw_ev *ev);
+
+/**
+ * @brief Stop calling the handler, until mw_ev_enable
+ */
+void mw_ev_disable(mw_ev *ev);
+
+/**
+ * @brief Delete a source, and deregister its descriptor if it was the last
+ *        one on it
+ *
+ * Deleting a deleted source does nothing.  Under io_uring the kernel lets go
+ * of the descriptor once the requests on it are cancelled, early in the next
+ * pass, so it can be closed straight away.
+ */
+void mw_ev_delete(mw_ev *ev);
+
+/**
+ * @brief The handler found the descriptor would block (EAGAIN)
+ *
+ * The kernel says nothing more until the descriptor becomes ready again, so
+ * handlers must call this rather than just return; until they do, they are
+ * called again every pass.
+ */
+void mw_ev_blocked(mw_ev *ev);
+
+/**
+ * @brief Read from a read source's socket
+ *
+ * Under io_uring this copies out what the kernel has already received into
+ * the loop's buffer ring, and gives the buffers back; otherwise it is read.
+ *
+ * @return Bytes read, 0 at end of file, or -1 with errno set (EAGAIN when
+ *         there is nothing to read)
+ */
+ssize_t mw_ev_read(mw_ev *ev, void *buf, size_t len);
+
+/**
+ * @brief Take a connection the kernel accepted on a listening socket's read
+ *        source (io_uring's multishot accept)
+ *
+ * The socket is non-blocking and close-on-exec.  Without io_uring, accept it
+ * ourselves.
+ *
+ * @return The socket, or -1 with errno set (EAGAIN when there is none)
+ */
+int mw_ev_accepted(mw_ev *ev);
+
+___END_DECLS
+#endif /* ifndef MW_EVLOOP_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
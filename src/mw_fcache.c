@@ -0,0 +1,154 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for pread, gmtime_r, asprintf and strdup
+#endif
+#include "mw_fcache.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SF_BUCKETS 1024
+
+/* Everything below is protected by sf.lock; the table's limit is the budget
+ * in bytes
+ */
+static struct {
+    pthread_mutex_t lock;
+    size_t max_file; ///< biggest file to cache
+    mw_lru lru;
+    mw_lru_node *buckets[SF_BUCKETS];
+} sf = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static size_t sf_entry_bytes(mw_lru_node *n)
+{
+    mw_fcache_entry *e = (mw_fcache_entry *)n;
+    return sizeof(*e) + strlen(n->path) + e->hdr_len + e->len;
+}
+
+static void sf_free(mw_lru_node *n)
+{
+    mw_fcache_entry *e = (mw_fcache_entry *)n;
+    free(n->path);
+    free(e->hdr);
+    free(e->data);
+    free(e);
+}
+
+static bool sf_matches(mw_fcache_entry *e, const struct stat *sb)
+{
+    return e->ino == sb->st_ino && e->mtime == sb->st_mtime &&
+           e->size == sb->st_size;
+}
+
+static mw_fcache_entry *sf_find(const char *path)
+{
+    return (mw_fcache_entry *)mw_lru_find(&sf.lru, path);
+}
+
+/* Read a file and format its header, without sf.lock held */
+static mw_fcache_entry *sf_load(const char *path,
+                                int fd,
+                                const struct stat *sb,
+                                const char *ctype)
+{
+    mw_fcache_entry *e = calloc(1, sizeof(*e));
+    assert(e);
+    e->ino = sb->st_ino;
+    e->mtime = sb->st_mtime;
+    e->size = sb->st_size;
+    e->len = sb->st_size;
+    e->data = malloc(e->len ? e->len : 1);
+    assert(e->data);
+    size_t off = 0;
+    while (off < e->len) {
+        ssize_t rd = pread(fd, e->data + off, e->len - off, off);
+        if (rd <= 0) {
+            free(e->data);
+            free(e);
+            return NULL;
+        }
+        off += rd;
+    }
+
+    char lm[40];
+    struct tm tm;
+    strftime(lm,
+             sizeof(lm),
+             "%a, %d %b %Y %H:%M:%S GMT",
+             gmtime_r(&e->mtime, &tm));
+    int n = asprintf(&e->hdr,
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %lld\r\n"
+                     "ETag: \"%llx-%llx\"\r\n"
+                     "Last-Modified: %s\r\n",
+                     ctype,
+                     (long long)e->len,
+                     (unsigned long long)e->size,
+                     (unsigned long long)e->mtime,
+                     lm);
+    assert(n > 0);
+    e->hdr_len = n;
+    e->node.path = strdup(path);
+    assert(e->node.path);
+    e->node.refs = 1;
+    return e;
+}
+
+void mw_fcache_init(size_t budget, size_t max_file)
+{
+    pthread_mutex_lock(&sf.lock);
+    if (!sf.lru.buckets) {
+        mw_lru_init(&sf.lru, sf.buckets, SF_BUCKETS, sf_entry_bytes, sf_free);
+    }
+    sf.lru.limit = budget;
+    sf.max_file = max_file;
+    mw_lru_evict(&sf.lru);
+    pthread_mutex_unlock(&sf.lock);
+}
+
+mw_fcache_entry *mw_fcache_get(const char *path,
+                               int fd,
+                               const struct stat *sb,
+                               const char *ctype)
+{
+    pthread_mutex_lock(&sf.lock);
+    if (!sf.lru.limit || (size_t)sb->st_size > sf.max_file) {
+        pthread_mutex_unlock(&sf.lock);
+        return NULL;
+    }
+    mw_fcache_entry *e = sf_find(path);
+    if (e && sf_matches(e, sb)) {
+        mw_lru_touch(&sf.lru, &e->node);
+        e->node.refs++;
+        pthread_mutex_unlock(&sf.lock);
+        return e;
+    }
+    pthread_mutex_unlock(&sf.lock);
+
+    // the files are small, so reading one here is cheaper than going
+    // through file_b even once
+    mw_fcache_entry *n = sf_load(path, fd, sb, ctype);
+    if (!n) return NULL;
+
+    pthread_mutex_lock(&sf.lock);
+    // drop the stale entry, or the one someone else loaded meanwhile
+    if ((e = sf_find(path))) mw_lru_remove(&sf.lru, &e->node);
+    mw_lru_insert(&sf.lru, &n->node);
+    n->node.refs++;
+    mw_lru_evict(&sf.lru);
+    pthread_mutex_unlock(&sf.lock);
+    return n;
+}
+
+void mw_fcache_release(mw_fcache_entry *e)
+{
+    pthread_mutex_lock(&sf.lock);
+    mw_lru_unref(&sf.lru, &e->node);
+    pthread_mutex_unlock(&sf.lock);
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,83 @@
+#ifndef MW_FCACHE_H
+#define MW_FCACHE_H
+
+#include "config.h"
+#include "mw_lru.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief The default memory budget of the small file cache
+ */
+#define MW_FCACHE_DEFAULT_BUDGET (32 * 1024 * 1024)
+
+/**
+ * @brief The default size of the largest file the small file cache holds
+ */
+#define MW_FCACHE_DEFAULT_MAX_FILE (16 * 1024)
+
+/**
+ * @brief A small file held in memory, with its response header
+ *
+ * Entries are keyed by path, and only match while the file still has the
+ * inode, mtime and size they were made from.  An entry is reference counted,
+ * so it stays valid until mw_fcache_release even if it is evicted meanwhile.
+ */
+typedef struct _mw_fcache_entry {
+    mw_lru_node node; ///< keyed by the path of the file
+
+    ino_t ino;    ///< inode of the file
+    time_t mtime; ///< mtime of the file
+    off_t size;   ///< size of the file
+
+    /**
+     * The status line and the header fields (Content-Type, Content-Length,
+     * ETag, Last-Modified), without the blank line that ends the header, so
+     * the sender can add fields of its own
+     */
+    char *hdr;
+    size_t hdr_len;      ///< length of hdr
+    unsigned char *data; ///< the file
+    size_t len;          ///< length of data
+} mw_fcache_entry;
+
+/**
+ * @brief Set up the cache
+ *
+ * @param budget How many bytes of files and headers to keep, 0 to disable
+ * @param max_file Only files up to this size are cached
+ */
+void mw_fcache_init(size_t budget, size_t max_file);
+
+/**
+ * @brief Find a small file, reading it into the cache if it isn't there
+ *
+ * @param path The path the file was opened with
+ * @param fd The open file, read with pread if the file isn't cached
+ * @param sb The stat of the open file
+ * @param ctype The Content-Type for the header
+ *
+ * @return A referenced entry (see mw_fcache_release), or NULL if the file is
+ *         too big, or the cache is disabled
+ */
+mw_fcache_entry *mw_fcache_get(const char *path,
+                               int fd,
+                               const struct stat *sb,
+                               const char *ctype);
+
+/**
+ * @brief Drop a reference returned by mw_fcache_get
+ *
+ * @param e The entry
+ */
+void mw_fcache_release(mw_fcache_entry *e);
+
+___END_DECLS
+#endif /* ifndef MW_FCACHE_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
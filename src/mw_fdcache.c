@@ -0,0 +1,195 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for O_CLOEXEC and strdup
+#endif
+#include "mw_fdcache.h"
+#include "mw_fmt.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The cache is split by path hash into stripes, each with its own lock, LRU
+ * and share of the descriptors, so requests for different files don't
+ * queue up behind one lock
+ */
+#define FC_STRIPES 16
+#define FC_BUCKETS 64 // per stripe
+
+/* Everything in a stripe, and its entries, is protected by its lock; the
+ * table's limit is the stripe's share of the descriptors
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    int ttl; ///< seconds before an entry is checked again
+    mw_lru lru;
+    mw_lru_node *buckets[FC_BUCKETS];
+} fc_stripe;
+
+static fc_stripe fc[FC_STRIPES];
+static pthread_once_t fc_once = PTHREAD_ONCE_INIT;
+
+/* Every entry costs one descriptor */
+static size_t fc_entry_fds(__attribute__((unused)) mw_lru_node *n)
+{
+    return 1;
+}
+
+static void fc_free(mw_lru_node *n)
+{
+    mw_fdcache_entry *e = (mw_fdcache_entry *)n;
+    close(e->fd);
+    free(n->path);
+    free(e);
+}
+
+static void fc_init_stripes(void)
+{
+    for (int i = 0; i < FC_STRIPES; i++) {
+        pthread_mutex_init(&fc[i].lock, NULL);
+        fc[i].ttl = MW_FDCACHE_DEFAULT_TTL;
+        mw_lru_init(&fc[i].lru,
+                    fc[i].buckets,
+                    FC_BUCKETS,
+                    fc_entry_fds,
+                    fc_free);
+    }
+}
+
+/* The table takes its bucket from the low bits of the hash, the stripe comes
+ * from the ones above
+ */
+static unsigned fc_stripe_of(const char *path)
+{
+    return mw_lru_hash(path) / FC_BUCKETS % FC_STRIPES;
+}
+
+static mw_fdcache_entry *fc_find(fc_stripe *st, const char *path)
+{
+    return (mw_fdcache_entry *)mw_lru_find(&st->lru, path);
+}
+
+/* Does path still name the file we have open, unchanged? */
+static bool fc_still_valid(mw_fdcache_entry *e)
+{
+    struct stat sb;
+    return !stat(e->node.path, &sb) && sb.st_ino == e->sb.st_ino &&
+           sb.st_dev == e->sb.st_dev && sb.st_mtime == e->sb.st_mtime &&
+           sb.st_size == e->sb.st_size;
+}
+
+/* Open and stat path, without the stripe's lock held */
+static mw_fdcache_entry *fc_open(const char *path, unsigned stripe)
+{
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    int err = 0;
+    mw_fdcache_entry *e = calloc(1, sizeof(*e));
+    if (!e) {
+        err = ENOMEM;
+    }
+    else if (fstat(fd, &e->sb)) {
+        err = errno;
+    }
+    else if (!S_ISREG(e->sb.st_mode)) {
+        err = S_ISDIR(e->sb.st_mode) ? EISDIR : ENODEV;
+    }
+    else if (!(e->node.path = strdup(path))) {
+        err = ENOMEM;
+    }
+    if (err) {
+        close(fd);
+        free(e);
+        errno = err;
+        return NULL;
+    }
+    e->fd = fd;
+    e->stripe = stripe;
+    e->verified = mw_fmt_now();
+    e->node.refs = 1;
+    return e;
+}
+
+void mw_fdcache_init(size_t max_fds, int ttl)
+{
+    pthread_once(&fc_once, fc_init_stripes);
+    for (int i = 0; i < FC_STRIPES; i++) {
+        fc_stripe *st = &fc[i];
+        pthread_mutex_lock(&st->lock);
+        st->lru.limit = (max_fds + FC_STRIPES - 1) / FC_STRIPES;
+        st->ttl = ttl;
+        mw_lru_evict(&st->lru);
+        pthread_mutex_unlock(&st->lock);
+    }
+}
+
+mw_fdcache_entry *mw_fdcache_open(const char *path)
+{
+    pthread_once(&fc_once, fc_init_stripes);
+    time_t now = mw_fmt_now();
+    unsigned stripe = fc_stripe_of(path);
+    fc_stripe *st = &fc[stripe];
+    pthread_mutex_lock(&st->lock);
+    mw_fdcache_entry *e = st->lru.limit ? fc_find(st, path) : NULL;
+    if (e) {
+        mw_lru_touch(&st->lru, &e->node);
+        e->node.refs++;
+        if (now - e->verified < st->ttl) {
+            pthread_mutex_unlock(&st->lock);
+            return e;
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+
+    // the entry is stale: check it, or open the file, without the lock held
+    if (e) {
+        if (fc_still_valid(e)) {
+            pthread_mutex_lock(&st->lock);
+            e->verified = now;
+            pthread_mutex_unlock(&st->lock);
+            return e;
+        }
+        pthread_mutex_lock(&st->lock);
+        if (!e->node.dead) mw_lru_remove(&st->lru, &e->node);
+        mw_lru_unref(&st->lru, &e->node);
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    mw_fdcache_entry *n = fc_open(path, stripe);
+    if (!n) return NULL;
+
+    pthread_mutex_lock(&st->lock);
+    if (st->lru.limit) {
+        // someone else may have opened it meanwhile, ours is as new as theirs
+        if ((e = fc_find(st, path))) mw_lru_remove(&st->lru, &e->node);
+        n->node.refs++;
+        mw_lru_insert(&st->lru, &n->node);
+        mw_lru_evict(&st->lru);
+    }
+    else {
+        // not cached, closed on release
+        n->node.dead = true;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return n;
+}
+
+void mw_fdcache_retain(mw_fdcache_entry *e)
+{
+    fc_stripe *st = &fc[e->stripe];
+    pthread_mutex_lock(&st->lock);
+    e->node.refs++;
+    pthread_mutex_unlock(&st->lock);
+}
+
+void mw_fdcache_release(mw_fdcache_entry *e)
+{
+    fc_stripe *st = &fc[e->stripe];
+    pthread_mutex_lock(&st->lock);
+    mw_lru_unref(&st->lru, &e->node);
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
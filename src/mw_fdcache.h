@@ -0,0 +1,79 @@
+#ifndef MW_FDCACHE_H
+#define MW_FDCACHE_H
+
+#include "config.h"
+#include "mw_lru.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief The default number of descriptors the cache keeps open
+ */
+#define MW_FDCACHE_DEFAULT_MAX 1024
+
+/**
+ * @brief The default number of seconds an entry is trusted without a stat
+ */
+#define MW_FDCACHE_DEFAULT_TTL 2
+
+/**
+ * @brief An open file, shared by every request for it
+ *
+ * Entries are keyed by path.  The descriptor is shared, so it must only be
+ * read with pread/preadv (or sendfile with an offset), never with read.  An
+ * entry is reference counted, so it stays open until mw_fdcache_release even
+ * if it is evicted meanwhile.
+ */
+typedef struct _mw_fdcache_entry {
+    mw_lru_node node; ///< keyed by the path the file was opened with
+
+    int fd;          ///< read only, non-blocking
+    struct stat sb;  ///< the stat of fd
+    time_t verified; ///< when path was last checked to still be this file
+
+    unsigned stripe; ///< the part of the cache, and the lock, it is in
+} mw_fdcache_entry;
+
+/**
+ * @brief Set up the cache
+ *
+ * @param max_fds How many descriptors to keep open, 0 to disable.  The cache
+ *        is split by path into parts with a lock each, which share these
+ *        out evenly, so a few more may be kept.
+ * @param ttl How many seconds to trust an entry before checking the path
+ *        again with stat
+ */
+void mw_fdcache_init(size_t max_fds, int ttl);
+
+/**
+ * @brief Open a regular file, or find it already open
+ *
+ * @param path The file to open
+ *
+ * @return A referenced entry (see mw_fdcache_release), or NULL with errno set
+ *         (EISDIR for directories, ENODEV for other non regular files)
+ */
+mw_fdcache_entry *mw_fdcache_open(const char *path);
+
+/**
+ * @brief Take another reference to an entry
+ *
+ * @param e The entry
+ */
+void mw_fdcache_retain(mw_fdcache_entry *e);
+
+/**
+ * @brief Drop a reference returned by mw_fdcache_open or mw_fdcache_retain
+ *
+ * @param e The entry
+ */
+void mw_fdcache_release(mw_fdcache_entry *e);
+
+___END_DECLS
+#endif /* ifndef MW_FDCACHE_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,255 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for gmtime_r
+#endif
+#include "mw_fmt.h"
+#include <dispatch/dispatch.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+/* The cached strings for one second.  Readers use the seqlock: an odd seq
+ * means an update is under way, and a seq that changed while reading means
+ * the copy has to be made again.
+ */
+static struct {
+    _Atomic unsigned seq;
+    _Atomic time_t sec;
+    char clf[MW_FMT_CLF_LEN];
+    char http[MW_FMT_HTTP_LEN];
+    bool timer; ///< is the once a second timer running?
+} tc;
+
+static const char days[7][4] = {"Sun",
+                                "Mon",
+                                "Tue",
+                                "Wed",
+                                "Thu",
+                                "Fri",
+                                "Sat"};
+static const char months[12][4] = {"Jan",
+                                   "Feb",
+                                   "Mar",
+                                   "Apr",
+                                   "May",
+                                   "Jun",
+                                   "Jul",
+                                   "Aug",
+                                   "Sep",
+                                   "Oct",
+                                   "Nov",
+                                   "Dec"};
+
+static char *put2(char *p, int v)
+{
+    *p++ = '0' + v / 10;
+    *p++ = '0' + v % 10;
+    return p;
+}
+
+static char *put4(char *p, int v)
+{
+    p = put2(p, v / 100);
+    return put2(p, v % 100);
+}
+
+static void fmt_clf(const struct tm *tm, char *out)
+{
+    char *p = put2(out, tm->tm_mday);
+    *p++ = '/';
+    memcpy(p, months[tm->tm_mon], 3);
+    p += 3;
+    *p++ = '/';
+    p = put4(p, tm->tm_year + 1900);
+    *p++ = ':';
+    p = put2(p, tm->tm_hour);
+    *p++ = ':';
+    p = put2(p, tm->tm_min);
+    *p++ = ':';
+    p = put2(p, tm->tm_sec);
+    memcpy(p, " +0", 3);
+}
+
+static void fmt_http(const struct tm *tm, char *out)
+{
+    memcpy(out, days[tm->tm_wday], 3);
+    char *p = out + 3;
+    *p++ = ',';
+    *p++ = ' ';
+    p = put2(p, tm->tm_mday);
+    *p++ = ' ';
+    memcpy(p, months[tm->tm_mon], 3);
+    p += 3;
+    *p++ = ' ';
+    p = put4(p, tm->tm_year + 1900);
+    *p++ = ' ';
+    p = put2(p, tm->tm_hour);
+    *p++ = ':';
+    p = put2(p, tm->tm_min);
+    *p++ = ':';
+    p = put2(p, tm->tm_sec);
+    memcpy(p, " GMT", 4);
+}
+
+/* Only the timer (or, before there is one, any reader that sees a stale
+ * second) updates the cache; two updating at once just write the same
+ * strings.
+ */
+static void tc_update(void)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+
+    atomic_fetch_add_explicit(&tc.seq, 1, memory_order_acq_rel);
+    fmt_clf(&tm, tc.clf);
+    fmt_http(&tm, tc.http);
+    atomic_store_explicit(&tc.sec, now, memory_order_relaxed);
+    atomic_fetch_add_explicit(&tc.seq, 1, memory_order_release);
+}
+
+/* Copy len bytes of the cached string src, returning the second it is for
+ */
+static time_t tc_read(const char *src, char *out, size_t len)
+{
+    unsigned s0, s1;
+    time_t sec;
+    do {
+        s0 = atomic_load_explicit(&tc.seq, memory_order_acquire);
+        sec = atomic_load_explicit(&tc.sec, memory_order_relaxed);
+        memcpy(out, src, len);
+        atomic_thread_fence(memory_order_acquire);
+        s1 = atomic_load_explicit(&tc.seq, memory_order_relaxed);
+    } while ((s0 & 1) || s0 != s1);
+    return sec;
+}
+
+void mw_fmt_init(void)
+{
+    tc_update();
+    dispatch_source_t t = dispatch_source_create(
+        DISPATCH_SOURCE_TYPE_TIMER,
+        0,
+        0,
+        dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
+    dispatch_source_set_timer(t,
+                              dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC),
+                              NSEC_PER_SEC,
+                              NSEC_PER_SEC / 100);
+    dispatch_source_set_event_handler_f(t, (dispatch_function_t)tc_update);
+    dispatch_resume(t);
+    tc.timer = true;
+}
+
+time_t mw_fmt_now(void)
+{
+    if (!tc.timer) tc_update();
+    return atomic_load_explicit(&tc.sec, memory_order_relaxed);
+}
+
+void mw_fmt_clf(time_t t, char *out)
+{
+    if (!tc.timer && t != atomic_load(&tc.sec)) tc_update();
+    if (tc_read(tc.clf, out, MW_FMT_CLF_LEN) == t) return;
+
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    fmt_clf(&tm, out);
+}
+
+void mw_fmt_http_now(char *out)
+{
+    if (!tc.timer) tc_update();
+    tc_read(tc.http, out, MW_FMT_HTTP_LEN);
+}
+
+static char *put_dec(char *p, unsigned v)
+{
+    if (v >= 100) *p++ = '0' + v / 100;
+    if (v >= 10) *p++ = '0' + v / 10 % 10;
+    *p++ = '0' + v % 10;
+    return p;
+}
+
+static char *put_ipv4(char *p, const unsigned char *a)
+{
+    for (int i = 0; i < 4; i++) {
+        if (i) *p++ = '.';
+        p = put_dec(p, a[i]);
+    }
+    return p;
+}
+
+static char *put_hex16(char *p, unsigned v)
+{
+    static const char hex[] = "0123456789abcdef";
+    bool started = false;
+    for (int shift = 12; shift >= 0; shift -= 4) {
+        unsigned d = (v >> shift) & 0xf;
+        if (d || started || shift == 0) {
+            *p++ = hex[d];
+            started = true;
+        }
+    }
+    return p;
+}
+
+static char *put_ipv6(char *p, const unsigned char *a)
+{
+    static const unsigned char mapped[12] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    if (!memcmp(a, mapped, sizeof(mapped))) {
+        memcpy(p, "::ffff:", 7);
+        return put_ipv4(p + 7, a + 12);
+    }
+
+    unsigned w[8];
+    for (int i = 0; i < 8; i++) w[i] = a[2 * i] << 8 | a[2 * i + 1];
+
+    // the longest run of two or more zero words becomes "::"
+    int best = -1, best_len = 1;
+    for (int i = 0; i < 8;) {
+        if (w[i]) {
+            i++;
+            continue;
+        }
+        int j = i;
+        while (j < 8 && !w[j]) j++;
+        if (j - i > best_len) {
+            best = i;
+            best_len = j - i;
+        }
+        i = j;
+    }
+
+    for (int i = 0; i < 8; i++) {
+        if (i == best) {
+            *p++ = ':';
+            if (i == 0) *p++ = ':';
+            i += best_len - 1;
+            continue;
+        }
+        p = put_hex16(p, w[i]);
+        if (i < 7) *p++ = ':';
+    }
+    return p;
+}
+
+size_t mw_fmt_addr(int af, const void *addr, char *out)
+{
+    char *p = out;
+    if (af == AF_INET) {
+        p = put_ipv4(p, addr);
+    }
+    else if (af == AF_INET6) {
+        p = put_ipv6(p, ((const struct in6_addr *)addr)->s6_addr);
+    }
+    else {
+        *p++ = '?';
+    }
+    return p - out;
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,71 @@
+#ifndef MW_FMT_H
+#define MW_FMT_H
+
+#include "config.h"
+#include <stddef.h>
+#include <time.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief Length of an access log timestamp, "18/Oct/2026:09:12:44 +0"
+ */
+#define MW_FMT_CLF_LEN 23
+
+/**
+ * @brief Length of an HTTP date, "Sun, 18 Oct 2026 09:12:44 GMT"
+ */
+#define MW_FMT_HTTP_LEN 29
+
+/**
+ * @brief Room for any address mw_fmt_addr writes (INET6_ADDRSTRLEN)
+ */
+#define MW_FMT_ADDR_MAX 46
+
+/**
+ * @brief Start refreshing the cached time once a second
+ *
+ * Until this is called the cached time is refreshed whenever it is read.
+ */
+void mw_fmt_init(void);
+
+/**
+ * @brief The current time, to the second, without a system call
+ */
+time_t mw_fmt_now(void);
+
+/**
+ * @brief Write an access log timestamp
+ *
+ * The current second comes from the cache, others are formatted.
+ *
+ * @param t The time
+ * @param out Room for MW_FMT_CLF_LEN bytes, not NUL terminated
+ */
+void mw_fmt_clf(time_t t, char *out);
+
+/**
+ * @brief Write the current time as an HTTP date, from the cache
+ *
+ * @param out Room for MW_FMT_HTTP_LEN bytes, not NUL terminated
+ */
+void mw_fmt_http_now(char *out);
+
+/**
+ * @brief Write an address in its text form, like inet_ntop
+ *
+ * IPv6 addresses use the RFC 5952 form (lower case, longest run of zeroes
+ * as "::"), with IPv4-mapped addresses written as ::ffff:a.b.c.d.
+ *
+ * @param af AF_INET or AF_INET6
+ * @param addr A struct in_addr or struct in6_addr
+ * @param out Room for MW_FMT_ADDR_MAX bytes, not NUL terminated
+ *
+ * @return The number of bytes written
+ */
+size_t mw_fmt_addr(int af, const void *addr, char *out);
+
+___END_DECLS
+#endif /* ifndef MW_FMT_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
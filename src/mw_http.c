@@ -0,0 +1,259 @@
+#include "mw_http.h"
+#include "mw_scan.h"
+#include <string.h>
+#include <strings.h>
+
+enum {
+    S_START,         // skipping blank lines before the request
+    S_METHOD,        // in the method
+    S_TARGET_START,  // after the method's SP
+    S_TARGET,        // in the request-target
+    S_VERSION,       // in the HTTP-version
+    S_RL_LF,         // after the request line's CR
+    S_HDR_START,     // at the start of a header line
+    S_HDR_NAME,      // in a field name
+    S_HDR_OWS,       // after the ':', before the value
+    S_HDR_VALUE,     // in a field value
+    S_HDR_LF,        // after a header line's CR
+    S_END_LF,        // after the CR of the blank line
+    S_DONE,          // finished, until mw_http_init
+};
+
+/* RFC 7230 tchar */
+static bool is_tchar(unsigned char ch)
+{
+    if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+        (ch >= '0' && ch <= '9')) {
+        return true;
+    }
+    return ch && strchr("!#$%&'*+-.^_`|~", ch);
+}
+
+static mw_span span(size_t from, size_t to)
+{
+    mw_span sp = {(uint32_t)from, (uint32_t)(to - from)};
+    return sp;
+}
+
+static bool parse_version(mw_http_parser *p, const char *buf)
+{
+    const char *v = buf + p->version.off;
+    if (p->version.len != 8 || memcmp(v, "HTTP/1.", 7) || v[7] < '0' ||
+        v[7] > '9') {
+        return false;
+    }
+    p->minor = v[7] - '0';
+    return true;
+}
+
+void mw_http_init(mw_http_parser *p, size_t start)
+{
+    memset(p, 0, sizeof(*p));
+    p->state = S_START;
+    p->pos = start;
+}
+
+mw_http_status mw_http_parse(mw_http_parser *p, const char *buf, size_t len)
+{
+    if (p->state == S_DONE) return MW_HTTP_DONE;
+
+    for (; p->pos < len; p->pos++) {
+        unsigned char ch = buf[p->pos];
+        switch (p->state) {
+        case S_START:
+            // RFC 7230 3.5: ignore empty lines before a request
+            if (ch == '\r' || ch == '\n') break;
+            if (!is_tchar(ch)) return MW_HTTP_ERROR;
+            p->tok = p->req_line.off = p->pos;
+            p->state = S_METHOD;
+            break;
+        case S_METHOD:
+            if (ch == ' ') {
+                p->method = span(p->tok, p->pos);
+                p->state = S_TARGET_START;
+            }
+            else if (!is_tchar(ch)) {
+                return MW_HTTP_ERROR;
+            }
+            break;
+        case S_TARGET_START:
+            if (ch <= ' ' || ch == 0x7f) return MW_HTTP_ERROR;
+            p->tok = p->pos;
+            p->state = S_TARGET;
+            break;
+        case S_TARGET:
+            if (ch == ' ') {
+                p->target = span(p->tok, p->pos);
+                p->tok = p->pos + 1;
+                p->state = S_VERSION;
+            }
+            else if (ch < ' ' || ch == 0x7f) {
+                return MW_HTTP_ERROR;
+            }
+            break;
+        case S_VERSION:
+            if (ch == '\r' || ch == '\n') {
+                p->version = span(p->tok, p->pos);
+                p->req_line.len = p->pos - p->req_line.off;
+                if (!parse_version(p, buf)) return MW_HTTP_ERROR;
+                p->state = ch == '\r' ? S_RL_LF : S_HDR_START;
+            }
+            break;
+        case S_RL_LF:
+        case S_HDR_LF:
+            if (ch != '\n') return MW_HTTP_ERROR;
+            p->state = S_HDR_START;
+            break;
+        case S_HDR_START:
+            if (ch == '\r') {
+                p->state = S_END_LF;
+            }
+            else if (ch == '\n') {
+                goto done;
+            }
+            else if (is_tchar(ch)) {
+                // (obsolete line folding starts with SP or HT, and is refused)
+                if (p->n_headers == MW_HTTP_MAX_HEADERS) return MW_HTTP_ERROR;
+                p->tok = p->pos;
+                p->state = S_HDR_NAME;
+            }
+            else {
+                return MW_HTTP_ERROR;
+            }
+            break;
+        case S_HDR_NAME: {
+            // find the ':' in one go, then check what we skipped over
+            size_t d = p->pos + mw_scan_delim(buf + p->pos, len - p->pos);
+            for (; p->pos < d; p->pos++) {
+                if (!is_tchar(buf[p->pos])) return MW_HTTP_ERROR;
+            }
+            if (d == len) {
+                p->pos = len - 1;
+                break;
+            }
+            if (buf[d] != ':') return MW_HTTP_ERROR;
+            p->headers[p->n_headers].name = span(p->tok, p->pos);
+            p->state = S_HDR_OWS;
+            break;
+        }
+        case S_HDR_OWS:
+            if (ch == ' ' || ch == '\t') break;
+            p->tok = p->pos;
+            p->state = S_HDR_VALUE;
+            // the value may be empty, so look for the line end right away
+            // fall through
+        case S_HDR_VALUE: {
+            // skip to the end of the line in one go
+            size_t eol = p->pos + mw_scan_eol(buf + p->pos, len - p->pos);
+            if (eol == len) {
+                p->pos = len - 1;
+                break;
+            }
+            p->pos = eol;
+            size_t v_end = p->pos;
+            while (v_end > p->tok &&
+                   (buf[v_end - 1] == ' ' || buf[v_end - 1] == '\t')) {
+                v_end--;
+            }
+            p->headers[p->n_headers++].value = span(p->tok, v_end);
+            p->state = buf[eol] == '\r' ? S_HDR_LF : S_HDR_START;
+            break;
+        }
+        case S_END_LF:
+            if (ch != '\n') return MW_HTTP_ERROR;
+            goto done;
+        }
+    }
+    return MW_HTTP_AGAIN;
+
+done:
+    p->end = ++p->pos;
+    p->state = S_DONE;
+    return MW_HTTP_DONE;
+}
+
+bool mw_span_eq(const char *buf, mw_span sp, const char *str)
+{
+    return strlen(str) == sp.len && !memcmp(buf + sp.off, str, sp.len);
+}
+
+const mw_http_header *mw_http_find(const mw_http_parser *p,
+                                   const char *buf,
+                                   const char *name)
+{
+    size_t l = strlen(name);
+    for (int i = 0; i < p->n_headers; i++) {
+        const mw_http_header *h = &p->headers[i];
+        if (h->name.len == l && !strncasecmp(buf + h->name.off, name, l)) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+bool mw_span_has_token(const char *buf, mw_span sp, const char *tok)
+{
+    size_t l = strlen(tok);
+    const char *s = buf + sp.off, *end = s + sp.len;
+    while (s < end) {
+        while (s < end && (*s == ' ' || *s == '\t' || *s == ',')) s++;
+        const char *t = s;
+        while (s < end && *s != ',' && *s != ';' && *s != ' ' && *s != '\t') {
+            s++;
+        }
+        if ((size_t)(s - t) == l && !strncasecmp(t, tok, l)) return true;
+        while (s < end && *s != ',') s++;
+    }
+    return false;
+}
+
+/* A qvalue at *sp, "0" to "1.000", in thousandths; *sp is moved past it */
+static int qvalue(const char **sp, const char *end)
+{
+    const char *s = *sp;
+    int q = 0;
+    if (s < end && (*s == '0' || *s == '1')) q = (*s++ - '0') * 1000;
+    if (s < end && *s == '.') {
+        s++;
+        for (int scale = 100; s < end && *s >= '0' && *s <= '9'; s++) {
+            q += (*s - '0') * scale;
+            scale /= 10;
+        }
+    }
+    *sp = s;
+    return q > 1000 ? 1000 : q;
+}
+
+int mw_span_token_q(const char *buf, mw_span sp, const char *tok)
+{
+    size_t l = strlen(tok);
+    int q = -1, star = -1;
+    const char *s = buf + sp.off, *end = s + sp.len;
+    while (s < end) {
+        while (s < end && (*s == ' ' || *s == '\t' || *s == ',')) s++;
+        const char *t = s;
+        while (s < end && *s != ',' && *s != ';' && *s != ' ' && *s != '\t') {
+            s++;
+        }
+        size_t t_len = s - t;
+        int v = 1000;
+        // the parameters, up to the next element
+        while (s < end && *s != ',') {
+            if (*s++ != ';') continue;
+            while (s < end && (*s == ' ' || *s == '\t')) s++;
+            if (end - s > 1 && (*s == 'q' || *s == 'Q') && s[1] == '=') {
+                s += 2;
+                v = qvalue(&s, end);
+            }
+        }
+        if (t_len == l && !strncasecmp(t, tok, l)) {
+            q = v;
+        }
+        else if (t_len == 1 && *t == '*') {
+            star = v;
+        }
+    }
+    return q >= 0 ? q : star;
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,125 @@
+#ifndef MW_HTTP_H
+#define MW_HTTP_H
+
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief The most header fields we record for one request
+ */
+#define MW_HTTP_MAX_HEADERS 64
+
+/**
+ * @brief A run of bytes in the buffer being parsed
+ *
+ * Spans are offsets rather than pointers, so they stay valid when the buffer
+ * is moved.
+ */
+typedef struct {
+    uint32_t off; ///< offset of the first byte
+    uint32_t len; ///< number of bytes
+} mw_span;
+
+/**
+ * @brief One header field
+ */
+typedef struct {
+    mw_span name;  ///< the field name
+    mw_span value; ///< the field value, without surrounding whitespace
+} mw_http_header;
+
+typedef enum {
+    MW_HTTP_DONE,  ///< a whole request has been parsed
+    MW_HTTP_AGAIN, ///< the request is incomplete, parse again after reading
+    MW_HTTP_ERROR, ///< the request is malformed (or has too many headers)
+} mw_http_status;
+
+/**
+ * @brief An incremental HTTP/1.x request parser
+ *
+ * The parser works in place over the caller's buffer and copies nothing.  It
+ * can be called again each time more bytes arrive, and picks up where it left
+ * off.  Bytes after the end of the request (pipelined requests) are left
+ * alone, starting at end.
+ */
+typedef struct _mw_http_parser {
+    int state;  ///< where we are in the request
+    size_t pos; ///< the next byte to look at
+    size_t tok; ///< start of the token being parsed
+
+    mw_span method;   ///< e.g. "GET"
+    mw_span target;   ///< the request-target, e.g. "/index.html?x=1"
+    mw_span version;  ///< e.g. "HTTP/1.1"
+    mw_span req_line; ///< the whole request line, without the line end
+    int minor;        ///< x in HTTP/1.x
+
+    mw_http_header headers[MW_HTTP_MAX_HEADERS];
+    int n_headers;
+
+    size_t end; ///< one past the blank line ending the request, once DONE
+} mw_http_parser;
+
+/**
+ * @brief Get a parser ready for a request starting at offset start
+ *
+ * @param p The parser
+ * @param start Where the request starts in the buffer
+ */
+void mw_http_init(mw_http_parser *p, size_t start);
+
+/**
+ * @brief Parse as much of a request as buf holds
+ *
+ * @param p The parser
+ * @param buf The buffer, the same one (or a moved copy) on every call
+ * @param len How many bytes of buf are filled in
+ *
+ * @return Whether the request is complete, incomplete, or malformed
+ */
+mw_http_status mw_http_parse(mw_http_parser *p, const char *buf, size_t len);
+
+/**
+ * @brief Find a header field by name (case insensitively)
+ *
+ * @param p The parser, after MW_HTTP_DONE
+ * @param buf The parsed buffer
+ * @param name The field name
+ *
+ * @return The first matching field, or NULL
+ */
+const mw_http_header *mw_http_find(const mw_http_parser *p,
+                                   const char *buf,
+                                   const char *name);
+
+/**
+ * @brief Does a span hold exactly str?
+ */
+bool mw_span_eq(const char *buf, mw_span sp, const char *str);
+
+/**
+ * @brief Does a comma separated list span hold the token tok?
+ *
+ * Parameters after a ';' (such as q-values) are ignored.
+ */
+bool mw_span_has_token(const char *buf, mw_span sp, const char *tok);
+
+/**
+ * @brief The q-value a comma separated list span, such as Accept-Encoding,
+ *        gives the token tok
+ *
+ * A token without a q parameter has q=1.  A token the list doesn't name gets
+ * the q-value of "*", if the list has it.
+ *
+ * @return The q-value in thousandths, 0 to 1000, or -1 if the list names
+ *         neither tok nor "*"
+ */
+int mw_span_token_q(const char *buf, mw_span sp, const char *tok);
+
+___END_DECLS
+#endif /* ifndef MW_HTTP_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,98 @@
+/*
+ * mw_logcat: print binary access logs (see mw_alog_bin_batch) in the text
+ * format miniweb writes otherwise.
+ *
+ *     mw_logcat [file ...]
+ *
+ * With no files, or a file of "-", it reads standard input.
+ */
+#include "mw_alog.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool read_all(FILE *f, void *buf, size_t len)
+{
+    return fread(buf, 1, len, f) == len;
+}
+
+static int logcat(FILE *f, const char *name)
+{
+    mw_alog_bin_batch b;
+    mw_alog_bin_rec *recs = NULL;
+    char *strs = NULL;
+    char line[MW_ALOG_LINE_MAX];
+    int rc = 0;
+
+    while (read_all(f, &b, sizeof(b))) {
+        if (b.magic != MW_ALOG_BIN_MAGIC) {
+            fprintf(stderr, "%s: not a miniweb binary log\n", name);
+            rc = 1;
+            break;
+        }
+        recs = realloc(recs, b.n_recs * sizeof(*recs) + 1);
+        strs = realloc(strs, b.str_len + 1);
+        if (!recs || !strs) {
+            perror(name);
+            rc = 1;
+            break;
+        }
+        if (!read_all(f, recs, b.n_recs * sizeof(*recs)) ||
+            !read_all(f, strs, b.str_len)) {
+            fprintf(stderr, "%s: truncated batch\n", name);
+            rc = 1;
+            break;
+        }
+        for (uint32_t i = 0; i < b.n_recs; i++) {
+            mw_alog_bin_rec *br = &recs[i];
+            mw_alog_rec rec = {
+                .when = br->when,
+                .status = br->status,
+                .total_written = br->total_written,
+                .latency_us = br->latency_us,
+            };
+            memcpy(&rec.addr, br->addr, sizeof(br->addr));
+            if (br->rl_len > MW_ALOG_RL_MAX ||
+                (uint64_t)br->rl_off + br->rl_len > b.str_len) {
+                fprintf(stderr, "%s: bad record\n", name);
+                rc = 1;
+                continue;
+            }
+            rec.rl_len = br->rl_len;
+            memcpy(rec.rl, strs + br->rl_off, br->rl_len);
+            fwrite(line, 1, mw_alog_format_line(&rec, line), stdout);
+        }
+        if (b.drops) printf("# dropped %u log records\n", b.drops);
+    }
+    if (ferror(f)) {
+        perror(name);
+        rc = 1;
+    }
+    free(recs);
+    free(strs);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) return logcat(stdin, "-");
+
+    int rc = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-")) {
+            rc |= logcat(stdin, "-");
+            continue;
+        }
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) {
+            perror(argv[i]);
+            rc = 1;
+            continue;
+        }
+        rc |= logcat(f, argv[i]);
+        fclose(f);
+    }
+    return rc;
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
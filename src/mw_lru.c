@@ -0,0 +1,99 @@
+#include "mw_lru.h"
+#include <assert.h>
+#include <string.h>
+
+size_t mw_lru_hash(const char *path)
+{
+    size_t h = 2166136261u;
+    for (; *path; path++) {
+        h ^= (unsigned char)*path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void mw_lru_init(mw_lru *t,
+                 mw_lru_node **buckets,
+                 size_t n_buckets,
+                 size_t (*cost)(mw_lru_node *n),
+                 void (*free)(mw_lru_node *n))
+{
+    memset(t, 0, sizeof(*t));
+    t->buckets = buckets;
+    t->n_buckets = n_buckets;
+    t->cost = cost;
+    t->free = free;
+}
+
+static mw_lru_node **lru_bucket(mw_lru *t, const char *path)
+{
+    return &t->buckets[mw_lru_hash(path) % t->n_buckets];
+}
+
+static void lru_unlink(mw_lru *t, mw_lru_node *n)
+{
+    if (n->lru_prev) n->lru_prev->lru_next = n->lru_next;
+    else t->head = n->lru_next;
+    if (n->lru_next) n->lru_next->lru_prev = n->lru_prev;
+    else t->tail = n->lru_prev;
+    n->lru_prev = n->lru_next = NULL;
+}
+
+static void lru_push(mw_lru *t, mw_lru_node *n)
+{
+    n->lru_next = t->head;
+    if (t->head) t->head->lru_prev = n;
+    t->head = n;
+    if (!t->tail) t->tail = n;
+}
+
+mw_lru_node *mw_lru_find(mw_lru *t, const char *path)
+{
+    mw_lru_node *n = *lru_bucket(t, path);
+    while (n && strcmp(n->path, path)) n = n->h_next;
+    return n;
+}
+
+void mw_lru_insert(mw_lru *t, mw_lru_node *n)
+{
+    mw_lru_node **b = lru_bucket(t, n->path);
+    n->h_next = *b;
+    *b = n;
+    lru_push(t, n);
+    t->used += t->cost(n);
+}
+
+void mw_lru_touch(mw_lru *t, mw_lru_node *n)
+{
+    lru_unlink(t, n);
+    lru_push(t, n);
+}
+
+void mw_lru_remove(mw_lru *t, mw_lru_node *n)
+{
+    mw_lru_node **pp = lru_bucket(t, n->path);
+    while (*pp != n) pp = &(*pp)->h_next;
+    *pp = n->h_next;
+    lru_unlink(t, n);
+    t->used -= t->cost(n);
+    n->dead = true;
+    mw_lru_unref(t, n);
+}
+
+void mw_lru_evict(mw_lru *t)
+{
+    while (t->used > t->limit && t->tail) {
+        mw_lru_remove(t, t->tail);
+    }
+}
+
+void mw_lru_unref(mw_lru *t, mw_lru_node *n)
+{
+    assert(n->refs > 0);
+    if (--n->refs == 0) {
+        assert(n->dead);
+        t->free(n);
+    }
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
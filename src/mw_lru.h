@@ -0,0 +1,105 @@
+#ifndef MW_LRU_H
+#define MW_LRU_H
+
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief An entry of a cache keyed by path, kept first in the structure it
+ *        is the entry of
+ *
+ * A node is reference counted, so an entry stays valid until its last
+ * reference is dropped even if it is evicted meanwhile.
+ */
+typedef struct _mw_lru_node {
+    struct _mw_lru_node *h_next;   ///< next node in this hash bucket
+    struct _mw_lru_node *lru_prev; ///< more recently used
+    struct _mw_lru_node *lru_next; ///< less recently used
+
+    char *path; ///< the key, freed with the entry
+    int refs;   ///< references held, including the cache's own
+    bool dead;  ///< evicted, freed when the last reference goes away
+} mw_lru_node;
+
+/**
+ * @brief A hash table of nodes in least recently used order
+ *
+ * Each node costs something (bytes, descriptors), and the least recently
+ * used are evicted while the total is over the limit.  The table isn't
+ * locked; the cache holding it serialises access to it and its nodes.
+ */
+typedef struct _mw_lru {
+    mw_lru_node **buckets; ///< the hash table, owned by the cache
+    size_t n_buckets;      ///< slots in buckets
+    mw_lru_node *head;     ///< most recently used
+    mw_lru_node *tail;     ///< least recently used
+    size_t used;           ///< cost of the nodes in the table
+    size_t limit;          ///< evict past this, 0 if the cache is disabled
+
+    size_t (*cost)(mw_lru_node *n); ///< the cost of a node
+    void (*free)(mw_lru_node *n);   ///< frees a node's entry
+} mw_lru;
+
+/**
+ * @brief Hash a path, with FNV-1a
+ */
+size_t mw_lru_hash(const char *path);
+
+/**
+ * @brief Set up an empty table
+ *
+ * @param t The table
+ * @param buckets n_buckets zeroed slots
+ * @param n_buckets Slots in buckets
+ * @param cost Gives the cost of a node
+ * @param free Frees a node's entry, path included
+ */
+void mw_lru_init(mw_lru *t,
+                 mw_lru_node **buckets,
+                 size_t n_buckets,
+                 size_t (*cost)(mw_lru_node *n),
+                 void (*free)(mw_lru_node *n));
+
+/**
+ * @brief Find the node for a path
+ *
+ * @return The node, or NULL
+ */
+mw_lru_node *mw_lru_find(mw_lru *t, const char *path);
+
+/**
+ * @brief Add a node as the most recently used, without evicting
+ *
+ * The table takes over the reference the node was made with.
+ */
+void mw_lru_insert(mw_lru *t, mw_lru_node *n);
+
+/**
+ * @brief Make a node the most recently used
+ */
+void mw_lru_touch(mw_lru *t, mw_lru_node *n);
+
+/**
+ * @brief Take a node out of the table, and drop the table's reference
+ *
+ * The node is freed once the last user is done with it.
+ */
+void mw_lru_remove(mw_lru *t, mw_lru_node *n);
+
+/**
+ * @brief Remove the least recently used nodes while over the limit
+ */
+void mw_lru_evict(mw_lru *t);
+
+/**
+ * @brief Drop a reference to a node, freeing it if it was the last
+ */
+void mw_lru_unref(mw_lru *t, mw_lru_node *n);
+
+___END_DECLS
+#endif /* ifndef MW_LRU_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -1,41 +1,187 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for strnlen
+#endif
 #include "mw_mempool.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static unsigned char *mw_mpool_region(mw_mempool *pmp, size_t *len)
+{
+    if (pmp->cur) {
+        *len = pmp->cur->len;
+        return pmp->cur->data;
+    }
+    *len = pmp->len;
+    return (unsigned char *)pmp->begin;
+}
+
+/* Padding needed to align the address base + idx */
+static size_t mw_mpool_pad(unsigned char *base, size_t idx, size_t align)
+{
+    uintptr_t addr = (uintptr_t)(base + idx);
+    return (align - (addr & (align - 1))) & (align - 1);
+}
+
+static mw_mpool_chunk *mw_mpool_new_chunk(size_t len)
+{
+    mw_mpool_chunk *c = malloc(sizeof(mw_mpool_chunk) + len);
+    if (!c) return NULL;
+    c->next = NULL;
+    c->len = len;
+    return c;
+}
+
+/* Move on to a chunk that can hold len bytes at the given alignment, reusing
+ * the next chunk in the chain when it is big enough.  Returns false, leaving
+ * the pool as it was, if there is no such chunk and no memory for one.
+ */
+static bool mw_mpool_next_chunk(mw_mempool *pmp, size_t len, size_t align)
+{
+    mw_mpool_chunk **link = pmp->cur ? &pmp->cur->next : &pmp->chunks;
+    mw_mpool_chunk *next = *link;
+    // chunk data is MW_MPOOL_ALIGN aligned, bigger alignments may need padding
+    size_t extra = align > MW_MPOOL_ALIGN ? align : 0;
+    if (len > SIZE_MAX - sizeof(mw_mpool_chunk) - extra) return false;
+    size_t need = len + extra;
+    if (!next || next->len < need) {
+        mw_mpool_chunk *c =
+            mw_mpool_new_chunk(need > pmp->chunk_sz ? need : pmp->chunk_sz);
+        if (!c) return false;
+        c->next = next;
+        *link = c;
+        next = c;
+    }
+    pmp->cur = next;
+    pmp->idx = 0;
+    return true;
+}
 
 void mw_mpool_init(mw_mempool *pmp, char *begin, size_t len)
 {
     pmp->begin = begin;
-    pmp->len = len;
+    pmp->len = begin ? len : 0;
     pmp->idx = 0;
-    pmp->cflag = 0;
+    pmp->chunks = NULL;
+    pmp->cur = NULL;
+    pmp->chunk_sz = MW_MPOOL_CHUNK_SZ;
+    pmp->last = NULL;
 }
 
-void *mw_mpool_malloc(mw_mempool *pmp, size_t len)
+void *mw_mpool_memalign(mw_mempool *pmp, size_t len, size_t align)
 {
-    void *ret = NULL;
-    size_t r_idx = pmp->idx + len;
-    if (r_idx > pmp->len) {
-        ret = malloc(len);
-        pmp->cflag = 1;
-    }
-    else {
-        ret = pmp->begin + pmp->idx;
-        pmp->idx = r_idx;
+    assert(align && !(align & (align - 1)));
+    size_t r_len;
+    unsigned char *base = mw_mpool_region(pmp, &r_len);
+    size_t pad = base ? mw_mpool_pad(base, pmp->idx, align) : 0;
+    // written so a huge len can't wrap round
+    if (!base || pad > r_len - pmp->idx || len > r_len - pmp->idx - pad) {
+        if (!mw_mpool_next_chunk(pmp, len, align)) return NULL;
+        base = mw_mpool_region(pmp, &r_len);
+        pad = mw_mpool_pad(base, 0, align);
     }
 
+    void *ret = base + pmp->idx + pad;
+    pmp->idx += pad + len;
+    pmp->last = ret;
     return ret;
 }
 
+void *mw_mpool_malloc(mw_mempool *pmp, size_t len)
+{
+    return mw_mpool_memalign(pmp, len, MW_MPOOL_ALIGN);
+}
+
 void mw_mpool_free(mw_mempool *pmp, void *p)
 {
-    /* only perform free when allocated on the heap */
-    if (p < (void *)pmp->begin || p >= (void *)(pmp->begin + pmp->len)) {
-        free(p);
+    /* only the most recent allocation can be given back right away, and only
+     * if it is in the current region
+     */
+    size_t r_len;
+    unsigned char *base = mw_mpool_region(pmp, &r_len);
+    if (p && p == pmp->last && (unsigned char *)p >= base &&
+        (unsigned char *)p < base + r_len) {
+        pmp->idx = (unsigned char *)p - base;
+        pmp->last = NULL;
     }
 }
 
 void mw_mpool_clear(mw_mempool *pmp)
 {
+    pmp->cur = NULL;
+    pmp->idx = 0;
+    pmp->last = NULL;
+}
+
+mw_mpool_mark mw_mpool_mark_get(mw_mempool *pmp)
+{
+    mw_mpool_mark mark = {pmp->cur, pmp->idx};
+    return mark;
+}
+
+void mw_mpool_rewind(mw_mempool *pmp, mw_mpool_mark mark)
+{
+    pmp->cur = mark.cur;
+    pmp->idx = mark.idx;
+    pmp->last = NULL;
+}
+
+void mw_mpool_destroy(mw_mempool *pmp)
+{
+    while (pmp->chunks) {
+        mw_mpool_chunk *c = pmp->chunks;
+        pmp->chunks = c->next;
+        free(c);
+    }
+    pmp->cur = NULL;
     pmp->idx = 0;
-    pmp->cflag = 0;
+    pmp->last = NULL;
+}
+
+char *mw_mpool_strndup(mw_mempool *pmp, const char *s, size_t n)
+{
+    size_t l = strnlen(s, n);
+    char *ret = mw_mpool_memalign(pmp, l + 1, 1);
+    if (!ret) return NULL;
+    memcpy(ret, s, l);
+    ret[l] = '\0';
+    return ret;
 }
+
+char *mw_mpool_vasprintf(mw_mempool *pmp, const char *fmt, va_list ap)
+{
+    va_list ap2;
+    va_copy(ap2, ap);
+
+    // try to format straight into whatever is left of the current region
+    size_t r_len;
+    unsigned char *base = mw_mpool_region(pmp, &r_len);
+    size_t left = base ? r_len - pmp->idx : 0;
+    char *ret = left ? (char *)base + pmp->idx : NULL;
+    int l = vsnprintf(ret, left, fmt, ap);
+    assert(l >= 0);
+    if ((size_t)l < left) {
+        pmp->idx += l + 1;
+        pmp->last = ret;
+    }
+    else {
+        ret = mw_mpool_memalign(pmp, l + 1, 1);
+        if (ret) vsnprintf(ret, l + 1, fmt, ap2);
+    }
+    va_end(ap2);
+    return ret;
+}
+
+char *mw_mpool_asprintf(mw_mempool *pmp, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    char *ret = mw_mpool_vasprintf(pmp, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -5,20 +5,103 @@
 
 ___BEGIN_DECLS
 
+#include <stdarg.h>
 #include <stddef.h>
 
+/**
+ * @brief The default size of the chunks a pool allocates for itself
+ */
+#define MW_MPOOL_CHUNK_SZ 4096
+
+/**
+ * @brief The alignment mw_mpool_malloc gives, enough for any type
+ */
+#define MW_MPOOL_ALIGN (sizeof(long double))
+
+/**
+ * @brief One heap allocated chunk of a pool's chain
+ */
+typedef struct _mw_mpool_chunk {
+    struct _mw_mpool_chunk *next; ///< next chunk in the chain
+    size_t len;                   ///< usable bytes in data
+    unsigned char data[];
+} mw_mpool_chunk;
+
+/**
+ * @brief An arena: allocations are carved out of a caller supplied region
+ *        first, then out of a chain of heap chunks.
+ *
+ * Memory is given back all at once with mw_mpool_clear, or back to a point
+ * taken with mw_mpool_mark.  The chunks are kept for reuse, so an arena that
+ * has warmed up stops calling malloc.
+ */
 typedef struct {
-    char *begin; ///< start position
-    size_t len;  ///< capacity
-    int idx;     ///< current index
-    int cflag;   ///< clear flag
+    char *begin;            ///< start of the caller supplied region
+    size_t len;             ///< capacity of the caller supplied region
+    size_t idx;             ///< next free offset in the current region
+    mw_mpool_chunk *chunks; ///< the chain of heap chunks
+    mw_mpool_chunk *cur;    ///< the current chunk, NULL for begin
+    size_t chunk_sz;        ///< size of the chunks we allocate
+    void *last;             ///< the most recent allocation
 } mw_mempool;
 
+/**
+ * @brief A position in a pool to rewind to
+ */
+typedef struct {
+    mw_mpool_chunk *cur;
+    size_t idx;
+} mw_mpool_mark;
+
 void mw_mpool_init(mw_mempool *pmp, char *begin, size_t len);
+
+/**
+ * @brief Allocate len bytes aligned to MW_MPOOL_ALIGN
+ *
+ * @return The memory, or NULL if len is more than can be had
+ */
 void *mw_mpool_malloc(mw_mempool *pmp, size_t len);
+
+/**
+ * @brief Allocate len bytes aligned to align, which must be a power of 2
+ *
+ * @return The memory, or NULL if len is more than can be had
+ */
+void *mw_mpool_memalign(mw_mempool *pmp, size_t len, size_t align);
+
+/**
+ * @brief Give back p if it was the most recent allocation; otherwise its
+ *        memory comes back on the next clear or rewind.
+ */
 void mw_mpool_free(mw_mempool *pmp, void *p);
+
+/**
+ * @brief Give back everything allocated, keeping the chunks for reuse
+ */
 void mw_mpool_clear(mw_mempool *pmp);
 
+/**
+ * @brief Remember the current position, to mw_mpool_rewind to later
+ */
+mw_mpool_mark mw_mpool_mark_get(mw_mempool *pmp);
+
+/**
+ * @brief Give back everything allocated since mark was taken
+ */
+void mw_mpool_rewind(mw_mempool *pmp, mw_mpool_mark mark);
+
+/**
+ * @brief Free the heap chunks.  The pool must be initialized again to be used.
+ */
+void mw_mpool_destroy(mw_mempool *pmp);
+
+char *mw_mpool_strndup(mw_mempool *pmp, const char *s, size_t n);
+
+char *mw_mpool_vasprintf(mw_mempool *pmp, const char *fmt, va_list ap);
+
+char *mw_mpool_asprintf(mw_mempool *pmp, const char *fmt, ...)
+    PRINTF_STYLE(2, 3);
+
 ___END_DECLS
 #endif /* ifndef MW_MPOOL_H */
 
@@ -0,0 +1,209 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for pread
+#endif
+#include "mw_pdeflate.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+mw_pdeflate *mw_pdeflate_new(int fd, off_t size, int level, bool gzip)
+{
+    mw_pdeflate *pd = calloc(1, sizeof(*pd));
+    if (!pd) return NULL;
+    // the blocks may still be reading after the caller has let go of fd
+    pd->fd = dup(fd);
+    if (pd->fd < 0) {
+        free(pd);
+        return NULL;
+    }
+    pd->size = size;
+    pd->level = level == Z_DEFAULT_COMPRESSION ? 6 : level;
+    pd->gzip = gzip;
+    pd->check = gzip ? crc32(0, NULL, 0) : adler32(0, NULL, 0);
+    // and calloc has left the strand empty
+    return pd;
+}
+
+mw_pdeflate_block *mw_pdeflate_next(mw_pdeflate *pd)
+{
+    if (pd->next_off >= pd->size) return NULL;
+    mw_pdeflate_block *b = calloc(1, sizeof(*b));
+    if (!b) return NULL;
+    b->pd = pd;
+    b->off = pd->next_off;
+    b->len = pd->size - b->off;
+    if (b->len > MW_PDEFLATE_BLOCK) b->len = MW_PDEFLATE_BLOCK;
+    pd->next_off += b->len;
+    b->last = pd->next_off == pd->size;
+    pd->inflight++;
+    return b;
+}
+
+/* The zlib header deflateInit would write for this level */
+static void put_zlib_header(unsigned char *p, int level)
+{
+    unsigned flags = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    unsigned h = (0x78 << 8) | (flags << 6);
+    h += 31 - h % 31;
+    p[0] = h >> 8;
+    p[1] = h & 0xff;
+}
+
+/* The gzip header deflateInit2 would write for this level: no name, no
+ * mtime, from Unix
+ */
+static void put_gzip_header(unsigned char *p, int level)
+{
+    static const unsigned char h[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+    memcpy(p, h, sizeof(h));
+    p[8] = level == 9 ? 2 : level == 1 ? 4 : 0;
+}
+
+/* Put v at p, least significant byte first */
+static void put_le32(unsigned char *p, uLong v)
+{
+    for (int i = 0; i < 4; i++) p[i] = (v >> (8 * i)) & 0xff;
+}
+
+/* Read len bytes at off, all of them */
+static int read_all(int fd, unsigned char *p, size_t len, off_t off)
+{
+    while (len) {
+        ssize_t n = pread(fd, p, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno;
+        // the file shrank under us
+        if (n == 0) return EIO;
+        p += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+void mw_pdeflate_compress(void *block)
+{
+    mw_pdeflate_block *b = block;
+    mw_pdeflate *pd = b->pd;
+    size_t dict = b->off < MW_PDEFLATE_DICT ? b->off : MW_PDEFLATE_DICT;
+    unsigned char *in = malloc(dict + b->len);
+    if (!in) {
+        b->err = ENOMEM;
+        return;
+    }
+    b->err = read_all(pd->fd, in, dict + b->len, b->off - dict);
+    if (b->err) {
+        free(in);
+        return;
+    }
+    b->check = pd->gzip ? crc32(crc32(0, NULL, 0), in + dict, b->len)
+                        : adler32(adler32(0, NULL, 0), in + dict, b->len);
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, pd->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
+        Z_OK) {
+        free(in);
+        b->err = ENOMEM;
+        return;
+    }
+    if (dict) deflateSetDictionary(&zs, in, dict);
+
+    // the first block starts the stream with its header, the rest are raw
+    mw_slab *tail = b->out = mw_slab_get();
+    if (!tail) {
+        deflateEnd(&zs);
+        free(in);
+        b->err = ENOMEM;
+        return;
+    }
+    size_t hdr = b->off ? 0 : pd->gzip ? 10 : 2;
+    if (hdr && pd->gzip) {
+        put_gzip_header(tail->data, pd->level);
+    }
+    else if (hdr) {
+        put_zlib_header(tail->data, pd->level);
+    }
+    zs.next_in = in + dict;
+    zs.avail_in = b->len;
+    zs.next_out = tail->data + hdr;
+    zs.avail_out = MW_SLAB_SZ - hdr;
+    int flush = b->last ? Z_FINISH : Z_SYNC_FLUSH;
+    for (;;) {
+        int rc = deflate(&zs, flush);
+        tail->len = MW_SLAB_SZ - zs.avail_out;
+        if (rc == Z_STREAM_END) break;
+        // Z_BUF_ERROR only means there was no room to make progress in
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            b->err = EIO;
+            break;
+        }
+        // a sync flush is complete once it leaves room to spare
+        if (zs.avail_out && !zs.avail_in && flush == Z_SYNC_FLUSH) break;
+        if (zs.avail_out) {
+            b->err = EIO;
+            break;
+        }
+        tail = tail->next = mw_slab_get();
+        if (!tail) {
+            b->err = ENOMEM;
+            break;
+        }
+        zs.next_out = tail->data;
+        zs.avail_out = MW_SLAB_SZ;
+    }
+    if (b->err) {
+        mw_slab_put(b->out);
+        b->out = NULL;
+    }
+    else {
+        b->out_len = zs.total_out + hdr;
+    }
+    deflateEnd(&zs);
+    free(in);
+}
+
+size_t mw_pdeflate_take(mw_pdeflate *pd,
+                        mw_pdeflate_block *b,
+                        unsigned char trailer[MW_PDEFLATE_TRAILER_MAX])
+{
+    pd->check = pd->gzip ? crc32_combine(pd->check, b->check, b->len)
+                         : adler32_combine(pd->check, b->check, b->len);
+    pd->in_done += b->len;
+    pd->out_done += b->out_len;
+    if (!b->last) return 0;
+    if (pd->gzip) {
+        // the crc32 and the length, both little-endian
+        put_le32(trailer, pd->check);
+        put_le32(trailer + 4, pd->size);
+        pd->out_done += 8;
+        return 8;
+    }
+    trailer[0] = pd->check >> 24;
+    trailer[1] = (pd->check >> 16) & 0xff;
+    trailer[2] = (pd->check >> 8) & 0xff;
+    trailer[3] = pd->check & 0xff;
+    pd->out_done += 4;
+    return 4;
+}
+
+void mw_pdeflate_release(mw_pdeflate *pd, mw_pdeflate_block *b)
+{
+    pd->inflight--;
+    mw_slab_put(b->out);
+    free(b);
+}
+
+bool mw_pdeflate_done(const mw_pdeflate *pd)
+{
+    return pd->in_done == pd->size;
+}
+
+void mw_pdeflate_free(mw_pdeflate *pd)
+{
+    close(pd->fd);
+    free(pd);
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,150 @@
+#ifndef MW_PDEFLATE_H
+#define MW_PDEFLATE_H
+
+#include "config.h"
+#include "mw_evloop.h"
+#include "mw_slab.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief Bytes of the file compressed by each job
+ */
+#define MW_PDEFLATE_BLOCK (128 * 1024)
+
+/**
+ * @brief Bytes before a block that prime its compressor, deflate's window
+ */
+#define MW_PDEFLATE_DICT (32 * 1024)
+
+/**
+ * @brief Smallest file compressed in parallel, unless configured otherwise
+ *
+ * Below this the blocks' flush markers and the jobs' overheads aren't worth
+ * it.
+ */
+#define MW_PDEFLATE_DEFAULT_MIN (1024 * 1024)
+
+/**
+ * @brief Most blocks of one response being compressed, or waiting to be sent
+ */
+#define MW_PDEFLATE_INFLIGHT 8
+
+/**
+ * @brief Most bytes of trailer mw_pdeflate_take gives, gzip's
+ */
+#define MW_PDEFLATE_TRAILER_MAX 8
+
+/**
+ * @brief One block of a parallel deflate, and the job that compresses it
+ */
+typedef struct _mw_pdeflate_block {
+    mw_job job;              ///< runs mw_pdeflate_compress
+    struct _mw_pdeflate *pd; ///< the stream it is part of
+    off_t off;               ///< where the block starts in the file
+    size_t len;              ///< bytes of the file in it
+    bool last;               ///< does it end the stream?
+    mw_slab *out;            ///< compressed, a chain of slabs, or NULL
+    size_t out_len;          ///< bytes in out
+    uLong check;             ///< adler32 or crc32 of the block's input
+    int err;                 ///< errno value, or 0
+} mw_pdeflate_block;
+
+/**
+ * @brief A file compressed as one zlib or gzip stream, a block per job, in
+ *        the style of pigz
+ *
+ * Each block is compressed on its own as raw deflate, primed with the
+ * MW_PDEFLATE_DICT bytes before it, and ended with a sync flush so the next
+ * block starts on a byte boundary.  Taken in order, the blocks make up one
+ * valid stream: the first carries the header, and the trailer's check value
+ * (adler32 for zlib, crc32 for gzip) is combined from the blocks'.  The
+ * priming keeps the ratio within a fraction of a percent of a serial deflate.
+ *
+ * The stream is handed out and taken on one thread; the blocks may be
+ * compressed on any.
+ */
+typedef struct _mw_pdeflate {
+    int fd;           ///< our own descriptor for the file
+    off_t size;       ///< bytes to compress
+    int level;        ///< zlib compression level
+    bool gzip;        ///< a gzip stream, rather than zlib?
+    off_t next_off;   ///< where the next block handed out starts
+    off_t in_done;    ///< input whose output has been taken
+    uLong check;      ///< adler32 or crc32 of the first in_done bytes
+    size_t out_done;  ///< compressed bytes taken, header and trailer included
+    int inflight;     ///< blocks handed out and not yet released
+    mw_strand strand; ///< takes the blocks in order
+    void *ctx;        ///< the owner's, NULL once it has let go
+} mw_pdeflate;
+
+/**
+ * @brief Start compressing size bytes of fd
+ *
+ * @param fd The file
+ * @param size Bytes of it to compress
+ * @param level The zlib compression level
+ * @param gzip Make a gzip stream, rather than a zlib one?
+ *
+ * @return The stream, or NULL with errno set
+ */
+mw_pdeflate *mw_pdeflate_new(int fd, off_t size, int level, bool gzip);
+
+/**
+ * @brief Hand out the next block, to be given to mw_pdeflate_compress
+ *
+ * @return The block, or NULL if they have all been handed out
+ */
+mw_pdeflate_block *mw_pdeflate_next(mw_pdeflate *pd);
+
+/**
+ * @brief Read and compress a block; a mw_task_fn, to run on any thread
+ *
+ * The output goes into slabs as it comes, so nothing is reserved for the
+ * worst case.  On failure out is NULL and err is set.
+ */
+void mw_pdeflate_compress(void *block);
+
+/**
+ * @brief Take a compressed block, the oldest not yet taken
+ *
+ * Its out follows what was taken before.  After the last block the
+ * stream's trailer follows too.
+ *
+ * @param pd The stream
+ * @param b The block
+ * @param trailer Set to the trailer after the last block
+ *
+ * @return The bytes in trailer: 4 (zlib) or 8 (gzip) after the last block,
+ *         else 0
+ */
+size_t mw_pdeflate_take(mw_pdeflate *pd,
+                        mw_pdeflate_block *b,
+                        unsigned char trailer[MW_PDEFLATE_TRAILER_MAX]);
+
+/**
+ * @brief Free a block, once taken or if its stream is abandoned
+ *
+ * Its out goes back to the slab pool, unless the taker has set it to NULL
+ * to keep it.
+ */
+void mw_pdeflate_release(mw_pdeflate *pd, mw_pdeflate_block *b);
+
+/**
+ * @brief Has the whole file been compressed and taken?
+ */
+bool mw_pdeflate_done(const mw_pdeflate *pd);
+
+/**
+ * @brief Free a stream with no blocks in flight
+ */
+void mw_pdeflate_free(mw_pdeflate *pd);
+
+___END_DECLS
+#endif /* ifndef MW_PDEFLATE_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
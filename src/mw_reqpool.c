@@ -0,0 +1,71 @@
+#include "mw_reqpool.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void mw_reqpool_destroy(mw_request *req)
+{
+    free(req->file_b.buf);
+    mw_slabq_clear(&req->deflate_q);
+    mw_mpool_destroy(&req->pool);
+    mw_codec_stream_release(&req->zs);
+    free(req);
+}
+
+/* Zero everything but file_b, pool and cmd_buf (which doesn't need clearing,
+ * and is most of the struct)
+ */
+static void mw_reqpool_reset(mw_request *req)
+{
+    mw_buffer file_b = req->file_b;
+    mw_mempool pool = req->pool;
+    // a connection cut off mid-response may still hold some output, and its
+    // engine's state
+    mw_slabq_clear(&req->deflate_q);
+    mw_codec_stream_release(&req->zs);
+
+    memset(req, 0, offsetof(mw_request, cmd_buf));
+    memset(&req->cb, 0, sizeof(*req) - offsetof(mw_request, cb));
+
+    req->file_b = file_b;
+    req->file_b.into = req->file_b.outof = req->file_b.buf;
+    req->file_b.used = 0;
+    req->pool = pool;
+    mw_mpool_clear(&req->pool);
+}
+
+mw_request *mw_reqpool_get(mw_reqpool *p)
+{
+    mw_request *req = p->free;
+    if (req) {
+        p->free = req->pool_next;
+        p->n_free--;
+        p->hits++;
+        req->pool_next = NULL;
+    }
+    else {
+        p->misses++;
+        req = calloc(1, sizeof(mw_request));
+        assert(req);
+        buf_init_ring(&req->file_b, MW_FILE_BUF_SZ);
+        mw_mpool_init(&req->pool, req->scratch, sizeof(req->scratch));
+    }
+    req->cb = req->cmd_buf;
+    req->fd = -1;
+    return req;
+}
+
+void mw_reqpool_put(mw_reqpool *p, mw_request *req)
+{
+    if (p->n_free >= p->high_water) {
+        p->drops++;
+        mw_reqpool_destroy(req);
+        return;
+    }
+    mw_reqpool_reset(req);
+    req->pool_next = p->free;
+    p->free = req;
+    p->n_free++;
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,55 @@
+#ifndef MW_REQPOOL_H
+#define MW_REQPOOL_H
+
+#include "miniweb_request.h"
+#include <stddef.h>
+
+/**
+ * @brief The default number of idle requests a pool keeps
+ */
+#define MW_REQPOOL_DEFAULT_MAX 1024
+
+/**
+ * @brief A pool of recycled requests
+ *
+ * A recycled request keeps its file_b and the chunks of its scratch pool, so a
+ * new connection usually costs no allocations.  Its compressed output was in
+ * slabs, and its codec state was the engine's, which both go back to their
+ * shared pools.  A pool is not thread safe, each mw_shard has its own, which
+ * belongs to the shard's queue.
+ */
+typedef struct _mw_reqpool {
+    mw_request *free;  ///< idle requests, linked through pool_next
+    size_t n_free;     ///< the number of idle requests
+    size_t high_water; ///< keep at most this many idle requests
+
+    size_t hits;   ///< requests handed out from the pool
+    size_t misses; ///< requests that had to be allocated
+    size_t drops;  ///< requests freed because the pool was full
+} mw_reqpool;
+
+/**
+ * @brief Get a request ready for a new connection
+ *
+ * The request is zeroed apart from its buffers, with an empty cmd_buf, no
+ * file (fd is -1), and a circular file_b.
+ *
+ * @param p The pool
+ *
+ * @return The request
+ */
+mw_request *mw_reqpool_get(mw_reqpool *p);
+
+/**
+ * @brief Give a request back to the pool, or free it if the pool is full
+ *
+ * The request's socket and file must already be closed.
+ *
+ * @param p The pool
+ * @param req The request
+ */
+void mw_reqpool_put(mw_reqpool *p, mw_request *req);
+
+#endif /* ifndef MW_REQPOOL_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
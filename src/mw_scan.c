@@ -0,0 +1,213 @@
+#include "mw_scan.h"
+#include <string.h>
+
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Each implementation is a set of three scanners, all returning len when
+ * they find nothing.  The vector loops only load whole vectors that lie
+ * inside buf, and leave the tail to the scalar code.
+ */
+typedef struct {
+    size_t (*eol)(const char *buf, size_t len);
+    size_t (*delim)(const char *buf, size_t len);
+    size_t (*hdr_end)(const char *buf, size_t len);
+} mw_scanners;
+
+static size_t scalar_eol(const char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') return i;
+    }
+    return len;
+}
+
+static size_t scalar_delim(const char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == ':' || buf[i] == '\r' || buf[i] == '\n') return i;
+    }
+    return len;
+}
+
+static size_t scalar_hdr_end(const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len;
+    while (end - p >= 4 && (p = memchr(p, '\r', end - p - 3))) {
+        if (!memcmp(p, "\r\n\r\n", 4)) return p - buf;
+        p++;
+    }
+    return len;
+}
+
+static const mw_scanners scalar = {scalar_eol, scalar_delim, scalar_hdr_end};
+
+#if HAVE_X86_SIMD
+
+/* The AVX2 scanners finish off with the SSE2 ones; inlining them there gets
+ * them VEX encoded, so there is no AVX/SSE transition penalty
+ */
+#define SSE2 __attribute__((target("sse2"), always_inline)) inline
+#define AVX2 __attribute__((target("avx2")))
+
+static SSE2 size_t sse2_eol(const char *buf, size_t len)
+{
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned m = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        if (m) return i + __builtin_ctz(m);
+    }
+    return i + scalar_eol(buf + i, len - i);
+}
+
+static SSE2 size_t sse2_delim(const char *buf, size_t len)
+{
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n'),
+                  colon = _mm_set1_epi8(':');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i eq = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)),
+            _mm_cmpeq_epi8(v, colon));
+        unsigned m = _mm_movemask_epi8(eq);
+        if (m) return i + __builtin_ctz(m);
+    }
+    return i + scalar_delim(buf + i, len - i);
+}
+
+/* Look for a '\r' a vector at a time, and check the rest of "\r\n\r\n" only
+ * where there is one.  Most lines are long enough that a vector holds at
+ * most one '\r'.
+ */
+static SSE2 size_t sse2_hdr_end(const char *buf, size_t len)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    size_t i = 0;
+    for (; i + 19 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+        for (; m; m &= m - 1) {
+            size_t at = i + __builtin_ctz(m);
+            if (!memcmp(buf + at, "\r\n\r\n", 4)) return at;
+        }
+    }
+    return i + scalar_hdr_end(buf + i, len - i);
+}
+
+static AVX2 size_t avx2_eol(const char *buf, size_t len)
+{
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i eol =
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf));
+        unsigned m = _mm256_movemask_epi8(eol);
+        if (m) return i + __builtin_ctz(m);
+    }
+    return i + sse2_eol(buf + i, len - i);
+}
+
+static AVX2 size_t avx2_delim(const char *buf, size_t len)
+{
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n'),
+                  colon = _mm256_set1_epi8(':');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i eq = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)),
+            _mm256_cmpeq_epi8(v, colon));
+        unsigned m = _mm256_movemask_epi8(eq);
+        if (m) return i + __builtin_ctz(m);
+    }
+    return i + sse2_delim(buf + i, len - i);
+}
+
+static AVX2 size_t avx2_hdr_end(const char *buf, size_t len)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    size_t i = 0;
+    for (; i + 35 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+        for (; m; m &= m - 1) {
+            size_t at = i + __builtin_ctz(m);
+            if (!memcmp(buf + at, "\r\n\r\n", 4)) return at;
+        }
+    }
+    return i + sse2_hdr_end(buf + i, len - i);
+}
+
+static const mw_scanners sse2 = {sse2_eol, sse2_delim, sse2_hdr_end};
+static const mw_scanners avx2 = {avx2_eol, avx2_delim, avx2_hdr_end};
+
+#endif /* HAVE_X86_SIMD */
+
+static const mw_scanners *scanners;
+
+static int supported(mw_scan_isa isa, const mw_scanners **s)
+{
+    switch (isa) {
+    case MW_SCAN_SCALAR:
+        *s = &scalar;
+        return 1;
+#if HAVE_X86_SIMD
+    case MW_SCAN_SSE2:
+        __builtin_cpu_init();
+        *s = &sse2;
+        return __builtin_cpu_supports("sse2");
+    case MW_SCAN_AVX2:
+        __builtin_cpu_init();
+        *s = &avx2;
+        return __builtin_cpu_supports("avx2");
+#else
+    default:
+        return 0;
+#endif
+    }
+    return 0;
+}
+
+int mw_scan_select(mw_scan_isa isa)
+{
+    const mw_scanners *s;
+    if (!supported(isa, &s)) return -1;
+    scanners = s;
+    return 0;
+}
+
+mw_scan_isa mw_scan_init(void)
+{
+    // every thread picks the same answer, so racing here is harmless
+    for (mw_scan_isa isa = MW_SCAN_AVX2; isa > MW_SCAN_SCALAR; isa--) {
+        if (!mw_scan_select(isa)) return isa;
+    }
+    mw_scan_select(MW_SCAN_SCALAR);
+    return MW_SCAN_SCALAR;
+}
+
+size_t mw_scan_eol(const char *buf, size_t len)
+{
+    if (!scanners) mw_scan_init();
+    return scanners->eol(buf, len);
+}
+
+size_t mw_scan_delim(const char *buf, size_t len)
+{
+    if (!scanners) mw_scan_init();
+    return scanners->delim(buf, len);
+}
+
+size_t mw_scan_hdr_end(const char *buf, size_t len)
+{
+    if (!scanners) mw_scan_init();
+    return scanners->hdr_end(buf, len);
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
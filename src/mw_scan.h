@@ -0,0 +1,64 @@
+#ifndef MW_SCAN_H
+#define MW_SCAN_H
+
+#include "config.h"
+#include <stddef.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief The ways mw_scan can search a buffer
+ */
+typedef enum {
+    MW_SCAN_SCALAR, ///< a byte at a time (memchr where it helps)
+    MW_SCAN_SSE2,   ///< 16 bytes at a time
+    MW_SCAN_AVX2,   ///< 32 bytes at a time
+} mw_scan_isa;
+
+/**
+ * @brief Pick the fastest implementation this CPU supports
+ *
+ * The scanners call this themselves the first time they are used, so calling
+ * it is optional.
+ *
+ * @return The implementation picked
+ */
+mw_scan_isa mw_scan_init(void);
+
+/**
+ * @brief Use a particular implementation, for tests and benchmarks
+ *
+ * @param isa The implementation
+ *
+ * @return 0, or -1 if the CPU (or the compiler) doesn't support it
+ */
+int mw_scan_select(mw_scan_isa isa);
+
+/**
+ * @brief Find the end of the first line in buf
+ *
+ * @return The offset of the first '\r' or '\n', or len if there is none
+ */
+size_t mw_scan_eol(const char *buf, size_t len);
+
+/**
+ * @brief Find the end of a header field name, or of the line
+ *
+ * @return The offset of the first ':', '\r' or '\n', or len if there is none
+ */
+size_t mw_scan_delim(const char *buf, size_t len);
+
+/**
+ * @brief Find the blank line that ends a header block
+ *
+ * Only the canonical "\r\n\r\n" is looked for; the parser deals with bare LF
+ * line ends.
+ *
+ * @return The offset of the first "\r\n\r\n", or len if there is none
+ */
+size_t mw_scan_hdr_end(const char *buf, size_t len);
+
+___END_DECLS
+#endif /* ifndef MW_SCAN_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,34 @@
+#include "mw_sendfile.h"
+#include <errno.h>
+#if HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#elif HAVE_BSD_SENDFILE
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+ssize_t mw_sendfile(int sd, int fd, off_t *off, size_t count)
+{
+#if HAVE_SYS_SENDFILE_H
+    return sendfile(sd, fd, off, count);
+#elif HAVE_BSD_SENDFILE
+    off_t len = count;
+    if (sendfile(fd, sd, *off, &len, NULL, 0) < 0) {
+        /* a non-blocking socket that filled up reports EAGAIN, but still
+         * tells us how much it took
+         */
+        if (!(errno == EAGAIN && len > 0)) return -1;
+    }
+    *off += len;
+    return len;
+#else
+    (void)sd;
+    (void)fd;
+    (void)off;
+    (void)count;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
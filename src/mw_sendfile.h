@@ -0,0 +1,36 @@
+#ifndef MW_SENDFILE_H
+#define MW_SENDFILE_H
+
+#include "config.h"
+#include <stdbool.h>
+#include <sys/types.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief Is there a zero-copy file to socket transfer on this platform?
+ */
+#define MW_HAVE_SENDFILE (HAVE_SYS_SENDFILE_H || HAVE_BSD_SENDFILE)
+
+/**
+ * @brief Copy file data to a socket inside the kernel
+ *
+ * Wraps the Linux and BSD flavors of sendfile(2) behind one interface.  A
+ * partial transfer on a non-blocking socket is reported as a short count, not
+ * as an error.
+ *
+ * @param sd The (non-blocking) socket to write to
+ * @param fd The file to read from
+ * @param off The file offset to start at, advanced by the amount sent
+ * @param count The most bytes to send
+ *
+ * @return The number of bytes sent, or -1 with errno set.  errno is EAGAIN if
+ *         the socket could not take any data, and ENOSYS if there is no
+ *         sendfile on this platform.
+ */
+ssize_t mw_sendfile(int sd, int fd, off_t *off, size_t count);
+
+___END_DECLS
+#endif /* ifndef MW_SENDFILE_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
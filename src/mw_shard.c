@@ -0,0 +1,349 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for accept4
+#endif
+#include "mw_shard.h"
+#include "miniweb.h"
+#include "miniweb_logging.h"
+#include "mw_clock.h"
+#include "mw_stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+mw_shard *shards;
+int n_shards;
+
+// the shards' loops, which share out their CPU-heavy jobs
+static mw_evgroup loops;
+
+/* Bind a non-blocking listening socket to port, sharing the port with the
+ * other shards
+ */
+static int mw_listen(const char *port)
+{
+    struct addrinfo hints = {0}, *res, *ai;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int rc = getaddrinfo(NULL, port, &hints, &res);
+    if (rc) {
+        qfprintf(stderr, "getaddrinfo %s: %s\n", port, gai_strerror(rc));
+        return -1;
+    }
+
+    int fd = -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0 &&
+            bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, SOMAXCONN) == 0) {
+            break;
+        }
+        qfprintf(stderr, "listen on %s: %s\n", port, strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/* Stop, or start again, taking connections off the shard's backlog */
+static void mw_shard_pause_accept(mw_shard *shard, bool pause)
+{
+    if (shard->loop) {
+        if (pause) {
+            mw_ev_disable(&shard->accept_ev);
+        }
+        else {
+            mw_ev_enable(&shard->accept_ev);
+        }
+    }
+    else if (pause) {
+        dispatch_suspend(shard->accept_ds);
+    }
+    else {
+        dispatch_resume(shard->accept_ds);
+    }
+}
+
+/* accept failed, and not for an empty backlog: whatever is short (usually
+ * descriptors) won't be there on the next pass either, so back off for a
+ * while, and say so now and then
+ */
+static void mw_shard_accept_failed(mw_shard *shard, int err)
+{
+    shard->accept_errors++;
+    uint64_t now = mw_clock_coarse_ns();
+    if (!shard->accept_logged ||
+        now - shard->accept_logged >= MW_ACCEPT_LOG_NS) {
+        qfprintf(stderr,
+                 "accept failure on shard#%d (errno=%d %s), %zu since the "
+                 "last report; pausing for %d ms\n",
+                 shard->id,
+                 err,
+                 strerror(err),
+                 shard->accept_errors,
+                 MW_ACCEPT_BACKOFF_MS);
+        shard->accept_logged = now;
+        shard->accept_errors = 0;
+    }
+    unsigned ticks = MW_ACCEPT_BACKOFF_MS / shard->wheel.tick_ms;
+    shard->accept_paused = ticks ? ticks : 1;
+    mw_shard_pause_accept(shard, true);
+}
+
+/* Accept the connections waiting on the shard's socket, up to a batch at a
+ * time; if there are more, the source fires again straight away
+ */
+static void mw_shard_accept_batch(mw_shard *shard)
+{
+    int n = 0;
+    for (int i = 0; i < MW_ACCEPT_BATCH; i++) {
+        struct sockaddr_in addr;
+        int s = mw_shard_accept(shard, &addr);
+        if (s >= 0) {
+            mw_accept_one(shard, s, &addr);
+            n++;
+            continue;
+        }
+        // a client that gave up while in the backlog doesn't end the batch
+        if (errno == ECONNABORTED || errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (shard->loop) mw_ev_blocked(&shard->accept_ev);
+        }
+        else {
+            mw_shard_accept_failed(shard, errno);
+        }
+        break;
+    }
+    mw_shard_note_batch(shard, n);
+}
+
+static void mw_shard_on_accept(mw_ev *ev, __unused size_t avail)
+{
+    mw_shard_accept_batch(ev->ctx);
+}
+
+static void mw_shard_tick(void *ctx)
+{
+    mw_shard *shard = ctx;
+    mw_twheel_expire(&shard->wheel, mw_req_timed_out, NULL);
+    if (shard->accept_paused && --shard->accept_paused == 0) {
+        mw_shard_pause_accept(shard, false);
+    }
+}
+
+/* Register the shard's socket and wheel with its loop.  Returns 0, or an errno
+ * if the loop can't watch the socket.
+ */
+static int mw_shard_setup_loop(mw_shard *shard)
+{
+    mw_evfd_init(&shard->accept_io, shard->lfd, MW_EVFD_LISTEN);
+    int rc = mw_ev_init(&shard->accept_ev,
+                        shard->loop,
+                        &shard->accept_io,
+                        false,
+                        mw_shard_on_accept,
+                        shard);
+    if (rc) return rc;
+    mw_ev_enable(&shard->accept_ev);
+    mw_evloop_set_tick(shard->loop, shard->wheel.tick_ms, mw_shard_tick, shard);
+    return 0;
+}
+
+/* Make the shard's queue, and its suspended sources for the socket and the
+ * wheel
+ */
+static void mw_shard_setup_queue(mw_shard *shard)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "shard#%d", shard->id);
+    shard->q = dispatch_queue_create(name, NULL);
+    shard->accept_ds = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ,
+                                              shard->lfd,
+                                              0,
+                                              shard->q);
+    dispatch_set_context(shard->accept_ds, shard);
+    dispatch_source_set_event_handler_f(
+        shard->accept_ds,
+        (dispatch_function_t)mw_shard_accept_batch);
+
+    shard->tick_ds =
+        dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, shard->q);
+    dispatch_source_set_timer(shard->tick_ds,
+                              DISPATCH_TIME_NOW,
+                              shard->wheel.tick_ms * NSEC_PER_MSEC,
+                              shard->wheel.tick_ms * NSEC_PER_MSEC / 4);
+    dispatch_set_context(shard->tick_ds, shard);
+    dispatch_source_set_event_handler_f(shard->tick_ds, mw_shard_tick);
+}
+
+int mw_shards_listen(const char *port, int n, int backend)
+{
+    if (n <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        n = ncpu > 0 ? (int)ncpu : 1;
+    }
+    shards = calloc(n, sizeof(mw_shard));
+    if (!shards) return -1;
+
+    for (int i = 0; i < n; i++) {
+        mw_shard *shard = &shards[n_shards];
+        shard->lfd = mw_listen(port);
+        if (shard->lfd < 0) break;
+
+        shard->id = n_shards++;
+        shard->pool.high_water = server.req_pool_max;
+
+        mw_twheel_init(&shard->wheel, server.timer_tick_ms);
+        if (backend != MW_EVLOOP_DISPATCH) {
+            int rc;
+            shard->loop = mw_evloop_create(backend, shard->id);
+            if (!shard->loop) {
+                qfprintf(stderr,
+                         "shard#%d: no event loop (%s), using dispatch\n",
+                         shard->id,
+                         strerror(errno));
+            }
+            else if ((rc = mw_shard_setup_loop(shard))) {
+                qfprintf(stderr,
+                         "shard#%d: can't watch its socket (%s), using "
+                         "dispatch\n",
+                         shard->id,
+                         strerror(rc));
+                mw_evloop_destroy(shard->loop);
+                shard->loop = NULL;
+            }
+            else if ((rc = mw_evgroup_add(&loops, shard->loop))) {
+                // it runs its own jobs, and steals none
+                qfprintf(stderr,
+                         "shard#%d: not sharing jobs: %s\n",
+                         shard->id,
+                         strerror(rc));
+            }
+        }
+        if (!shard->loop) mw_shard_setup_queue(shard);
+    }
+
+    qprintf("listening on port %s with %d shard%s, on %s\n",
+            port,
+            n_shards,
+            n_shards == 1 ? "" : "s",
+            mw_evloop_name(n_shards && shards[0].loop ? shards[0].loop->backend
+                                                      : MW_EVLOOP_DISPATCH));
+    return n_shards ? n_shards : -1;
+}
+
+int mw_shards_start(const char *port, int n, int backend)
+{
+    if (mw_shards_listen(port, n, backend) < 0) return -1;
+
+    // one shard to a CPU, if there are enough of them
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < n_shards; i++) {
+        mw_shard *shard = &shards[i];
+        if (!shard->loop) {
+            dispatch_resume(shard->accept_ds);
+            dispatch_resume(shard->tick_ds);
+            continue;
+        }
+        int rc = mw_evloop_start(shard->loop, ncpu >= n_shards ? i : -1);
+        if (rc) {
+            qfprintf(stderr, "shard#%d: no thread: %s\n", i, strerror(rc));
+            return -1;
+        }
+    }
+    return n_shards;
+}
+
+/* The next connection on the shard's listening socket: non-blocking and
+ * close-on-exec
+ */
+static int mw_shard_accept_fd(mw_shard *shard,
+                              struct sockaddr_in *addr,
+                              socklen_t *len)
+{
+    if (shard->loop && shard->loop->backend == MW_EVLOOP_URING) {
+        // the ring's multishot accept has taken it off the backlog already
+        int s = mw_ev_accepted(&shard->accept_ev);
+        if (s >= 0) getpeername(s, (struct sockaddr *)addr, len);
+        return s;
+    }
+#if HAVE_ACCEPT4
+    return accept4(shard->lfd,
+                   (struct sockaddr *)addr,
+                   len,
+                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int s = accept(shard->lfd, (struct sockaddr *)addr, len);
+    if (s < 0) return -1;
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+    return s;
+#endif
+}
+
+int mw_shard_accept(mw_shard *shard, struct sockaddr_in *addr)
+{
+    socklen_t len = sizeof(*addr);
+    int s = mw_shard_accept_fd(shard, addr, &len);
+    if (s < 0) return -1;
+
+    int on = 1;
+    // responses go out in as few writes as we can manage, don't hold them
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+    setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    return s;
+}
+
+void mw_shard_note_batch(mw_shard *shard, int n)
+{
+    shard->accept_wakeups++;
+    if (n == 0) {
+        shard->accept_empty++;
+        return;
+    }
+    shard->accepted += n;
+    mw_stats_count(MW_STAT_ACCEPTS, n);
+    int b = 0;
+    while (n >>= 1) b++;
+    if (b >= MW_ACCEPT_BUCKETS) b = MW_ACCEPT_BUCKETS - 1;
+    shard->accept_batches[b]++;
+}
+
+void mw_shard_add(mw_shard *shard, mw_request *req)
+{
+    req->shard = shard;
+    req->shard_prev = NULL;
+    req->shard_next = shard->reqs;
+    if (shard->reqs) shard->reqs->shard_prev = req;
+    shard->reqs = req;
+    shard->n_reqs++;
+}
+
+void mw_shard_remove(mw_shard *shard, mw_request *req)
+{
+    if (req->shard_prev) {
+        req->shard_prev->shard_next = req->shard_next;
+    }
+    else {
+        shard->reqs = req->shard_next;
+    }
+    if (req->shard_next) req->shard_next->shard_prev = req->shard_prev;
+    req->shard_next = req->shard_prev = NULL;
+    shard->n_reqs--;
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,145 @@
+#ifndef MW_SHARD_H
+#define MW_SHARD_H
+
+#include "miniweb_request.h"
+#include "mw_evloop.h"
+#include "mw_reqpool.h"
+#include "mw_twheel.h"
+#include <dispatch/dispatch.h>
+
+/**
+ * @brief The most connections accepted per wakeup of a shard's accept source
+ *
+ * Bounding the loop lets the other work on the shard's queue (freeing
+ * requests) run during a connection storm.
+ */
+#define MW_ACCEPT_BATCH 64
+
+/**
+ * @brief Buckets of mw_shard's accept batch size histogram
+ *
+ * Bucket i counts wakeups that accepted 2^i to 2^(i+1)-1 connections.
+ */
+#define MW_ACCEPT_BUCKETS 7
+
+/**
+ * @brief How long a shard stops accepting after accept fails, e.g. for want
+ *        of descriptors (EMFILE, ENFILE)
+ *
+ * The connection stays in the backlog, so the source would fire again at
+ * once; instead it is disabled, and the shard's tick enables it again.
+ */
+#define MW_ACCEPT_BACKOFF_MS 100
+
+/**
+ * @brief The least time between a shard's logs of accept failures; the ones
+ *        in between are counted in the next
+ */
+#define MW_ACCEPT_LOG_NS NSEC_PER_SEC
+
+/**
+ * @brief One listening socket, and the connections accepted on it
+ *
+ * Every shard binds its own socket to the server port with SO_REUSEPORT, so
+ * the kernel spreads new connections over the shards.  A shard's accept
+ * source, request registry and request pool all belong to its queue, so
+ * accepting and freeing connections never touches anything global.  The
+ * shard's timer wheel holds its idle keep-alive connections, and turns on
+ * the shard's queue.
+ *
+ * With an event loop backend the shard's loop takes the place of its queue,
+ * and of its requests' queues too: the shard's connections are handled on
+ * its loop's thread, from accept to close.  The shards' loops form one
+ * group, so CPU-heavy jobs a connection spawns can run on any of them.
+ */
+typedef struct _mw_shard {
+    int id;                      ///< index in shards
+    int lfd;                     ///< the listening socket
+    dispatch_queue_t q;          ///< accepts, and frees, this shard's requests
+    dispatch_source_t accept_ds; ///< read events on lfd
+    mw_twheel wheel;             ///< keep-alive timeouts
+    dispatch_source_t tick_ds;   ///< turns wheel
+    mw_evloop *loop;             ///< runs the shard, or NULL under dispatch
+    mw_evfd accept_io;           ///< lfd's registration with loop
+    mw_ev accept_ev;             ///< read events on lfd, on loop
+
+    mw_request *reqs;  ///< live requests, linked through shard_next
+    int n_reqs;        ///< the number of live requests
+    int req_num;       ///< requests accepted so far, to name their queues
+    int dump_reported; ///< n_reqs at the last mw_dump_reqs
+    mw_reqpool pool;   ///< idle requests to reuse
+
+    size_t accept_wakeups; ///< times the accept source fired
+    size_t accept_empty;   ///< wakeups that found nothing to accept
+    size_t accepted;       ///< connections accepted
+    size_t accept_batches[MW_ACCEPT_BUCKETS]; ///< batch size histogram
+    unsigned accept_paused;   ///< ticks until accepting again, 0 if accepting
+    size_t accept_errors;     ///< failures since the last one logged
+    uint64_t accept_logged;   ///< when one was last logged, mw_clock_coarse_ns
+} mw_shard;
+
+extern mw_shard *shards; ///< All the shards
+extern int n_shards;     ///< The number of shards
+
+/**
+ * @brief Listen on port with n shards, ready to start
+ *
+ * Each shard gets the backend asked for, or libdispatch if that backend
+ * can't be had.  Its sources are set up, but nothing runs them yet: its
+ * queue's sources are suspended, and its loop has no thread (tests run a
+ * pass with mw_evloop_poll).
+ *
+ * @param port The port (or service name) to listen on
+ * @param n The number of shards, or 0 for one per CPU
+ * @param backend The MW_EVLOOP_* backend to run them on
+ *
+ * @return The number of shards, or -1 if no socket could be bound
+ */
+int mw_shards_listen(const char *port, int n, int backend);
+
+/**
+ * @brief Listen on port with n shards, and start accepting connections
+ *
+ * mw_shards_listen, then a thread for each loop and the queues' sources
+ * resumed.
+ *
+ * @return The number of shards started, or -1 if no socket could be bound or
+ *         a loop's thread couldn't be made
+ */
+int mw_shards_start(const char *port, int n, int backend);
+
+/**
+ * @brief Accept one connection from the shard's listening socket
+ *
+ * The socket comes back non-blocking and close-on-exec, with its socket
+ * options set.
+ *
+ * @param shard The shard
+ * @param addr Filled in with the peer's address
+ *
+ * @return The socket, or -1 with errno set
+ */
+int mw_shard_accept(mw_shard *shard, struct sockaddr_in *addr);
+
+/**
+ * @brief Count one wakeup of the accept source that accepted n connections
+ */
+void mw_shard_note_batch(mw_shard *shard, int n);
+
+/**
+ * @brief Add a newly accepted request to its shard's registry
+ *
+ * Must be called on the shard's queue, or loop.
+ */
+void mw_shard_add(mw_shard *shard, mw_request *req);
+
+/**
+ * @brief Take a request out of its shard's registry
+ *
+ * Must be called on the shard's queue, or loop.
+ */
+void mw_shard_remove(mw_shard *shard, mw_request *req);
+
+#endif /* ifndef MW_SHARD_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,205 @@
+#include "mw_slab.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The slabs are shared by every thread: the request loops take and give them
+ * back, and so do the jobs compressing for them anywhere.  A slab is 8K of
+ * compression work, next to which the lock costs nothing.
+ */
+static struct {
+    pthread_mutex_t lock;
+    mw_slab *idle;   ///< linked through next
+    size_t max_idle; ///< keep at most this many idle
+    mw_slab_usage usage;
+} slabs = {PTHREAD_MUTEX_INITIALIZER, NULL, MW_SLAB_DEFAULT_MAX_IDLE, {0}};
+
+void mw_slab_init(size_t max_idle)
+{
+    pthread_mutex_lock(&slabs.lock);
+    slabs.max_idle = max_idle;
+    pthread_mutex_unlock(&slabs.lock);
+}
+
+mw_slab *mw_slab_get(void)
+{
+    pthread_mutex_lock(&slabs.lock);
+    mw_slab *s = slabs.idle;
+    if (s) {
+        slabs.idle = s->next;
+        slabs.usage.idle--;
+    }
+    else {
+        slabs.usage.allocs++;
+    }
+    if (++slabs.usage.in_use > slabs.usage.peak) {
+        slabs.usage.peak = slabs.usage.in_use;
+    }
+    pthread_mutex_unlock(&slabs.lock);
+    if (!s && !(s = malloc(sizeof(*s)))) {
+        pthread_mutex_lock(&slabs.lock);
+        slabs.usage.in_use--;
+        slabs.usage.allocs--;
+        pthread_mutex_unlock(&slabs.lock);
+        return NULL;
+    }
+    s->next = NULL;
+    s->len = s->off = 0;
+    return s;
+}
+
+void mw_slab_put(mw_slab *s)
+{
+    mw_slab *extra = NULL;
+    pthread_mutex_lock(&slabs.lock);
+    while (s) {
+        mw_slab *next = s->next;
+        slabs.usage.in_use--;
+        if (slabs.usage.idle < slabs.max_idle) {
+            s->next = slabs.idle;
+            slabs.idle = s;
+            slabs.usage.idle++;
+        }
+        else {
+            s->next = extra;
+            extra = s;
+        }
+        s = next;
+    }
+    pthread_mutex_unlock(&slabs.lock);
+    // free outside the lock
+    while (extra) {
+        mw_slab *next = extra->next;
+        free(extra);
+        extra = next;
+    }
+}
+
+mw_slab_usage mw_slab_usage_get(void)
+{
+    pthread_mutex_lock(&slabs.lock);
+    mw_slab_usage u = slabs.usage;
+    pthread_mutex_unlock(&slabs.lock);
+    return u;
+}
+
+void mw_slab_drain(void)
+{
+    pthread_mutex_lock(&slabs.lock);
+    mw_slab *s = slabs.idle;
+    slabs.idle = NULL;
+    slabs.usage.idle = 0;
+    pthread_mutex_unlock(&slabs.lock);
+    while (s) {
+        mw_slab *next = s->next;
+        free(s);
+        s = next;
+    }
+}
+
+/* Put s at the end of q */
+static void slabq_push(mw_slabq *q, mw_slab *s)
+{
+    if (q->tail) {
+        q->tail->next = s;
+    }
+    else {
+        q->head = s;
+    }
+    q->tail = s;
+    q->n++;
+}
+
+size_t mw_slabq_room(mw_slabq *q, unsigned max, unsigned char **into)
+{
+    if (!q->tail || q->tail->len == MW_SLAB_SZ) {
+        if (q->n >= max) return 0;
+        mw_slab *s = mw_slab_get();
+        if (!s) return 0;
+        slabq_push(q, s);
+    }
+    *into = q->tail->data + q->tail->len;
+    return MW_SLAB_SZ - q->tail->len;
+}
+
+void mw_slabq_used_into(mw_slabq *q, size_t used)
+{
+    if (!used) return;
+    assert(q->tail && q->tail->len + used <= MW_SLAB_SZ);
+    q->tail->len += used;
+    q->bytes += used;
+}
+
+bool mw_slabq_write(mw_slabq *q, const void *p, size_t len)
+{
+    const unsigned char *c = p;
+    while (len) {
+        unsigned char *into;
+        size_t room = mw_slabq_room(q, -1, &into);
+        if (!room) return false;
+        if (room > len) room = len;
+        memcpy(into, c, room);
+        mw_slabq_used_into(q, room);
+        c += room;
+        len -= room;
+    }
+    return true;
+}
+
+void mw_slabq_append(mw_slabq *q, mw_slab *chain)
+{
+    while (chain) {
+        mw_slab *next = chain->next;
+        chain->next = NULL;
+        if (chain->len == chain->off) {
+            mw_slab_put(chain);
+        }
+        else {
+            slabq_push(q, chain);
+            q->bytes += chain->len - chain->off;
+        }
+        chain = next;
+    }
+}
+
+int mw_slabq_outof_iov(mw_slabq *q, struct iovec *iov, int max)
+{
+    int n = 0;
+    for (mw_slab *s = q->head; s && n < max; s = s->next) {
+        if (s->len == s->off) continue;
+        iov[n].iov_base = s->data + s->off;
+        iov[n].iov_len = s->len - s->off;
+        n++;
+    }
+    return n;
+}
+
+void mw_slabq_used_outof(mw_slabq *q, size_t used)
+{
+    assert(used <= q->bytes);
+    q->bytes -= used;
+    while (q->head) {
+        mw_slab *s = q->head;
+        size_t avail = s->len - s->off;
+        size_t take = used < avail ? used : avail;
+        s->off += take;
+        used -= take;
+        // even the tail goes once it is all taken, room and all
+        if (s->off < s->len) break;
+        q->head = s->next;
+        if (!q->head) q->tail = NULL;
+        q->n--;
+        s->next = NULL;
+        mw_slab_put(s);
+    }
+    assert(!used);
+}
+
+void mw_slabq_clear(mw_slabq *q)
+{
+    mw_slab_put(q->head);
+    memset(q, 0, sizeof(*q));
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,152 @@
+#ifndef MW_SLAB_H
+#define MW_SLAB_H
+
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief The bytes of data a slab holds
+ */
+#define MW_SLAB_SZ (8 * 1024)
+
+/**
+ * @brief The default number of idle slabs kept for reuse
+ */
+#define MW_SLAB_DEFAULT_MAX_IDLE 4096
+
+/**
+ * @brief The slabs a connection compresses into before it waits for the
+ *        network to empty one
+ */
+#define MW_SLABQ_MAX 4
+
+/**
+ * @brief The most iovecs mw_slabq_outof_iov is asked for in one go
+ */
+#define MW_SLABQ_IOV 8
+
+/**
+ * @brief A fixed size piece of output, from the shared pool
+ */
+typedef struct _mw_slab {
+    struct _mw_slab *next; ///< the slab after it in its queue
+    unsigned len;          ///< bytes written into data
+    unsigned off;          ///< bytes of them taken out again
+    unsigned char data[MW_SLAB_SZ];
+} mw_slab;
+
+/**
+ * @brief The pool's use of memory, for stats and tests
+ */
+typedef struct _mw_slab_usage {
+    size_t in_use; ///< slabs handed out
+    size_t idle;   ///< slabs kept for reuse
+    size_t peak;   ///< most slabs ever in use at once
+    size_t allocs; ///< slabs that had to be allocated
+} mw_slab_usage;
+
+/**
+ * @brief Output made of slabs, taken out in the order it was put in
+ *
+ * A queue only holds slabs while it holds data: each slab goes back to the
+ * pool as soon as it has been taken out of, so an idle connection costs
+ * nothing.
+ */
+typedef struct _mw_slabq {
+    mw_slab *head; ///< taken out of at head->off, NULL if empty
+    mw_slab *tail; ///< written into at tail->len
+    unsigned n;    ///< the slabs held
+    size_t bytes;  ///< the bytes ready to be taken out
+} mw_slabq;
+
+/**
+ * @brief Set how many idle slabs the pool keeps
+ *
+ * @param max_idle Idle slabs beyond this are freed
+ */
+void mw_slab_init(size_t max_idle);
+
+/**
+ * @brief Take an empty slab from the pool, allocating it if there is none.
+ *        Thread safe.
+ *
+ * @return The slab, or NULL if there was none and no memory for one
+ */
+mw_slab *mw_slab_get(void);
+
+/**
+ * @brief Give a chain of slabs, linked through next, back to the pool.
+ *        Thread safe.
+ */
+void mw_slab_put(mw_slab *s);
+
+/**
+ * @brief How much memory the pool is using
+ */
+mw_slab_usage mw_slab_usage_get(void);
+
+/**
+ * @brief Free the idle slabs
+ */
+void mw_slab_drain(void);
+
+/**
+ * @brief Find room to write into, without going over max slabs
+ *
+ * @param q The queue
+ * @param max The slabs the queue may hold
+ * @param into Set to where the room starts
+ *
+ * @return The bytes of room, 0 if the queue already holds max full slabs or
+ *         there is no memory for another
+ */
+size_t mw_slabq_room(mw_slabq *q, unsigned max, unsigned char **into);
+
+/**
+ * @brief Account for data written into the room from mw_slabq_room
+ */
+void mw_slabq_used_into(mw_slabq *q, size_t used);
+
+/**
+ * @brief Copy data in, taking as many slabs as it needs
+ *
+ * @return false if there was no memory for a slab, with what fit written
+ */
+bool mw_slabq_write(mw_slabq *q, const void *p, size_t len);
+
+/**
+ * @brief Put a chain of slabs, linked through next, at the end of the queue
+ *
+ * The chain's data follows the queue's; the queue owns its slabs afterwards.
+ */
+void mw_slabq_append(mw_slabq *q, mw_slab *chain);
+
+/**
+ * @brief Describe the data ready to be taken out, suitable for writev
+ *
+ * @param q The queue
+ * @param iov Filled in with a region per slab
+ * @param max The room in iov
+ *
+ * @return The number of iovecs used, 0 if the queue is empty
+ */
+int mw_slabq_outof_iov(mw_slabq *q, struct iovec *iov, int max);
+
+/**
+ * @brief Account for data taken out, giving emptied slabs back to the pool
+ */
+void mw_slabq_used_outof(mw_slabq *q, size_t used);
+
+/**
+ * @brief Drop all the data, giving every slab back to the pool
+ */
+void mw_slabq_clear(mw_slabq *q);
+
+___END_DECLS
+#endif /* ifndef MW_SLAB_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
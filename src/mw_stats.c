@@ -0,0 +1,271 @@
+#include "mw_stats.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A histogram as a thread records into it */
+typedef struct {
+    _Atomic uint64_t counts[MW_HIST_BUCKETS];
+    _Atomic uint64_t n, sum, max;
+} stats_hist;
+
+/* One thread's counters and histograms.  Only the owning thread writes them,
+ * so an update is a relaxed load and store rather than a locked add; the
+ * snapshot reads them with relaxed loads, and may be a moment behind.
+ */
+typedef struct _stats_block {
+    struct _stats_block *next; ///< in st.blocks
+    _Atomic bool orphaned;     ///< the owning thread has exited
+    _Atomic uint64_t counters[MW_STAT_N_COUNTERS];
+    stats_hist hists[MW_HIST_N];
+} stats_block;
+
+static struct {
+    pthread_mutex_t lock; ///< protects blocks
+    stats_block *blocks;  ///< every thread's block, never freed
+    pthread_once_t once;
+    pthread_key_t key; ///< marks a thread's block orphaned when it exits
+} st = {.lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT};
+
+static _Thread_local stats_block *my_block;
+
+static const char *counter_names[MW_STAT_N_COUNTERS] = {
+    "accepts",
+    "closes",
+    "timeouts",
+    "requests",
+    "deflate_in_bytes",
+    "deflate_out_bytes",
+    "buffer_growths",
+    "compress_skipped_type",
+    "compress_skipped_load",
+    "compress_level_lowered",
+    "compress_level_raised",
+};
+
+static const char *hist_names[MW_HIST_N] = {
+    "ttfb_us",
+    "latency_us",
+    "response_bytes",
+    "compress_level",
+    "cpu_load_permille",
+};
+
+static const struct {
+    const char *name;
+    double q;
+} quantiles[] = {
+    {"p50", 0.5},
+    {"p90", 0.9},
+    {"p99", 0.99},
+    {"p999", 0.999},
+};
+
+static void stats_orphan(void *block)
+{
+    atomic_store(&((stats_block *)block)->orphaned, true);
+}
+
+static void stats_key_init(void)
+{
+    pthread_key_create(&st.key, stats_orphan);
+}
+
+/* Find this thread a block: one left by a thread that has exited (its counts
+ * still count), or a new one
+ */
+static stats_block *stats_block_get(void)
+{
+    pthread_once(&st.once, stats_key_init);
+    pthread_mutex_lock(&st.lock);
+    stats_block *b;
+    for (b = st.blocks; b; b = b->next) {
+        if (atomic_load(&b->orphaned)) break;
+    }
+    if (b) {
+        atomic_store(&b->orphaned, false);
+    }
+    else {
+        b = calloc(1, sizeof(*b));
+        assert(b);
+        b->next = st.blocks;
+        st.blocks = b;
+    }
+    pthread_mutex_unlock(&st.lock);
+    pthread_setspecific(st.key, b);
+    return b;
+}
+
+static void bump(_Atomic uint64_t *c, uint64_t n)
+{
+    atomic_store_explicit(c,
+                          atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+void mw_stats_count(mw_stat_counter c, uint64_t n)
+{
+    if (!my_block) my_block = stats_block_get();
+    bump(&my_block->counters[c], n);
+}
+
+unsigned mw_hist_bucket(uint64_t v)
+{
+    if (v < (1u << MW_HIST_SUB_BITS)) return v;
+    if (v >> MW_HIST_MAX_BITS) return MW_HIST_BUCKETS - 1;
+    unsigned shift = 63 - __builtin_clzll(v) - MW_HIST_SUB_BITS;
+    return ((shift + 1) << MW_HIST_SUB_BITS) +
+           (unsigned)(v >> shift) - (1u << MW_HIST_SUB_BITS);
+}
+
+uint64_t mw_hist_bucket_max(unsigned b)
+{
+    if (b < (1u << MW_HIST_SUB_BITS)) return b;
+    if (b == MW_HIST_BUCKETS - 1) return UINT64_MAX;
+    unsigned shift = (b >> MW_HIST_SUB_BITS) - 1;
+    uint64_t sub = (b & ((1u << MW_HIST_SUB_BITS) - 1)) +
+                   (1u << MW_HIST_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+void mw_stats_record(mw_stat_hist h, uint64_t v)
+{
+    if (!my_block) my_block = stats_block_get();
+    stats_hist *hist = &my_block->hists[h];
+    bump(&hist->counts[mw_hist_bucket(v)], 1);
+    bump(&hist->n, 1);
+    bump(&hist->sum, v);
+    if (v > atomic_load_explicit(&hist->max, memory_order_relaxed)) {
+        atomic_store_explicit(&hist->max, v, memory_order_relaxed);
+    }
+}
+
+uint64_t mw_hist_quantile(const mw_hist *h, double q)
+{
+    if (h->n == 0) return 0;
+    uint64_t rank = (uint64_t)(q * h->n);
+    if (rank >= h->n) rank = h->n - 1;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < MW_HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen > rank) {
+            uint64_t top = mw_hist_bucket_max(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+void mw_stats_snapshot(uint64_t counters[MW_STAT_N_COUNTERS],
+                       mw_hist hists[MW_HIST_N])
+{
+    memset(counters, 0, MW_STAT_N_COUNTERS * sizeof(*counters));
+    memset(hists, 0, MW_HIST_N * sizeof(*hists));
+
+    pthread_mutex_lock(&st.lock);
+    stats_block *blocks = st.blocks;
+    pthread_mutex_unlock(&st.lock);
+
+    // blocks are only ever added at the head, so walking without the lock is
+    // safe
+    for (stats_block *b = blocks; b; b = b->next) {
+        for (int c = 0; c < MW_STAT_N_COUNTERS; c++) {
+            counters[c] += atomic_load_explicit(&b->counters[c],
+                                                memory_order_relaxed);
+        }
+        for (int i = 0; i < MW_HIST_N; i++) {
+            mw_hist *h = &hists[i];
+            for (unsigned k = 0; k < MW_HIST_BUCKETS; k++) {
+                h->counts[k] += atomic_load_explicit(&b->hists[i].counts[k],
+                                                     memory_order_relaxed);
+            }
+            h->n += atomic_load_explicit(&b->hists[i].n, memory_order_relaxed);
+            h->sum +=
+                atomic_load_explicit(&b->hists[i].sum, memory_order_relaxed);
+            uint64_t max =
+                atomic_load_explicit(&b->hists[i].max, memory_order_relaxed);
+            if (max > h->max) h->max = max;
+        }
+    }
+}
+
+void mw_stats_json(mw_buffer *b)
+{
+    uint64_t counters[MW_STAT_N_COUNTERS];
+    mw_hist *hists = malloc(MW_HIST_N * sizeof(*hists));
+    assert(hists);
+    mw_stats_snapshot(counters, hists);
+
+    buf_sprintf(b, "{\"counters\":{");
+    for (int c = 0; c < MW_STAT_N_COUNTERS; c++) {
+        buf_sprintf(b,
+                    "%s\"%s\":%llu",
+                    c ? "," : "",
+                    counter_names[c],
+                    (unsigned long long)counters[c]);
+    }
+    buf_sprintf(b, "},\"histograms\":{");
+    for (int i = 0; i < MW_HIST_N; i++) {
+        const mw_hist *h = &hists[i];
+        buf_sprintf(b,
+                    "%s\"%s\":{\"count\":%llu,\"sum\":%llu,\"max\":%llu",
+                    i ? "," : "",
+                    hist_names[i],
+                    (unsigned long long)h->n,
+                    (unsigned long long)h->sum,
+                    (unsigned long long)h->max);
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(*quantiles); q++) {
+            buf_sprintf(b,
+                        ",\"%s\":%llu",
+                        quantiles[q].name,
+                        (unsigned long long)mw_hist_quantile(h,
+                                                             quantiles[q].q));
+        }
+        buf_sprintf(b, "}");
+    }
+    buf_sprintf(b, "}}\n");
+    free(hists);
+}
+
+void mw_stats_prometheus(mw_buffer *b)
+{
+    uint64_t counters[MW_STAT_N_COUNTERS];
+    mw_hist *hists = malloc(MW_HIST_N * sizeof(*hists));
+    assert(hists);
+    mw_stats_snapshot(counters, hists);
+
+    for (int c = 0; c < MW_STAT_N_COUNTERS; c++) {
+        buf_sprintf(b,
+                    "# TYPE miniweb_%s_total counter\n"
+                    "miniweb_%s_total %llu\n",
+                    counter_names[c],
+                    counter_names[c],
+                    (unsigned long long)counters[c]);
+    }
+    for (int i = 0; i < MW_HIST_N; i++) {
+        const mw_hist *h = &hists[i];
+        const char *name = hist_names[i];
+        buf_sprintf(b, "# TYPE miniweb_%s summary\n", name);
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(*quantiles); q++) {
+            buf_sprintf(b,
+                        "miniweb_%s{quantile=\"%g\"} %llu\n",
+                        name,
+                        quantiles[q].q,
+                        (unsigned long long)mw_hist_quantile(h,
+                                                             quantiles[q].q));
+        }
+        buf_sprintf(b,
+                    "miniweb_%s_sum %llu\n"
+                    "miniweb_%s_count %llu\n",
+                    name,
+                    (unsigned long long)h->sum,
+                    name,
+                    (unsigned long long)h->n);
+    }
+    free(hists);
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,121 @@
+#ifndef MW_STATS_H
+#define MW_STATS_H
+
+#include "config.h"
+#include "mw_buffer.h"
+#include <stdint.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief Sub-buckets per power of two in a histogram, as a power of two
+ *
+ * 4 gives 16 sub-buckets, so a bucket is at most 1/16 (about 6%) wide.
+ */
+#define MW_HIST_SUB_BITS 4
+
+/**
+ * @brief Values at or above 2^MW_HIST_MAX_BITS land in the last bucket
+ */
+#define MW_HIST_MAX_BITS 40
+
+/**
+ * @brief The number of buckets in a histogram
+ */
+#define MW_HIST_BUCKETS                                                        \
+    ((MW_HIST_MAX_BITS - MW_HIST_SUB_BITS + 1) << MW_HIST_SUB_BITS)
+
+typedef enum {
+    MW_STAT_ACCEPTS,     ///< connections accepted
+    MW_STAT_CLOSES,      ///< connections closed
+    MW_STAT_TIMEOUTS,    ///< keep-alive connections closed for idling
+    MW_STAT_REQUESTS,    ///< responses finished
+    MW_STAT_DEFLATE_IN,  ///< bytes fed to streamed compression
+    MW_STAT_DEFLATE_OUT, ///< bytes streamed compression produced
+    MW_STAT_BUF_GROWTHS, ///< mw_buffer reallocations
+    MW_STAT_Z_SKIP_TYPE, ///< uncompressed, the content type isn't worth it
+    MW_STAT_Z_SKIP_LOAD, ///< uncompressed, the CPU is too busy, see mw_zctl
+    MW_STAT_Z_LOWERED,   ///< compressed below the engine's level
+    MW_STAT_Z_RAISED,    ///< compressed above the engine's level
+    MW_STAT_N_COUNTERS,
+} mw_stat_counter;
+
+typedef enum {
+    MW_HIST_TTFB_US,    ///< from the start of a response to its first byte out
+    MW_HIST_LATENCY_US, ///< from the start of a response to its last byte out
+    MW_HIST_RESP_BYTES, ///< body bytes per response
+    MW_HIST_Z_LEVEL,    ///< level of each response compressed on the fly
+    MW_HIST_CPU_LOAD,   ///< CPU use in permille, at each of those decisions
+    MW_HIST_N,
+} mw_stat_hist;
+
+/**
+ * @brief A log-linear (HDR style) histogram
+ *
+ * Values below 2^MW_HIST_SUB_BITS get a bucket each; above that every power
+ * of two is split into 2^MW_HIST_SUB_BITS equal buckets.
+ */
+typedef struct _mw_hist {
+    uint64_t counts[MW_HIST_BUCKETS];
+    uint64_t n;   ///< values recorded
+    uint64_t sum; ///< their total
+    uint64_t max; ///< the largest
+} mw_hist;
+
+/**
+ * @brief Add n to a counter
+ *
+ * Each thread counts into its own block, so this takes no locks and no
+ * locked instructions.
+ */
+void mw_stats_count(mw_stat_counter c, uint64_t n);
+
+/**
+ * @brief Record one value in a histogram, in the calling thread's block
+ */
+void mw_stats_record(mw_stat_hist h, uint64_t v);
+
+/**
+ * @brief Which bucket of a histogram v belongs in
+ */
+unsigned mw_hist_bucket(uint64_t v);
+
+/**
+ * @brief The largest value that lands in bucket b
+ */
+uint64_t mw_hist_bucket_max(unsigned b);
+
+/**
+ * @brief Estimate a quantile of a histogram
+ *
+ * @param h The histogram
+ * @param q The quantile, 0 to 1
+ *
+ * @return The top of the bucket holding the quantile (but no more than the
+ *         largest value recorded), or 0 for an empty histogram
+ */
+uint64_t mw_hist_quantile(const mw_hist *h, double q);
+
+/**
+ * @brief Add up every thread's counters and histograms
+ *
+ * @param counters Filled in with the totals
+ * @param hists Filled in with the merged histograms
+ */
+void mw_stats_snapshot(uint64_t counters[MW_STAT_N_COUNTERS],
+                       mw_hist hists[MW_HIST_N]);
+
+/**
+ * @brief Write a snapshot of the stats as a JSON object
+ */
+void mw_stats_json(mw_buffer *b);
+
+/**
+ * @brief Write a snapshot of the stats in the Prometheus text format
+ */
+void mw_stats_prometheus(mw_buffer *b);
+
+___END_DECLS
+#endif /* ifndef MW_STATS_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,150 @@
+#include "mw_twheel.h"
+#include "mw_clock.h"
+#include <assert.h>
+
+#define SLOT_MASK (MW_TWHEEL_SLOTS - 1)
+
+static uint64_t now_ms(void)
+{
+    return mw_clock_coarse_ns() / 1000000;
+}
+
+static void tw_unlink(mw_timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+static void tw_push(mw_timer *head, mw_timer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/* Link t into the slot its expiry falls in, as seen from tick w->now */
+static void tw_place(mw_twheel *w, mw_timer *t)
+{
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < MW_TWHEEL_LEVELS - 1 &&
+           delta >= (uint64_t)1 << (MW_TWHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    uint64_t when = t->expires;
+    if (level == MW_TWHEEL_LEVELS - 1) {
+        // too far out for the wheel: park it in the furthest slot, it is
+        // placed again when that slot comes round
+        uint64_t max = ((uint64_t)1 << (MW_TWHEEL_BITS * MW_TWHEEL_LEVELS)) - 1;
+        if (delta > max) when = w->now + max;
+    }
+    unsigned slot = (when >> (MW_TWHEEL_BITS * level)) & SLOT_MASK;
+    tw_push(&w->slots[level][slot], t);
+}
+
+void mw_twheel_init(mw_twheel *w, unsigned tick_ms)
+{
+    pthread_mutex_init(&w->lock, NULL);
+    w->tick_ms = tick_ms ? tick_ms : MW_TWHEEL_DEFAULT_TICK_MS;
+    w->start_ms = now_ms();
+    w->now = 0;
+    w->n = 0;
+    for (int l = 0; l < MW_TWHEEL_LEVELS; l++) {
+        for (int s = 0; s < MW_TWHEEL_SLOTS; s++) {
+            w->slots[l][s].prev = w->slots[l][s].next = &w->slots[l][s];
+        }
+    }
+}
+
+unsigned mw_twheel_arm(mw_twheel *w, mw_timer *t, uint64_t ms)
+{
+    pthread_mutex_lock(&w->lock);
+    if (t->next) {
+        tw_unlink(t);
+    }
+    else {
+        w->n++;
+    }
+    // round up, and count the tick under way as already gone
+    t->expires = w->now + 1 + (ms + w->tick_ms - 1) / w->tick_ms;
+    tw_place(w, t);
+    unsigned gen = ++t->gen;
+    pthread_mutex_unlock(&w->lock);
+    return gen;
+}
+
+unsigned mw_twheel_arm_within(mw_twheel *w, mw_timer *t, uint64_t ms)
+{
+    // the tick under way ends within a tick, so round down
+    uint64_t ticks = ms / w->tick_ms;
+    if (!ticks) ticks = 1;
+    return mw_twheel_arm(w, t, (ticks - 1) * w->tick_ms);
+}
+
+void mw_twheel_disarm(mw_twheel *w, mw_timer *t)
+{
+    pthread_mutex_lock(&w->lock);
+    if (t->next) {
+        tw_unlink(t);
+        w->n--;
+    }
+    t->gen++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Move the timers in a slot of a higher level down to where they now belong
+ */
+static void tw_cascade(mw_twheel *w, int level, unsigned slot)
+{
+    mw_timer *head = &w->slots[level][slot];
+    mw_timer list = {&list, &list, 0, 0};
+    if (head->next == head) return;
+    // take the whole list, then place each timer again
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    head->next = head->prev = head;
+    while (list.next != &list) {
+        mw_timer *t = list.next;
+        tw_unlink(t);
+        tw_place(w, t);
+    }
+}
+
+size_t mw_twheel_advance(mw_twheel *w,
+                         uint64_t tick,
+                         mw_timer_fn fn,
+                         void *ctx)
+{
+    size_t fired = 0;
+    pthread_mutex_lock(&w->lock);
+    while (w->now < tick) {
+        w->now++;
+        // when a level wraps, bring the next level's slot down
+        for (int l = 1; l < MW_TWHEEL_LEVELS; l++) {
+            if (w->now & (((uint64_t)1 << (MW_TWHEEL_BITS * l)) - 1)) break;
+            tw_cascade(w, l, (w->now >> (MW_TWHEEL_BITS * l)) & SLOT_MASK);
+        }
+        mw_timer *head = &w->slots[0][w->now & SLOT_MASK];
+        while (head->next != head) {
+            mw_timer *t = head->next;
+            assert(t->expires <= w->now);
+            tw_unlink(t);
+            w->n--;
+            fired++;
+            fn(t, t->gen, ctx);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return fired;
+}
+
+size_t mw_twheel_expire(mw_twheel *w, mw_timer_fn fn, void *ctx)
+{
+    return mw_twheel_advance(w, (now_ms() - w->start_ms) / w->tick_ms, fn, ctx);
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,131 @@
+#ifndef MW_TWHEEL_H
+#define MW_TWHEEL_H
+
+#include "config.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief Slots per level of a timer wheel, as a power of two
+ */
+#define MW_TWHEEL_BITS 6
+
+/**
+ * @brief Slots per level of a timer wheel
+ */
+#define MW_TWHEEL_SLOTS (1 << MW_TWHEEL_BITS)
+
+/**
+ * @brief Levels of a timer wheel
+ *
+ * Level n holds timers due within MW_TWHEEL_SLOTS^(n+1) ticks.  With 100ms
+ * ticks the four levels reach 6.4 seconds, 7 minutes, 7 hours and 19 days;
+ * anything further out waits in the last level.
+ */
+#define MW_TWHEEL_LEVELS 4
+
+/**
+ * @brief The default length of a tick, in milliseconds
+ */
+#define MW_TWHEEL_DEFAULT_TICK_MS 100
+
+/**
+ * @brief A timer, kept in the structure it times out
+ *
+ * A zeroed timer is disarmed.
+ */
+typedef struct _mw_timer {
+    struct _mw_timer *prev; ///< in its slot's list, NULL when disarmed
+    struct _mw_timer *next; ///< in its slot's list, NULL when disarmed
+    uint64_t expires;       ///< the tick it is due on
+    unsigned gen;           ///< bumped by every arm and disarm
+} mw_timer;
+
+/**
+ * @brief A hierarchical timing wheel
+ *
+ * Arming, re-arming and disarming a timer are O(1): a timer is linked into
+ * the slot of the level its expiry falls in, and as the wheel turns the
+ * timers in a higher level's slot are moved down a level, until they reach
+ * level 0 and expire.  The wheel is locked, so timers can be armed from any
+ * queue while it turns on another.
+ */
+typedef struct _mw_twheel {
+    pthread_mutex_t lock;
+    unsigned tick_ms;  ///< length of a tick
+    uint64_t start_ms; ///< the clock at tick 0
+    uint64_t now;      ///< the last tick processed
+    size_t n;          ///< armed timers
+
+    mw_timer slots[MW_TWHEEL_LEVELS][MW_TWHEEL_SLOTS]; ///< list heads
+} mw_twheel;
+
+/**
+ * @brief Called for each timer that expires, with the wheel locked
+ *
+ * It must not arm or disarm timers on the same wheel.  The timer has already
+ * been disarmed; gen tells a later arm or disarm apart from this expiry.
+ */
+typedef void (*mw_timer_fn)(mw_timer *t, unsigned gen, void *ctx);
+
+/**
+ * @brief Set up an empty wheel
+ *
+ * @param w The wheel
+ * @param tick_ms The length of a tick, in milliseconds
+ */
+void mw_twheel_init(mw_twheel *w, unsigned tick_ms);
+
+/**
+ * @brief Arm a timer to expire in ms milliseconds, re-arming it if armed
+ *
+ * The timer expires on the first tick at least ms after now.
+ *
+ * @return The timer's new generation
+ */
+unsigned mw_twheel_arm(mw_twheel *w, mw_timer *t, uint64_t ms);
+
+/**
+ * @brief Arm a timer to expire no later than ms milliseconds from now,
+ *        re-arming it if armed
+ *
+ * The timer expires on the last tick at most ms after now, and no sooner than
+ * the next: a wait shorter than a tick takes a tick.
+ *
+ * @return The timer's new generation
+ */
+unsigned mw_twheel_arm_within(mw_twheel *w, mw_timer *t, uint64_t ms);
+
+/**
+ * @brief Disarm a timer, if it is armed
+ */
+void mw_twheel_disarm(mw_twheel *w, mw_timer *t);
+
+/**
+ * @brief Turn the wheel up to the current time, expiring what is due
+ *
+ * @param w The wheel
+ * @param fn Called for each expired timer
+ * @param ctx Passed to fn
+ *
+ * @return The number of timers expired
+ */
+size_t mw_twheel_expire(mw_twheel *w, mw_timer_fn fn, void *ctx);
+
+/**
+ * @brief Turn the wheel to tick, expiring what is due by then
+ *
+ * mw_twheel_expire with the clock reading given as a tick, for tests.
+ */
+size_t mw_twheel_advance(mw_twheel *w,
+                         uint64_t tick,
+                         mw_timer_fn fn,
+                         void *ctx);
+
+___END_DECLS
+#endif /* ifndef MW_TWHEEL_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
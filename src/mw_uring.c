@@ -0,0 +1,260 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for syscall, MAP_ANONYMOUS and MAP_POPULATE
+#endif
+#include "mw_uring.h"
+
+#if HAVE_IO_URING
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd,
+                     unsigned submit,
+                     unsigned wait,
+                     unsigned flags,
+                     void *arg,
+                     size_t sz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, sz);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+int mw_uring_init(mw_uring *r, unsigned entries)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // handlers run between waits anyway, don't interrupt them for task work,
+    // just flag it so a pass that doesn't wait still enters the kernel
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN |
+              IORING_SETUP_TASKRUN_FLAG;
+    p.cq_entries = entries * 4;
+    int fd = sys_setup(entries, &p);
+    if (fd < 0 && errno == EINVAL) {
+        p.flags = IORING_SETUP_CQSIZE;
+        fd = sys_setup(entries, &p);
+    }
+    if (fd < 0) return -errno;
+    r->fd = fd;
+    r->features = p.features;
+    // we wait with a timeout, and map the rings in one go
+    unsigned need = IORING_FEAT_EXT_ARG | IORING_FEAT_SINGLE_MMAP |
+                    IORING_FEAT_NODROP;
+    if ((p.features & need) != need) {
+        mw_uring_exit(r);
+        return -ENOSYS;
+    }
+
+    r->sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_sz > r->sq_map_sz) r->sq_map_sz = cq_sz;
+    r->sq_map = mmap(NULL,
+                     r->sq_map_sz,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE,
+                     fd,
+                     IORING_OFF_SQ_RING);
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL,
+                   r->sqes_sz,
+                   PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE,
+                   fd,
+                   IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+        int e = errno;
+        if (r->sq_map == MAP_FAILED) r->sq_map = NULL;
+        if (r->sqes == MAP_FAILED) r->sqes = NULL;
+        mw_uring_exit(r);
+        return -e;
+    }
+
+    char *sq = r->sq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+    r->sqe_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)(sq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(sq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(sq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+    return 0;
+}
+
+void mw_uring_exit(mw_uring *r)
+{
+    if (r->sqes) munmap(r->sqes, r->sqes_sz);
+    if (r->sq_map) munmap(r->sq_map, r->sq_map_sz);
+    if (r->fd >= 0) close(r->fd);
+    r->sqes = NULL;
+    r->sq_map = NULL;
+    r->fd = -1;
+}
+
+bool mw_uring_supports(mw_uring *r, const uint8_t *ops, int n)
+{
+    size_t sz = sizeof(struct io_uring_probe) +
+                256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, sz);
+    if (!probe) return false;
+    bool ok = sys_register(r->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int i = 0; ok && i < n; i++) {
+        ok = ops[i] <= probe->last_op &&
+             (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+/* Make the SQEs we have filled in visible to the kernel, returning how many
+ * it hasn't taken yet
+ */
+static unsigned sq_flush(mw_uring *r)
+{
+    unsigned tail = *r->sq_tail;
+    while (tail != r->sqe_tail) {
+        r->sq_array[tail & r->sq_mask] = tail & r->sq_mask;
+        tail++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+    return tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *mw_uring_sqe(mw_uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail - head >= r->sq_entries) {
+        sys_enter(r->fd, sq_flush(r), 0, 0, NULL, 0);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sqe_tail - head >= r->sq_entries) return NULL;
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail++ & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int mw_uring_enter(mw_uring *r, int timeout_ms)
+{
+    unsigned submit = sq_flush(r);
+    // completions may be waiting on us to enter the kernel to post them
+    bool taskrun = __atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) &
+                   IORING_SQ_TASKRUN;
+    if (timeout_ms == 0 || mw_uring_peek(r)) {
+        if (!submit && !taskrun) return 0;
+        unsigned flags = taskrun ? IORING_ENTER_GETEVENTS : 0;
+        int rc = sys_enter(r->fd, submit, 0, flags, NULL, 0);
+        return rc < 0 ? -errno : rc;
+    }
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms > 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    int rc = sys_enter(r->fd,
+                       submit,
+                       1,
+                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                       &arg,
+                       sizeof(arg));
+    return rc < 0 ? -errno : rc;
+}
+
+struct io_uring_cqe *mw_uring_peek(mw_uring *r)
+{
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+void mw_uring_seen(mw_uring *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int mw_uring_bufs_init(mw_uring *r,
+                       mw_uring_bufs *b,
+                       unsigned n,
+                       unsigned sz,
+                       uint16_t bgid)
+{
+    memset(b, 0, sizeof(*b));
+    size_t ring_sz = n * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL,
+                      ring_sz,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0);
+    if (ring == MAP_FAILED) return -errno;
+    b->base = malloc((size_t)n * sz);
+    if (!b->base) {
+        munmap(ring, ring_sz);
+        return -ENOMEM;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = n;
+    reg.bgid = bgid;
+    if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int e = errno;
+        munmap(ring, ring_sz);
+        free(b->base);
+        b->base = NULL;
+        return -e;
+    }
+    b->ring = ring;
+    b->n = n;
+    b->sz = sz;
+    b->bgid = bgid;
+    for (unsigned i = 0; i < n; i++) mw_uring_buf_put(b, i);
+    return 0;
+}
+
+void mw_uring_bufs_exit(mw_uring_bufs *b)
+{
+    if (b->ring) munmap(b->ring, b->n * sizeof(struct io_uring_buf));
+    free(b->base);
+    b->ring = NULL;
+    b->base = NULL;
+}
+
+void mw_uring_buf_put(mw_uring_bufs *b, uint16_t bid)
+{
+    struct io_uring_buf *buf = &b->ring->bufs[b->tail & (b->n - 1)];
+    buf->addr = (uint64_t)(uintptr_t)mw_uring_buf(b, bid);
+    buf->len = b->sz;
+    buf->bid = bid;
+    __atomic_store_n(&b->ring->tail, ++b->tail, __ATOMIC_RELEASE);
+}
+
+char *mw_uring_buf(mw_uring_bufs *b, uint16_t bid)
+{
+    return b->base + (size_t)bid * b->sz;
+}
+
+#endif /* HAVE_IO_URING */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
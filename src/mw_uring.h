@@ -0,0 +1,138 @@
+#ifndef MW_URING_H
+#define MW_URING_H
+
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief An io_uring instance, mapped into our address space
+ *
+ * Just the parts of liburing the event loop needs, on the raw system calls.
+ * SQEs are filled in with mw_uring_sqe and go to the kernel with the next
+ * mw_uring_enter; completions are read with mw_uring_peek and mw_uring_seen.
+ * A ring belongs to one thread.
+ */
+typedef struct _mw_uring {
+    int fd;              ///< the ring, -1 before mw_uring_init
+    unsigned features;   ///< IORING_FEAT_* the kernel offers
+    unsigned *sq_head;   ///< kernel's SQ consumer index
+    unsigned *sq_tail;   ///< our SQ producer index, as the kernel sees it
+    unsigned *sq_array;  ///< SQ ring: indexes into sqes
+    unsigned sq_mask;    ///< SQ ring entries - 1
+    unsigned sq_entries; ///< SQ ring entries
+    unsigned *sq_flags;  ///< IORING_SQ_* the kernel sets
+    unsigned sqe_tail;   ///< our SQ producer index, including unpublished
+    struct io_uring_sqe *sqes; ///< the SQEs
+
+    unsigned *cq_head;   ///< our CQ consumer index
+    unsigned *cq_tail;   ///< kernel's CQ producer index
+    unsigned cq_mask;    ///< CQ ring entries - 1
+    struct io_uring_cqe *cqes; ///< the CQ ring
+
+    void *sq_map;     ///< mapping holding the SQ and CQ rings
+    size_t sq_map_sz; ///< its size
+    size_t sqes_sz;   ///< size of the sqes mapping
+} mw_uring;
+
+/**
+ * @brief A ring of buffers the kernel picks from for receives
+ *
+ * Buffers are all sz bytes; buffer bid is at base + bid * sz.
+ */
+typedef struct _mw_uring_bufs {
+    struct io_uring_buf_ring *ring; ///< shared with the kernel
+    char *base;      ///< the buffers
+    unsigned n;      ///< buffers, a power of two
+    unsigned sz;     ///< bytes in each
+    uint16_t bgid;   ///< buffer group id, for IOSQE_BUFFER_SELECT
+    uint16_t tail;   ///< our producer index
+} mw_uring_bufs;
+
+/**
+ * @brief Set up a ring
+ *
+ * @param r The ring
+ * @param entries SQ size; the CQ gets four times as many
+ *
+ * @return 0, or a negative errno value (-ENOSYS without io_uring)
+ */
+int mw_uring_init(mw_uring *r, unsigned entries);
+
+/**
+ * @brief Unmap and close a ring
+ */
+void mw_uring_exit(mw_uring *r);
+
+/**
+ * @brief Does the kernel support all of these IORING_OP_* opcodes?
+ *
+ * @param r The ring
+ * @param ops The opcodes
+ * @param n How many
+ */
+bool mw_uring_supports(mw_uring *r, const uint8_t *ops, int n);
+
+/**
+ * @brief A zeroed SQE to fill in, submitting what is queued if the SQ is full
+ */
+struct io_uring_sqe *mw_uring_sqe(mw_uring *r);
+
+/**
+ * @brief Submit the queued SQEs, and wait for a completion
+ *
+ * @param r The ring
+ * @param timeout_ms Longest to wait, 0 not to, -1 for ever
+ *
+ * @return The number of SQEs submitted, or a negative errno value (-ETIME
+ *         and -EINTR just mean nothing came)
+ */
+int mw_uring_enter(mw_uring *r, int timeout_ms);
+
+/**
+ * @brief The oldest completion not yet seen, or NULL
+ */
+struct io_uring_cqe *mw_uring_peek(mw_uring *r);
+
+/**
+ * @brief Done with the completion mw_uring_peek returned
+ */
+void mw_uring_seen(mw_uring *r);
+
+/**
+ * @brief Allocate n buffers of sz bytes, and register them as group bgid
+ *
+ * @return 0, or a negative errno value (-EINVAL before Linux 5.19)
+ */
+int mw_uring_bufs_init(mw_uring *r,
+                       mw_uring_bufs *b,
+                       unsigned n,
+                       unsigned sz,
+                       uint16_t bgid);
+
+/**
+ * @brief Free a ring's buffers, after the ring itself has gone
+ */
+void mw_uring_bufs_exit(mw_uring_bufs *b);
+
+/**
+ * @brief Hand buffer bid back to the kernel
+ */
+void mw_uring_buf_put(mw_uring_bufs *b, uint16_t bid);
+
+/**
+ * @brief The address of buffer bid
+ */
+char *mw_uring_buf(mw_uring_bufs *b, uint16_t bid);
+
+___END_DECLS
+#endif /* HAVE_IO_URING */
+#endif /* ifndef MW_URING_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,254 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for asprintf
+#endif
+#include "mw_zcache.h"
+#include "mw_codec.h"
+#include <assert.h>
+#include <dispatch/dispatch.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ZC_BUCKETS 1024
+
+/* Everything below is protected by zc.lock, except the contents of an entry
+ * that is being filled, which belong to the filling block until it sets
+ * filling back to false.  The table's limit is the budget in bytes.
+ */
+static struct {
+    pthread_mutex_t lock;
+    mw_lru lru;
+    mw_lru_node *buckets[ZC_BUCKETS];
+} zc = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static size_t zc_entry_bytes(mw_lru_node *n)
+{
+    mw_zcache_entry *e = (mw_zcache_entry *)n;
+    return sizeof(*e) + strlen(n->path) +
+           (e->gz_path ? strlen(e->gz_path) : 0) + e->len;
+}
+
+static void zc_free(mw_lru_node *n)
+{
+    mw_zcache_entry *e = (mw_zcache_entry *)n;
+    free(n->path);
+    free(e->gz_path);
+    free(e->data);
+    free(e);
+}
+
+static bool zc_matches(mw_zcache_entry *e, const struct stat *sb)
+{
+    return e->ino == sb->st_ino && e->mtime == sb->st_mtime &&
+           e->size == sb->st_size;
+}
+
+static mw_zcache_entry *zc_find(const char *path)
+{
+    return (mw_zcache_entry *)mw_lru_find(&zc.lru, path);
+}
+
+/* Make an entry for path, without zc.lock held: looking for the .gz is a
+ * syscall
+ */
+static mw_zcache_entry *zc_new(const char *path, const struct stat *sb)
+{
+    mw_zcache_entry *e = calloc(1, sizeof(*e));
+    assert(e);
+    e->node.path = strdup(path);
+    assert(e->node.path);
+    e->ino = sb->st_ino;
+    e->mtime = sb->st_mtime;
+    e->size = sb->st_size;
+    e->node.refs = 1;
+
+    // a sibling .gz is only used if it is at least as new as the original
+    struct stat gz_sb;
+    if (asprintf(&e->gz_path, "%s.gz", path) < 0) {
+        e->gz_path = NULL;
+    }
+    else if (stat(e->gz_path, &gz_sb) || !S_ISREG(gz_sb.st_mode) ||
+             gz_sb.st_mtime < sb->st_mtime) {
+        free(e->gz_path);
+        e->gz_path = NULL;
+    }
+    return e;
+}
+
+/* Read and compress the file an entry describes.  Called without zc.lock
+ * held, the result is handed over under it.
+ */
+static void zc_fill(mw_zcache_entry *e)
+{
+    unsigned char *src = NULL, *data = NULL;
+    size_t zlen = 0;
+    struct stat sb;
+    int fd = open(e->node.path, O_RDONLY);
+    if (fd < 0) goto done;
+    // the file may have changed since the request that asked for this
+    if (fstat(fd, &sb) || !zc_matches(e, &sb)) goto done;
+
+    src = malloc(e->size ? e->size : 1);
+    assert(src);
+    off_t off = 0;
+    while (off < e->size) {
+        ssize_t rd = pread(fd, src + off, e->size - off, off);
+        if (rd <= 0) goto done;
+        off += rd;
+    }
+
+    // only output smaller than the file is worth keeping
+    data = malloc(e->size ? e->size : 1);
+    assert(data);
+    // this is paid once per file, so spend the CPU on the smallest output,
+    // with libdeflate when we have it
+    const mw_codec *c = mw_codec_oneshot(MW_CODING_DEFLATE);
+    zlen = mw_codec_compress(c,
+                             MW_CODING_DEFLATE,
+                             c->max_level,
+                             src,
+                             e->size,
+                             data,
+                             e->size);
+    if (!zlen || zlen >= (size_t)e->size) {
+        free(data);
+        data = NULL;
+    }
+    else {
+        data = reallocf(data, zlen);
+    }
+
+done:
+    if (fd >= 0) close(fd);
+    free(src);
+
+    pthread_mutex_lock(&zc.lock);
+    e->filling = false;
+    if (data && !e->node.dead) {
+        zc.lru.used -= zc_entry_bytes(&e->node);
+        e->data = data;
+        e->len = zlen;
+        zc.lru.used += zc_entry_bytes(&e->node);
+        mw_lru_evict(&zc.lru);
+    }
+    else {
+        free(data);
+    }
+    mw_lru_unref(&zc.lru, &e->node);
+    pthread_mutex_unlock(&zc.lock);
+}
+
+static void zc_fill_f(void *ctx)
+{
+    zc_fill(ctx);
+}
+
+void mw_zcache_init(size_t budget)
+{
+    pthread_mutex_lock(&zc.lock);
+    if (!zc.lru.buckets) {
+        mw_lru_init(&zc.lru, zc.buckets, ZC_BUCKETS, zc_entry_bytes, zc_free);
+    }
+    zc.lru.limit = budget;
+    mw_lru_evict(&zc.lru);
+    pthread_mutex_unlock(&zc.lock);
+}
+
+/* Find or make the entry for path, returning with zc.lock held, or NULL
+ * without it if the cache is disabled.  A new entry is made with the lock
+ * dropped, and only goes in if nobody else put one in meanwhile.
+ */
+static mw_zcache_entry *zc_lookup(const char *path, const struct stat *sb)
+{
+    mw_zcache_entry *fresh = NULL;
+    for (;;) {
+        pthread_mutex_lock(&zc.lock);
+        mw_zcache_entry *e = zc.lru.limit ? zc_find(path) : NULL;
+        if (e && !zc_matches(e, sb)) {
+            mw_lru_remove(&zc.lru, &e->node);
+            e = NULL;
+        }
+        if (e || !zc.lru.limit) {
+            if (e) {
+                mw_lru_touch(&zc.lru, &e->node);
+            }
+            else {
+                pthread_mutex_unlock(&zc.lock);
+            }
+            if (fresh) zc_free(&fresh->node);
+            return e;
+        }
+        if (fresh) {
+            mw_lru_insert(&zc.lru, &fresh->node);
+            return fresh;
+        }
+        pthread_mutex_unlock(&zc.lock);
+        fresh = zc_new(path, sb);
+    }
+}
+
+/* Only files that are small next to the budget are worth compressing into
+ * memory, a few big files would keep evicting everything else.  A file is
+ * compressed once: an entry that changes is replaced by zc_lookup.
+ */
+static bool zc_should_fill(mw_zcache_entry *e)
+{
+    return !e->tried && (size_t)e->size <= zc.lru.limit / 8;
+}
+
+mw_zcache_entry *mw_zcache_get(const char *path, const struct stat *sb)
+{
+    mw_zcache_entry *e = zc_lookup(path, sb);
+    if (!e) return NULL;
+    if (zc_should_fill(e)) {
+        e->filling = e->tried = true;
+        e->node.refs++;
+        dispatch_async_f(
+            dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0),
+            e,
+            zc_fill_f);
+    }
+    if (!e->data && !e->gz_path) {
+        e = NULL;
+    }
+    else {
+        e->node.refs++;
+    }
+    pthread_mutex_unlock(&zc.lock);
+    return e;
+}
+
+bool mw_zcache_warm(const char *path)
+{
+    struct stat sb;
+    if (stat(path, &sb) || !S_ISREG(sb.st_mode)) return false;
+
+    mw_zcache_entry *e = zc_lookup(path, &sb);
+    if (!e) return false;
+    bool fill = zc_should_fill(e);
+    if (fill) {
+        e->filling = e->tried = true;
+        e->node.refs++;
+    }
+    pthread_mutex_unlock(&zc.lock);
+
+    if (fill) zc_fill(e);
+
+    pthread_mutex_lock(&zc.lock);
+    e = zc_find(path);
+    bool cached = e && (e->data || e->gz_path);
+    pthread_mutex_unlock(&zc.lock);
+    return cached;
+}
+
+void mw_zcache_release(mw_zcache_entry *e)
+{
+    pthread_mutex_lock(&zc.lock);
+    mw_lru_unref(&zc.lru, &e->node);
+    pthread_mutex_unlock(&zc.lock);
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,82 @@
+#ifndef MW_ZCACHE_H
+#define MW_ZCACHE_H
+
+#include "config.h"
+#include "mw_lru.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief The default memory budget of the compressed representation cache
+ */
+#define MW_ZCACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+/**
+ * @brief A cached compressed representation of one file
+ *
+ * Entries are keyed by path, and only match while the file still has the
+ * inode, mtime and size they were made from.  An entry is reference counted,
+ * so it stays valid until mw_zcache_release even if it is evicted meanwhile.
+ */
+typedef struct _mw_zcache_entry {
+    mw_lru_node node; ///< keyed by the path of the uncompressed file
+
+    ino_t ino;    ///< inode of the uncompressed file
+    time_t mtime; ///< mtime of the uncompressed file
+    off_t size;   ///< size of the uncompressed file
+
+    char *gz_path;       ///< up to date sibling .gz file, or NULL
+    unsigned char *data; ///< zlib ("deflate") compressed file, or NULL
+    size_t len;          ///< length of data
+    bool filling;        ///< is data being compressed in the background?
+    bool tried;          ///< has data been made, or failed to be, already?
+} mw_zcache_entry;
+
+/**
+ * @brief Set up the cache
+ *
+ * @param budget How many bytes of compressed data to keep, 0 to disable
+ */
+void mw_zcache_init(size_t budget);
+
+/**
+ * @brief Find the compressed representations of a file
+ *
+ * If there is no cached deflate representation, one is made in the background
+ * (on a global queue), so the caller should compress this response itself.
+ * It is made once per version of the file: one that can't be read, or doesn't
+ * compress smaller than it is, isn't tried again until the file changes.
+ *
+ * @param path The path the file was opened with
+ * @param sb The stat of the open file
+ *
+ * @return A referenced entry (see mw_zcache_release), or NULL if the file is
+ *         not cached
+ */
+mw_zcache_entry *mw_zcache_get(const char *path, const struct stat *sb);
+
+/**
+ * @brief Compress a file into the cache right away, for warming it at startup
+ *
+ * @param path The file to compress
+ *
+ * @return true if the file is now cached
+ */
+bool mw_zcache_warm(const char *path);
+
+/**
+ * @brief Drop a reference returned by mw_zcache_get
+ *
+ * @param e The entry
+ */
+void mw_zcache_release(mw_zcache_entry *e);
+
+___END_DECLS
+#endif /* ifndef MW_ZCACHE_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,124 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for clock_gettime and CLOCK_PROCESS_CPUTIME_ID
+#endif
+#include "mw_zctl.h"
+#include "mw_clock.h"
+#include "mw_stats.h"
+#include <time.h>
+#include <unistd.h>
+
+static struct {
+    int workers;     ///< threads the CPU use is shared by
+    unsigned low;    ///< permille above which levels come down
+    unsigned high;   ///< permille at which compression mostly stops
+    uint64_t at;     ///< mw_clock_coarse_ns of the last sample
+    uint64_t cpu_ns; ///< the process's CPU time then
+    unsigned load;   ///< smoothed CPU use, permille
+} zctl = {1, MW_ZCTL_DEFAULT_LOW, MW_ZCTL_DEFAULT_HIGH, 0, 0, 0};
+
+static uint64_t process_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void mw_zctl_init(int workers, unsigned low, unsigned high)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0 || (ncpu > 0 && workers > ncpu)) {
+        workers = ncpu > 0 ? (int)ncpu : 1;
+    }
+    zctl.workers = workers;
+    zctl.low = low;
+    zctl.high = high > low ? high : low + 1;
+    zctl.at = mw_clock_coarse_ns();
+    zctl.cpu_ns = process_cpu_ns();
+    zctl.load = 0;
+}
+
+unsigned mw_zctl_load(void)
+{
+    uint64_t now = mw_clock_coarse_ns();
+    uint64_t at = __atomic_load_n(&zctl.at, __ATOMIC_ACQUIRE);
+    // one thread takes each sample
+    if (now > at && now - at >= MW_ZCTL_SAMPLE_MS * 1000000ull &&
+        __atomic_compare_exchange_n(&zctl.at,
+                                    &at,
+                                    now,
+                                    false,
+                                    __ATOMIC_ACQ_REL,
+                                    __ATOMIC_RELAXED)) {
+        uint64_t cpu = process_cpu_ns();
+        uint64_t used = cpu - __atomic_exchange_n(&zctl.cpu_ns,
+                                                  cpu,
+                                                  __ATOMIC_ACQ_REL);
+        uint64_t sample = used * 1000 / ((now - at) * zctl.workers);
+        if (sample > 1000) sample = 1000;
+        // half the weight on the newest, so about a second of history
+        unsigned load = __atomic_load_n(&zctl.load, __ATOMIC_RELAXED);
+        __atomic_store_n(&zctl.load, (load + sample) / 2, __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&zctl.load, __ATOMIC_RELAXED);
+}
+
+void mw_zrate_write(mw_zrate *r, bool blocked)
+{
+    if (blocked) {
+        r->blocked++;
+    }
+    else {
+        r->writes++;
+    }
+}
+
+void mw_zrate_done(mw_zrate *r, uint64_t bytes, uint64_t ns)
+{
+    r->bytes += bytes;
+    r->ns += ns;
+}
+
+int mw_zctl_level(const mw_codec *c, unsigned load, const mw_zrate *r)
+{
+    // zlib's level 0 only stores, it is no use to anyone in a hurry
+    int fastest = c->min_level > 1 ? c->min_level : 1;
+    int level = c->level;
+    if (level < fastest) fastest = level;
+
+    bool known = r && r->ns && r->bytes >= MW_ZCTL_MIN_BYTES;
+    double bps = known ? r->bytes * 1e9 / r->ns : 0;
+    // a socket full a quarter of the time means the network sets the pace
+    bool held = known && r->blocked * 4 >= r->writes + r->blocked;
+    bool slow = held && bps < MW_ZCTL_SLOW_BPS;
+
+    if (known && !r->blocked && bps > MW_ZCTL_FAST_BPS) return fastest;
+    if (load >= zctl.high) return slow ? fastest : MW_ZCTL_SKIP;
+    if (slow) {
+        if (load > zctl.low) return level;
+        level += MW_ZCTL_RAISE;
+        return level < c->max_level ? level : c->max_level;
+    }
+    if (load > zctl.low) {
+        level = fastest + (level - fastest) * (int)(zctl.high - load) /
+                              (int)(zctl.high - zctl.low);
+    }
+    return level;
+}
+
+int mw_zctl_choose(const mw_codec *c, const mw_zrate *r)
+{
+    unsigned load = mw_zctl_load();
+    int level = mw_zctl_level(c, load, r);
+    if (level == MW_ZCTL_SKIP) {
+        mw_stats_count(MW_STAT_Z_SKIP_LOAD, 1);
+    }
+    else {
+        if (level < c->level) mw_stats_count(MW_STAT_Z_LOWERED, 1);
+        if (level > c->level) mw_stats_count(MW_STAT_Z_RAISED, 1);
+        mw_stats_record(MW_HIST_Z_LEVEL, level);
+    }
+    mw_stats_record(MW_HIST_CPU_LOAD, load);
+    return level;
+}
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
@@ -0,0 +1,127 @@
+#ifndef MW_ZCTL_H
+#define MW_ZCTL_H
+
+#include "config.h"
+#include "mw_codec.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+___BEGIN_DECLS
+
+/**
+ * @brief How often the CPU use is sampled, in milliseconds
+ */
+#define MW_ZCTL_SAMPLE_MS 250
+
+/**
+ * @brief CPU use, in permille of the workers, above which levels come down
+ */
+#define MW_ZCTL_DEFAULT_LOW 500
+
+/**
+ * @brief CPU use, in permille of the workers, at which only clients the
+ *        network holds back get compressed responses, at the lowest level
+ */
+#define MW_ZCTL_DEFAULT_HIGH 850
+
+/**
+ * @brief Body bytes a connection must have sent before its rate counts
+ */
+#define MW_ZCTL_MIN_BYTES (64 * 1024)
+
+/**
+ * @brief A client the network holds back to fewer bytes per second than
+ *        this is slow: bytes on the wire cost it more than our CPU does
+ */
+#define MW_ZCTL_SLOW_BPS (256 * 1024)
+
+/**
+ * @brief A client taking more bytes per second than this, without ever
+ *        filling its socket, is fast: compressing is what holds it back
+ */
+#define MW_ZCTL_FAST_BPS (32 * 1024 * 1024)
+
+/**
+ * @brief Levels above the configured one a slow client gets, CPU permitting
+ */
+#define MW_ZCTL_RAISE 2
+
+/**
+ * @brief mw_zctl_level's answer for "don't compress"
+ */
+#define MW_ZCTL_SKIP (-1)
+
+/**
+ * @brief How fast a connection has taken its responses, from how its socket
+ *        has been writable
+ *
+ * Kept for the life of the connection, so a keep-alive client's earlier
+ * responses decide the level of its later ones.
+ */
+typedef struct _mw_zrate {
+    uint64_t bytes;   ///< bytes of the finished responses
+    uint64_t ns;      ///< time they took, from first byte to last
+    unsigned writes;  ///< writes that made progress
+    unsigned blocked; ///< writes that found the socket full
+} mw_zrate;
+
+/**
+ * @brief Set up the controller
+ *
+ * @param workers The threads serving requests, 0 for one per CPU
+ * @param low CPU use, in permille, above which levels come down
+ * @param high CPU use, in permille, at which compression mostly stops
+ */
+void mw_zctl_init(int workers, unsigned low, unsigned high);
+
+/**
+ * @brief The recent CPU use of the process, in permille of the workers
+ *
+ * Sampled at most every MW_ZCTL_SAMPLE_MS by whichever thread asks, and
+ * smoothed over the last few samples.
+ */
+unsigned mw_zctl_load(void);
+
+/**
+ * @brief Note a write to a connection's socket
+ *
+ * @param r The connection's rate
+ * @param blocked Did the socket refuse it as full?
+ */
+void mw_zrate_write(mw_zrate *r, bool blocked);
+
+/**
+ * @brief Note a finished response
+ *
+ * @param r The connection's rate
+ * @param bytes The bytes sent
+ * @param ns How long they took
+ */
+void mw_zrate_done(mw_zrate *r, uint64_t bytes, uint64_t ns);
+
+/**
+ * @brief The level to compress a response at
+ *
+ * Below the low mark of CPU use the engine's level is used, MW_ZCTL_RAISE
+ * more for slow clients.  Between low and high the level comes down linearly
+ * towards the engine's fastest, but slow clients keep the engine's level.
+ * From high on only slow clients get compressed responses, at the fastest
+ * level.  Fast clients get the fastest level whatever the load.
+ *
+ * @param c The engine
+ * @param load The CPU use, from mw_zctl_load
+ * @param r The connection's rate, or NULL if unknown
+ *
+ * @return The level, or MW_ZCTL_SKIP
+ */
+int mw_zctl_level(const mw_codec *c, unsigned load, const mw_zrate *r);
+
+/**
+ * @brief mw_zctl_level at the current load, counted in the stats
+ */
+int mw_zctl_choose(const mw_codec *c, const mw_zrate *r);
+
+___END_DECLS
+#endif /* ifndef MW_ZCTL_H */
+
+/* vim: set ts=8 sw=4 tw=80 ft=c et :*/
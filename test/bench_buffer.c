@@ -0,0 +1,143 @@
+/*
+ * Microbenchmark: the linear mw_buffer layout vs. the circular one.
+ *
+ * Both runs push the same pseudo-random sequence of "file reads" and "socket
+ * writes" through a buffer.  The linear run mirrors the old mw_read_filedata
+ * (buf_need_into the amount available, then read), the circular run mirrors
+ * the current one (read only as much as fits, via the into iovecs).
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for clock_gettime
+#endif
+#include "mw_buffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ROUNDS (200 * 1000)
+#define MAX_IO (64 * 1024)
+
+static unsigned char src[MAX_IO];
+static unsigned char dst[MAX_IO];
+
+typedef struct {
+    double secs;
+    size_t bytes;
+    size_t peak_sz;
+    size_t resizes;
+} bench_result;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A small xorshift so both runs see the same I/O sizes */
+static size_t next_io(unsigned *state)
+{
+    unsigned x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return 1 + x % MAX_IO;
+}
+
+static void note_size(mw_buffer *b, bench_result *r, size_t *last)
+{
+    if (b->sz != *last) {
+        r->resizes++;
+        *last = b->sz;
+    }
+    if (b->sz > r->peak_sz) r->peak_sz = b->sz;
+}
+
+static bench_result run_linear(void)
+{
+    bench_result r = {0};
+    mw_buffer b = {0};
+    size_t last = 0;
+    unsigned seed = 0x2545F491;
+    double start = now();
+
+    for (int i = 0; i < ROUNDS; i++) {
+        size_t rd = next_io(&seed);
+        buf_need_into(&b, rd);
+        memcpy(b.into, src, rd);
+        buf_used_into(&b, rd);
+        note_size(&b, &r, &last);
+
+        size_t wr = next_io(&seed);
+        if (wr > buf_outof_sz(&b)) wr = buf_outof_sz(&b);
+        memcpy(dst, b.outof, wr);
+        buf_used_outof(&b, wr);
+        r.bytes += wr;
+    }
+
+    r.secs = now() - start;
+    free(b.buf);
+    return r;
+}
+
+static bench_result run_ring(void)
+{
+    bench_result r = {0};
+    mw_buffer b = {0};
+    size_t last = 0;
+    unsigned seed = 0x2545F491;
+    struct iovec iov[2];
+    double start = now();
+
+    buf_init_ring(&b, 2 * MAX_IO);
+    last = b.sz;
+    for (int i = 0; i < ROUNDS; i++) {
+        size_t rd = next_io(&seed);
+        int n = buf_into_iov(&b, iov);
+        size_t got = 0;
+        for (int j = 0; j < n && got < rd; j++) {
+            size_t l = iov[j].iov_len < rd - got ? iov[j].iov_len : rd - got;
+            memcpy(iov[j].iov_base, src + got, l);
+            got += l;
+        }
+        buf_used_into(&b, got);
+        note_size(&b, &r, &last);
+
+        size_t wr = next_io(&seed);
+        n = buf_outof_iov(&b, iov);
+        size_t put = 0;
+        for (int j = 0; j < n && put < wr; j++) {
+            size_t l = iov[j].iov_len < wr - put ? iov[j].iov_len : wr - put;
+            memcpy(dst + put, iov[j].iov_base, l);
+            put += l;
+        }
+        buf_used_outof(&b, put);
+        r.bytes += put;
+    }
+
+    r.secs = now() - start;
+    free(b.buf);
+    return r;
+}
+
+static void report(const char *name, bench_result r)
+{
+    printf("%-8s %8.3f s %10.1f MB/s  peak %8zu bytes  %6zu resizes\n",
+           name,
+           r.secs,
+           r.bytes / r.secs / (1024 * 1024),
+           r.peak_sz,
+           r.resizes);
+}
+
+int main(void)
+{
+    memset(src, 'x', sizeof(src));
+    report("linear", run_linear());
+    report("ring", run_ring());
+    return 0;
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -0,0 +1,255 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for mkdtemp and nanosleep
+#endif
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mw_alog.h"
+#include "mw_fmt.h"
+
+#define FLUSH_MS 50
+#define N_THREADS 4
+#define N_RECS 20000 // per thread, enough to fill a ring many times over
+
+static char dir[] = "/tmp/test_alog.XXXXXX";
+static char first[64], rings[64], timed[64], rotated[64], rolled[64];
+
+/* The whole file, NUL terminated, or an empty string if there is none */
+static char *slurp(const char *path)
+{
+    char *s = calloc(1, 1);
+    size_t len = 0, n;
+    char chunk[4096];
+    FILE *f = fopen(path, "r");
+    if (!f) return s;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        s = realloc(s, len + n + 1);
+        memcpy(s + len, chunk, n);
+        len += n;
+        s[len] = '\0';
+    }
+    fclose(f);
+    return s;
+}
+
+static bool log_one(const char *rl, short status, ssize_t written)
+{
+    mw_alog_rec *rec = mw_alog_begin();
+    if (!rec) return false;
+    rec->when = time(NULL);
+    inet_pton(AF_INET, "127.0.0.1", &rec->addr);
+    rec->status = status;
+    rec->total_written = written;
+    rec->latency_us = 1;
+    rec->rl_len = strlen(rl);
+    memcpy(rec->rl, rl, rec->rl_len);
+    mw_alog_commit(rec);
+    return true;
+}
+
+static int setup(void **state)
+{
+    (void)state;
+    if (!mkdtemp(dir)) return -1;
+    snprintf(first, sizeof(first), "%s/first.log", dir);
+    snprintf(rings, sizeof(rings), "%s/rings.log", dir);
+    snprintf(timed, sizeof(timed), "%s/timed.log", dir);
+    snprintf(rotated, sizeof(rotated), "%s/access.log", dir);
+    snprintf(rolled, sizeof(rolled), "%s/access.log.1", dir);
+
+    // nothing is logged before there is a writer
+    if (mw_alog_begin()) return -1;
+    mw_alog_commit(NULL);
+
+    FILE *f = fopen(first, "a");
+    if (!f) return -1;
+    mw_alog_init(f, FLUSH_MS, mw_alog_format_for(first));
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    (void)state;
+    unlink(first);
+    unlink(rings);
+    unlink(timed);
+    unlink(rotated);
+    unlink(rolled);
+    rmdir(dir);
+    return 0;
+}
+
+/* A text line is what the Common Log Format says */
+static void test_format_line(void **state)
+{
+    (void)state;
+    mw_alog_rec rec = {.when = 1234567890, .status = 404, .total_written = 0};
+    inet_pton(AF_INET, "10.1.2.3", &rec.addr);
+    rec.rl_len = strlen("GET /missing HTTP/1.1");
+    memcpy(rec.rl, "GET /missing HTTP/1.1", rec.rl_len);
+
+    char clf[MW_FMT_CLF_LEN + 1], want[MW_ALOG_LINE_MAX], got[MW_ALOG_LINE_MAX];
+    mw_fmt_clf(rec.when, clf);
+    clf[MW_FMT_CLF_LEN] = '\0';
+    snprintf(want,
+             sizeof(want),
+             "10.1.2.3 -- [%s] \"GET /missing HTTP/1.1\" 404 0\n",
+             clf);
+    size_t n = mw_alog_format_line(&rec, got);
+    assert_int_equal(n, strlen(want));
+    assert_memory_equal(got, want, n);
+
+    // the longest request line fits
+    rec.rl_len = MW_ALOG_RL_MAX;
+    memset(rec.rl, 'x', MW_ALOG_RL_MAX);
+    rec.total_written = -1;
+    rec.status = 500;
+    assert_true(mw_alog_format_line(&rec, got) <= MW_ALOG_LINE_MAX);
+
+    assert_int_equal(mw_alog_format_for(NULL), MW_ALOG_TEXT);
+    assert_int_equal(mw_alog_format_for("access.log"), MW_ALOG_TEXT);
+    assert_int_equal(mw_alog_format_for(MW_ALOG_BIN_SUFFIX), MW_ALOG_TEXT);
+    assert_int_equal(mw_alog_format_for("access" MW_ALOG_BIN_SUFFIX),
+                     MW_ALOG_BINARY);
+}
+
+typedef struct {
+    int id;
+    int drops; // records mw_alog_begin turned away
+} producer;
+
+static void *produce(void *arg)
+{
+    producer *p = arg;
+    char rl[64];
+    for (int i = 0; i < N_RECS; i++) {
+        snprintf(rl, sizeof(rl), "GET /%d/%d HTTP/1.1", p->id, i);
+        if (!log_one(rl, 200, i)) p->drops++;
+    }
+    return NULL;
+}
+
+/* Every record a thread commits is written once, in the order it was
+ * committed, and the ones a full ring turned away are counted
+ */
+static void test_rings(void **state)
+{
+    (void)state;
+    mw_alog_reopen(rings);
+
+    producer p[2 * N_THREADS] = {{0}};
+    pthread_t t[N_THREADS];
+    // the second round takes over the rings the first left behind
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < N_THREADS; i++) {
+            p[round * N_THREADS + i].id = round * N_THREADS + i;
+            pthread_create(&t[i], NULL, produce, &p[round * N_THREADS + i]);
+        }
+        for (int i = 0; i < N_THREADS; i++) pthread_join(t[i], NULL);
+    }
+    // everything committed is written out before the reopen returns
+    mw_alog_reopen(rings);
+
+    char *log = slurp(rings);
+    int next[2 * N_THREADS] = {0}, written = 0, drops = 0;
+    for (char *line = log, *end; *line; line = end + 1) {
+        end = strchr(line, '\n');
+        assert_non_null(end);
+        int id, i;
+        size_t n;
+        char *rl = strstr(line, "\"GET /");
+        if (rl && rl < end && sscanf(rl, "\"GET /%d/%d", &id, &i) == 2) {
+            assert_true(id >= 0 && id < 2 * N_THREADS);
+            assert_true(i >= next[id]);
+            next[id] = i + 1;
+            written++;
+        }
+        else if (sscanf(line, "# dropped %zu log records", &n) == 1) {
+            drops += n;
+        }
+        else {
+            assert_memory_equal(line, "# flush 'n roll!", end - line);
+        }
+    }
+    int turned_away = 0;
+    for (int i = 0; i < 2 * N_THREADS; i++) turned_away += p[i].drops;
+    assert_int_equal(drops, turned_away);
+    assert_int_equal(written + drops, 2 * N_THREADS * N_RECS);
+    free(log);
+}
+
+/* A line doesn't wait for more to be written, only for the flush time */
+static void test_flush_time(void **state)
+{
+    (void)state;
+    mw_alog_reopen(timed);
+    assert_true(log_one("GET /timed HTTP/1.1", 200, 1));
+
+    struct timespec ts = {0, 10 * 1000000};
+    char *log = NULL;
+    for (int i = 0; i < 200; i++) {
+        free(log);
+        log = slurp(timed);
+        if (*log) break;
+        nanosleep(&ts, NULL);
+    }
+    assert_non_null(strstr(log, "\"GET /timed HTTP/1.1\" 200 1\n"));
+    free(log);
+}
+
+/* After a rotation the old file has everything logged before it and the
+ * marker, the new one everything after
+ */
+static void test_reopen(void **state)
+{
+    (void)state;
+    mw_alog_reopen(rotated);
+    assert_true(log_one("GET /before HTTP/1.1", 200, 1));
+    assert_int_equal(rename(rotated, rolled), 0);
+    mw_alog_reopen(rotated);
+
+    char *old = slurp(rolled);
+    char *cur = slurp(rotated);
+    assert_non_null(strstr(old, "\"GET /before HTTP/1.1\" 200 1\n"));
+    size_t len = strlen(old), mark = strlen("# flush 'n roll!\n");
+    assert_true(len > mark);
+    assert_string_equal(old + len - mark, "# flush 'n roll!\n");
+    assert_string_equal(cur, "");
+    free(old);
+    free(cur);
+
+    assert_true(log_one("GET /after HTTP/1.1", 200, 2));
+    mw_alog_reopen(rotated);
+    old = slurp(rolled);
+    cur = slurp(rotated);
+    assert_null(strstr(old, "/after"));
+    assert_null(strstr(cur, "/before"));
+    assert_non_null(strstr(cur, "\"GET /after HTTP/1.1\" 200 2\n"));
+    free(old);
+    free(cur);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_format_line),
+        cmocka_unit_test(test_rings),
+        cmocka_unit_test(test_flush_time),
+        cmocka_unit_test(test_reopen),
+    };
+
+    return cmocka_run_group_tests(tests, setup, teardown);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
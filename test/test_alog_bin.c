@@ -0,0 +1,225 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for mkdtemp and popen
+#endif
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mw_alog.h"
+
+#define N_RECS 2000
+#define PER_BATCH 500 // under a ring, so none are dropped
+
+static const char *lines[] = {
+    "GET / HTTP/1.1",
+    "GET /index.html HTTP/1.1",
+    "GET /style.css HTTP/1.1",
+    "HEAD /robots.txt HTTP/1.0",
+    "GET /images/a%20b.png HTTP/1.1",
+    "POST /form HTTP/1.1",
+    "GET /favicon.ico HTTP/1.1",
+};
+#define N_LINES (sizeof(lines) / sizeof(lines[0]))
+
+static char dir[] = "/tmp/test_alog_bin.XXXXXX";
+static char path[64], cut[64], text[64];
+
+/* The i-th record the test logs */
+static void make_rec(int i, mw_alog_rec *rec)
+{
+    static const short statuses[] = {200, 304, 404, 500};
+    char a[32];
+    memset(rec, 0, sizeof(*rec));
+    rec->when = 1700000000 + i;
+    snprintf(a, sizeof(a), "10.0.%d.%d", i / 256, i % 256);
+    inet_pton(AF_INET, a, &rec->addr);
+    rec->status = statuses[i % 4];
+    rec->total_written = (ssize_t)i * 13;
+    rec->latency_us = i * 7;
+    rec->rl_len = strlen(lines[i % N_LINES]);
+    memcpy(rec->rl, lines[i % N_LINES], rec->rl_len);
+}
+
+static char *slurp(FILE *f, size_t *len)
+{
+    char *s = NULL, chunk[4096];
+    size_t n;
+    *len = 0;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        s = realloc(s, *len + n + 1);
+        memcpy(s + *len, chunk, n);
+        *len += n;
+        s[*len] = '\0';
+    }
+    return s;
+}
+
+/* Run mw_logcat on a file, returning what it printed and its exit status */
+static char *logcat(const char *file, int *status)
+{
+    char cmd[256];
+    size_t len;
+    snprintf(cmd, sizeof(cmd), "%s %s 2>/dev/null", MW_LOGCAT, file);
+    FILE *p = popen(cmd, "r");
+    assert_non_null(p);
+    char *out = slurp(p, &len);
+    int rc = pclose(p);
+    *status = WIFEXITED(rc) ? WEXITSTATUS(rc) : -1;
+    return out ? out : calloc(1, 1);
+}
+
+static int setup(void **state)
+{
+    (void)state;
+    if (!mkdtemp(dir)) return -1;
+    snprintf(path, sizeof(path), "%s/access%s", dir, MW_ALOG_BIN_SUFFIX);
+    snprintf(cut, sizeof(cut), "%s/cut%s", dir, MW_ALOG_BIN_SUFFIX);
+    snprintf(text, sizeof(text), "%s/access.log", dir);
+
+    FILE *f = fopen(path, "a");
+    if (!f) return -1;
+    mw_alog_init(f, 1000, mw_alog_format_for(path));
+    for (int i = 0; i < N_RECS; i++) {
+        mw_alog_rec *rec = mw_alog_begin();
+        if (!rec) return -1;
+        make_rec(i, rec);
+        mw_alog_commit(rec);
+        // each reopen writes out what is logged as a batch
+        if ((i + 1) % PER_BATCH == 0) mw_alog_reopen(path);
+    }
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    (void)state;
+    unlink(path);
+    unlink(cut);
+    unlink(text);
+    rmdir(dir);
+    return 0;
+}
+
+/* The file is batches of fixed size records, each request line stored once
+ * per batch
+ */
+static void test_batches(void **state)
+{
+    (void)state;
+    FILE *f = fopen(path, "rb");
+    assert_non_null(f);
+    size_t distinct = 0;
+    for (size_t i = 0; i < N_LINES; i++) distinct += strlen(lines[i]);
+
+    int n = 0, batches = 0;
+    mw_alog_bin_batch b;
+    while (fread(&b, sizeof(b), 1, f) == 1) {
+        batches++;
+        assert_int_equal(b.magic, MW_ALOG_BIN_MAGIC);
+        assert_int_equal(b.n_recs, PER_BATCH);
+        assert_int_equal(b.drops, 0);
+        assert_int_equal(b.str_len, distinct);
+        mw_alog_bin_rec *recs = malloc(b.n_recs * sizeof(*recs));
+        char *strs = malloc(b.str_len);
+        assert_int_equal(fread(recs, sizeof(*recs), b.n_recs, f), b.n_recs);
+        assert_int_equal(fread(strs, 1, b.str_len, f), b.str_len);
+        for (uint32_t i = 0; i < b.n_recs; i++, n++) {
+            mw_alog_rec want;
+            make_rec(n, &want);
+            assert_int_equal(recs[i].when, want.when);
+            assert_int_equal(recs[i].total_written, want.total_written);
+            assert_int_equal(recs[i].latency_us, want.latency_us);
+            assert_int_equal(recs[i].status, want.status);
+            assert_memory_equal(recs[i].addr, &want.addr, 4);
+            assert_int_equal(recs[i].rl_len, want.rl_len);
+            assert_true(recs[i].rl_off + recs[i].rl_len <= b.str_len);
+            assert_memory_equal(strs + recs[i].rl_off, want.rl, want.rl_len);
+        }
+        free(recs);
+        free(strs);
+    }
+    assert_int_equal(batches, N_RECS / PER_BATCH);
+    assert_int_equal(n, N_RECS);
+    assert_true(feof(f));
+    fclose(f);
+}
+
+/* mw_logcat prints just what the text format would have written */
+static void test_logcat(void **state)
+{
+    (void)state;
+    char line[MW_ALOG_LINE_MAX];
+    size_t len = 0;
+    char *want = malloc(N_RECS * MW_ALOG_LINE_MAX);
+    for (int i = 0; i < N_RECS; i++) {
+        mw_alog_rec rec;
+        make_rec(i, &rec);
+        size_t n = mw_alog_format_line(&rec, line);
+        memcpy(want + len, line, n);
+        len += n;
+    }
+    want[len] = '\0';
+
+    int status;
+    char *got = logcat(path, &status);
+    assert_int_equal(status, 0);
+    assert_string_equal(got, want);
+    free(got);
+    free(want);
+}
+
+/* A cut short batch, or a file that isn't a binary log, is an error after
+ * printing what can be read
+ */
+static void test_logcat_errors(void **state)
+{
+    (void)state;
+    size_t len;
+    FILE *f = fopen(path, "rb");
+    char *log = slurp(f, &len);
+    fclose(f);
+    f = fopen(cut, "wb");
+    fwrite(log, 1, len - 10, f);
+    fclose(f);
+    free(log);
+
+    int status;
+    char *got = logcat(cut, &status);
+    assert_int_equal(status, 1);
+    // the batches before the last are all there
+    int printed = 0;
+    for (char *p = got; (p = strchr(p, '\n')); p++) printed++;
+    assert_int_equal(printed, N_RECS - PER_BATCH);
+    free(got);
+
+    f = fopen(text, "w");
+    fputs("127.0.0.1 -- [14/Nov/2023:22:13:20 +0] \"GET / HTTP/1.1\" 200 0\n",
+          f);
+    fclose(f);
+    got = logcat(text, &status);
+    assert_int_equal(status, 1);
+    assert_string_equal(got, "");
+    free(got);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_batches),
+        cmocka_unit_test(test_logcat),
+        cmocka_unit_test(test_logcat_errors),
+    };
+
+    return cmocka_run_group_tests(tests, setup, teardown);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
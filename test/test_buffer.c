@@ -0,0 +1,157 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mw_buffer.h"
+
+#define RING_SZ 16
+
+/* Copy len bytes of p into the buffer through buf_into_iov, as readv would */
+static size_t put(mw_buffer *b, const char *p, size_t len)
+{
+    struct iovec iov[2];
+    int n = buf_into_iov(b, iov);
+    size_t done = 0;
+    for (int i = 0; i < n && done < len; i++) {
+        size_t l = iov[i].iov_len < len - done ? iov[i].iov_len : len - done;
+        memcpy(iov[i].iov_base, p + done, l);
+        done += l;
+    }
+    buf_used_into(b, done);
+    return done;
+}
+
+/* Take up to len bytes out through buf_outof_iov, as writev would */
+static size_t take(mw_buffer *b, char *p, size_t len)
+{
+    struct iovec iov[2];
+    int n = buf_outof_iov(b, iov);
+    size_t done = 0;
+    for (int i = 0; i < n && done < len; i++) {
+        size_t l = iov[i].iov_len < len - done ? iov[i].iov_len : len - done;
+        memcpy(p + done, iov[i].iov_base, l);
+        done += l;
+    }
+    buf_used_outof(b, done);
+    return done;
+}
+
+/* An empty ring offers all its space as one region, and nothing to read */
+static void test_empty(void **state)
+{
+    (void)state;
+    mw_buffer b = {0};
+    buf_init_ring(&b, RING_SZ);
+    struct iovec iov[2];
+    assert_int_equal(buf_outof_sz(&b), 0);
+    assert_int_equal(buf_outof_iov(&b, iov), 0);
+    assert_int_equal(buf_into_sz(&b), RING_SZ);
+    assert_int_equal(buf_into_iov(&b, iov), 1);
+    assert_ptr_equal(iov[0].iov_base, b.buf);
+    assert_int_equal(iov[0].iov_len, RING_SZ);
+    free(b.buf);
+}
+
+/* A full ring has into == outof, and offers nothing to write into */
+static void test_full(void **state)
+{
+    (void)state;
+    mw_buffer b = {0};
+    buf_init_ring(&b, RING_SZ);
+    assert_int_equal(put(&b, "0123456789abcdefXX", 18), RING_SZ);
+    assert_ptr_equal(b.into, b.outof);
+    struct iovec iov[2];
+    assert_int_equal(buf_into_sz(&b), 0);
+    assert_int_equal(buf_into_iov(&b, iov), 0);
+    assert_int_equal(buf_outof_iov(&b, iov), 1);
+    assert_int_equal(iov[0].iov_len, RING_SZ);
+
+    // emptying it starts both ends over at buf
+    char out[RING_SZ];
+    assert_int_equal(take(&b, out, RING_SZ), RING_SZ);
+    assert_memory_equal(out, "0123456789abcdef", RING_SZ);
+    assert_ptr_equal(b.into, b.buf);
+    assert_ptr_equal(b.outof, b.buf);
+    free(b.buf);
+}
+
+/* Both regions wrap, as two iovecs that split at the end of buf */
+static void test_wrap(void **state)
+{
+    (void)state;
+    mw_buffer b = {0};
+    buf_init_ring(&b, RING_SZ);
+    char out[RING_SZ];
+    put(&b, "0123456789ab", 12);
+    assert_int_equal(take(&b, out, 10), 10);
+
+    // the space to write into is the 4 at the end and the 10 at the front
+    struct iovec iov[2];
+    assert_int_equal(buf_into_iov(&b, iov), 2);
+    assert_ptr_equal(iov[0].iov_base, b.buf + 12);
+    assert_int_equal(iov[0].iov_len, 4);
+    assert_ptr_equal(iov[1].iov_base, b.buf);
+    assert_int_equal(iov[1].iov_len, 10);
+    assert_int_equal(put(&b, "cdefghij", 8), 8);
+    assert_ptr_equal(b.into, b.buf + 4);
+
+    // and the data to write out of is 6 at the end and 4 at the front
+    assert_int_equal(buf_outof_iov(&b, iov), 2);
+    assert_ptr_equal(iov[0].iov_base, b.buf + 10);
+    assert_int_equal(iov[0].iov_len, 6);
+    assert_ptr_equal(iov[1].iov_base, b.buf);
+    assert_int_equal(iov[1].iov_len, 4);
+    assert_int_equal(take(&b, out, RING_SZ), 10);
+    assert_memory_equal(out, "abcdefghij", 10);
+
+    // into ending exactly at the end of buf wraps to the front
+    put(&b, "0123456789abcdef", RING_SZ);
+    take(&b, out, 8);
+    assert_ptr_equal(b.into, b.buf);
+    put(&b, "ghijklmn", 8);
+    assert_int_equal(buf_into_sz(&b), 0);
+    assert_int_equal(take(&b, out, RING_SZ), RING_SZ);
+    assert_memory_equal(out, "89abcdefghijklmn", RING_SZ);
+    free(b.buf);
+}
+
+/* Asking a wrapped ring for more room, or printing into it, unwraps it */
+static void test_grow(void **state)
+{
+    (void)state;
+    mw_buffer b = {0};
+    buf_init_ring(&b, RING_SZ);
+    char out[64];
+    put(&b, "0123456789abcd", 14);
+    take(&b, out, 10);
+    put(&b, "efghij", 6);
+    buf_need_into(&b, 20);
+    assert_true(b.ring);
+    assert_true(buf_into_sz(&b) >= 20);
+    assert_ptr_equal(b.outof, b.buf);
+    assert_int_equal(buf_outof_sz(&b), 10);
+
+    int n = buf_sprintf(&b, "%s-%d", "klmnopqrstuvwxyz", 42);
+    assert_int_equal(n, 19);
+    assert_int_equal(take(&b, out, sizeof(out)), 29);
+    assert_memory_equal(out, "abcdefghijklmnopqrstuvwxyz-42", 29);
+    free(b.buf);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_empty),
+        cmocka_unit_test(test_full),
+        cmocka_unit_test(test_wrap),
+        cmocka_unit_test(test_grow),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
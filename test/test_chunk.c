@@ -0,0 +1,251 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mw_chunk.h"
+#include "mw_twheel.h"
+
+#define HDR "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+#define BODY_LEN (300 * 1000)
+#define TARGET (16 * 1024)
+#define WAIT_NS 20000000ull
+#define TICK_MS 100
+
+/* What a client sees: the header, the body decoded, and its trailers */
+typedef struct {
+    unsigned char *wire; ///< everything written
+    size_t len;          ///< bytes in wire
+    unsigned writes;     ///< writev calls
+    unsigned chunks;     ///< chunks with data
+} peer;
+
+/* Decode p's chunked body after the header into body, returning its length
+ * and setting *trailers to the trailer section
+ */
+static size_t dechunk(peer *p, unsigned char *body, char **trailers)
+{
+    size_t off = strlen(HDR), len = 0;
+    assert_memory_equal(p->wire, HDR, off);
+    for (;;) {
+        char *end;
+        unsigned long n = strtoul((char *)p->wire + off, &end, 16);
+        assert_memory_equal(end, "\r\n", 2);
+        off = (unsigned char *)end + 2 - p->wire;
+        if (!n) break;
+        memcpy(body + len, p->wire + off, n);
+        len += n;
+        off += n;
+        assert_memory_equal(p->wire + off, "\r\n", 2);
+        off += 2;
+        p->chunks++;
+    }
+    // the trailer section ends with an empty line, and so does the message
+    *trailers = (char *)p->wire + off;
+    assert_true(p->len >= off + 2);
+    assert_memory_equal(p->wire + p->len - 2, "\r\n", 2);
+    p->wire[p->len - 2] = '\0';
+    return len;
+}
+
+/* Write what c describes, taking at most room bytes; returns the data taken */
+static size_t write_some(mw_chunker *c,
+                         peer *p,
+                         const unsigned char *data,
+                         size_t avail,
+                         size_t room)
+{
+    struct iovec d = {(void *)data, avail}, iov[1 + MW_CHUNK_IOV];
+    int n = mw_chunk_iov(c, &d, 1, iov);
+    size_t took = 0;
+    for (int i = 0; i < n && took < room; i++) {
+        size_t l = iov[i].iov_len < room - took ? iov[i].iov_len : room - took;
+        memcpy(p->wire + p->len + took, iov[i].iov_base, l);
+        took += l;
+    }
+    p->len += took;
+    p->writes++;
+    return mw_chunk_sent(c, took);
+}
+
+/* A body made in small pieces goes out in few, big chunks, header first and
+ * trailers last, however little of it each write takes
+ */
+static void test_coalesce(void **state)
+{
+    (void)state;
+    unsigned char *data = malloc(strlen(HDR) + BODY_LEN);
+    memcpy(data, HDR, strlen(HDR));
+    for (size_t i = 0; i < BODY_LEN; i++) {
+        data[strlen(HDR) + i] = "chunky"[i % 6] + i / 1000;
+    }
+    size_t total = strlen(HDR) + BODY_LEN;
+    peer p = {malloc(2 * total), 0, 0, 0};
+    mw_chunker c;
+    mw_chunk_init(&c, strlen(HDR), TARGET, WAIT_NS);
+    static const char trailers[] = "X-Checksum: 42\r\n"
+                                   "Server-Timing: z;dur=1\r\n";
+    mw_chunk_trailers(&c, trailers, strlen(trailers));
+
+    // the engine gives 100 to 3000 bytes at a time, and the writer is woken
+    // for each: one chunk each, as it used to be
+    size_t made = strlen(HDR), sent = 0;
+    unsigned seed = 1, pieces = 0;
+    uint64_t now = 1;
+    mw_chunk_state st;
+    while ((st = mw_chunk_begin(&c, made - sent, made < total, now)) !=
+           MW_CHUNK_DONE) {
+        seed = seed * 1103515245 + 12345;
+        if (st == MW_CHUNK_SEND) {
+            // a socket that takes 1 to 64K
+            size_t room = 1 + (seed >> 8) % (64 * 1024);
+            sent += write_some(&c, &p, data + sent, made - sent, room);
+        }
+        else if (made < total) {
+            size_t n = 100 + (seed >> 16) % 2900;
+            if (n > total - made) n = total - made;
+            made += n;
+            pieces++;
+        }
+        else {
+            fail();
+        }
+        now += 1000;
+    }
+    assert_int_equal(sent, total);
+
+    unsigned char *body = malloc(BODY_LEN);
+    char *t;
+    assert_int_equal(dechunk(&p, body, &t), BODY_LEN);
+    assert_memory_equal(body, data + strlen(HDR), BODY_LEN);
+    assert_string_equal(t, trailers);
+    // no chunk under target but the last, instead of one per piece
+    assert_true(p.chunks <= BODY_LEN / TARGET + 1);
+    assert_true(pieces > 5 * p.chunks);
+    free(body);
+    free(p.wire);
+    free(data);
+}
+
+/* Data is held back for at most the wait, or until it is due */
+static void test_hold(void **state)
+{
+    (void)state;
+    mw_chunker c;
+    mw_chunk_init(&c, 10, TARGET, WAIT_NS);
+    // the header alone waits for the first data
+    assert_int_equal(mw_chunk_begin(&c, 10, true, 100), MW_CHUNK_HOLD);
+    assert_int_equal(mw_chunk_begin(&c, 500, true, 100 + WAIT_NS - 1),
+                     MW_CHUNK_HOLD);
+    assert_int_equal(mw_chunk_begin(&c, 500, true, 100 + WAIT_NS),
+                     MW_CHUNK_SEND);
+    assert_int_equal(c.f_raw, 10);
+    assert_int_equal(c.len, 490);
+    assert_string_equal(c.line, "1ea\r\n");
+    // until it has all gone, the frame stays as it is
+    assert_int_equal(mw_chunk_sent(&c, 12), 10);
+    assert_int_equal(mw_chunk_begin(&c, 5000, true, 200), MW_CHUNK_SEND);
+    assert_int_equal(c.len, 490);
+    assert_int_equal(mw_chunk_sent(&c, 3 + 490 + 2), 490);
+    assert_false(c.busy);
+    assert_int_equal(mw_chunk_begin(&c, 0, true, 250), MW_CHUNK_EMPTY);
+
+    // the timer says so
+    assert_int_equal(mw_chunk_begin(&c, 100, true, 300), MW_CHUNK_HOLD);
+    c.due = true;
+    assert_int_equal(mw_chunk_begin(&c, 100, true, 301), MW_CHUNK_SEND);
+    assert_int_equal(mw_chunk_sent(&c, 4 + 100 + 2), 100);
+
+    // enough for a chunk, or the end, goes at once
+    assert_int_equal(mw_chunk_begin(&c, TARGET, true, 400), MW_CHUNK_SEND);
+    assert_false(c.last);
+    mw_chunk_sent(&c, 6 + TARGET + 2);
+    assert_int_equal(mw_chunk_begin(&c, 1, false, 500), MW_CHUNK_SEND);
+    assert_true(c.last);
+    assert_false(c.done);
+    mw_chunk_sent(&c, 3 + 1 + 2 + 3 + 2);
+    assert_int_equal(mw_chunk_begin(&c, 0, false, 600), MW_CHUNK_DONE);
+}
+
+static void on_flush(mw_timer *t, unsigned gen, void *ctx)
+{
+    (void)t;
+    (void)gen;
+    mw_chunker *c = ctx;
+    c->due = true;
+}
+
+/* Hold data back, as the writer does, with the flush timer armed within
+ * wait_ms on a wheel of TICK_MS ticks, and return the milliseconds until it
+ * goes out
+ */
+static uint64_t hold_and_flush(unsigned wait_ms)
+{
+    mw_twheel w;
+    mw_timer t = {0};
+    mw_chunker c;
+    mw_twheel_init(&w, TICK_MS);
+    mw_chunk_init(&c, 0, TARGET, (uint64_t)wait_ms * 1000000);
+    // time as the wheel sees it: a tick may end as soon as it is armed
+    uint64_t tick = 0;
+    assert_int_equal(mw_chunk_begin(&c, 100, true, 1), MW_CHUNK_HOLD);
+    mw_twheel_arm_within(&w, &t, wait_ms);
+    // the writer is off until the timer wakes it
+    while (!c.due) {
+        assert_true(tick < 100);
+        mw_twheel_advance(&w, ++tick, on_flush, &c);
+    }
+    uint64_t now_ms = tick * TICK_MS;
+    assert_int_equal(mw_chunk_begin(&c, 100, true, now_ms * 1000000),
+                     MW_CHUNK_SEND);
+    return now_ms;
+}
+
+/* Held data goes out within the wait, on the timer's tick, however short the
+ * ticks are against it; a wait shorter than a tick takes one
+ */
+static void test_flush_timer(void **state)
+{
+    (void)state;
+    assert_int_equal(hold_and_flush(250), 200);
+    assert_int_equal(hold_and_flush(300), 300);
+    assert_int_equal(hold_and_flush(20), TICK_MS);
+}
+
+/* A body that ends with nothing pending gets just the last-chunk */
+static void test_last_only(void **state)
+{
+    (void)state;
+    mw_chunker c;
+    mw_chunk_init(&c, 0, TARGET, WAIT_NS);
+    assert_int_equal(mw_chunk_begin(&c, 0, false, 1), MW_CHUNK_SEND);
+    struct iovec iov[MW_CHUNK_IOV];
+    int n = mw_chunk_iov(&c, NULL, 0, iov);
+    char wire[16];
+    size_t len = 0;
+    for (int i = 0; i < n; i++) {
+        memcpy(wire + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    assert_int_equal(len, 5);
+    assert_memory_equal(wire, "0\r\n\r\n", 5);
+    assert_int_equal(mw_chunk_sent(&c, 5), 0);
+    assert_true(c.done);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_coalesce),
+        cmocka_unit_test(test_hold),
+        cmocka_unit_test(test_last_only),
+        cmocka_unit_test(test_flush_timer),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -0,0 +1,79 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for clock_gettime and nanosleep
+#endif
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <time.h>
+
+#include "mw_clock.h"
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Whichever source is picked, it never goes backwards, and keeps time with
+ * CLOCK_MONOTONIC
+ */
+static void check_source(bool use_tsc)
+{
+    mw_clock_init(use_tsc);
+    uint64_t last = mw_clock_ns();
+    for (int i = 0; i < 100000; i++) {
+        uint64_t now = mw_clock_ns();
+        assert_true(now >= last);
+        last = now;
+    }
+
+    uint64_t m0 = monotonic_ns(), c0 = mw_clock_ns();
+    struct timespec nap = {0, 50 * 1000000L};
+    nanosleep(&nap, NULL);
+    uint64_t m1 = monotonic_ns(), c1 = mw_clock_ns();
+    int64_t drift = (int64_t)(c1 - c0) - (int64_t)(m1 - m0);
+    // within 2% of 50ms
+    assert_true(drift < 1000000 && drift > -1000000);
+}
+
+static void test_monotonic(void **state)
+{
+    (void)state;
+    check_source(false);
+}
+
+static void test_tsc(void **state)
+{
+    (void)state;
+    // falls back to CLOCK_MONOTONIC where there is no invariant TSC
+    check_source(true);
+}
+
+static void test_cached(void **state)
+{
+    (void)state;
+    uint64_t now = mw_clock_update();
+    assert_int_equal(mw_clock_now(), now);
+    assert_int_equal(mw_clock_now(), now);
+    assert_true(mw_clock_update() >= now);
+
+    int64_t coarse = mw_clock_coarse_ns(), precise = monotonic_ns();
+    // the coarse clock is a tick or so behind
+    assert_true(precise - coarse < 50000000 && coarse - precise < 1000000);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_monotonic),
+        cmocka_unit_test(test_tsc),
+        cmocka_unit_test(test_cached),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
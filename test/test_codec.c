@@ -0,0 +1,325 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "mw_codec.h"
+#include "testdata.h"
+#if HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define DATA_LEN (300 * 1000)
+
+static unsigned char *data;
+
+static int setup(void **state)
+{
+    (void)state;
+    data = malloc(DATA_LEN);
+    testdata_text(data, DATA_LEN, 1);
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    (void)state;
+    free(data);
+    return 0;
+}
+
+/* Decode len bytes of coding at z, and check they give back data */
+static void check_decodes(mw_coding coding, const unsigned char *z, size_t len)
+{
+    unsigned char *back = malloc(DATA_LEN + 1);
+    size_t back_len = 0;
+    if (coding == MW_CODING_DEFLATE || coding == MW_CODING_GZIP) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        int bits = coding == MW_CODING_GZIP ? 15 + 16 : 15;
+        assert_int_equal(inflateInit2(&zs, bits), Z_OK);
+        zs.next_in = (unsigned char *)z;
+        zs.avail_in = len;
+        zs.next_out = back;
+        zs.avail_out = DATA_LEN + 1;
+        assert_int_equal(inflate(&zs, Z_FINISH), Z_STREAM_END);
+        assert_int_equal(zs.avail_in, 0);
+        back_len = zs.total_out;
+        inflateEnd(&zs);
+    }
+#if HAVE_BROTLI
+    else if (coding == MW_CODING_BR) {
+        back_len = DATA_LEN + 1;
+        assert_int_equal(BrotliDecoderDecompress(len, z, &back_len, back),
+                         BROTLI_DECODER_RESULT_SUCCESS);
+    }
+#endif
+#if HAVE_ZSTD
+    else if (coding == MW_CODING_ZSTD) {
+        back_len = ZSTD_decompress(back, DATA_LEN + 1, z, len);
+        assert_false(ZSTD_isError(back_len));
+    }
+#endif
+    else {
+        fail();
+    }
+    assert_int_equal(back_len, DATA_LEN);
+    assert_memory_equal(back, data, DATA_LEN);
+    free(back);
+}
+
+/* Stream data through s in pieces, into little room at a time */
+static unsigned char *run(mw_codec_stream *s, size_t piece, size_t *len)
+{
+    unsigned char *z = malloc(2 * DATA_LEN);
+    size_t in_off = 0, out_off = 0;
+    mw_codec_status rc;
+    do {
+        size_t in_len = DATA_LEN - in_off;
+        if (in_len > piece) in_len = piece;
+        bool finish = in_off + in_len == DATA_LEN;
+        size_t out_len = 1000;
+        rc = mw_codec_stream_run(s,
+                                 data + in_off,
+                                 &in_len,
+                                 z + out_off,
+                                 &out_len,
+                                 finish);
+        assert_int_not_equal(rc, MW_CODEC_ERROR);
+        in_off += in_len;
+        out_off += out_len;
+    } while (rc != MW_CODEC_END);
+    assert_int_equal(in_off, DATA_LEN);
+    assert_int_equal(s->total_in, DATA_LEN);
+    assert_int_equal(s->total_out, out_off);
+    *len = out_off;
+    return z;
+}
+
+/* Every coding we can stream decodes back, and a reopened stream too */
+static void test_round_trip(void **state)
+{
+    (void)state;
+    unsigned avail = mw_codec_available();
+    assert_int_equal(avail & (MW_ENC_DEFLATE | MW_ENC_GZIP),
+                     MW_ENC_DEFLATE | MW_ENC_GZIP);
+    mw_codec_stream s;
+    memset(&s, 0, sizeof(s));
+    for (int c = 0; c < MW_CODINGS; c++) {
+        if (!(avail & (1u << c))) {
+            assert_int_not_equal(mw_codec_stream_open(&s, c, 3), 0);
+            continue;
+        }
+        for (int i = 0; i < 2; i++) {
+            // the second time at another level, on the reset state
+            assert_int_equal(mw_codec_stream_open(&s, c, i ? 1 : 5), 0);
+            assert_int_equal(s.coding, c);
+            assert_int_equal(s.level, i ? 1 : 5);
+            size_t len;
+            unsigned char *z = run(&s, i ? 7777 : DATA_LEN, &len);
+            assert_true(len < DATA_LEN / 2);
+            check_decodes(c, z, len);
+            free(z);
+        }
+    }
+    mw_codec_stream_close(&s);
+    assert_null(s.state);
+}
+
+/* The one-shot engines give the same codings, or nothing if out is short */
+static void test_oneshot(void **state)
+{
+    (void)state;
+    unsigned char *z = malloc(DATA_LEN);
+    for (int c = 0; c < MW_CODINGS; c++) {
+        if (!(mw_codec_available() & (1u << c))) continue;
+        const mw_codec *e = mw_codec_oneshot(c);
+        assert_non_null(e);
+        size_t len =
+            mw_codec_compress(e, c, e->level, data, DATA_LEN, z, DATA_LEN);
+        assert_int_not_equal(len, 0);
+        check_decodes(c, z, len);
+        assert_int_equal(
+            mw_codec_compress(e, c, e->level, data, DATA_LEN, z, len / 2),
+            0);
+    }
+
+    // a stream given its body whole hands it to the one-shot engine
+    mw_codec_stream s;
+    memset(&s, 0, sizeof(s));
+    assert_int_equal(mw_codec_stream_open(&s, MW_CODING_GZIP, 6), 0);
+    size_t in_len = DATA_LEN, out_len = mw_codec_stream_bound(&s, DATA_LEN);
+    z = realloc(z, out_len);
+    assert_int_equal(
+        mw_codec_stream_run(&s, data, &in_len, z, &out_len, true),
+        MW_CODEC_END);
+    assert_int_equal(in_len, DATA_LEN);
+    check_decodes(MW_CODING_GZIP, z, out_len);
+    mw_codec_stream_close(&s);
+    free(z);
+}
+
+/* A released stream's state is kept for the next stream of its coding, up to
+ * MW_CODEC_MAX_IDLE, and the rest are freed
+ */
+static void test_release(void **state)
+{
+    (void)state;
+    // the streams above left theirs when they changed coding
+    mw_codec_drain();
+    mw_codec_usage before = mw_codec_usage_get();
+    assert_int_equal(before.open, 0);
+    mw_codec_stream s[MW_CODEC_MAX_IDLE + 2];
+    memset(s, 0, sizeof(s));
+    assert_int_equal(mw_codec_stream_open(&s[0], MW_CODING_GZIP, 6), 0);
+    void *st = s[0].state;
+    mw_codec_stream_release(&s[0]);
+    assert_null(s[0].state);
+    mw_codec_usage u = mw_codec_usage_get();
+    assert_int_equal(u.open, 1);
+    assert_int_equal(u.idle, 1);
+
+    // reset for another stream, at another level; not for another coding
+    assert_int_equal(mw_codec_stream_open(&s[1], MW_CODING_GZIP, 1), 0);
+    assert_ptr_equal(s[1].state, st);
+    assert_int_equal(mw_codec_stream_open(&s[2], MW_CODING_DEFLATE, 6), 0);
+    assert_ptr_not_equal(s[2].state, st);
+    u = mw_codec_usage_get();
+    assert_int_equal(u.allocs, before.allocs + 2);
+    assert_int_equal(u.idle, 0);
+    size_t len;
+    unsigned char *z = run(&s[1], 7777, &len);
+    check_decodes(MW_CODING_GZIP, z, len);
+    free(z);
+    mw_codec_stream_release(&s[2]);
+
+    for (int i = 2; i < MW_CODEC_MAX_IDLE + 2; i++) {
+        assert_int_equal(mw_codec_stream_open(&s[i], MW_CODING_GZIP, 6), 0);
+    }
+    for (int i = 1; i < MW_CODEC_MAX_IDLE + 2; i++) {
+        mw_codec_stream_release(&s[i]);
+    }
+    u = mw_codec_usage_get();
+    assert_int_equal(u.idle, MW_CODEC_MAX_IDLE + 1);
+    assert_int_equal(u.open, u.idle);
+    mw_codec_drain();
+    u = mw_codec_usage_get();
+    assert_int_equal(u.open, 0);
+    assert_int_equal(u.idle, 0);
+
+#if HAVE_BROTLI
+    // brotli can't reset a state, so there is no keeping one
+    assert_int_equal(mw_codec_stream_open(&s[0], MW_CODING_BR, 5), 0);
+    mw_codec_stream_release(&s[0]);
+    u = mw_codec_usage_get();
+    assert_int_equal(u.open, 0);
+    assert_int_equal(u.idle, 0);
+    // nor reusing its own
+    assert_int_equal(mw_codec_stream_open(&s[0], MW_CODING_BR, 5), 0);
+    assert_int_equal(mw_codec_stream_open(&s[0], MW_CODING_BR, 5), 0);
+    z = run(&s[0], 7777, &len);
+    check_decodes(MW_CODING_BR, z, len);
+    free(z);
+    mw_codec_stream_release(&s[0]);
+    u = mw_codec_usage_get();
+    assert_int_equal(u.open, 0);
+#endif
+}
+
+/* No more than the set number of states are open at once: an idle one of
+ * another coding makes way, and past that a stream isn't opened
+ */
+static void test_max_open(void **state)
+{
+    (void)state;
+    mw_codec_drain();
+    mw_codec_set_max_open(2);
+    mw_codec_stream s[3];
+    memset(s, 0, sizeof(s));
+    assert_int_equal(mw_codec_stream_open(&s[0], MW_CODING_GZIP, 6), 0);
+    assert_int_equal(mw_codec_stream_open(&s[1], MW_CODING_DEFLATE, 6), 0);
+    assert_int_equal(mw_codec_stream_open(&s[2], MW_CODING_GZIP, 6), EBUSY);
+    assert_null(s[2].state);
+
+    mw_codec_stream_release(&s[1]);
+    assert_int_equal(mw_codec_stream_open(&s[2], MW_CODING_GZIP, 6), 0);
+    mw_codec_usage u = mw_codec_usage_get();
+    assert_int_equal(u.open, 2);
+    assert_int_equal(u.idle, 0);
+    size_t len;
+    unsigned char *z = run(&s[2], 7777, &len);
+    check_decodes(MW_CODING_GZIP, z, len);
+    free(z);
+
+    mw_codec_stream_close(&s[0]);
+    mw_codec_stream_close(&s[2]);
+    mw_codec_set_max_open(MW_CODEC_DEFAULT_MAX_OPEN);
+}
+
+/* Levels are per engine, and clamped to the engine's range */
+static void test_levels(void **state)
+{
+    (void)state;
+    mw_codec_levels levels = MW_CODEC_DEFAULT_LEVELS;
+    levels.zlib = 42;
+    mw_codec_init(&levels);
+    const mw_codec *zlib = mw_codec_streamer(MW_CODING_DEFLATE);
+    assert_string_equal(zlib->name, "zlib");
+    assert_ptr_equal(mw_codec_streamer(MW_CODING_GZIP), zlib);
+    assert_int_equal(zlib->level, zlib->max_level);
+    levels.zlib = 1;
+    mw_codec_init(&levels);
+    assert_int_equal(zlib->level, 1);
+#if HAVE_ZSTD
+    assert_int_equal(mw_codec_streamer(MW_CODING_ZSTD)->level, levels.zstd);
+#endif
+    mw_codec_levels defaults = MW_CODEC_DEFAULT_LEVELS;
+    mw_codec_init(&defaults);
+}
+
+/* The client's q-values pick the codings, then our preference among them */
+static void test_negotiate(void **state)
+{
+    (void)state;
+    // "gzip, deflate, br"
+    int q[MW_CODINGS] = {1000, 1000, 1000, -1};
+    unsigned best = mw_codec_negotiate(q, MW_ENC_ALL);
+    assert_int_equal(best, MW_ENC_DEFLATE | MW_ENC_GZIP | MW_ENC_BR);
+    assert_int_equal(mw_codec_pick(best), MW_CODING_BR);
+    assert_int_equal(mw_codec_pick(best & ~MW_ENC_BR), MW_CODING_GZIP);
+    // what the content type allows, or we can produce
+    best = mw_codec_negotiate(q, MW_ENC_DEFLATE | MW_ENC_ZSTD);
+    assert_int_equal(best, MW_ENC_DEFLATE);
+
+    // "gzip;q=0.5, zstd, br;q=0"
+    int q2[MW_CODINGS] = {-1, 500, 0, 1000};
+    assert_int_equal(mw_codec_negotiate(q2, MW_ENC_ALL), MW_ENC_ZSTD);
+    assert_int_equal(mw_codec_negotiate(q2, MW_ENC_ALL & ~MW_ENC_ZSTD),
+                     MW_ENC_GZIP);
+    assert_int_equal(mw_codec_negotiate(q2, MW_ENC_BR | MW_ENC_DEFLATE), 0);
+    assert_int_equal(mw_codec_pick(0), MW_CODINGS);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_round_trip, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_oneshot, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_release, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_max_open, setup, teardown),
+        cmocka_unit_test(test_levels),
+        cmocka_unit_test(test_negotiate),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
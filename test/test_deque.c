@@ -0,0 +1,132 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mw_deque.h"
+
+static void *item(uintptr_t i)
+{
+    return (void *)(i + 1);
+}
+
+/* The owner takes the newest, thieves the oldest */
+static void test_ends(__attribute__((unused)) void **state)
+{
+    mw_deque *d = malloc(sizeof(*d));
+    mw_deque_init(d);
+    assert_true(mw_deque_empty(d));
+    assert_null(mw_deque_pop(d));
+    assert_null(mw_deque_steal(d));
+
+    for (uintptr_t i = 0; i < 4; i++) assert_true(mw_deque_push(d, item(i)));
+    assert_false(mw_deque_empty(d));
+    assert_ptr_equal(mw_deque_pop(d), item(3));
+    assert_ptr_equal(mw_deque_steal(d), item(0));
+    assert_ptr_equal(mw_deque_steal(d), item(1));
+    assert_ptr_equal(mw_deque_pop(d), item(2));
+    assert_null(mw_deque_pop(d));
+    assert_true(mw_deque_empty(d));
+    free(d);
+}
+
+/* A full deque refuses more, and takes more once emptied */
+static void test_full(__attribute__((unused)) void **state)
+{
+    mw_deque *d = malloc(sizeof(*d));
+    mw_deque_init(d);
+    for (uintptr_t i = 0; i < MW_DEQUE_SIZE; i++) {
+        assert_true(mw_deque_push(d, item(i)));
+    }
+    assert_false(mw_deque_push(d, item(0)));
+    assert_ptr_equal(mw_deque_steal(d), item(0));
+    // the slot a thief freed wraps round
+    assert_true(mw_deque_push(d, item(MW_DEQUE_SIZE)));
+    assert_ptr_equal(mw_deque_pop(d), item(MW_DEQUE_SIZE));
+    for (uintptr_t i = MW_DEQUE_SIZE - 1; i > 0; i--) {
+        assert_ptr_equal(mw_deque_pop(d), item(i));
+    }
+    assert_null(mw_deque_pop(d));
+    free(d);
+}
+
+#define STRESS_ITEMS 100000
+#define STRESS_THIEVES 3
+
+typedef struct {
+    mw_deque *d;
+    unsigned char *seen; // one per item, counts who took it
+    volatile int done;
+} stress;
+
+static void *thief(void *arg)
+{
+    stress *st = arg;
+    for (;;) {
+        void *p = mw_deque_steal(st->d);
+        if (p) {
+            __atomic_fetch_add(&st->seen[(uintptr_t)p - 1],
+                               1,
+                               __ATOMIC_RELAXED);
+        }
+        else if (__atomic_load_n(&st->done, __ATOMIC_ACQUIRE) &&
+                 mw_deque_empty(st->d)) {
+            return NULL;
+        }
+    }
+}
+
+/* With thieves racing the owner, every item is taken exactly once */
+static void test_stress(__attribute__((unused)) void **state)
+{
+    stress st;
+    st.d = malloc(sizeof(*st.d));
+    st.seen = calloc(STRESS_ITEMS, 1);
+    st.done = 0;
+    mw_deque_init(st.d);
+    pthread_t t[STRESS_THIEVES];
+    for (int i = 0; i < STRESS_THIEVES; i++) {
+        pthread_create(&t[i], NULL, thief, &st);
+    }
+
+    for (uintptr_t i = 0; i < STRESS_ITEMS; i++) {
+        while (!mw_deque_push(st.d, item(i))) {
+            void *p = mw_deque_pop(st.d);
+            if (p) st.seen[(uintptr_t)p - 1]++;
+        }
+        // take some back, to race the thieves for the last item
+        if (i % 3 == 0) {
+            void *p = mw_deque_pop(st.d);
+            if (p) {
+                __atomic_fetch_add(&st.seen[(uintptr_t)p - 1],
+                                   1,
+                                   __ATOMIC_RELAXED);
+            }
+        }
+    }
+    __atomic_store_n(&st.done, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < STRESS_THIEVES; i++) pthread_join(t[i], NULL);
+    void *p;
+    while ((p = mw_deque_pop(st.d))) st.seen[(uintptr_t)p - 1]++;
+
+    for (int i = 0; i < STRESS_ITEMS; i++) assert_int_equal(st.seen[i], 1);
+    free(st.seen);
+    free(st.d);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_ends),
+        cmocka_unit_test(test_full),
+        cmocka_unit_test(test_stress),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
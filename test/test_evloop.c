@@ -0,0 +1,580 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for mkstemp
+#endif
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "mw_evloop.h"
+
+// each test runs on an epoll loop, then on an io_uring one
+#if HAVE_EPOLL
+
+typedef struct {
+    mw_evloop *loop;
+    int sv[2]; // sv[0] is watched, sv[1] is the peer
+    mw_evfd efd;
+    mw_ev rd, wr;
+    int rd_calls, wr_calls, cancels, deferred;
+    size_t last_avail;
+    bool drain; // should on_read read until EAGAIN?
+} fixture;
+
+static void on_read(mw_ev *ev, size_t avail)
+{
+    fixture *f = ev->ctx;
+    f->rd_calls++;
+    f->last_avail = avail;
+    if (!f->drain) return;
+    char buf[256];
+    while (mw_ev_read(ev, buf, sizeof(buf)) > 0) continue;
+    mw_ev_blocked(ev);
+}
+
+static void on_write(mw_ev *ev, size_t avail)
+{
+    fixture *f = ev->ctx;
+    assert_int_equal(avail, 0);
+    f->wr_calls++;
+}
+
+static void on_cancel(void *ctx)
+{
+    fixture *f = ctx;
+    f->cancels++;
+}
+
+static void on_deferred(void *ctx)
+{
+    fixture *f = ctx;
+    // deferred work runs after the pass's handlers
+    assert_int_equal(f->cancels, 1);
+    f->deferred++;
+}
+
+static int setup(void **state, int backend)
+{
+    fixture *f = calloc(1, sizeof(*f));
+    // without io_uring in the kernel, the uring tests run on epoll again
+    f->loop = mw_evloop_create(backend, 0);
+    if (!f->loop) {
+        free(f);
+        return -1;
+    }
+    socketpair(AF_UNIX, SOCK_STREAM, 0, f->sv);
+    fcntl(f->sv[0], F_SETFL, fcntl(f->sv[0], F_GETFL) | O_NONBLOCK);
+    mw_evfd_init(&f->efd, f->sv[0], MW_EVFD_STREAM);
+    mw_ev_init(&f->rd, f->loop, &f->efd, false, on_read, f);
+    *state = f;
+    return 0;
+}
+
+static int setup_epoll(void **state)
+{
+    return setup(state, MW_EVLOOP_EPOLL);
+}
+
+static int setup_uring(void **state)
+{
+    return setup(state, MW_EVLOOP_URING);
+}
+
+static int teardown(void **state)
+{
+    fixture *f = *state;
+    mw_ev_delete(&f->rd);
+    mw_ev_delete(&f->wr);
+    close(f->sv[0]);
+    close(f->sv[1]);
+    mw_evloop_destroy(f->loop);
+    free(f);
+    return 0;
+}
+
+/* A ready source is called every pass until it blocks, like a level-triggered
+ * dispatch source
+ */
+static void test_ready_until_blocked(void **state)
+{
+    fixture *f = *state;
+    mw_ev_enable(&f->rd);
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 0);
+
+    assert_int_equal(write(f->sv[1], "hello", 5), 5);
+    assert_int_equal(mw_evloop_poll(f->loop, 1000), 1);
+    assert_int_equal(f->last_avail, 5);
+    // we didn't read it, and didn't say we were blocked
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 1);
+    assert_int_equal(f->rd_calls, 2);
+
+    f->drain = true;
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 1);
+    assert_false(f->efd.readable);
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 0);
+    assert_int_equal(f->rd_calls, 3);
+
+    // the next edge wakes it again
+    assert_int_equal(write(f->sv[1], "x", 1), 1);
+    assert_int_equal(mw_evloop_poll(f->loop, 1000), 1);
+    assert_int_equal(f->rd_calls, 4);
+}
+
+/* An edge that comes while a source is disabled isn't lost */
+static void test_disabled_keeps_edge(void **state)
+{
+    fixture *f = *state;
+    f->drain = true;
+    assert_int_equal(write(f->sv[1], "hello", 5), 5);
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 0);
+    assert_true(f->efd.readable);
+    assert_int_equal(f->rd_calls, 0);
+
+    mw_ev_enable(&f->rd);
+    mw_ev_disable(&f->rd);
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 0);
+    mw_ev_enable(&f->rd);
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 1);
+    assert_int_equal(f->rd_calls, 1);
+}
+
+/* Both directions of one descriptor share its registration */
+static void test_read_and_write(void **state)
+{
+    fixture *f = *state;
+    mw_ev_init(&f->wr, f->loop, &f->efd, true, on_write, f);
+    mw_ev_enable(&f->rd);
+    mw_ev_enable(&f->wr);
+    // the socket starts out writable
+    assert_int_equal(mw_evloop_poll(f->loop, 1000), 1);
+    assert_int_equal(f->wr_calls, 1);
+    assert_int_equal(f->rd_calls, 0);
+    mw_ev_blocked(&f->wr);
+
+    // the descriptor leaves the epoll set with its last source
+    mw_ev_delete(&f->wr);
+    assert_true(f->efd.polled);
+    assert_null(f->efd.wr);
+    mw_ev_delete(&f->rd);
+    assert_false(f->efd.polled);
+    assert_int_equal(write(f->sv[1], "x", 1), 1);
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 0);
+}
+
+/* A source deleted by a handler is cancelled at once, and a task deferred by
+ * the handler runs at the end of the pass
+ */
+static void delete_self(mw_ev *ev, __attribute__((unused)) size_t avail)
+{
+    fixture *f = ev->ctx;
+    static mw_evtask task;
+    f->rd_calls++;
+    mw_evloop_defer(f->loop, &task, on_deferred, f);
+    mw_ev_delete(ev);
+    assert_int_equal(f->cancels, 1);
+}
+
+static void test_delete_defer(void **state)
+{
+    fixture *f = *state;
+    mw_ev_delete(&f->rd);
+    mw_ev_init(&f->rd, f->loop, &f->efd, false, delete_self, f);
+    mw_ev_set_cancel(&f->rd, on_cancel, f);
+    mw_ev_enable(&f->rd);
+    assert_int_equal(write(f->sv[1], "x", 1), 1);
+    assert_int_equal(mw_evloop_poll(f->loop, 1000), 1);
+    assert_int_equal(f->deferred, 1);
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 0);
+    assert_int_equal(f->rd_calls, 1);
+    // deleting again does nothing
+    mw_ev_delete(&f->rd);
+    assert_int_equal(f->cancels, 1);
+}
+
+/* Regular files can't be polled, and are always ready */
+static void test_file(void **state)
+{
+    fixture *f = *state;
+    char path[] = "/tmp/test_evloop.XXXXXX";
+    int fd = mkstemp(path);
+    assert_true(fd >= 0);
+    unlink(path);
+    assert_int_equal(write(fd, "0123456789", 10), 10);
+
+    mw_evfd efd;
+    mw_ev ev;
+    mw_evfd_init(&efd, fd, MW_EVFD_FILE);
+    mw_ev_init(&ev, f->loop, &efd, false, on_read, f);
+    assert_false(efd.polled);
+    mw_ev_enable(&ev);
+    mw_ev_blocked(&ev);
+    assert_int_equal(mw_evloop_poll(f->loop, 1000), 1);
+    assert_int_equal(mw_evloop_poll(f->loop, 1000), 1);
+    mw_ev_disable(&ev);
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 0);
+    mw_ev_delete(&ev);
+    close(fd);
+}
+
+/* A socket the loop can't watch makes no source, rather than one that is
+ * always ready and would spin
+ */
+static void test_unwatchable(void **state)
+{
+    fixture *f = *state;
+    char path[] = "/tmp/test_evloop.XXXXXX";
+    int fd = mkstemp(path);
+    assert_true(fd >= 0);
+    unlink(path);
+
+    // epoll won't have a regular file
+    mw_evfd efd;
+    mw_ev ev;
+    mw_evfd_init(&efd, fd, MW_EVFD_STREAM);
+    assert_int_equal(mw_ev_init(&ev, f->loop, &efd, false, on_read, f), EPERM);
+    assert_false(efd.polled);
+    assert_false(efd.readable);
+    assert_null(efd.rd);
+    // there is nothing to delete
+    mw_ev_delete(&ev);
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 0);
+    close(fd);
+}
+
+/* What was sent before the peer closed is all read before the end of file */
+static void test_eof(void **state)
+{
+    fixture *f = *state;
+    mw_ev_enable(&f->rd);
+    assert_int_equal(write(f->sv[1], "hello, world", 12), 12);
+    shutdown(f->sv[1], SHUT_WR);
+    while (f->rd_calls == 0) mw_evloop_poll(f->loop, 1000);
+
+    char buf[8];
+    assert_int_equal(mw_ev_read(&f->rd, buf, 5), 5);
+    assert_memory_equal(buf, "hello", 5);
+    assert_int_equal(mw_ev_read(&f->rd, buf, sizeof(buf)), 7);
+    assert_memory_equal(buf, ", world", 7);
+    // the end of file may be a completion of its own
+    ssize_t rc;
+    while ((rc = mw_ev_read(&f->rd, buf, sizeof(buf))) < 0) {
+        assert_int_equal(errno, EAGAIN);
+        mw_ev_blocked(&f->rd);
+        mw_evloop_poll(f->loop, 1000);
+    }
+    assert_int_equal(rc, 0);
+}
+
+#define HOG_LEN (64 * 1024)
+
+/* A connection that doesn't read keeps no more than its share of the ring's
+ * buffers: the rest waits in its socket, and is all read, in order, once it
+ * does
+ */
+static void test_hog(void **state)
+{
+    fixture *f = *state;
+    mw_ev_enable(&f->rd);
+    unsigned char *data = malloc(HOG_LEN), *back = malloc(HOG_LEN);
+    for (size_t i = 0; i < HOG_LEN; i++) data[i] = i * 7 + (i >> 8);
+    assert_int_equal(write(f->sv[1], data, HOG_LEN), HOG_LEN);
+    for (int i = 0; i < 20; i++) mw_evloop_poll(f->loop, 10);
+    assert_true(f->rd_calls > 0);
+    // what has been received is the start, the rest is in the socket
+    int in_socket = 0;
+    assert_int_equal(ioctl(f->sv[0], FIONREAD, &in_socket), 0);
+    size_t held = HOG_LEN - in_socket;
+    assert_true(held < MW_EVLOOP_RECV_QUEUE_MAX + MW_EVLOOP_RECV_BUF_SZ);
+    assert_int_equal(f->last_avail, f->loop->ring ? held : HOG_LEN);
+
+    size_t got = 0;
+    while (got < HOG_LEN) {
+        ssize_t n = mw_ev_read(&f->rd, back + got, 1000);
+        if (n < 0) {
+            assert_int_equal(errno, EAGAIN);
+            mw_ev_blocked(&f->rd);
+            mw_evloop_poll(f->loop, 1000);
+            continue;
+        }
+        assert_true(n > 0);
+        got += n;
+    }
+    assert_memory_equal(back, data, HOG_LEN);
+
+    // caught up, it reads as before
+    char buf[8];
+    while (mw_ev_read(&f->rd, buf, sizeof(buf)) > 0) continue;
+    assert_int_equal(errno, EAGAIN);
+    mw_ev_blocked(&f->rd);
+    assert_int_equal(write(f->sv[1], "hello", 5), 5);
+    ssize_t n;
+    while ((n = mw_ev_read(&f->rd, buf, sizeof(buf))) < 0) {
+        assert_int_equal(errno, EAGAIN);
+        mw_ev_blocked(&f->rd);
+        mw_evloop_poll(f->loop, 1000);
+    }
+    assert_int_equal(n, 5);
+    assert_memory_equal(buf, "hello", 5);
+    free(data);
+    free(back);
+}
+
+static void on_accept(mw_ev *ev, __attribute__((unused)) size_t avail)
+{
+    fixture *f = ev->ctx;
+    int s;
+    for (;;) {
+        if (ev->loop->backend == MW_EVLOOP_URING) {
+            s = mw_ev_accepted(ev);
+        }
+        else {
+            s = accept(ev->efd->fd, NULL, NULL);
+            if (s >= 0) fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+        }
+        if (s < 0) break;
+        assert_true(fcntl(s, F_GETFL) & O_NONBLOCK);
+        close(s);
+        f->rd_calls++;
+    }
+    assert_int_equal(errno, EAGAIN);
+    mw_ev_blocked(ev);
+}
+
+/* Connections to a listening socket are taken as they come */
+static void test_accept(void **state)
+{
+    fixture *f = *state;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert_int_equal(bind(lfd, (struct sockaddr *)&addr, len), 0);
+    assert_int_equal(listen(lfd, 16), 0);
+    getsockname(lfd, (struct sockaddr *)&addr, &len);
+
+    mw_evfd efd;
+    mw_ev ev;
+    mw_evfd_init(&efd, lfd, MW_EVFD_LISTEN);
+    mw_ev_init(&ev, f->loop, &efd, false, on_accept, f);
+    mw_ev_enable(&ev);
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 0);
+
+    int c[3];
+    for (int i = 0; i < 3; i++) {
+        c[i] = socket(AF_INET, SOCK_STREAM, 0);
+        assert_int_equal(connect(c[i], (struct sockaddr *)&addr, len), 0);
+    }
+    for (int i = 0; f->rd_calls < 3 && i < 100; i++) {
+        mw_evloop_poll(f->loop, 100);
+    }
+    assert_int_equal(f->rd_calls, 3);
+
+    mw_ev_delete(&ev);
+    close(lfd);
+    for (int i = 0; i < 3; i++) close(c[i]);
+}
+
+#define N_JOBS 64
+
+typedef struct {
+    mw_job job;
+    int i;
+    pthread_t ran_on;
+    int *order; // where done records i
+    int *n_done;
+} job_ctx;
+
+static void job_fn(void *ctx)
+{
+    job_ctx *j = ctx;
+    j->ran_on = pthread_self();
+    // long enough for another loop to come and steal
+    uint64_t spin = 0;
+    for (int k = 0; k < 200000; k++) {
+        __atomic_fetch_add(&spin, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void job_done(void *ctx)
+{
+    job_ctx *j = ctx;
+    j->order[(*j->n_done)++] = j->i;
+}
+
+/* A loop runs one of its own jobs a pass, and a strand's dones come in order */
+static void test_jobs(void **state)
+{
+    fixture *f = *state;
+    job_ctx jobs[3];
+    int order[3], n_done = 0;
+    mw_strand strand;
+    mw_strand_init(&strand);
+    for (int i = 0; i < 3; i++) {
+        jobs[i] = (job_ctx){.i = i, .order = order, .n_done = &n_done};
+        mw_evloop_spawn(f->loop,
+                        &strand,
+                        &jobs[i].job,
+                        job_fn,
+                        job_done,
+                        &jobs[i]);
+    }
+    assert_false(mw_strand_idle(&strand));
+    // pending jobs keep the loop from waiting
+    assert_int_equal(mw_evloop_poll(f->loop, -1), 1);
+    // the newest goes first, its done waits for the others
+    assert_int_equal(n_done, 0);
+    assert_int_equal(mw_evloop_poll(f->loop, -1), 1);
+    assert_int_equal(mw_evloop_poll(f->loop, -1), 1);
+    assert_int_equal(n_done, 3);
+    for (int i = 0; i < 3; i++) assert_int_equal(order[i], i);
+    assert_true(mw_strand_idle(&strand));
+    assert_int_equal(f->loop->ran, 3);
+    assert_int_equal(mw_evloop_poll(f->loop, 0), 0);
+}
+
+typedef struct {
+    mw_evloop *loop;
+    volatile int stop;
+} runner;
+
+static void *run_loop(void *arg)
+{
+    runner *r = arg;
+    while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+        mw_evloop_poll(r->loop, 100);
+    }
+    return NULL;
+}
+
+/* An idle loop in the group is woken to steal jobs, and their dones come back
+ * to the loop that spawned them, in order
+ */
+static void test_steal(void **state)
+{
+    fixture *f = *state;
+    mw_evgroup *g = calloc(1, sizeof(*g));
+    runner r = {.loop = mw_evloop_create(f->loop->backend, 1)};
+    assert_non_null(r.loop);
+    assert_int_equal(mw_evgroup_add(g, f->loop), 0);
+    assert_int_equal(mw_evgroup_add(g, r.loop), 0);
+    pthread_t t;
+    pthread_create(&t, NULL, run_loop, &r);
+
+    job_ctx *jobs = calloc(N_JOBS, sizeof(*jobs));
+    int order[N_JOBS], n_done = 0;
+    mw_strand strand;
+    mw_strand_init(&strand);
+    for (int i = 0; i < N_JOBS; i++) {
+        jobs[i] = (job_ctx){.i = i, .order = order, .n_done = &n_done};
+        mw_evloop_spawn(f->loop,
+                        &strand,
+                        &jobs[i].job,
+                        job_fn,
+                        job_done,
+                        &jobs[i]);
+    }
+    while (!mw_strand_idle(&strand)) mw_evloop_poll(f->loop, 1000);
+
+    __atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(t, NULL);
+    assert_int_equal(n_done, N_JOBS);
+    for (int i = 0; i < N_JOBS; i++) assert_int_equal(order[i], i);
+    assert_int_equal(f->loop->ran + r.loop->ran, N_JOBS);
+    assert_true(r.loop->stolen > 0);
+    int elsewhere = 0;
+    for (int i = 0; i < N_JOBS; i++) {
+        elsewhere += !pthread_equal(jobs[i].ran_on, pthread_self());
+    }
+    assert_int_equal(elsewhere, r.loop->stolen);
+
+    f->loop->group = NULL;
+    mw_evloop_destroy(r.loop);
+    free(jobs);
+    free(g);
+}
+
+static void on_tick(void *ctx)
+{
+    int *ticks = ctx;
+    (*ticks)++;
+}
+
+static void test_tick(void **state)
+{
+    fixture *f = *state;
+    int ticks = 0;
+    mw_evloop_set_tick(f->loop, 10, on_tick, &ticks);
+    // with nothing else to do, the pass waits for the tick
+    while (ticks == 0) mw_evloop_poll(f->loop, -1);
+    assert_int_equal(ticks, 1);
+    f->loop->tick = NULL;
+}
+
+#endif /* HAVE_EPOLL */
+
+int main(void)
+{
+#if HAVE_EPOLL
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_ready_until_blocked,
+                                        setup_epoll,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_disabled_keeps_edge,
+                                        setup_epoll,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_read_and_write,
+                                        setup_epoll,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_delete_defer,
+                                        setup_epoll,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_file, setup_epoll, teardown),
+        cmocka_unit_test_setup_teardown(test_unwatchable,
+                                        setup_epoll,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_eof, setup_epoll, teardown),
+        cmocka_unit_test_setup_teardown(test_accept, setup_epoll, teardown),
+        cmocka_unit_test_setup_teardown(test_hog, setup_epoll, teardown),
+        cmocka_unit_test_setup_teardown(test_jobs, setup_epoll, teardown),
+        cmocka_unit_test_setup_teardown(test_steal, setup_epoll, teardown),
+        cmocka_unit_test_setup_teardown(test_tick, setup_epoll, teardown),
+        cmocka_unit_test_setup_teardown(test_ready_until_blocked,
+                                        setup_uring,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_disabled_keeps_edge,
+                                        setup_uring,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_read_and_write,
+                                        setup_uring,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_delete_defer,
+                                        setup_uring,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_file, setup_uring, teardown),
+        cmocka_unit_test_setup_teardown(test_eof, setup_uring, teardown),
+        cmocka_unit_test_setup_teardown(test_accept, setup_uring, teardown),
+        cmocka_unit_test_setup_teardown(test_hog, setup_uring, teardown),
+        cmocka_unit_test_setup_teardown(test_jobs, setup_uring, teardown),
+        cmocka_unit_test_setup_teardown(test_steal, setup_uring, teardown),
+        cmocka_unit_test_setup_teardown(test_tick, setup_uring, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+#else
+    return 0;
+#endif
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
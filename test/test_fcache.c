@@ -0,0 +1,258 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for mkdtemp and utimes
+#endif
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "mw_fcache.h"
+#include "testdata.h"
+
+#define MAX_FILE (16 * 1024)
+#define FILE_LEN 4096
+// room for three FILE_LEN files with their headers, not four
+#define BUDGET (3 * FILE_LEN + 3 * 1024)
+#define N_FILES 16
+#define T0 1700000000
+
+static char dir[] = "/tmp/test_fcache.XXXXXX";
+static unsigned char *page;
+
+static const char *path_of(const char *name)
+{
+    static char path[64];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return path;
+}
+
+/* Write a file of len bytes at path, over any that is there, with mtime */
+static void put_file(const char *name,
+                     const unsigned char *data,
+                     size_t len,
+                     time_t mtime)
+{
+    FILE *f = fopen(path_of(name), "w");
+    assert_non_null(f);
+    assert_int_equal(fwrite(data, 1, len, f), len);
+    fclose(f);
+    struct timeval tv[2] = {{mtime, 0}, {mtime, 0}};
+    assert_int_equal(utimes(path_of(name), tv), 0);
+}
+
+/* Get the entry for a file as a request would, having opened it */
+static mw_fcache_entry *get(const char *name)
+{
+    int fd = open(path_of(name), O_RDONLY);
+    assert_true(fd >= 0);
+    struct stat sb;
+    assert_int_equal(fstat(fd, &sb), 0);
+    mw_fcache_entry *e = mw_fcache_get(path_of(name), fd, &sb, "text/html");
+    close(fd);
+    return e;
+}
+
+static const char *name_of(int i)
+{
+    static char name[16];
+    snprintf(name, sizeof(name), "f%d", i);
+    return name;
+}
+
+static int setup(void **state)
+{
+    (void)state;
+    if (!mkdtemp(dir)) return -1;
+    page = malloc(MAX_FILE + 1);
+    testdata_text(page, MAX_FILE + 1, 5);
+    for (int i = 0; i < N_FILES; i++) {
+        put_file(name_of(i), page + i, FILE_LEN, T0);
+    }
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    (void)state;
+    mw_fcache_init(0, 0);
+    for (int i = 0; i < N_FILES; i++) unlink(path_of(name_of(i)));
+    static const char *names[] = {
+        "page.html", "changed.html", "changed.new", "big.html", "empty.html"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        unlink(path_of(names[i]));
+    }
+    rmdir(dir);
+    free(page);
+    return 0;
+}
+
+/* A file is read into memory with its header, and shared after */
+static void test_header(void **state)
+{
+    (void)state;
+    mw_fcache_init(BUDGET, MAX_FILE);
+    put_file("page.html", page, 100, T0);
+    mw_fcache_entry *e = get("page.html");
+    assert_non_null(e);
+    assert_int_equal(e->len, 100);
+    assert_memory_equal(e->data, page, 100);
+    // the ETag is the size and mtime, in hex
+    static const char want[] = "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: text/html\r\n"
+                               "Content-Length: 100\r\n"
+                               "ETag: \"64-6553f100\"\r\n"
+                               "Last-Modified: Tue, 14 Nov 2023 22:13:20 GMT"
+                               "\r\n";
+    assert_int_equal(e->hdr_len, strlen(want));
+    assert_string_equal(e->hdr, want);
+
+    mw_fcache_entry *again = get("page.html");
+    assert_ptr_equal(again, e);
+    mw_fcache_release(again);
+    mw_fcache_release(e);
+
+    // an empty file is a file too
+    put_file("empty.html", page, 0, T0);
+    e = get("empty.html");
+    assert_non_null(e);
+    assert_int_equal(e->len, 0);
+    assert_non_null(strstr(e->hdr, "Content-Length: 0\r\n"));
+    mw_fcache_release(e);
+}
+
+/* An entry only matches the inode, mtime and size it was made from */
+static void test_match(void **state)
+{
+    (void)state;
+    mw_fcache_init(BUDGET, MAX_FILE);
+    put_file("changed.html", page, 100, T0);
+    mw_fcache_entry *e = get("changed.html");
+    assert_non_null(e);
+
+    // a new mtime is a new file, however alike; the request still sending
+    // the old one keeps it
+    put_file("changed.html", page, 100, T0 + 1);
+    mw_fcache_entry *n = get("changed.html");
+    assert_non_null(n);
+    assert_ptr_not_equal(n, e);
+    assert_true(e->node.dead);
+    assert_memory_equal(e->data, page, 100);
+    assert_non_null(strstr(n->hdr, "ETag: \"64-6553f101\"\r\n"));
+    mw_fcache_release(e);
+
+    // and so is a new size, at the same mtime
+    put_file("changed.html", page + 1, 99, T0 + 1);
+    e = get("changed.html");
+    assert_non_null(e);
+    assert_ptr_not_equal(e, n);
+    assert_true(n->node.dead);
+    assert_int_equal(e->len, 99);
+    assert_memory_equal(e->data, page + 1, 99);
+    assert_non_null(strstr(e->hdr, "Content-Length: 99\r\n"));
+    mw_fcache_release(n);
+
+    // and a new inode, at the same size and mtime, moved over it
+    put_file("changed.new", page + 2, 99, T0 + 1);
+    char to[64];
+    snprintf(to, sizeof(to), "%s", path_of("changed.html"));
+    assert_int_equal(rename(path_of("changed.new"), to), 0);
+    n = get("changed.html");
+    assert_non_null(n);
+    assert_ptr_not_equal(n, e);
+    assert_memory_equal(n->data, page + 2, 99);
+    mw_fcache_release(e);
+    mw_fcache_release(n);
+}
+
+/* The files kept, with their headers, fit the budget; the least recently
+ * used go first
+ */
+static void test_budget(void **state)
+{
+    (void)state;
+    mw_fcache_init(BUDGET, MAX_FILE);
+    // held, so the evicted ones can still be looked at
+    mw_fcache_entry *e[N_FILES];
+    for (int i = 0; i < 3; i++) {
+        e[i] = get(name_of(i));
+        assert_non_null(e[i]);
+    }
+    for (int i = 0; i < 3; i++) assert_false(e[i]->node.dead);
+
+    // f0 is used again, so f1 is the one to go for f3
+    mw_fcache_entry *again = get(name_of(0));
+    assert_ptr_equal(again, e[0]);
+    mw_fcache_release(again);
+    e[3] = get(name_of(3));
+    assert_non_null(e[3]);
+    assert_false(e[0]->node.dead);
+    assert_true(e[1]->node.dead);
+    assert_false(e[2]->node.dead);
+    assert_false(e[3]->node.dead);
+
+    // however many files go through, only the last used few are kept
+    for (int i = 4; i < N_FILES; i++) {
+        e[i] = get(name_of(i));
+        assert_non_null(e[i]);
+        size_t bytes = 0;
+        int live = 0;
+        for (int j = 0; j <= i; j++) {
+            if (e[j]->node.dead) continue;
+            bytes += e[j]->len + e[j]->hdr_len;
+            live++;
+        }
+        assert_true(bytes <= BUDGET);
+        assert_int_equal(live, 3);
+        assert_false(e[i - 1]->node.dead);
+        assert_true(e[i - 3]->node.dead);
+    }
+    for (int i = 0; i < N_FILES; i++) mw_fcache_release(e[i]);
+
+    // a smaller budget evicts at once
+    e[0] = get(name_of(N_FILES - 1));
+    mw_fcache_init(FILE_LEN + 1024, MAX_FILE);
+    assert_false(e[0]->node.dead);
+    e[1] = get(name_of(N_FILES - 2));
+    assert_true(e[0]->node.dead);
+    mw_fcache_release(e[0]);
+    mw_fcache_release(e[1]);
+}
+
+/* Files over the limit aren't cached, nor anything with no budget */
+static void test_limits(void **state)
+{
+    (void)state;
+    mw_fcache_init(BUDGET, MAX_FILE);
+    put_file("big.html", page, MAX_FILE + 1, T0);
+    assert_null(get("big.html"));
+    put_file("big.html", page, MAX_FILE, T0 + 1);
+    mw_fcache_entry *e = get("big.html");
+    assert_non_null(e);
+    mw_fcache_release(e);
+
+    mw_fcache_init(0, MAX_FILE);
+    assert_null(get("big.html"));
+    assert_null(get(name_of(0)));
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_header),
+        cmocka_unit_test(test_match),
+        cmocka_unit_test(test_budget),
+        cmocka_unit_test(test_limits),
+    };
+
+    return cmocka_run_group_tests(tests, setup, teardown);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -0,0 +1,289 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for mkdtemp, nanosleep and utimes
+#endif
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mw_fdcache.h"
+#include "mw_fmt.h"
+
+#define N_FILES 200
+#define T0 1700000000
+#define N_THREADS 8
+
+static char dir[] = "/tmp/test_fdcache.XXXXXX";
+static char race_path[64];
+
+static const char *path_of(const char *name)
+{
+    static char path[64];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return path;
+}
+
+/* Write len bytes of 'x' at name, over any file that is there, with mtime */
+static void put_file(const char *name, size_t len, time_t mtime)
+{
+    FILE *f = fopen(path_of(name), "w");
+    assert_non_null(f);
+    for (size_t i = 0; i < len; i++) fputc('x', f);
+    fclose(f);
+    struct timeval tv[2] = {{mtime, 0}, {mtime, 0}};
+    assert_int_equal(utimes(path_of(name), tv), 0);
+}
+
+/* The descriptors this process has open */
+static int open_fds(void)
+{
+    DIR *d = opendir("/proc/self/fd");
+    assert_non_null(d);
+    int n = 0;
+    while (readdir(d)) n++;
+    closedir(d);
+    // ., .. and d's own
+    return n - 3;
+}
+
+static bool fd_open(int fd)
+{
+    return fcntl(fd, F_GETFD) != -1;
+}
+
+static int setup(void **state)
+{
+    (void)state;
+    if (!mkdtemp(dir)) return -1;
+    for (int i = 0; i < N_FILES; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%d", i);
+        put_file(name, 10, T0);
+    }
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    (void)state;
+    mw_fdcache_init(0, 0);
+    for (int i = 0; i < N_FILES; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%d", i);
+        unlink(path_of(name));
+    }
+    unlink(path_of("page.html"));
+    rmdir(dir);
+    return 0;
+}
+
+/* The same file is shared while it is unchanged; a changed one is opened
+ * again, and the old one is closed once the last request lets go of it
+ */
+static void test_replace(void **state)
+{
+    (void)state;
+    mw_fdcache_init(64, 0);
+    put_file("page.html", 100, T0);
+    mw_fdcache_entry *e = mw_fdcache_open(path_of("page.html"));
+    assert_non_null(e);
+    assert_int_equal(e->sb.st_size, 100);
+    mw_fdcache_entry *again = mw_fdcache_open(path_of("page.html"));
+    assert_ptr_equal(again, e);
+    mw_fdcache_release(again);
+
+    // a new mtime, at the same size, is a new file
+    put_file("page.html", 100, T0 + 1);
+    mw_fdcache_entry *n = mw_fdcache_open(path_of("page.html"));
+    assert_non_null(n);
+    assert_ptr_not_equal(n, e);
+    assert_int_equal(n->sb.st_mtime, T0 + 1);
+    // the request still reading the old one keeps it open
+    int old_fd = e->fd;
+    assert_true(fd_open(old_fd));
+    mw_fdcache_release(e);
+    assert_false(fd_open(old_fd));
+
+    // and so is a new size
+    put_file("page.html", 200, T0 + 1);
+    e = mw_fdcache_open(path_of("page.html"));
+    assert_ptr_not_equal(e, n);
+    assert_int_equal(e->sb.st_size, 200);
+    mw_fdcache_release(n);
+    mw_fdcache_release(e);
+
+    // only regular files
+    assert_null(mw_fdcache_open(dir));
+    assert_int_equal(errno, EISDIR);
+    assert_null(mw_fdcache_open(path_of("missing")));
+    assert_int_equal(errno, ENOENT);
+}
+
+/* An entry is trusted for ttl seconds, then checked again */
+static void test_ttl(void **state)
+{
+    (void)state;
+    mw_fdcache_init(64, 1);
+    put_file("page.html", 100, T0);
+    // start at the top of a second, for a whole second to work in
+    time_t t = mw_fmt_now();
+    struct timespec ts = {0, 10 * 1000000};
+    while (mw_fmt_now() == t) nanosleep(&ts, NULL);
+    mw_fdcache_entry *e = mw_fdcache_open(path_of("page.html"));
+    assert_non_null(e);
+    mw_fdcache_release(e);
+
+    // changed within the ttl, the entry we have is still given out
+    put_file("page.html", 300, T0 + 2);
+    mw_fdcache_entry *stale = mw_fdcache_open(path_of("page.html"));
+    assert_ptr_equal(stale, e);
+    assert_int_equal(stale->sb.st_size, 100);
+    mw_fdcache_release(stale);
+
+    // after it, the change is found
+    t = mw_fmt_now();
+    while (mw_fmt_now() == t) nanosleep(&ts, NULL);
+    mw_fdcache_entry *n = mw_fdcache_open(path_of("page.html"));
+    assert_ptr_not_equal(n, e);
+    assert_int_equal(n->sb.st_size, 300);
+    mw_fdcache_release(n);
+
+    // an unchanged file is checked, and kept
+    t = mw_fmt_now();
+    while (mw_fmt_now() == t) nanosleep(&ts, NULL);
+    e = mw_fdcache_open(path_of("page.html"));
+    assert_ptr_equal(e, n);
+    assert_int_equal(e->verified, mw_fmt_now());
+    mw_fdcache_release(e);
+}
+
+/* Each stripe keeps its share of the descriptors open, and no more; one
+ * evicted while in use is closed when it is released
+ */
+static void test_cap(void **state)
+{
+    (void)state;
+    mw_fdcache_init(0, 0);
+    int base = open_fds();
+    // 16 stripes, one descriptor each
+    mw_fdcache_init(16, 60);
+    mw_fdcache_entry *held = mw_fdcache_open(path_of("f0"));
+    assert_non_null(held);
+    for (int i = 1; i < N_FILES; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%d", i);
+        mw_fdcache_entry *e = mw_fdcache_open(path_of(name));
+        assert_non_null(e);
+        mw_fdcache_release(e);
+        // the one still held may be past the cap, until it is released
+        assert_true(open_fds() - base <= 16 + 1);
+    }
+
+    // f0 was evicted for another file in its stripe, but is still open
+    mw_fdcache_entry *e = mw_fdcache_open(path_of("f0"));
+    assert_ptr_not_equal(e, held);
+    assert_true(fd_open(held->fd));
+    int fd = held->fd;
+    mw_fdcache_release(held);
+    assert_false(fd_open(fd));
+    mw_fdcache_release(e);
+    assert_true(open_fds() - base <= 16);
+
+    // with no cache, a file is closed on its last release
+    mw_fdcache_init(0, 60);
+    assert_int_equal(open_fds(), base);
+    e = mw_fdcache_open(path_of("f1"));
+    assert_non_null(e);
+    fd = e->fd;
+    mw_fdcache_release(e);
+    assert_false(fd_open(fd));
+}
+
+typedef struct {
+    int id;
+    int opens;
+    int bad; ///< Opens that gave a closed descriptor
+} opener;
+
+static void *open_loop(void *arg)
+{
+    opener *o = arg;
+    char c;
+    for (int i = 0; i < 2000; i++) {
+        mw_fdcache_entry *e = mw_fdcache_open(race_path);
+        if (!e) continue;
+        o->opens++;
+        if (pread(e->fd, &c, 1, 0) < 0) o->bad++;
+        // now and then, the file grows under the others
+        if (i % N_THREADS == o->id) {
+            int fd = open(race_path, O_WRONLY | O_APPEND);
+            if (fd < 0 || write(fd, "x", 1) != 1) o->bad++;
+            if (fd >= 0) close(fd);
+        }
+        mw_fdcache_release(e);
+    }
+    return NULL;
+}
+
+/* Requests racing to open and check the same file, while it changes, end up
+ * sharing one entry, and leave no descriptor behind
+ */
+static void test_race(void **state)
+{
+    (void)state;
+    mw_fdcache_init(0, 0);
+    put_file("page.html", 100, T0);
+    int base = open_fds();
+    snprintf(race_path, sizeof(race_path), "%s", path_of("page.html"));
+    // every open checks the file again
+    mw_fdcache_init(64, 0);
+    pthread_t t[N_THREADS];
+    opener o[N_THREADS];
+    for (int i = 0; i < N_THREADS; i++) {
+        o[i] = (opener){.id = i};
+        pthread_create(&t[i], NULL, open_loop, &o[i]);
+    }
+    int opens = 0;
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(t[i], NULL);
+        opens += o[i].opens;
+        assert_int_equal(o[i].bad, 0);
+    }
+    assert_int_equal(opens, N_THREADS * 2000);
+    // one entry for the file, whoever opened it last
+    assert_int_equal(open_fds(), base + 1);
+    mw_fdcache_entry *a = mw_fdcache_open(path_of("page.html"));
+    mw_fdcache_entry *b = mw_fdcache_open(path_of("page.html"));
+    assert_ptr_equal(a, b);
+    mw_fdcache_release(a);
+    mw_fdcache_release(b);
+    mw_fdcache_init(0, 0);
+    assert_int_equal(open_fds(), base);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_replace),
+        cmocka_unit_test(test_ttl),
+        cmocka_unit_test(test_cap),
+        cmocka_unit_test(test_race),
+    };
+
+    return cmocka_run_group_tests(tests, setup, teardown);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -0,0 +1,105 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for gmtime_r
+#endif
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mw_fmt.h"
+
+/* mw_fmt_addr must write what inet_ntop does */
+static void check_addr(int af, const char *text)
+{
+    unsigned char a[16];
+    char want[MW_FMT_ADDR_MAX + 1], got[MW_FMT_ADDR_MAX + 1];
+    assert_int_equal(inet_pton(af, text, a), 1);
+    assert_non_null(inet_ntop(af, a, want, sizeof(want)));
+    size_t n = mw_fmt_addr(af, a, got);
+    got[n] = '\0';
+    assert_string_equal(got, want);
+}
+
+static void test_ipv4(void **state)
+{
+    (void)state;
+    check_addr(AF_INET, "0.0.0.0");
+    check_addr(AF_INET, "1.2.3.4");
+    check_addr(AF_INET, "10.100.9.255");
+    check_addr(AF_INET, "255.255.255.255");
+
+    srand(1);
+    for (int i = 0; i < 10000; i++) {
+        struct in_addr a = {.s_addr = (unsigned)rand() * 2654435761u};
+        char want[MW_FMT_ADDR_MAX + 1], got[MW_FMT_ADDR_MAX + 1];
+        inet_ntop(AF_INET, &a, want, sizeof(want));
+        got[mw_fmt_addr(AF_INET, &a, got)] = '\0';
+        assert_string_equal(got, want);
+    }
+}
+
+static void test_ipv6(void **state)
+{
+    (void)state;
+    check_addr(AF_INET6, "::");
+    check_addr(AF_INET6, "::1");
+    check_addr(AF_INET6, "1::");
+    check_addr(AF_INET6, "2001:db8::1");
+    check_addr(AF_INET6, "2001:db8:0:0:1:0:0:1");
+    check_addr(AF_INET6, "1:0:0:2:0:0:0:3");
+    check_addr(AF_INET6, "1:0:2:3:4:5:6:7");
+    check_addr(AF_INET6, "1:2:3:4:5:6:7:8");
+    check_addr(AF_INET6, "fe80::1:2:3:4");
+    check_addr(AF_INET6, "::ffff:10.0.0.1");
+}
+
+static void test_clf(void **state)
+{
+    (void)state;
+    srand(2);
+    for (int i = 0; i < 10000; i++) {
+        time_t t = (time_t)rand() * 7;
+        struct tm tm;
+        char want[64], got[MW_FMT_CLF_LEN + 1];
+        strftime(want, sizeof(want), "%d/%b/%Y:%H:%M:%S +0", gmtime_r(&t, &tm));
+        mw_fmt_clf(t, got);
+        got[MW_FMT_CLF_LEN] = '\0';
+        assert_string_equal(got, want);
+    }
+}
+
+static void test_now(void **state)
+{
+    (void)state;
+    time_t t = mw_fmt_now();
+    struct tm tm;
+    char want[64], got[MW_FMT_HTTP_LEN + 1];
+    mw_fmt_http_now(got);
+    got[MW_FMT_HTTP_LEN] = '\0';
+    const char *http = "%a, %d %b %Y %H:%M:%S GMT";
+    strftime(want, sizeof(want), http, gmtime_r(&t, &tm));
+    // the second may have turned over in between
+    if (strcmp(got, want)) {
+        t++;
+        strftime(want, sizeof(want), http, gmtime_r(&t, &tm));
+    }
+    assert_string_equal(got, want);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_ipv4),
+        cmocka_unit_test(test_ipv6),
+        cmocka_unit_test(test_clf),
+        cmocka_unit_test(test_now),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -0,0 +1,130 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <string.h>
+
+#include "mw_http.h"
+
+static const char *pipelined = "\r\nGET /a/b?x=1 HTTP/1.1\r\n"
+                               "Host: example.com \r\n"
+                               "Accept-Encoding: gzip, deflate;q=0.5\r\n"
+                               "X-Empty:\r\n"
+                               "\r\n"
+                               "GET /2 HTTP/1.0\n"
+                               "\n";
+
+static void check_first(mw_http_parser *p, const char *buf)
+{
+    assert_true(mw_span_eq(buf, p->method, "GET"));
+    assert_true(mw_span_eq(buf, p->target, "/a/b?x=1"));
+    assert_true(mw_span_eq(buf, p->req_line, "GET /a/b?x=1 HTTP/1.1"));
+    assert_int_equal(p->minor, 1);
+    assert_int_equal(p->n_headers, 3);
+
+    const mw_http_header *h = mw_http_find(p, buf, "host");
+    assert_non_null(h);
+    assert_true(mw_span_eq(buf, h->value, "example.com"));
+
+    h = mw_http_find(p, buf, "X-EMPTY");
+    assert_non_null(h);
+    assert_int_equal(h->value.len, 0);
+
+    h = mw_http_find(p, buf, "Accept-Encoding");
+    assert_non_null(h);
+    assert_true(mw_span_has_token(buf, h->value, "deflate"));
+    assert_true(mw_span_has_token(buf, h->value, "GZIP"));
+    assert_false(mw_span_has_token(buf, h->value, "br"));
+}
+
+static void test_whole(void **state)
+{
+    (void)state;
+    mw_http_parser p;
+    mw_http_init(&p, 0);
+    assert_int_equal(mw_http_parse(&p, pipelined, strlen(pipelined)),
+                     MW_HTTP_DONE);
+    check_first(&p, pipelined);
+}
+
+static void test_split_reads(void **state)
+{
+    (void)state;
+    size_t len = strlen(pipelined);
+    for (size_t split = 1; split < len; split++) {
+        mw_http_parser p;
+        mw_http_init(&p, 0);
+        mw_http_status st = mw_http_parse(&p, pipelined, split);
+        if (st == MW_HTTP_AGAIN) st = mw_http_parse(&p, pipelined, len);
+        assert_int_equal(st, MW_HTTP_DONE);
+        check_first(&p, pipelined);
+    }
+}
+
+static void test_pipelined(void **state)
+{
+    (void)state;
+    size_t len = strlen(pipelined);
+    mw_http_parser p;
+    mw_http_init(&p, 0);
+    assert_int_equal(mw_http_parse(&p, pipelined, len), MW_HTTP_DONE);
+
+    mw_http_init(&p, p.end);
+    assert_int_equal(mw_http_parse(&p, pipelined, len), MW_HTTP_DONE);
+    assert_true(mw_span_eq(pipelined, p.target, "/2"));
+    assert_int_equal(p.minor, 0);
+    assert_int_equal(p.end, len);
+}
+
+static void test_malformed(void **state)
+{
+    (void)state;
+    const char *bad[] = {
+        "GET / HTTP/2.0\r\n\r\n",
+        "GET / HTTP/1.1\r\nBad Name: x\r\n\r\n",
+        "GET  / HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\r\n folded\r\n\r\n",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        mw_http_parser p;
+        mw_http_init(&p, 0);
+        assert_int_equal(mw_http_parse(&p, bad[i], strlen(bad[i])),
+                         MW_HTTP_ERROR);
+    }
+}
+
+/* Accept-Encoding style q-values, in thousandths */
+static void test_token_q(void **state)
+{
+    (void)state;
+    const char *ae =
+        "gzip;q=0.5, br ; Q=1.0,zstd;level=3;q=0.123 ,x;q=0, *;q=.2";
+    mw_span sp = {0, strlen(ae)};
+    assert_int_equal(mw_span_token_q(ae, sp, "gzip"), 500);
+    assert_int_equal(mw_span_token_q(ae, sp, "BR"), 1000);
+    assert_int_equal(mw_span_token_q(ae, sp, "zstd"), 123);
+    assert_int_equal(mw_span_token_q(ae, sp, "x"), 0);
+    // not named, so it gets the q-value of *
+    assert_int_equal(mw_span_token_q(ae, sp, "deflate"), 200);
+
+    const char *plain = "deflate, gzip";
+    sp.len = strlen(plain);
+    assert_int_equal(mw_span_token_q(plain, sp, "gzip"), 1000);
+    assert_int_equal(mw_span_token_q(plain, sp, "br"), -1);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_whole),
+        cmocka_unit_test(test_split_reads),
+        cmocka_unit_test(test_pipelined),
+        cmocka_unit_test(test_malformed),
+        cmocka_unit_test(test_token_q),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
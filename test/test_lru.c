@@ -0,0 +1,173 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for strdup
+#endif
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mw_lru.h"
+
+#define N_BUCKETS 4 // few, so the chains are long
+
+typedef struct {
+    mw_lru_node node;
+    size_t size;
+} entry;
+
+static int freed;
+
+static size_t entry_cost(mw_lru_node *n)
+{
+    return ((entry *)n)->size;
+}
+
+static void entry_free(mw_lru_node *n)
+{
+    free(n->path);
+    free(n);
+    freed++;
+}
+
+static entry *entry_new(const char *path, size_t size)
+{
+    entry *e = calloc(1, sizeof(*e));
+    e->node.path = strdup(path);
+    e->node.refs = 1;
+    e->size = size;
+    return e;
+}
+
+static void setup_table(mw_lru *t, mw_lru_node **buckets, size_t limit)
+{
+    memset(buckets, 0, N_BUCKETS * sizeof(*buckets));
+    mw_lru_init(t, buckets, N_BUCKETS, entry_cost, entry_free);
+    t->limit = limit;
+    freed = 0;
+}
+
+static void drain(mw_lru *t)
+{
+    t->limit = 0;
+    mw_lru_evict(t);
+    assert_null(t->head);
+    assert_null(t->tail);
+    assert_int_equal(t->used, 0);
+}
+
+/* The same path always hashes the same, different ones (mostly) don't */
+static void test_hash(void **state)
+{
+    (void)state;
+    // FNV-1a of the empty string is its offset basis
+    assert_int_equal(mw_lru_hash(""), 2166136261u);
+    assert_int_equal(mw_lru_hash("/index.html"), mw_lru_hash("/index.html"));
+    assert_int_not_equal(mw_lru_hash("/a"), mw_lru_hash("/b"));
+}
+
+/* Nodes are found by path, however their buckets are shared */
+static void test_find(void **state)
+{
+    (void)state;
+    mw_lru t;
+    mw_lru_node *buckets[N_BUCKETS];
+    setup_table(&t, buckets, 1000);
+
+    char path[16];
+    entry *e[20];
+    for (int i = 0; i < 20; i++) {
+        snprintf(path, sizeof(path), "/f%d", i);
+        e[i] = entry_new(path, 1);
+        mw_lru_insert(&t, &e[i]->node);
+    }
+    assert_int_equal(t.used, 20);
+    for (int i = 0; i < 20; i++) {
+        snprintf(path, sizeof(path), "/f%d", i);
+        assert_ptr_equal(mw_lru_find(&t, path), &e[i]->node);
+    }
+    assert_null(mw_lru_find(&t, "/f20"));
+
+    // a removed node is gone from its chain, and the rest are still there
+    mw_lru_remove(&t, &e[7]->node);
+    assert_int_equal(freed, 1);
+    assert_null(mw_lru_find(&t, "/f7"));
+    assert_ptr_equal(mw_lru_find(&t, "/f11"), &e[11]->node);
+    assert_int_equal(t.used, 19);
+
+    drain(&t);
+    assert_int_equal(freed, 20);
+}
+
+/* Eviction takes the least recently used first, until under the limit */
+static void test_evict(void **state)
+{
+    (void)state;
+    mw_lru t;
+    mw_lru_node *buckets[N_BUCKETS];
+    setup_table(&t, buckets, 10);
+
+    entry *a = entry_new("/a", 4);
+    entry *b = entry_new("/b", 4);
+    entry *c = entry_new("/c", 4);
+    mw_lru_insert(&t, &a->node);
+    mw_lru_insert(&t, &b->node);
+    mw_lru_evict(&t);
+    assert_int_equal(freed, 0);
+
+    // a is the oldest, until it is used again
+    assert_ptr_equal(t.tail, &a->node);
+    mw_lru_touch(&t, &a->node);
+    assert_ptr_equal(t.head, &a->node);
+    assert_ptr_equal(t.tail, &b->node);
+
+    mw_lru_insert(&t, &c->node);
+    assert_int_equal(t.used, 12);
+    mw_lru_evict(&t);
+    assert_int_equal(freed, 1);
+    assert_null(mw_lru_find(&t, "/b"));
+    assert_int_equal(t.used, 8);
+    assert_ptr_equal(t.head, &c->node);
+    assert_ptr_equal(t.tail, &a->node);
+
+    drain(&t);
+}
+
+/* A node that is still referenced outlives its eviction */
+static void test_refs(void **state)
+{
+    (void)state;
+    mw_lru t;
+    mw_lru_node *buckets[N_BUCKETS];
+    setup_table(&t, buckets, 10);
+
+    entry *a = entry_new("/a", 4);
+    mw_lru_insert(&t, &a->node);
+    a->node.refs++;
+    t.limit = 0;
+    mw_lru_evict(&t);
+    assert_int_equal(freed, 0);
+    assert_true(a->node.dead);
+    assert_null(mw_lru_find(&t, "/a"));
+    assert_int_equal(t.used, 0);
+    assert_string_equal(a->node.path, "/a");
+    mw_lru_unref(&t, &a->node);
+    assert_int_equal(freed, 1);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_hash),
+        cmocka_unit_test(test_find),
+        cmocka_unit_test(test_evict),
+        cmocka_unit_test(test_refs),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -0,0 +1,144 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mw_mempool.h"
+
+#define REGION_SZ 256
+
+static _Alignas(64) char region[REGION_SZ + 1];
+
+static bool aligned(void *p, size_t align)
+{
+    return ((uintptr_t)p & (align - 1)) == 0;
+}
+
+/* Clearing and rewinding hand out the same memory again */
+static void test_reset(void **state)
+{
+    (void)state;
+    mw_mempool p;
+    mw_mpool_init(&p, region, REGION_SZ);
+    char *a = mw_mpool_malloc(&p, 10);
+    assert_ptr_equal(a, region);
+    mw_mpool_mark m = mw_mpool_mark_get(&p);
+    char *b = mw_mpool_malloc(&p, 10);
+    assert_true(b > a);
+    mw_mpool_rewind(&p, m);
+    assert_ptr_equal(mw_mpool_malloc(&p, 10), b);
+
+    // only the latest allocation comes back on free
+    mw_mpool_free(&p, a);
+    char *c = mw_mpool_malloc(&p, 10);
+    assert_true(c > b);
+    mw_mpool_free(&p, c);
+    assert_ptr_equal(mw_mpool_malloc(&p, 10), c);
+
+    mw_mpool_clear(&p);
+    assert_ptr_equal(mw_mpool_malloc(&p, 10), region);
+    assert_null(p.chunks);
+    mw_mpool_destroy(&p);
+}
+
+/* Past the region the pool grows a chain of chunks, which it keeps and
+ * reuses in order after a clear
+ */
+static void test_growth(void **state)
+{
+    (void)state;
+    mw_mempool p;
+    mw_mpool_init(&p, region, REGION_SZ);
+    mw_mpool_malloc(&p, REGION_SZ - 16);
+    void *a = mw_mpool_malloc(&p, 100);
+    assert_non_null(p.chunks);
+    assert_ptr_equal(a, p.chunks->data);
+    assert_int_equal(p.chunks->len, MW_MPOOL_CHUNK_SZ);
+    // bigger than a chunk, it gets one of its own
+    void *big = mw_mpool_malloc(&p, 3 * MW_MPOOL_CHUNK_SZ);
+    mw_mpool_chunk *second = p.chunks->next;
+    assert_non_null(second);
+    assert_ptr_equal(big, second->data);
+    assert_int_equal(second->len, 3 * MW_MPOOL_CHUNK_SZ);
+    memset(big, 'x', 3 * MW_MPOOL_CHUNK_SZ);
+    // a string that doesn't fit what is left goes in a new chunk whole
+    char *s = mw_mpool_asprintf(&p, "%0*d", 200, 7);
+    assert_int_equal(strlen(s), 200);
+    assert_ptr_equal(p.cur, second->next);
+
+    // a warm pool gives the same memory without allocating
+    mw_mpool_chunk *first = p.chunks;
+    mw_mpool_clear(&p);
+    mw_mpool_malloc(&p, REGION_SZ - 16);
+    assert_ptr_equal(mw_mpool_malloc(&p, 100), a);
+    assert_ptr_equal(mw_mpool_malloc(&p, 3 * MW_MPOOL_CHUNK_SZ), big);
+    assert_ptr_equal(p.chunks, first);
+    assert_ptr_equal(p.chunks->next, second);
+    mw_mpool_destroy(&p);
+    assert_null(p.chunks);
+}
+
+/* Allocations are aligned however the region and earlier ones fall */
+static void test_alignment(void **state)
+{
+    (void)state;
+    mw_mempool p;
+    // a region that starts off MW_MPOOL_ALIGN
+    mw_mpool_init(&p, region + 1, REGION_SZ);
+    for (int i = 0; i < 100; i++) {
+        char *b = mw_mpool_memalign(&p, 3, 1);
+        assert_non_null(b);
+        void *m = mw_mpool_malloc(&p, 5);
+        assert_true(aligned(m, MW_MPOOL_ALIGN));
+        void *a = mw_mpool_memalign(&p, 7, 64);
+        assert_true(aligned(a, 64));
+    }
+    // more than a chunk's data is aligned to
+    void *page = mw_mpool_memalign(&p, MW_MPOOL_CHUNK_SZ, 4096);
+    assert_true(aligned(page, 4096));
+    memset(page, 0, MW_MPOOL_CHUNK_SZ);
+    mw_mpool_destroy(&p);
+}
+
+/* A size that can't be had fails, and leaves the pool as it was */
+static void test_overflow(void **state)
+{
+    (void)state;
+    mw_mempool p;
+    mw_mpool_init(&p, region, REGION_SZ);
+    char *a = mw_mpool_malloc(&p, 16);
+    mw_mpool_mark m = mw_mpool_mark_get(&p);
+    assert_null(mw_mpool_malloc(&p, SIZE_MAX));
+    assert_null(mw_mpool_malloc(&p, SIZE_MAX - 8));
+    assert_null(mw_mpool_memalign(&p, SIZE_MAX - sizeof(mw_mpool_chunk), 64));
+    assert_null(p.chunks);
+    assert_ptr_equal(p.cur, m.cur);
+    assert_int_equal(p.idx, m.idx);
+    assert_ptr_equal(mw_mpool_malloc(&p, 16), a + 16);
+
+    // from a chunk too
+    mw_mpool_malloc(&p, REGION_SZ);
+    m = mw_mpool_mark_get(&p);
+    assert_null(mw_mpool_malloc(&p, SIZE_MAX - 8));
+    assert_ptr_equal(p.cur, m.cur);
+    assert_int_equal(p.idx, m.idx);
+    mw_mpool_destroy(&p);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_reset),
+        cmocka_unit_test(test_growth),
+        cmocka_unit_test(test_alignment),
+        cmocka_unit_test(test_overflow),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
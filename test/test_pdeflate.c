@@ -0,0 +1,215 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for mkstemp
+#endif
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mw_pdeflate.h"
+#include "testdata.h"
+
+typedef struct {
+    int fd;
+    unsigned char *data;
+    size_t len;
+} fixture;
+
+static int setup_sized(void **state, size_t len)
+{
+    fixture *f = calloc(1, sizeof(*f));
+    char path[] = "/tmp/test_pdeflate.XXXXXX";
+    f->fd = mkstemp(path);
+    if (f->fd < 0) return -1;
+    unlink(path);
+    f->len = len;
+    f->data = malloc(len);
+    testdata_text(f->data, len, 1);
+    if (write(f->fd, f->data, len) != (ssize_t)len) return -1;
+    *state = f;
+    return 0;
+}
+
+static int setup(void **state)
+{
+    // three and a half blocks
+    return setup_sized(state, MW_PDEFLATE_BLOCK * 7 / 2);
+}
+
+static int setup_small(void **state)
+{
+    // less than the dictionary
+    return setup_sized(state, 1000);
+}
+
+static int teardown(void **state)
+{
+    fixture *f = *state;
+    close(f->fd);
+    free(f->data);
+    free(f);
+    return 0;
+}
+
+/* Compress the blocks in the order given, take them in file order, and
+ * return the stream
+ */
+static unsigned char *run(fixture *f,
+                          int level,
+                          bool gzip,
+                          bool reverse,
+                          size_t *len)
+{
+    mw_pdeflate *pd = mw_pdeflate_new(f->fd, f->len, level, gzip);
+    assert_non_null(pd);
+    mw_pdeflate_block *blocks[64];
+    int n = 0;
+    mw_pdeflate_block *b;
+    while ((b = mw_pdeflate_next(pd))) blocks[n++] = b;
+    assert_int_equal(n, (f->len + MW_PDEFLATE_BLOCK - 1) / MW_PDEFLATE_BLOCK);
+    assert_int_equal(pd->inflight, n);
+    for (int i = 0; i < n; i++) {
+        mw_pdeflate_compress(blocks[reverse ? n - 1 - i : i]);
+    }
+
+    unsigned char *out = malloc(f->len + 1024);
+    size_t off = 0;
+    for (int i = 0; i < n; i++) {
+        b = blocks[i];
+        assert_int_equal(b->err, 0);
+        size_t b_len = 0;
+        for (mw_slab *s = b->out; s; s = s->next) {
+            memcpy(out + off + b_len, s->data, s->len);
+            b_len += s->len;
+        }
+        assert_int_equal(b_len, b->out_len);
+        off += b_len;
+        unsigned char trailer[MW_PDEFLATE_TRAILER_MAX];
+        size_t t = mw_pdeflate_take(pd, b, trailer);
+        assert_int_equal(t, i < n - 1 ? 0 : gzip ? 8 : 4);
+        memcpy(out + off, trailer, t);
+        off += t;
+        mw_pdeflate_release(pd, b);
+    }
+    assert_true(mw_pdeflate_done(pd));
+    assert_int_equal(pd->out_done, off);
+    assert_int_equal(pd->inflight, 0);
+    mw_pdeflate_free(pd);
+    *len = off;
+    return out;
+}
+
+static void check_inflates(fixture *f, unsigned char *z, size_t z_len)
+{
+    uLongf len = f->len + 1;
+    unsigned char *back = malloc(len);
+    // uncompress checks the header and the adler32 trailer
+    assert_int_equal(uncompress(back, &len, z, z_len), Z_OK);
+    assert_int_equal(len, f->len);
+    assert_memory_equal(back, f->data, f->len);
+    free(back);
+}
+
+/* gunzip it: inflate checks the crc32 and length in the trailer */
+static void check_gunzips(fixture *f, unsigned char *z, size_t z_len)
+{
+    unsigned char *back = malloc(f->len + 1);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    assert_int_equal(inflateInit2(&zs, 15 + 16), Z_OK);
+    zs.next_in = z;
+    zs.avail_in = z_len;
+    zs.next_out = back;
+    zs.avail_out = f->len + 1;
+    assert_int_equal(inflate(&zs, Z_FINISH), Z_STREAM_END);
+    assert_int_equal(zs.total_out, f->len);
+    assert_int_equal(zs.avail_in, 0);
+    inflateEnd(&zs);
+    assert_memory_equal(back, f->data, f->len);
+    free(back);
+}
+
+/* The blocks make one zlib stream, whatever order they are compressed in */
+static void test_round_trip(void **state)
+{
+    fixture *f = *state;
+    size_t len;
+    unsigned char *z = run(f, Z_DEFAULT_COMPRESSION, false, false, &len);
+    check_inflates(f, z, len);
+    free(z);
+    z = run(f, 1, false, true, &len);
+    check_inflates(f, z, len);
+    free(z);
+}
+
+/* Or one gzip stream */
+static void test_round_trip_gzip(void **state)
+{
+    fixture *f = *state;
+    size_t len;
+    unsigned char *z = run(f, 9, true, false, &len);
+    check_gunzips(f, z, len);
+    free(z);
+    z = run(f, 1, true, true, &len);
+    check_gunzips(f, z, len);
+    free(z);
+}
+
+/* The dictionaries keep the ratio close to a serial deflate */
+static void test_ratio(void **state)
+{
+    fixture *f = *state;
+    size_t len;
+    unsigned char *z = run(f, Z_DEFAULT_COMPRESSION, false, false, &len);
+    uLongf serial = compressBound(f->len);
+    unsigned char *s = malloc(serial);
+    assert_int_equal(compress2(s, &serial, f->data, f->len, 6), Z_OK);
+    // the header is the one deflateInit writes
+    assert_memory_equal(z, s, 2);
+    assert_true(len < serial + serial / 100 + 64);
+    free(s);
+    free(z);
+}
+
+/* A failed read is reported in the block */
+static void test_read_error(void **state)
+{
+    fixture *f = *state;
+    mw_pdeflate *pd =
+        mw_pdeflate_new(f->fd, f->len + MW_PDEFLATE_BLOCK, 6, false);
+    mw_pdeflate_block *b, *last = NULL;
+    while ((b = mw_pdeflate_next(pd))) {
+        if (last) mw_pdeflate_release(pd, last);
+        last = b;
+    }
+    // the last block is past the end of the file
+    mw_pdeflate_compress(last);
+    assert_int_equal(last->err, EIO);
+    assert_null(last->out);
+    mw_pdeflate_release(pd, last);
+    assert_int_equal(pd->inflight, 0);
+    mw_pdeflate_free(pd);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_round_trip, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_round_trip, setup_small, teardown),
+        cmocka_unit_test_setup_teardown(test_round_trip_gzip, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_round_trip_gzip,
+                                        setup_small,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(test_ratio, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_read_error, setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -0,0 +1,142 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mw_reqpool.h"
+
+/* Leave a request the way a finished connection does */
+static void use(mw_request *req)
+{
+    memcpy(req->cmd_buf, "GET / HTTP/1.1\r\n", 16);
+    req->cb = req->cmd_buf + 16;
+    req->status_number = 200;
+    req->files_served = 3;
+    req->close_after = true;
+    req->total_written = 12345;
+    buf_used_into(&req->file_b, 100);
+    // more than the scratch region, so the pool grows a heap chunk
+    assert_non_null(mw_mpool_malloc(&req->pool, 2 * MW_REQ_SCRATCH_SZ));
+    assert_true(mw_slabq_write(&req->deflate_q, "cut off mid-response", 20));
+    assert_int_equal(mw_codec_stream_open(&req->zs, MW_CODING_GZIP, 1), 0);
+}
+
+/* Free the pool's idle requests, by handing them out and taking them back
+ * with no room to keep them
+ */
+static void empty(mw_reqpool *p)
+{
+    mw_request *reqs[8];
+    size_t n = 0;
+    while (p->n_free) reqs[n++] = mw_reqpool_get(p);
+    p->high_water = 0;
+    for (size_t i = 0; i < n; i++) mw_reqpool_put(p, reqs[i]);
+}
+
+static int teardown(void **state)
+{
+    (void)state;
+    mw_codec_drain();
+    return 0;
+}
+
+/* A recycled request comes back like new, with its buffers kept */
+static void test_reset(void **state)
+{
+    (void)state;
+    mw_reqpool p = {.high_water = 4};
+    mw_request *req = mw_reqpool_get(&p);
+    assert_int_equal(p.misses, 1);
+    assert_ptr_equal(req->cb, req->cmd_buf);
+    assert_int_equal(req->fd, -1);
+    assert_true(req->file_b.ring);
+    assert_int_equal(req->file_b.sz, MW_FILE_BUF_SZ);
+    unsigned char *file_buf = req->file_b.buf;
+    use(req);
+    mw_mpool_chunk *chunk = req->pool.chunks;
+    assert_non_null(chunk);
+    size_t slabs = mw_slab_usage_get().in_use;
+    mw_codec_usage states = mw_codec_usage_get();
+
+    mw_reqpool_put(&p, req);
+    assert_int_equal(p.n_free, 1);
+    // the output and engine state it held go back to the shared pools
+    // straight away
+    assert_int_equal(mw_slab_usage_get().in_use, slabs - 1);
+    assert_int_equal(mw_codec_usage_get().idle, states.idle + 1);
+    assert_int_equal(mw_codec_usage_get().open, states.open);
+
+    assert_ptr_equal(mw_reqpool_get(&p), req);
+    assert_int_equal(p.hits, 1);
+    assert_int_equal(p.n_free, 0);
+    assert_ptr_equal(req->cb, req->cmd_buf);
+    assert_int_equal(req->fd, -1);
+    assert_int_equal(req->status_number, 0);
+    assert_int_equal(req->files_served, 0);
+    assert_false(req->close_after);
+    assert_int_equal(req->total_written, 0);
+    assert_null(req->pool_next);
+    assert_null(req->deflate_q.head);
+    assert_int_equal(req->deflate_q.bytes, 0);
+    assert_null(req->zs.state);
+    // file_b and the pool's chunk are the same memory, emptied
+    assert_ptr_equal(req->file_b.buf, file_buf);
+    assert_int_equal(buf_outof_sz(&req->file_b), 0);
+    assert_ptr_equal(req->file_b.into, req->file_b.buf);
+    assert_ptr_equal(req->pool.chunks, chunk);
+    assert_null(req->pool.cur);
+    assert_int_equal(req->pool.idx, 0);
+
+    mw_reqpool_put(&p, req);
+    empty(&p);
+}
+
+/* The pool keeps at most high_water requests, and hands out the one it got
+ * back last
+ */
+static void test_reuse(void **state)
+{
+    (void)state;
+    mw_reqpool p = {.high_water = 2};
+    mw_request *a = mw_reqpool_get(&p);
+    mw_request *b = mw_reqpool_get(&p);
+    mw_request *c = mw_reqpool_get(&p);
+    assert_int_equal(p.misses, 3);
+    use(a);
+    use(b);
+    use(c);
+    mw_reqpool_put(&p, a);
+    mw_reqpool_put(&p, b);
+    mw_reqpool_put(&p, c);
+    assert_int_equal(p.n_free, 2);
+    assert_int_equal(p.drops, 1);
+
+    assert_ptr_equal(mw_reqpool_get(&p), b);
+    assert_ptr_equal(mw_reqpool_get(&p), a);
+    assert_int_equal(p.hits, 2);
+    assert_int_equal(p.n_free, 0);
+    mw_request *d = mw_reqpool_get(&p);
+    assert_int_equal(p.misses, 4);
+    mw_reqpool_put(&p, a);
+    mw_reqpool_put(&p, b);
+    mw_reqpool_put(&p, d);
+    assert_int_equal(p.drops, 2);
+    empty(&p);
+    assert_int_equal(p.n_free, 0);
+    assert_null(p.free);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_reset),
+        cmocka_unit_test(test_reuse),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, teardown);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
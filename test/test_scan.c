@@ -0,0 +1,67 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <string.h>
+
+#include "mw_scan.h"
+
+/* Every implementation the CPU has must agree with the scalar one, wherever
+ * the interesting bytes fall relative to the vector width.
+ */
+static void check_all_isas(const char *buf, size_t len)
+{
+    mw_scan_select(MW_SCAN_SCALAR);
+    size_t eol = mw_scan_eol(buf, len), delim = mw_scan_delim(buf, len),
+           end = mw_scan_hdr_end(buf, len);
+
+    for (mw_scan_isa isa = MW_SCAN_SSE2; isa <= MW_SCAN_AVX2; isa++) {
+        if (mw_scan_select(isa)) continue;
+        assert_int_equal(mw_scan_eol(buf, len), eol);
+        assert_int_equal(mw_scan_delim(buf, len), delim);
+        assert_int_equal(mw_scan_hdr_end(buf, len), end);
+    }
+}
+
+static void test_scalar(void **state)
+{
+    (void)state;
+    const char *s = "Host: x\r\n\r\n";
+    assert_int_equal(mw_scan_select(MW_SCAN_SCALAR), 0);
+    assert_int_equal(mw_scan_eol(s, strlen(s)), 7);
+    assert_int_equal(mw_scan_delim(s, strlen(s)), 4);
+    assert_int_equal(mw_scan_hdr_end(s, strlen(s)), 7);
+    assert_int_equal(mw_scan_hdr_end("\r\n\r", 3), 3);
+    assert_int_equal(mw_scan_eol("abc", 3), 3);
+}
+
+static void test_positions(void **state)
+{
+    (void)state;
+    char buf[100];
+    for (size_t len = 0; len <= sizeof(buf); len++) {
+        for (size_t at = 0; at + 4 <= len; at++) {
+            memset(buf, 'a', sizeof(buf));
+            memcpy(buf + at, "\r\n\r\n", 4);
+            check_all_isas(buf, len);
+            // a near miss first, and a ':' to find
+            if (at >= 3) memcpy(buf + at - 3, ":\r\n", 3);
+            check_all_isas(buf, len);
+        }
+        memset(buf, 'a', sizeof(buf));
+        check_all_isas(buf, len);
+    }
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_scalar),
+        cmocka_unit_test(test_positions),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
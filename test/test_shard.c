@@ -0,0 +1,257 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for SO_REUSEPORT
+#endif
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "miniweb.h"
+#include "miniweb_logging.h"
+#include "mw_shard.h"
+
+// the shards run on epoll loops, a pass at a time
+#if HAVE_EPOLL
+
+#define N_SHARDS 2
+#define N_CONNS 150
+
+mw_server server = {.req_pool_max = 4, .timer_tick_ms = 10};
+
+static char port[8];
+static int accepted[N_SHARDS]; // connections each shard handed on
+
+/* Instead of a request, check the socket we got and let it go */
+void mw_accept_one(mw_shard *shard,
+                   int s,
+                   __attribute__((unused)) struct sockaddr_in *addr)
+{
+    int on = 0;
+    socklen_t len = sizeof(on);
+    assert_true(fcntl(s, F_GETFL) & O_NONBLOCK);
+    assert_true(fcntl(s, F_GETFD) & FD_CLOEXEC);
+    getsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, &len);
+    assert_true(on);
+    accepted[shard->id]++;
+    close(s);
+}
+
+void mw_req_timed_out(__attribute__((unused)) mw_timer *t,
+                      __attribute__((unused)) unsigned gen,
+                      __attribute__((unused)) void *ctx)
+{
+    fail();
+}
+
+void qfprintf(FILE *f, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(f, fmt, ap);
+    va_end(ap);
+}
+
+/* Listen on a port nothing else has */
+static int setup(__attribute__((unused)) void **state)
+{
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    bind(fd, (struct sockaddr *)&addr, len);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    close(fd);
+    snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+    int n = mw_shards_listen(port, N_SHARDS, MW_EVLOOP_EPOLL);
+    return n == N_SHARDS ? 0 : -1;
+}
+
+static int teardown(__attribute__((unused)) void **state)
+{
+    for (int i = 0; i < n_shards; i++) {
+        mw_ev_delete(&shards[i].accept_ev);
+        shards[i].loop->group = NULL;
+        mw_evloop_destroy(shards[i].loop);
+        close(shards[i].lfd);
+    }
+    free(shards);
+    shards = NULL;
+    n_shards = 0;
+    return 0;
+}
+
+/* Every shard has a socket of its own on the one port */
+static void test_listen(__attribute__((unused)) void **state)
+{
+    assert_int_equal(n_shards, N_SHARDS);
+    for (int i = 0; i < n_shards; i++) {
+        mw_shard *shard = &shards[i];
+        assert_int_equal(shard->id, i);
+        assert_non_null(shard->loop);
+        assert_true(fcntl(shard->lfd, F_GETFL) & O_NONBLOCK);
+        int on = 0;
+        socklen_t len = sizeof(on);
+        getsockopt(shard->lfd, SOL_SOCKET, SO_REUSEPORT, &on, &len);
+        assert_true(on);
+        struct sockaddr_in addr;
+        len = sizeof(addr);
+        getsockname(shard->lfd, (struct sockaddr *)&addr, &len);
+        assert_int_equal(ntohs(addr.sin_port), atoi(port));
+        for (int j = 0; j < i; j++) {
+            assert_int_not_equal(shard->lfd, shards[j].lfd);
+        }
+    }
+
+    // without SO_REUSEPORT the port is taken
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert_int_equal(bind(fd, (struct sockaddr *)&addr, sizeof(addr)), -1);
+    assert_int_equal(errno, EADDRINUSE);
+    close(fd);
+}
+
+/* A wakeup takes at most a batch off the backlog, and the next pass takes
+ * the rest; the kernel spreads the connections over the shards
+ */
+static void test_batch(__attribute__((unused)) void **state)
+{
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(port));
+    int c[N_CONNS];
+    for (int i = 0; i < N_CONNS; i++) {
+        c[i] = socket(AF_INET, SOCK_STREAM, 0);
+        int r = connect(c[i], (struct sockaddr *)&addr, sizeof(addr));
+        assert_int_equal(r, 0);
+    }
+
+    // one wakeup each: one of them has more than a batch waiting
+    int most = 0;
+    for (int i = 0; i < n_shards; i++) {
+        mw_shard *shard = &shards[i];
+        for (int j = 0; !shard->accept_wakeups && j < 10; j++) {
+            mw_evloop_poll(shard->loop, 100);
+        }
+        assert_int_equal(shard->accept_wakeups, 1);
+        assert_int_equal(shard->accepted, accepted[i]);
+        assert_true(accepted[i] <= MW_ACCEPT_BATCH);
+        if (accepted[i] == MW_ACCEPT_BATCH) {
+            assert_int_equal(shard->accept_batches[6], 1);
+        }
+        if (accepted[i] > most) most = accepted[i];
+    }
+    assert_int_equal(most, MW_ACCEPT_BATCH);
+
+    // a full batch leaves the source ready, so the next pass goes on
+    int total = 0;
+    for (int i = 0; i < n_shards; i++) {
+        mw_shard *shard = &shards[i];
+        if (accepted[i] == MW_ACCEPT_BATCH) {
+            mw_evloop_poll(shard->loop, 0);
+            assert_int_equal(shard->accept_wakeups, 2);
+        }
+        for (int j = 0; j < 10; j++) mw_evloop_poll(shard->loop, 0);
+        assert_true(accepted[i] > 0);
+        assert_int_equal(shard->accepted, accepted[i]);
+        size_t batches = 0;
+        for (int b = 0; b < MW_ACCEPT_BUCKETS; b++) {
+            batches += shard->accept_batches[b];
+        }
+        assert_int_equal(batches + shard->accept_empty, shard->accept_wakeups);
+        total += accepted[i];
+    }
+    assert_int_equal(total, N_CONNS);
+
+    for (int i = 0; i < N_CONNS; i++) close(c[i]);
+}
+
+/* Out of descriptors, a shard stops accepting for a while instead of trying
+ * again every pass, then takes the connection
+ */
+static void test_backoff(__attribute__((unused)) void **state)
+{
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(port));
+    int c = socket(AF_INET, SOCK_STREAM, 0);
+    assert_int_equal(connect(c, (struct sockaddr *)&addr, sizeof(addr)), 0);
+
+    // the lowest free descriptor is over the limit
+    struct rlimit old, low;
+    getrlimit(RLIMIT_NOFILE, &old);
+    int fd = dup(0);
+    close(fd);
+    low = old;
+    low.rlim_cur = fd;
+    assert_int_equal(setrlimit(RLIMIT_NOFILE, &low), 0);
+
+    size_t woke[N_SHARDS];
+    int before[N_SHARDS];
+    for (int i = 0; i < n_shards; i++) {
+        woke[i] = shards[i].accept_wakeups;
+        before[i] = accepted[i];
+    }
+    int i = -1;
+    for (int j = 0; i < 0 && j < 50; j++) {
+        for (int k = 0; k < n_shards; k++) {
+            mw_evloop_poll(shards[k].loop, 10);
+            if (shards[k].accept_wakeups > woke[k]) i = k;
+        }
+    }
+    assert_true(i >= 0);
+    mw_shard *shard = &shards[i];
+    assert_int_equal(shard->accept_wakeups, woke[i] + 1);
+    assert_int_equal(accepted[i], before[i]);
+    // the pass may have ticked since
+    assert_true(shard->accept_paused > 0);
+    unsigned backoff_ticks = MW_ACCEPT_BACKOFF_MS / server.timer_tick_ms;
+    assert_true(shard->accept_paused <= backoff_ticks);
+    assert_int_not_equal(shard->accept_logged, 0);
+
+    // no spinning on the connection still in the backlog
+    for (int j = 0; j < 5; j++) mw_evloop_poll(shard->loop, 0);
+    assert_int_equal(shard->accept_wakeups, woke[i] + 1);
+
+    // the ticks start it again
+    assert_int_equal(setrlimit(RLIMIT_NOFILE, &old), 0);
+    for (int j = 0; accepted[i] == before[i] && j < 100; j++) {
+        mw_evloop_poll(shard->loop, -1);
+    }
+    assert_int_equal(accepted[i], before[i] + 1);
+    assert_int_equal(shard->accept_paused, 0);
+    close(c);
+}
+
+#endif /* HAVE_EPOLL */
+
+int main(void)
+{
+#if HAVE_EPOLL
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_listen),
+        cmocka_unit_test(test_batch),
+        cmocka_unit_test(test_backoff),
+    };
+
+    return cmocka_run_group_tests(tests, setup, teardown);
+#else
+    return 0;
+#endif
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
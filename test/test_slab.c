@@ -0,0 +1,321 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "mw_codec.h"
+#include "mw_slab.h"
+#include "testdata.h"
+
+#define DATA_LEN (200 * 1000)
+#define PAGE_LEN (4 * 1024)
+#define CONNS 10000
+#define STATES 128 // engine states open at once
+
+static unsigned char *data;
+
+static int setup(void **state)
+{
+    (void)state;
+    data = malloc(DATA_LEN);
+    testdata_text(data, DATA_LEN, 7);
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    (void)state;
+    free(data);
+    mw_slab_drain();
+    mw_codec_drain();
+    return 0;
+}
+
+/* Take up to len bytes out of q into out, as writev would */
+static size_t drain(mw_slabq *q, unsigned char *out, size_t len)
+{
+    struct iovec iov[MW_SLABQ_IOV];
+    int n = mw_slabq_outof_iov(q, iov, MW_SLABQ_IOV);
+    size_t took = 0;
+    for (int i = 0; i < n && took < len; i++) {
+        size_t l = iov[i].iov_len < len - took ? iov[i].iov_len : len - took;
+        if (out) memcpy(out + took, iov[i].iov_base, l);
+        took += l;
+    }
+    mw_slabq_used_outof(q, took);
+    return took;
+}
+
+/* Compress into q until it holds MW_SLABQ_MAX full slabs or all of in is
+ * out, as mw_req_deflate_more does, from 64K of input at a time; true at the
+ * end
+ */
+static bool fill(mw_codec_stream *s,
+                 mw_slabq *q,
+                 const unsigned char *in,
+                 size_t len,
+                 size_t *in_off)
+{
+    for (;;) {
+        size_t left = len - *in_off;
+        if (left > 64 * 1024) left = 64 * 1024;
+        bool finish = *in_off + left == len;
+        unsigned char *out;
+        size_t room = mw_slabq_room(q, MW_SLABQ_MAX, &out);
+        if (!room) return false;
+        mw_codec_status rc =
+            mw_codec_stream_run(s, in + *in_off, &left, out, &room, finish);
+        assert_int_not_equal(rc, MW_CODEC_ERROR);
+        *in_off += left;
+        mw_slabq_used_into(q, room);
+        if (rc == MW_CODEC_END) return true;
+    }
+}
+
+/* Copy into q until it holds MW_SLABQ_MAX full slabs or all of in is out, as
+ * a response that goes out as it is; true at the end
+ */
+static bool copy(mw_slabq *q,
+                 const unsigned char *in,
+                 size_t len,
+                 size_t *in_off)
+{
+    while (*in_off < len) {
+        unsigned char *out;
+        size_t room = mw_slabq_room(q, MW_SLABQ_MAX, &out);
+        if (!room) return false;
+        if (room > len - *in_off) room = len - *in_off;
+        memcpy(out, in + *in_off, room);
+        *in_off += room;
+        mw_slabq_used_into(q, room);
+    }
+    return true;
+}
+
+/* Data comes out as it went in, across slabs, and the slabs go back */
+static void test_queue(void **state)
+{
+    (void)state;
+    mw_slab_usage before = mw_slab_usage_get();
+    mw_slabq q;
+    memset(&q, 0, sizeof(q));
+    unsigned char *into;
+    assert_int_equal(mw_slabq_room(&q, 1, &into), MW_SLAB_SZ);
+    memcpy(into, data, 100);
+    mw_slabq_used_into(&q, 100);
+    assert_int_equal(mw_slabq_room(&q, 1, &into), MW_SLAB_SZ - 100);
+    memcpy(into, data + 100, MW_SLAB_SZ - 100);
+    mw_slabq_used_into(&q, MW_SLAB_SZ - 100);
+    // full, and not allowed another
+    assert_int_equal(mw_slabq_room(&q, 1, &into), 0);
+    // a write takes what it needs regardless
+    mw_slabq_write(&q, data + MW_SLAB_SZ, 2 * MW_SLAB_SZ);
+    assert_int_equal(q.n, 3);
+    assert_int_equal(q.bytes, 3 * MW_SLAB_SZ);
+    assert_int_equal(mw_slab_usage_get().in_use, before.in_use + 3);
+
+    unsigned char *out = malloc(3 * MW_SLAB_SZ);
+    assert_int_equal(drain(&q, out, 10), 10);
+    assert_int_equal(q.n, 3);
+    assert_int_equal(drain(&q, out + 10, 2 * MW_SLAB_SZ), 2 * MW_SLAB_SZ);
+    // only the last is left, partly taken out of
+    assert_int_equal(q.n, 1);
+    assert_int_equal(drain(&q, out + 10 + 2 * MW_SLAB_SZ, MW_SLAB_SZ),
+                     MW_SLAB_SZ - 10);
+    assert_memory_equal(out, data, 3 * MW_SLAB_SZ);
+    // an empty queue holds no slabs
+    assert_int_equal(q.n, 0);
+    assert_null(q.head);
+    assert_int_equal(mw_slab_usage_get().in_use, before.in_use);
+
+    // a chain joins the end, dropping its empty slabs
+    mw_slab *a = mw_slab_get(), *b = mw_slab_get(), *c = mw_slab_get();
+    a->next = b;
+    b->next = c;
+    a->len = 5;
+    c->len = 7;
+    mw_slabq_append(&q, a);
+    assert_int_equal(q.n, 2);
+    assert_int_equal(q.bytes, 12);
+    struct iovec iov[MW_SLABQ_IOV];
+    assert_int_equal(mw_slabq_outof_iov(&q, iov, MW_SLABQ_IOV), 2);
+    mw_slabq_clear(&q);
+    assert_int_equal(mw_slab_usage_get().in_use, before.in_use);
+    free(out);
+}
+
+/* Compressing into slabs, a little room at a time, and never more than
+ * MW_SLABQ_MAX of them, gives the same stream
+ */
+static void test_stream(void **state)
+{
+    (void)state;
+    mw_codec_stream s;
+    memset(&s, 0, sizeof(s));
+    assert_int_equal(mw_codec_stream_open(&s, MW_CODING_GZIP, 6), 0);
+    mw_slabq q;
+    memset(&q, 0, sizeof(q));
+    unsigned char *z = malloc(DATA_LEN);
+    size_t in_off = 0, z_len = 0;
+    bool end = false;
+    while (!end || q.bytes) {
+        if (!end) end = fill(&s, &q, data, DATA_LEN, &in_off);
+        assert_true(q.n <= MW_SLABQ_MAX);
+        // a slow network
+        z_len += drain(&q, z + z_len, 5000);
+    }
+    assert_int_equal(in_off, DATA_LEN);
+    assert_int_equal(z_len, s.total_out);
+    mw_codec_stream_close(&s);
+
+    unsigned char *back = malloc(DATA_LEN + 1);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    assert_int_equal(inflateInit2(&zs, 15 + 16), Z_OK);
+    zs.next_in = z;
+    zs.avail_in = z_len;
+    zs.next_out = back;
+    zs.avail_out = DATA_LEN + 1;
+    assert_int_equal(inflate(&zs, Z_FINISH), Z_STREAM_END);
+    assert_int_equal(zs.total_out, DATA_LEN);
+    inflateEnd(&zs);
+    assert_memory_equal(back, data, DATA_LEN);
+    free(back);
+    free(z);
+}
+
+/* A keep-alive connection, and the response it is sending if any */
+typedef struct {
+    mw_codec_stream zs; // with no state, the response isn't compressed
+    mw_slabq q;
+    size_t len;    // of the body, 0 between responses
+    size_t in_off; // of it in q
+    bool end;      // all of it is in q
+} conn;
+
+/* One in 20 clients downloads a big file over a slow network, the rest
+ * fetch pages
+ */
+static void respond(conn *c, int i)
+{
+    assert_null(c->zs.state);
+    // the fastest level: the engine's state is the same size at any
+    int rc = mw_codec_stream_open(&c->zs, MW_CODING_GZIP, 1);
+    // with too many engines open, it goes out as it is
+    assert_true(rc == 0 || rc == EBUSY);
+    c->len = i % 20 ? PAGE_LEN : DATA_LEN;
+    c->in_off = 0;
+    c->end = false;
+}
+
+/* Put as much of the response in the connection's queue as it may hold */
+static void step(conn *c)
+{
+    if (c->zs.state) {
+        c->end = fill(&c->zs, &c->q, data, c->len, &c->in_off);
+    }
+    else {
+        c->end = copy(&c->q, data, c->len, &c->in_off);
+    }
+}
+
+/* 10k keep-alive connections all responding at once, most quickly and some
+ * held back by the network: STATES of them compress and the rest go out as
+ * they are, and each holds at most MW_SLABQ_MAX slabs, so however many
+ * respond the memory is bounded; all of it comes back
+ */
+static void test_many(void **state)
+{
+    (void)state;
+    mw_slab_init(1024);
+    mw_codec_drain();
+    mw_codec_set_max_open(STATES);
+    mw_slab_usage before = mw_slab_usage_get();
+    mw_codec_usage zbefore = mw_codec_usage_get();
+    assert_int_equal(zbefore.open, 0);
+    conn *c = calloc(CONNS, sizeof(*c));
+    int active = 0, zipped = 0;
+    for (int i = 0; i < CONNS; i++, active++) {
+        respond(&c[i], i);
+        if (c[i].zs.state) zipped++;
+    }
+    assert_int_equal(zipped, STATES);
+    size_t peak = 0;
+    while (active) {
+        for (int i = 0; i < CONNS; i++) {
+            if (!c[i].len) {
+                // done: no output, no engine
+                assert_null(c[i].zs.state);
+                assert_int_equal(c[i].q.n, 0);
+                continue;
+            }
+            if (!c[i].end) step(&c[i]);
+            assert_true(c[i].q.n <= MW_SLABQ_MAX);
+            size_t net = i % 20 ? 16 * 1024 : 1024;
+            drain(&c[i].q, NULL, net);
+            if (!c[i].end || c[i].q.bytes) continue;
+            // the connection waits for its next request with nothing
+            assert_int_equal(c[i].q.n, 0);
+            mw_codec_stream_release(&c[i].zs);
+            assert_null(c[i].zs.state);
+            c[i].len = 0;
+            active--;
+        }
+        size_t held = 0, zipping = 0;
+        for (int i = 0; i < CONNS; i++) {
+            held += c[i].q.n;
+            if (c[i].zs.state) zipping++;
+        }
+        mw_slab_usage u = mw_slab_usage_get();
+        assert_int_equal(u.in_use, before.in_use + held);
+        if (held > peak) peak = held;
+        // a state per response compressing, and no more than STATES
+        mw_codec_usage z = mw_codec_usage_get();
+        assert_int_equal(z.open - z.idle, zipping);
+        assert_true(z.open <= STATES);
+    }
+    // per connection, MW_SLABQ_MAX slabs; and STATES engines between them
+    mw_slab_usage after = mw_slab_usage_get();
+    assert_int_equal(after.in_use, before.in_use);
+    assert_true(after.peak - before.in_use <= (size_t)CONNS * MW_SLABQ_MAX);
+    assert_true(after.idle <= 1024);
+    mw_codec_usage z = mw_codec_usage_get();
+    assert_int_equal(z.open, z.idle);
+    assert_true(z.idle <= MW_CODEC_MAX_IDLE);
+    assert_int_equal(z.allocs - zbefore.allocs, STATES);
+    // the responses that had engines gave them back for the next
+    mw_codec_stream s;
+    memset(&s, 0, sizeof(s));
+    assert_int_equal(mw_codec_stream_open(&s, MW_CODING_GZIP, 1), 0);
+    mw_codec_stream_close(&s);
+    print_message("%d responses at once: peak %zu slabs, %zu MB; "
+                  "%d compressed\n",
+                  CONNS,
+                  peak,
+                  peak * sizeof(mw_slab) >> 20,
+                  STATES);
+    free(c);
+    mw_codec_drain();
+    assert_int_equal(mw_codec_usage_get().open, 0);
+    mw_codec_set_max_open(MW_CODEC_DEFAULT_MAX_OPEN);
+    mw_slab_init(MW_SLAB_DEFAULT_MAX_IDLE);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_queue),
+        cmocka_unit_test(test_stream),
+        cmocka_unit_test(test_many),
+    };
+
+    return cmocka_run_group_tests(tests, setup, teardown);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
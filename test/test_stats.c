@@ -0,0 +1,116 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mw_stats.h"
+
+static void test_buckets(void **state)
+{
+    (void)state;
+    // every value lands in a bucket whose range holds it, and buckets only
+    // ever go up
+    unsigned last = 0;
+    for (uint64_t v = 0; v < 100000; v++) {
+        unsigned b = mw_hist_bucket(v);
+        assert_true(b < MW_HIST_BUCKETS);
+        assert_true(b >= last);
+        assert_true(v <= mw_hist_bucket_max(b));
+        if (b) assert_true(v > mw_hist_bucket_max(b - 1));
+        last = b;
+    }
+    for (int bit = 17; bit < 64; bit++) {
+        uint64_t v = (uint64_t)1 << bit;
+        unsigned b = mw_hist_bucket(v);
+        assert_true(v <= mw_hist_bucket_max(b));
+        if (bit < MW_HIST_MAX_BITS) {
+            // no wider than 1/2^MW_HIST_SUB_BITS of the value
+            assert_true(mw_hist_bucket_max(b) - v < v >> MW_HIST_SUB_BITS);
+        }
+    }
+    assert_int_equal(mw_hist_bucket(UINT64_MAX), MW_HIST_BUCKETS - 1);
+}
+
+static void test_quantiles(void **state)
+{
+    (void)state;
+    mw_hist *h = calloc(1, sizeof(*h));
+    assert_int_equal(mw_hist_quantile(h, 0.5), 0);
+    for (uint64_t v = 1; v <= 1000; v++) {
+        h->counts[mw_hist_bucket(v)]++;
+        h->n++;
+        h->sum += v;
+        h->max = v;
+    }
+    uint64_t p50 = mw_hist_quantile(h, 0.5), p99 = mw_hist_quantile(h, 0.99);
+    assert_true(p50 >= 500 && p50 <= 500 + 500 / 16);
+    assert_true(p99 >= 990 && p99 <= 1000);
+    assert_int_equal(mw_hist_quantile(h, 1), 1000);
+    free(h);
+}
+
+static void *count_some(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < 1000; i++) {
+        mw_stats_count(MW_STAT_REQUESTS, 1);
+        mw_stats_record(MW_HIST_LATENCY_US, i);
+    }
+    return NULL;
+}
+
+static void test_threads(void **state)
+{
+    (void)state;
+    pthread_t t[4];
+    for (int i = 0; i < 4; i++) pthread_create(&t[i], NULL, count_some, NULL);
+    for (int i = 0; i < 4; i++) pthread_join(t[i], NULL);
+
+    uint64_t counters[MW_STAT_N_COUNTERS];
+    mw_hist *hists = malloc(MW_HIST_N * sizeof(*hists));
+    mw_stats_snapshot(counters, hists);
+    assert_int_equal(counters[MW_STAT_REQUESTS], 4000);
+    assert_int_equal(hists[MW_HIST_LATENCY_US].n, 4000);
+    assert_int_equal(hists[MW_HIST_LATENCY_US].sum, 4 * 999 * 1000 / 2);
+    assert_int_equal(hists[MW_HIST_LATENCY_US].max, 999);
+    free(hists);
+}
+
+static void test_output(void **state)
+{
+    (void)state;
+    mw_stats_count(MW_STAT_ACCEPTS, 3);
+
+    mw_buffer b = {0};
+    mw_stats_json(&b);
+    buf_sprintf(&b, "%c", '\0');
+    assert_non_null(strstr((char *)b.outof, "\"accepts\":3,"));
+    assert_non_null(strstr((char *)b.outof, "\"latency_us\":{\"count\":"));
+    free(b.buf);
+
+    memset(&b, 0, sizeof(b));
+    mw_stats_prometheus(&b);
+    buf_sprintf(&b, "%c", '\0');
+    assert_non_null(strstr((char *)b.outof, "\nminiweb_accepts_total 3\n"));
+    assert_non_null(
+        strstr((char *)b.outof, "miniweb_ttfb_us{quantile=\"0.99\"} 0\n"));
+    free(b.buf);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_buckets),
+        cmocka_unit_test(test_quantiles),
+        cmocka_unit_test(test_threads),
+        cmocka_unit_test(test_output),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -0,0 +1,148 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mw_twheel.h"
+
+#define N_TIMERS 2000
+
+typedef struct {
+    mw_twheel w;
+    mw_timer timers[N_TIMERS];
+    uint64_t due[N_TIMERS];   // the tick each should fire on, 0 for never
+    uint64_t fired[N_TIMERS]; // the tick each did fire on
+} fixture;
+
+static void on_fire(mw_timer *t, unsigned gen, void *ctx)
+{
+    fixture *f = ctx;
+    size_t i = t - f->timers;
+    assert_int_equal(gen, t->gen);
+    assert_int_equal(f->fired[i], 0);
+    f->fired[i] = f->w.now;
+}
+
+static void test_arm_expire(void **state)
+{
+    (void)state;
+    fixture *f = calloc(1, sizeof(*f));
+    mw_twheel_init(&f->w, 100);
+
+    // 250ms is 3 ticks, and counting the tick under way, due on tick 4
+    mw_twheel_arm(&f->w, &f->timers[0], 250);
+    assert_int_equal(mw_twheel_advance(&f->w, 3, on_fire, f), 0);
+    assert_int_equal(mw_twheel_advance(&f->w, 4, on_fire, f), 1);
+    assert_int_equal(f->fired[0], 4);
+    assert_null(f->timers[0].next);
+    assert_int_equal(f->w.n, 0);
+
+    // re-arming moves it, disarming drops it
+    mw_twheel_arm(&f->w, &f->timers[1], 100);
+    mw_twheel_arm(&f->w, &f->timers[1], 1000);
+    mw_twheel_arm(&f->w, &f->timers[2], 100);
+    mw_twheel_disarm(&f->w, &f->timers[2]);
+    assert_int_equal(f->w.n, 1);
+    assert_int_equal(mw_twheel_advance(&f->w, 14, on_fire, f), 0);
+    assert_int_equal(mw_twheel_advance(&f->w, 15, on_fire, f), 1);
+    assert_int_equal(f->fired[1], 15);
+    assert_int_equal(f->fired[2], 0);
+    free(f);
+}
+
+/* Armed within a wait, a timer fires on the last tick inside it, or the next
+ * tick for a wait shorter than one
+ */
+static void test_arm_within(void **state)
+{
+    (void)state;
+    fixture *f = calloc(1, sizeof(*f));
+    mw_twheel_init(&f->w, 100);
+    mw_twheel_arm_within(&f->w, &f->timers[0], 250);
+    mw_twheel_arm_within(&f->w, &f->timers[1], 300);
+    mw_twheel_arm_within(&f->w, &f->timers[2], 20);
+    mw_twheel_arm_within(&f->w, &f->timers[3], 0);
+    assert_int_equal(mw_twheel_advance(&f->w, 1, on_fire, f), 2);
+    assert_int_equal(mw_twheel_advance(&f->w, 2, on_fire, f), 1);
+    assert_int_equal(mw_twheel_advance(&f->w, 3, on_fire, f), 1);
+    assert_int_equal(f->fired[0], 2);
+    assert_int_equal(f->fired[1], 3);
+    assert_int_equal(f->fired[2], 1);
+    assert_int_equal(f->fired[3], 1);
+    free(f);
+}
+
+/* Timers at every distance, through every level, fire on exactly their tick
+ */
+static void test_levels(void **state)
+{
+    (void)state;
+    fixture *f = calloc(1, sizeof(*f));
+    mw_twheel_init(&f->w, 1);
+    srand(3);
+
+    uint64_t last = 0;
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < N_TIMERS; i++) {
+            if (f->timers[i].next) continue;
+            // a spread of delays from a few ticks to beyond level 2
+            uint64_t ms = (uint64_t)rand() % (1u << (4 + 4 * (i % 4)));
+            mw_twheel_arm(&f->w, &f->timers[i], ms);
+            f->due[i] = f->w.now + 1 + ms;
+            f->fired[i] = 0;
+        }
+        // now and then disarm a few
+        for (int i = round; i < N_TIMERS; i += 97) {
+            mw_twheel_disarm(&f->w, &f->timers[i]);
+            f->due[i] = 0;
+        }
+        last = f->w.now + (1u << 15);
+        mw_twheel_advance(&f->w, last, on_fire, f);
+        for (int i = 0; i < N_TIMERS; i++) {
+            if (f->due[i] && f->due[i] <= last) {
+                assert_int_equal(f->fired[i], f->due[i]);
+                f->due[i] = 0;
+            }
+            else if (!f->due[i]) {
+                assert_true(f->fired[i] == 0 || f->timers[i].next == NULL);
+            }
+        }
+    }
+    // the rest fire eventually, and on time
+    mw_twheel_advance(&f->w, last + (1u << 17), on_fire, f);
+    for (int i = 0; i < N_TIMERS; i++) {
+        if (f->due[i]) assert_int_equal(f->fired[i], f->due[i]);
+    }
+    assert_int_equal(f->w.n, 0);
+    free(f);
+}
+
+static void test_far(void **state)
+{
+    (void)state;
+    fixture *f = calloc(1, sizeof(*f));
+    mw_twheel_init(&f->w, 1);
+    // further out than the whole wheel
+    uint64_t ms = ((uint64_t)1 << (MW_TWHEEL_BITS * MW_TWHEEL_LEVELS)) + 12345;
+    mw_twheel_arm(&f->w, &f->timers[0], ms);
+    assert_int_equal(mw_twheel_advance(&f->w, ms, on_fire, f), 0);
+    assert_int_equal(mw_twheel_advance(&f->w, ms + 1, on_fire, f), 1);
+    free(f);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_arm_expire),
+        cmocka_unit_test(test_arm_within),
+        cmocka_unit_test(test_levels),
+        cmocka_unit_test(test_far),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -0,0 +1,271 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for mkdtemp, nanosleep and utimes
+#endif
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "mw_zcache.h"
+#include "testdata.h"
+
+#define BUDGET (256 * 1024) // files up to 32K are compressed
+#define PAGE_LEN 20000
+#define BIG_LEN (BUDGET / 8 + 1)
+#define T0 1700000000
+
+static char dir[] = "/tmp/test_zcache.XXXXXX";
+static unsigned char *page, *noise;
+
+/* Write a file of len bytes at path, over any that is there, with mtime */
+static void put_file(const char *name,
+                     const unsigned char *data,
+                     size_t len,
+                     time_t mtime)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *f = fopen(path, "w");
+    assert_non_null(f);
+    assert_int_equal(fwrite(data, 1, len, f), len);
+    fclose(f);
+    struct timeval tv[2] = {{mtime, 0}, {mtime, 0}};
+    assert_int_equal(utimes(path, tv), 0);
+}
+
+static const char *path_of(const char *name)
+{
+    static char path[64];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return path;
+}
+
+/* Get the entry for a file as a request would, having stat'ed it */
+static mw_zcache_entry *get(const char *name)
+{
+    struct stat sb;
+    assert_int_equal(stat(path_of(name), &sb), 0);
+    return mw_zcache_get(path_of(name), &sb);
+}
+
+/* Get the entry for a file once its compressed data has been made in the
+ * background, or NULL if it isn't in two seconds
+ */
+static mw_zcache_entry *get_filled(const char *name)
+{
+    struct timespec ts = {0, 10 * 1000000};
+    for (int i = 0; i < 200; i++) {
+        mw_zcache_entry *e = get(name);
+        // without a .gz it is only returned with its data
+        if (e) return e;
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+/* The entry's data is the file, zlib compressed */
+static void check_data(mw_zcache_entry *e,
+                       const unsigned char *want,
+                       size_t len)
+{
+    assert_non_null(e->data);
+    assert_true(e->len < len);
+    unsigned char *back = malloc(len + 1);
+    uLongf back_len = len + 1;
+    assert_int_equal(uncompress(back, &back_len, e->data, e->len), Z_OK);
+    assert_int_equal(back_len, len);
+    assert_memory_equal(back, want, len);
+    free(back);
+}
+
+static int setup(void **state)
+{
+    (void)state;
+    if (!mkdtemp(dir)) return -1;
+    page = malloc(BIG_LEN);
+    testdata_text(page, BIG_LEN, 3);
+    // no repeats for the compressor to find
+    noise = malloc(PAGE_LEN);
+    unsigned x = 1;
+    for (size_t i = 0; i < PAGE_LEN; i++) {
+        x = x * 1103515245 + 12345;
+        noise[i] = x >> 23;
+    }
+    mw_zcache_init(BUDGET);
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    (void)state;
+    static const char *names[] = {"page.html",
+                                  "changed.html",
+                                  "style.css",
+                                  "style.css.gz",
+                                  "old.css",
+                                  "old.css.gz",
+                                  "big.html",
+                                  "big.html.gz",
+                                  "noise.html",
+                                  "warm.html"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        unlink(path_of(names[i]));
+    }
+    rmdir(dir);
+    mw_zcache_init(0);
+    free(page);
+    free(noise);
+    return 0;
+}
+
+/* A file is compressed in the background, and served from memory after */
+static void test_fill(void **state)
+{
+    (void)state;
+    put_file("page.html", page, PAGE_LEN, T0);
+    mw_zcache_entry *e = get_filled("page.html");
+    assert_non_null(e);
+    assert_null(e->gz_path);
+    check_data(e, page, PAGE_LEN);
+    mw_zcache_release(e);
+    // and again, the same entry
+    mw_zcache_entry *again = get("page.html");
+    assert_ptr_equal(again, e);
+    mw_zcache_release(again);
+}
+
+/* An entry only matches the inode, mtime and size it was made from */
+static void test_match(void **state)
+{
+    (void)state;
+    put_file("changed.html", page, PAGE_LEN, T0);
+    mw_zcache_entry *e = get_filled("changed.html");
+    assert_non_null(e);
+    mw_zcache_release(e);
+
+    // a new mtime is a new file, however alike
+    put_file("changed.html", page, PAGE_LEN, T0 + 1);
+    e = get_filled("changed.html");
+    assert_non_null(e);
+    check_data(e, page, PAGE_LEN);
+    mw_zcache_release(e);
+
+    // and so is a new size, at the same mtime
+    put_file("changed.html", page + 1, PAGE_LEN - 1, T0 + 1);
+    e = get_filled("changed.html");
+    assert_non_null(e);
+    check_data(e, page + 1, PAGE_LEN - 1);
+    mw_zcache_release(e);
+
+    // the old stat doesn't find the new file's data
+    struct stat sb;
+    assert_int_equal(stat(path_of("changed.html"), &sb), 0);
+    sb.st_size = PAGE_LEN;
+    assert_null(mw_zcache_get(path_of("changed.html"), &sb));
+}
+
+/* A sibling .gz is used only if it is at least as new as the file */
+static void test_gz_sibling(void **state)
+{
+    (void)state;
+    put_file("style.css", page, 1000, T0);
+    put_file("style.css.gz", noise, 100, T0 + 10);
+    mw_zcache_entry *e = get("style.css");
+    assert_non_null(e);
+    assert_string_equal(e->gz_path, path_of("style.css.gz"));
+    mw_zcache_release(e);
+
+    put_file("old.css", page, 1000, T0);
+    put_file("old.css.gz", noise, 100, T0 - 10);
+    e = get_filled("old.css");
+    assert_non_null(e);
+    assert_null(e->gz_path);
+    mw_zcache_release(e);
+}
+
+/* Only files up to an eighth of the budget are compressed into memory */
+static void test_cutoff(void **state)
+{
+    (void)state;
+    put_file("big.html", page, BIG_LEN, T0);
+    assert_null(get("big.html"));
+    assert_false(mw_zcache_warm(path_of("big.html")));
+
+    // its .gz is still worth finding, looked for when the file changes
+    put_file("big.html.gz", noise, 100, T0 + 1);
+    put_file("big.html", page, BIG_LEN, T0 + 1);
+    mw_zcache_entry *e = get("big.html");
+    assert_non_null(e);
+    assert_non_null(e->gz_path);
+    assert_false(e->tried);
+    assert_null(e->data);
+    mw_zcache_release(e);
+
+    // with no budget there is no cache at all
+    mw_zcache_init(0);
+    assert_null(get("big.html"));
+    assert_false(mw_zcache_warm(path_of("page.html")));
+    mw_zcache_init(BUDGET);
+}
+
+/* A file that doesn't compress smaller isn't tried again, until it changes */
+static void test_no_refill(void **state)
+{
+    (void)state;
+    struct timespec ts = {0, 10 * 1000000};
+    put_file("noise.html", noise, PAGE_LEN, T0);
+    assert_false(mw_zcache_warm(path_of("noise.html")));
+
+    // the same inode, size and mtime: the entry still matches, and would
+    // compress now if it were tried
+    put_file("noise.html", page, PAGE_LEN, T0);
+    for (int i = 0; i < 10; i++) {
+        assert_null(get("noise.html"));
+        nanosleep(&ts, NULL);
+    }
+    assert_false(mw_zcache_warm(path_of("noise.html")));
+
+    put_file("noise.html", page, PAGE_LEN, T0 + 1);
+    assert_true(mw_zcache_warm(path_of("noise.html")));
+}
+
+/* Warming compresses a file before the first request asks for it */
+static void test_warm(void **state)
+{
+    (void)state;
+    put_file("warm.html", page, PAGE_LEN, T0);
+    assert_true(mw_zcache_warm(path_of("warm.html")));
+    mw_zcache_entry *e = get("warm.html");
+    assert_non_null(e);
+    check_data(e, page, PAGE_LEN);
+    mw_zcache_release(e);
+
+    assert_false(mw_zcache_warm(path_of("missing.html")));
+    // only regular files
+    assert_false(mw_zcache_warm(dir));
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_fill),
+        cmocka_unit_test(test_match),
+        cmocka_unit_test(test_gz_sibling),
+        cmocka_unit_test(test_cutoff),
+        cmocka_unit_test(test_no_refill),
+        cmocka_unit_test(test_warm),
+    };
+
+    return cmocka_run_group_tests(tests, setup, teardown);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -0,0 +1,150 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for clock_gettime
+#endif
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+#include <string.h>
+#include <time.h>
+
+#include "mw_codec.h"
+#include "mw_zctl.h"
+
+#define LOW 500
+#define HIGH 850
+
+/* A connection that sent bytes in ms, with a full socket that often */
+static mw_zrate rate(uint64_t bytes, uint64_t ms, unsigned writes,
+                     unsigned blocked)
+{
+    mw_zrate r;
+    memset(&r, 0, sizeof(r));
+    for (unsigned i = 0; i < writes; i++) mw_zrate_write(&r, false);
+    for (unsigned i = 0; i < blocked; i++) mw_zrate_write(&r, true);
+    mw_zrate_done(&r, bytes, ms * 1000000);
+    return r;
+}
+
+static int setup(void **state)
+{
+    (void)state;
+    mw_codec_levels levels = MW_CODEC_DEFAULT_LEVELS;
+    mw_codec_init(&levels);
+    mw_zctl_init(1, LOW, HIGH);
+    return 0;
+}
+
+/* Counts add up over the responses of a connection */
+static void test_rate(void **state)
+{
+    (void)state;
+    mw_zrate r = rate(1000, 2, 3, 1);
+    mw_zrate_write(&r, true);
+    mw_zrate_done(&r, 500, 1000);
+    assert_int_equal(r.writes, 3);
+    assert_int_equal(r.blocked, 2);
+    assert_int_equal(r.bytes, 1500);
+    assert_int_equal(r.ns, 2001000);
+}
+
+/* An unknown client gets the engine's level, coming down with the load */
+static void test_load(void **state)
+{
+    (void)state;
+    const mw_codec *zlib = mw_codec_streamer(MW_CODING_GZIP);
+    assert_int_equal(zlib->level, 6);
+    assert_int_equal(mw_zctl_level(zlib, 0, NULL), 6);
+    assert_int_equal(mw_zctl_level(zlib, LOW, NULL), 6);
+    int last = 6;
+    for (unsigned load = LOW + 1; load < HIGH; load++) {
+        int level = mw_zctl_level(zlib, load, NULL);
+        assert_true(level <= last);
+        assert_true(level >= 1);
+        last = level;
+    }
+    assert_int_equal(last, 1);
+    assert_int_equal(mw_zctl_level(zlib, HIGH, NULL), MW_ZCTL_SKIP);
+    assert_int_equal(mw_zctl_level(zlib, 1000, NULL), MW_ZCTL_SKIP);
+
+    // too little sent yet to say how fast the client is
+    mw_zrate r = rate(MW_ZCTL_MIN_BYTES - 1, 10000, 1, 10);
+    assert_int_equal(mw_zctl_level(zlib, 0, &r), 6);
+    assert_int_equal(mw_zctl_level(zlib, 1000, &r), MW_ZCTL_SKIP);
+}
+
+/* A client the network holds back gets more compression, and keeps some */
+static void test_slow(void **state)
+{
+    (void)state;
+    const mw_codec *zlib = mw_codec_streamer(MW_CODING_GZIP);
+    // 1MB in 10s, the socket full most of the time
+    mw_zrate r = rate(1000000, 10000, 10, 30);
+    assert_int_equal(mw_zctl_level(zlib, 0, &r), 6 + MW_ZCTL_RAISE);
+    assert_int_equal(mw_zctl_level(zlib, LOW + 1, &r), 6);
+    assert_int_equal(mw_zctl_level(zlib, HIGH, &r), 1);
+
+    // as slow, but never waited on: that's the server, not the network
+    mw_zrate idle = rate(1000000, 10000, 40, 0);
+    assert_int_equal(mw_zctl_level(zlib, 0, &idle), 6);
+    assert_int_equal(mw_zctl_level(zlib, HIGH, &idle), MW_ZCTL_SKIP);
+
+    // no raising past the engine's maximum
+    mw_codec_levels levels = MW_CODEC_DEFAULT_LEVELS;
+    levels.zlib = 8;
+    mw_codec_init(&levels);
+    assert_int_equal(mw_zctl_level(zlib, 0, &r), zlib->max_level);
+    levels.zlib = 6;
+    mw_codec_init(&levels);
+}
+
+/* A client that is never kept waiting gets the fastest level */
+static void test_fast(void **state)
+{
+    (void)state;
+    const mw_codec *zlib = mw_codec_streamer(MW_CODING_GZIP);
+    // 100MB in 1s
+    mw_zrate r = rate(100000000, 1000, 100, 0);
+    assert_int_equal(mw_zctl_level(zlib, 0, &r), 1);
+    assert_int_equal(mw_zctl_level(zlib, 1000, &r), 1);
+    // one full socket and the network had a say after all
+    mw_zrate_write(&r, true);
+    assert_int_equal(mw_zctl_level(zlib, 0, &r), 6);
+}
+
+/* Burning a CPU shows in the load, once a sample is due */
+static void test_measure(void **state)
+{
+    (void)state;
+    mw_zctl_init(1, LOW, HIGH);
+    assert_int_equal(mw_zctl_load(), 0);
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    volatile unsigned spin = 0;
+    do {
+        for (int i = 0; i < 100000; i++) spin++;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000 +
+                 (now.tv_nsec - start.tv_nsec) / 1000000 <
+             MW_ZCTL_SAMPLE_MS + 50);
+    // half the weight on the sample, which is most of the CPU
+    unsigned load = mw_zctl_load();
+    assert_true(load > 250);
+    assert_true(load <= 500);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_rate),
+        cmocka_unit_test(test_load),
+        cmocka_unit_test(test_slow),
+        cmocka_unit_test(test_fast),
+        cmocka_unit_test(test_measure),
+    };
+
+    return cmocka_run_group_tests(tests, setup, NULL);
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -0,0 +1,19 @@
+#include "testdata.h"
+#include <string.h>
+
+void testdata_text(unsigned char *out, size_t len, unsigned seed)
+{
+    static const char *words[] = {"GET ", "/index.html ", "HTTP/1.1 ", "200 ",
+                                  "miniweb ", "deflate ", "\n", "0123 "};
+    size_t off = 0;
+    while (off < len) {
+        seed = seed * 1103515245 + 12345;
+        const char *w = words[(seed >> 16) % 8];
+        size_t n = strlen(w);
+        if (n > len - off) n = len - off;
+        memcpy(out + off, w, n);
+        off += n;
+    }
+}
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/
@@ -0,0 +1,20 @@
+#ifndef TESTDATA_H
+#define TESTDATA_H
+
+#include <stddef.h>
+
+/**
+ * @brief Fill out with text-like data, compressible but not trivially so
+ *
+ * Words from a request and response, in an order picked by a linear
+ * congruential generator, so the same seed always gives the same data.
+ *
+ * @param out Where to write
+ * @param len How many bytes to write
+ * @param seed Picks the sequence of words
+ */
+void testdata_text(unsigned char *out, size_t len, unsigned seed);
+
+#endif /* ifndef TESTDATA_H */
+
+/* vim: set ts=8 sw=4 tw=0 ft=c et :*/